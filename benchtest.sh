@@ -15,14 +15,14 @@ else
   sourceFile="$(readlink -f $1)"
 fi
 
-./tool_build.sh "$sourceFile"
+./tool_build.sh "$sourceFile" -sim=2000 -cosim
 
 mkdir -p "$tbDir"
 
 cd "$tbDir" > /dev/null
 
     ghdl -a "$buildDir/gen_constants.vhd"
-    ghdl -a "$codeDir/alu.vhd"
+    ghdl -a "$buildDir/gen_alu.vhd"
     ghdl -a "$buildDir/gen_controller.vhd"
     ghdl -a "$codeDir/io.vhd"
     ghdl -a "$buildDir/gen_opcodes.vhd"
@@ -42,4 +42,21 @@ cd "$tbDir" > /dev/null
     ghdl -e tb_cpu
     ghdl -r tb_cpu --wave=cpu_wave.ghw
 
+    # NOTE(michiel): Lock-step check against the C model, stops at the first divergence. It
+    # gets a library of its own with only the generated design it was made for.
+    mkdir -p cosim
+    cd cosim > /dev/null
+    cp "$buildDir/gen_stimulus.txt" "$buildDir/gen_expected.txt" .
+    ghdl -a "$buildDir/gen_constants.vhd"
+    ghdl -a "$buildDir/gen_alu.vhd"
+    ghdl -a "$buildDir/gen_controller.vhd"
+    ghdl -a "$codeDir/io.vhd"
+    ghdl -a "$buildDir/gen_opcodes.vhd"
+    ghdl -a "$buildDir/gen_registers.vhd"
+    ghdl -a "$buildDir/gen_cpu.vhd"
+    ghdl -a "$buildDir/gen_tb_cpu.vhd"
+    ghdl -e tb_gen_cpu
+    ghdl -r tb_gen_cpu --assert-level=error
+    cd .. > /dev/null
+
 cd - > /dev/null
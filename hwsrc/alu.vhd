@@ -6,7 +6,14 @@ use work.constants_and_co.all;
 
 entity ALU is
     generic (
-        BITS  : integer := 8
+        BITS    : integer := 8;
+        OP_BITS : integer := 3;
+        -- Register stages from the operands to p, the extra stages are meant to be
+        -- retimed into the adder by synthesis
+        STAGES  : integer := 1;
+        -- Register stages of the multiplier, 0 leaves it out. The other operations
+        -- wait alongside, so every operation takes STAGES + MUL_STAGES - 1 cycles.
+        MUL_STAGES : integer := 0
     );
     port (
         clk  : in  std_logic;
@@ -15,7 +22,7 @@ entity ALU is
         a    : in  std_logic_vector(BITS - 1 downto 0);
         b    : in  std_logic_vector(BITS - 1 downto 0);
 
-        op   : in  std_logic_vector(2 downto 0);
+        op   : in  std_logic_vector(OP_BITS - 1 downto 0);
 
         p    : out std_logic_vector(BITS downto 0)
     );
@@ -23,37 +30,133 @@ end entity; -- ALU
 
 architecture RTL of ALU is
 
+    type stage_array is array(0 to STAGES - 1) of std_logic_vector(BITS downto 0);
+
+    -- Bits of b the barrel shifter looks at, enough to count to BITS - 1
+    function amount_bits(width : integer) return integer is
+        variable result : integer := 1;
+    begin
+        while (2 ** result < width) loop
+            result := result + 1;
+        end loop;
+        return result;
+    end function;
+
+    constant SHIFT_BITS : integer := amount_bits(BITS);
+
+    signal result   : std_logic_vector(BITS downto 0);
+    signal selected : std_logic_vector(BITS downto 0);
+    signal stage    : stage_array;
+
+    signal amount    : natural range 0 to 2 ** SHIFT_BITS - 1;
+    signal shift_out : std_logic; -- Shift amount of BITS or more, b is unsigned here
 
 begin
 
+    p <= stage(STAGES - 1);
+
+    amount <= to_integer(unsigned(b(SHIFT_BITS - 1 downto 0)));
+    shift_out <= '1' when (unsigned(b) >= BITS) else '0';
+
+    no_multiplier : if MUL_STAGES = 0 generate
+        selected <= result;
+    end generate;
+
+    multiplier : if MUL_STAGES > 0 generate
+        signal product : std_logic_vector(BITS downto 0);
+    begin
+        product <= std_logic_vector(resize(signed(a) * signed(b), BITS + 1));
+
+        single_stage : if MUL_STAGES = 1 generate
+            selected <= product when (op = Alu_Mul) else result;
+        end generate;
+
+        -- The product registers follow the multiply directly, so synthesis can move them
+        -- into the pipeline registers of a DSP block. Those have no reset, nor do these.
+        multi_stage : if MUL_STAGES > 1 generate
+            type delay_array is array(1 to MUL_STAGES - 1) of std_logic_vector(BITS downto 0);
+            type op_array is array(1 to MUL_STAGES - 1) of std_logic_vector(OP_BITS - 1 downto 0);
+
+            signal products : delay_array;
+            signal results  : delay_array;
+            signal ops      : op_array;
+        begin
+            selected <= products(MUL_STAGES - 1) when (ops(MUL_STAGES - 1) = Alu_Mul) else
+                        results(MUL_STAGES - 1);
+
+            delays : process(clk)
+            begin
+                if (clk'event and clk = '1') then
+                    products(1) <= product;
+                    results(1) <= result;
+                    ops(1) <= op;
+                    for idx in 2 to MUL_STAGES - 1 loop
+                        products(idx) <= products(idx - 1);
+                        results(idx) <= results(idx - 1);
+                        ops(idx) <= ops(idx - 1);
+                    end loop;
+                end if;
+            end process;
+        end generate;
+    end generate;
+
+    operation : process(a, b, op, amount, shift_out)
+    begin
+        case (op) is
+            when Alu_Noop =>
+                result(BITS - 1 downto 0) <= a;
+                result(BITS) <= a(BITS - 1);
+            when Alu_And =>
+                result(BITS - 1 downto 0) <= a and b;
+                result(BITS) <= '0';
+            when Alu_Or =>
+                result(BITS - 1 downto 0) <= a or b;
+                result(BITS) <= '0';
+            when Alu_Xor =>
+                result(BITS - 1 downto 0) <= a xor b;
+                result(BITS) <= '0';
+            when Alu_Add =>
+                result <= std_logic_vector(signed(a(BITS - 1) & a) +
+                                           signed(b(BITS - 1) & b));
+            when Alu_Sub =>
+                result <= std_logic_vector(signed(a(BITS - 1) & a) -
+                                           signed(b(BITS - 1) & b));
+            when Alu_Sll =>
+                if (shift_out = '1') then
+                    result(BITS - 1 downto 0) <= (others => '0');
+                else
+                    result(BITS - 1 downto 0) <= std_logic_vector(shift_left(unsigned(a), amount));
+                end if;
+                result(BITS) <= '0';
+            when Alu_Srl =>
+                if (shift_out = '1') then
+                    result(BITS - 1 downto 0) <= (others => '0');
+                else
+                    result(BITS - 1 downto 0) <= std_logic_vector(shift_right(unsigned(a), amount));
+                end if;
+                result(BITS) <= '0';
+            when Alu_Sra =>
+                if (shift_out = '1') then
+                    result(BITS - 1 downto 0) <= (others => a(BITS - 1));
+                else
+                    result(BITS - 1 downto 0) <= std_logic_vector(shift_right(signed(a), amount));
+                end if;
+                result(BITS) <= a(BITS - 1);
+            when others =>
+                result <= (others => '0');
+        end case;
+    end process;
+
     clocker : process(clk)
     begin
         if (clk'event and clk = '1') then
             if (nrst = '0') then
-                p <= (others => '0');
+                stage <= (others => (others => '0'));
             else
-                case (op) is
-                    when Alu_Noop =>
-                        p(BITS - 1 downto 0) <= a;
-                        p(BITS) <= a(BITS - 1);
-                    when Alu_And =>
-                        p(BITS - 1 downto 0) <= a and b;
-                        p(BITS) <= '0';
-                    when Alu_Or =>
-                        p(BITS - 1 downto 0) <= a or b;
-                        p(BITS) <= '0';
-                    when Alu_Xor =>
-                        p(BITS - 1 downto 0) <= a xor b;
-                        p(BITS) <= '0';
-                    when Alu_Add =>
-                        p <= std_logic_vector(signed(a(BITS - 1) & a) +
-                                              signed(b(BITS - 1) & b));
-                    when Alu_Sub =>
-                        p <= std_logic_vector(signed(a(BITS - 1) & a) -
-                                              signed(b(BITS - 1) & b));
-                    when others =>
-                        null;
-                end case;
+                stage(0) <= selected;
+                for idx in 1 to STAGES - 1 loop
+                    stage(idx) <= stage(idx - 1);
+                end loop;
             end if;
         end if;
     end process;
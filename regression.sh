@@ -0,0 +1,252 @@
+#!/bin/bash
+
+# NOTE(michiel): Nightly regression over every program and schedule, the jobs run on all
+# cores. Every program gets three stages per configuration:
+#   compile   generate the VHDL
+#   simulate  run the core on a sample stream and check it against the golden model
+#   cosim     run the self checking testbench in GHDL, skipped without ghdl
+# Results are cached on the source, the configuration and a hash of the tools and VHDL, so
+# only what changed runs again. Use -f to ignore the cache and -j N for the job count. The
+# failures in regression_expected.txt report as xfail and don't fail the run.
+#
+#   ./regression.sh [-j N] [-f] [file.turd ...]
+
+set -e
+
+curDir="$(pwd)"
+codeDir="$curDir/tools"
+hwDir="$curDir/hwsrc"
+buildDir="$curDir/gebouw"
+regDir="$buildDir/regression"
+cacheDir="$regDir/cache"
+resultDir="$regDir/results"
+expectedFile="$curDir/regression_expected.txt"
+generator="$regDir/opcode-gen"
+
+sampleCount=20000
+cosimTicks=2000
+configs=(
+  ""
+  "-sched=list"
+  "-sched=modulo"
+  "-sched=list -alus=2"
+  "-sched=modulo -alus=2 -pipe=3"
+  "-pipe=1 -mul=2"
+  "-sched=list -pipe=3 -mul=3"
+  "-io-bits=8"
+)
+
+now() { date +%s.%N; }
+elapsed() { awk -v start="$1" -v end="$(now)" 'BEGIN { printf "%.3f", end - start }'; }
+# NOTE(michiel): In a subshell, so a crash ends up in the log instead of the terminal
+generate() { ( "$generator" "$@"; exit $? ) >> log.txt 2>&1; }
+
+expected_failure() {
+  # NOTE(michiel): Prints the reason when the job is a known failure
+  local stage="$1" program="$(basename "$2")" config="${3:-default}"
+  local xStage xProgram xConfig reason
+  [ -f "$expectedFile" ] || return 1
+  while IFS='|' read -r xStage xProgram xConfig reason; do
+    case "$xStage" in ''|'#'*) continue ;; esac
+    if [[ "$stage" == $xStage && "$program" == $xProgram && "$config" == $xConfig ]]; then
+      echo "$reason"
+      return 0
+    fi
+  done < "$expectedFile"
+  return 1
+}
+
+expect() {
+  # NOTE(michiel): Turns the status of a known failure into xfail, or xpass when it passed.
+  # Applied after the cache, so editing the list doesn't run anything again.
+  local stage="$1" source="$2" config="$3" status="$4" reason
+  if [ "$status" != "skip" ] && reason=$(expected_failure "$stage" "$source" "$config"); then
+    if [ "$status" = "fail" ]; then
+      status="xfail"
+    else
+      status="xpass"
+    fi
+  fi
+  echo "$status"
+}
+
+run_job() {
+  # NOTE(michiel): One stage of one program and configuration, in a directory of its own
+  # since the generator writes to the working directory. Leaves 'status seconds detail' in
+  # the result file and the cache.
+  local stage="$1" source="$2" config="$3"
+  local sourceHash=$(sha1sum < "$source" | cut -c1-40)
+  # NOTE(michiel): The path is part of the key, two programs with the same text still get a
+  # result of their own
+  local key=$(echo "$(cat "$regDir/tool_version") $stage $config $sampleCount $cosimTicks $source $sourceHash" | sha1sum | cut -c1-40)
+  local tag=$(echo "$config" | tr -c 'a-zA-Z0-9=\n' '_')
+  local jobDir="$regDir/jobs/$(basename "$source" .turd)/${tag:-default}/$stage"
+  local result="$resultDir/$key"
+  # NOTE(michiel): The stimulus has to fit in the declared IO input width
+  local ioBits=$(echo "$config" | sed -n 's/.*-io-bits=\([0-9]*\).*/\1/p')
+  local stimulus="$regDir/stimulus_${ioBits:-32}.txt"
+
+  if [ -z "$REGRESSION_FORCE" ] && [ -f "$cacheDir/$key" ]; then
+    local status seconds detail
+    IFS='|' read -r status seconds detail < "$cacheDir/$key"
+    status=$(expect "$stage" "$source" "$config" "$status")
+    echo "$stage|$source|$config|$status|$seconds|$detail|cached|$jobDir" > "$result"
+    return 0
+  fi
+
+  rm -rf "$jobDir"
+  mkdir -p "$jobDir"
+  cd "$jobDir"
+  local start=$(now)
+  local status="pass" detail=""
+  case "$stage" in
+    compile)
+      if ! generate "$source" $config; then
+        status="fail"; detail="generator failed"
+      elif [ ! -f gen_cpu.vhd ]; then
+        status="fail"; detail="no VHDL written"
+      fi
+      ;;
+    simulate)
+      if ! generate "$source" $config -sim-in="$stimulus" -sim-format=text -sim-out=cpu.txt \
+           -golden=0 -golden-out=golden.txt; then
+        status="fail"; detail="generator failed"
+      else
+        local lines=$(wc -l < cpu.txt) goldenLines=$(wc -l < golden.txt)
+        if [ "$lines" -eq 0 ]; then
+          status="fail"; detail="no outputs"
+        elif cmp -s golden.txt cpu.txt; then
+          detail="$lines outputs"
+        else
+          local common=$(( lines < goldenLines ? lines : goldenLines ))
+          local first=$(cmp <(head -n "$common" golden.txt) <(head -n "$common" cpu.txt) | sed 's/.* line //')
+          if [ -n "$first" ]; then
+            status="fail"; detail="output $first differs from the golden model"
+          else
+            status="fail"; detail="$lines outputs, the golden model has $goldenLines"
+          fi
+        fi
+      fi
+      ;;
+    cosim)
+      if ! command -v ghdl > /dev/null; then
+        status="skip"; detail="no ghdl"
+      elif ! generate "$source" $config -sim=$cosimTicks -cosim; then
+        status="fail"; detail="generator failed"
+      elif [ ! -f gen_tb_cpu.vhd ]; then
+        status="skip"; detail="no CPU testbench for this configuration"
+      elif ! { ghdl -a gen_constants.vhd && ghdl -a gen_alu.vhd && ghdl -a gen_controller.vhd &&
+               ghdl -a "$hwDir/io.vhd" && ghdl -a gen_opcodes.vhd && ghdl -a gen_registers.vhd &&
+               ghdl -a gen_cpu.vhd && ghdl -a gen_tb_cpu.vhd && ghdl -e tb_gen_cpu; } >> log.txt 2>&1; then
+        status="fail"; detail="GHDL could not build the core"
+      elif ! ghdl -r tb_gen_cpu --assert-level=error >> log.txt 2>&1; then
+        status="fail"; detail="$(grep -m1 -o 'Divergence.*' log.txt || echo 'testbench failed')"
+      fi
+      ;;
+  esac
+  local seconds=$(elapsed $start)
+  if [ "$status" != "skip" ]; then
+    echo "$status|$seconds|$detail" > "$cacheDir/$key"
+  fi
+  status=$(expect "$stage" "$source" "$config" "$status")
+  echo "$stage|$source|$config|$status|$seconds|$detail|run|$jobDir" > "$result"
+}
+
+if [ "$1" = "--job" ]; then
+  run_job "$2" "$3" "$4"
+  exit 0
+fi
+
+jobCount=$(nproc)
+while getopts "j:f" option; do
+  case "$option" in
+    j) jobCount="$OPTARG" ;;
+    f) export REGRESSION_FORCE=1 ;;
+    *) exit 1 ;;
+  esac
+done
+shift $((OPTIND - 1))
+
+if [ $# -eq 0 ]; then
+  sources=("$curDir"/swsrc/*.turd)
+else
+  sources=()
+  for source in "$@"; do
+    sources+=("$(readlink -f "$source")")
+  done
+fi
+
+mkdir -p "$cacheDir"
+rm -rf "$resultDir"
+mkdir -p "$resultDir"
+wallStart=$(now)
+
+# NOTE(michiel): The tool version covers everything that can change a result, the generator
+# is only built again when it changes
+toolVersion=$(cat "$codeDir"/*.c "$codeDir"/*.h "$hwDir"/*.vhd "$0" | sha1sum | cut -c1-40)
+if [ ! -x "$generator" ] || [ "$(cat "$regDir/tool_version" 2> /dev/null)" != "$toolVersion" ]; then
+  rm -f "$regDir/tool_version"
+  ${CC:-clang} -O2 -Wall -Werror -pedantic -Wno-unused-function -Wno-missing-braces \
+    "$codeDir/opcode_generator.c" -o "$generator" -lm -ldl
+  echo "$toolVersion" > "$regDir/tool_version"
+fi
+buildSeconds=$(elapsed $wallStart)
+
+# NOTE(michiel): Park-Miller samples over the whole signed range of every IO width in the
+# configurations, the same every night
+for config in "${configs[@]}"; do
+  ioBits=$(echo "$config" | sed -n 's/.*-io-bits=\([0-9]*\).*/\1/p')
+  ioBits=${ioBits:-32}
+  awk -v count=$sampleCount -v bits=$ioBits 'BEGIN {
+    range = 2 ^ bits; if (range > 2147483646) { range = 2147483646; }
+    x = 1; for (i = 0; i < count; ++i) { x = (x * 16807) % 2147483647; printf "%d\n", (x % range) - range / 2 } }' \
+    > "$regDir/stimulus_$ioBits.txt"
+done
+
+for source in "${sources[@]}"; do
+  for config in "${configs[@]}"; do
+    for stage in compile simulate cosim; do
+      printf '%s\0%s\0%s\0' "$stage" "$source" "$config"
+    done
+  done
+done | xargs -0 -n 3 -P "$jobCount" "$0" --job
+
+wallSeconds=$(elapsed $wallStart)
+
+# NOTE(michiel): One line per job in the results, the cached ones carry the time of the run
+# that made them
+sort -t'|' -k2,2 -k3,3 "$resultDir"/* | awk -F'|' -v wall="$wallSeconds" -v build="$buildSeconds" -v jobs="$jobCount" '
+  {
+    stage = $1; status = $4; seconds = $5; origin = $7;
+    sourceName = $2; sub(/.*\//, "", sourceName);
+    ++total[stage];
+    ++count[stage, status];
+    if (origin == "cached") { ++cached[stage]; saved[stage] += seconds; }
+    else { spent[stage] += seconds; }
+    if (status == "fail") {
+      failures[++failCount] = sprintf("  %-8s %-24s %-32s %s (%s)", stage, sourceName, $3 == "" ? "default" : $3, $6, $8);
+    }
+    if (status == "xpass") {
+      passes[++passCount] = sprintf("  %-8s %-24s %-32s (%s)", stage, sourceName, $3 == "" ? "default" : $3, $8);
+    }
+  }
+  END {
+    printf "%-10s %5s %5s %5s %5s %5s %5s %7s %10s %10s\n", "Stage", "Jobs", "Pass", "Fail", "XFail", "XPass", "Skip",
+           "Cached", "Run (s)", "Saved (s)";
+    split("compile simulate cosim", stages, " ");
+    for (i = 1; i <= 3; ++i) {
+      s = stages[i];
+      printf "%-10s %5d %5d %5d %5d %5d %5d %7d %10.2f %10.2f\n", s, total[s], count[s, "pass"], count[s, "fail"],
+             count[s, "xfail"], count[s, "xpass"], count[s, "skip"], cached[s], spent[s], saved[s];
+    }
+    printf "Build %.2f s, wall time %.2f s on %d jobs\n", build, wall, jobs;
+    if (passCount) {
+      printf "Passing, but listed in regression_expected.txt:\n";
+      for (i = 1; i <= passCount; ++i) { print passes[i]; }
+    }
+    if (failCount) {
+      printf "Failures:\n";
+      for (i = 1; i <= failCount; ++i) { print failures[i]; }
+      exit 1;
+    }
+  }'
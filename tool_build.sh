@@ -16,14 +16,14 @@ fi
 
 flags="-O0 -g -ggdb -Wall -Werror -pedantic"
 exceptions="-Wno-unused-function -Wno-missing-braces"
-libs="-lm"
+libs="-lm -ldl"
 
 mkdir -p "$buildDir"
 
 pushd "$buildDir" > /dev/null
 
 clang $flags $exceptions "$codeDir/opcode_generator.c" -o opcode-gen $libs
-./opcode-gen "$sourceFile"
+./opcode-gen "$sourceFile" "${@:2}"
 dot -Tsvg tokens.dot -o tokens.svg
 dot -Tsvg ast.dot -o ast.svg
 dot -Tsvg opcodes.dot -o opcodes.svg
@@ -728,15 +728,18 @@ global Map *gConstSymbols = &gConstSymbols_;
 internal s64
 execute_op(TokenKind op, s64 left, s64 right)
 {
+    // NOTE(michiel): Shifts wrap at 32 bits like in the ALU. Their amounts are unsigned,
+    // so a negative amount shifts everything out.
     s64 val = 0;
+    b32 shiftOut = (right < 0) || (right > 31);
     switch ((u32)op)
     {
         case TOKEN_POW: { val = (s64)(pow((f64)left, (f64)right)); } break;
         case '*': { val = left * right; } break;
         case '/': { i_expect(right); val = left / right; } break;
-        case TOKEN_SLL: { val = left << right; } break;
-        case TOKEN_SRA: { val = (s64)((s64)left >> (s64)right); } break;
-        case TOKEN_SRL: { val = (s64)((u64)left >> (u64)right); } break;
+        case TOKEN_SLL: { val = shiftOut ? 0 : (s32)((u32)left << right); } break;
+        case TOKEN_SRA: { val = (s32)left >> (shiftOut ? 31 : right); } break;
+        case TOKEN_SRL: { val = shiftOut ? 0 : (s32)((u32)left >> right); } break;
         case '+': { val = left + right; } break;
         case '-': { val = left - right; } break;
         case '&': { val = left & right; } break;
@@ -821,8 +824,15 @@ combine_const(AstOptimizer *optimizer, Expr *expr)
 
             combine_const(optimizer, expr->binary.left);
             combine_const(optimizer, expr->binary.right);
-            if ((expr->binary.left->kind == Expr_Int) &&
-                (expr->binary.right->kind == Expr_Int))
+            if ((expr->binary.op == TOKEN_SRL) &&
+                (expr->binary.left->kind == Expr_Int) &&
+                (expr->binary.left->intConst < 0))
+            {
+                // NOTE(michiel): The zeroes shifted in land at the datapath width, which
+                // isn't known yet, so the ALU does this one.
+            }
+            else if ((expr->binary.left->kind == Expr_Int) &&
+                     (expr->binary.right->kind == Expr_Int))
             {
                 s64 left = expr->binary.left->intConst;
                 s64 right = expr->binary.right->intConst;
@@ -925,7 +935,20 @@ combine_const(AstOptimizer *optimizer, Expr *expr)
                 TokenKind op = expr->binary.op;
                 OpPrecedence opP = get_op_precedence(op);
                 
-    if (left->kind == Expr_Binary)
+                if ((left->kind == Expr_Binary) &&
+                    (left->binary.op == op) &&
+                    ((op == TOKEN_SLL) || (op == TOKEN_SRA) || (op == TOKEN_SRL)) &&
+                    (left->binary.right->kind == Expr_Int) &&
+                    (left->binary.right->intConst >= 0) &&
+                    (expr->binary.right->intConst >= 0))
+                {
+                    // NOTE(michiel): X << 2 << 3 => X << 5, the same for right shifts
+                    expr->binary.right->intConst += left->binary.right->intConst;
+                    expr->binary.left = left->binary.left;
+                    free_expr(optimizer, left->binary.right);
+                    free_expr(optimizer, left);
+                }
+                else if (left->kind == Expr_Binary)
     {
     TokenKind leftOp = left->binary.op;
                 OpPrecedence leftOpP = get_op_precedence(leftOp);
@@ -1369,6 +1392,102 @@ fprintf(stderr, "%.*s:%d:%d: Unused variable %.*s.\n",
     }
 }
 
+internal b32
+is_shift_multiplier(Expr *expr)
+{
+    b32 result = ((expr->kind == Expr_Int) && (expr->intConst > 0) &&
+                  (expr->intConst <= 0x80000000LL) && is_pow2(expr->intConst));
+    return result;
+}
+
+internal void
+reduce_multiply(AstOptimizer *optimizer, Expr *expr)
+{
+    // NOTE(michiel): A multiply by a power of two is a left shift, so programs that only
+    // scale don't pull a multiplier into the core.
+    switch (expr->kind)
+    {
+        case Expr_Paren:
+        {
+            reduce_multiply(optimizer, expr->paren.expr);
+        } break;
+
+        case Expr_Unary:
+        {
+            reduce_multiply(optimizer, expr->unary.expr);
+        } break;
+
+        case Expr_Binary:
+        {
+            reduce_multiply(optimizer, expr->binary.left);
+            reduce_multiply(optimizer, expr->binary.right);
+            if ((expr->binary.op == TOKEN_MUL) && is_shift_multiplier(expr->binary.left) &&
+                (expr->binary.right->kind != Expr_Int))
+            {
+                Expr *swap = expr->binary.left;
+                expr->binary.left = expr->binary.right;
+                expr->binary.right = swap;
+            }
+            if ((expr->binary.op == TOKEN_MUL) && is_shift_multiplier(expr->binary.right))
+            {
+                expr->binary.op = TOKEN_SLL;
+                expr->binary.right->intConst = log2_up((u32)expr->binary.right->intConst) - 1;
+            }
+        } break;
+
+        default: {} break;
+    }
+}
+
+internal void
+ast_reduce_multiplies(AstOptimizer *optimizer)
+{
+    for (u32 stmtIdx = 0; stmtIdx < optimizer->statements.stmtCount; ++stmtIdx)
+    {
+        Stmt *stmt = optimizer->statements.stmts[stmtIdx];
+        if (stmt->kind == Stmt_Assign)
+        {
+            reduce_multiply(optimizer, stmt->assign.right);
+        }
+    }
+}
+
+internal b32
+expr_uses_multiplier(Expr *expr)
+{
+    b32 result = false;
+    switch (expr->kind)
+    {
+        case Expr_Paren: { result = expr_uses_multiplier(expr->paren.expr); } break;
+        case Expr_Unary: { result = expr_uses_multiplier(expr->unary.expr); } break;
+        case Expr_Binary:
+        {
+            result = ((expr->binary.op == TOKEN_MUL) ||
+                      expr_uses_multiplier(expr->binary.left) ||
+                      expr_uses_multiplier(expr->binary.right));
+        } break;
+        default: {} break;
+    }
+    return result;
+}
+
+internal b32
+ast_uses_multiplier(AstOptimizer *optimizer)
+{
+    // NOTE(michiel): Constant products are folded and powers of two became shifts, so any
+    // multiply left needs the hardware multiplier.
+    b32 result = false;
+    for (u32 stmtIdx = 0; !result && (stmtIdx < optimizer->statements.stmtCount); ++stmtIdx)
+    {
+        Stmt *stmt = optimizer->statements.stmts[stmtIdx];
+        if (stmt->kind == Stmt_Assign)
+        {
+            result = expr_uses_multiplier(stmt->assign.right);
+        }
+    }
+    return result;
+}
+
 internal void
 ast_optimize(AstOptimizer *optimizer)
 {
@@ -1377,4 +1496,5 @@ ast_optimize(AstOptimizer *optimizer)
     ast_expand_single_assignment(optimizer);
     ast_combine_const(optimizer);
     ast_remove_unused(optimizer);
+    ast_reduce_multiplies(optimizer);
 }
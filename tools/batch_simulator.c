@@ -0,0 +1,381 @@
+// NOTE(michiel): Batched simulator for running many independent input streams at once. The
+// program has no branches, so every lane is at the same pc and only the data differs. Every
+// value of the machine state is an array with a vector of BATCH_VECTOR_LANES per group of
+// lanes, an opcode is decoded once per tick and each of its operations runs over all groups.
+// With GCC or clang the vectors are compiler vector types, so the build flags pick SSE or
+// AVX2 (-mavx2 or -march=native), else it is a loop per lane. Same cycle model as simulate().
+
+#define BATCH_VECTOR_LANES 8
+#define MAX_BATCH_LANES    32
+
+#if defined(__GNUC__)
+#define BATCH_VECTOR_TYPES 1
+typedef u32 BatchVector __attribute__((vector_size(BATCH_VECTOR_LANES * sizeof(u32))));
+typedef s32 BatchVectorSigned __attribute__((vector_size(BATCH_VECTOR_LANES * sizeof(u32))));
+#define batch_lane(v, lane) ((v)[lane])
+#else
+#define BATCH_VECTOR_TYPES 0
+typedef struct BatchVector
+{
+    u32 e[BATCH_VECTOR_LANES];
+} BatchVector;
+#define batch_lane(v, lane) ((v).e[lane])
+#endif
+
+typedef struct BatchSim
+{
+    // NOTE(michiel): Every pointer is the start of groupCount vectors. The next state values
+    // and the pipeline stages get swapped around instead of copied.
+    u32 laneCount;
+    u32 groupCount;
+    u32 registerCount;
+    u32 aluLatency;
+    u32 signShift;
+
+    BatchVector mask;
+    BatchVector width;
+    BatchVector maxShift;
+
+    BatchVector *zero;
+    BatchVector *immediate; // NOTE(michiel): Of the current opcode
+    BatchVector *ioIn;
+    BatchVector *memOutA;
+    BatchVector *memOutB;
+    BatchVector *memNextA;
+    BatchVector *memNextB;
+    BatchVector *aluOut[MAX_ALU_COUNT];
+    BatchVector *aluPending[MAX_ALU_COUNT][MAX_ALU_LATENCY - 1];
+    BatchVector *aluNext[MAX_ALU_COUNT];
+    BatchVector *outputHash;
+    BatchVector *registers; // NOTE(michiel): registerCount arrays
+    BatchVector *inputs;    // NOTE(michiel): One array per input sample
+
+    void *memory;
+    BatchVector *nextFree;
+} BatchSim;
+
+// NOTE(michiel): Vectors go by pointer, passing them by value changes the ABI between SSE
+// and AVX builds.
+internal inline void
+batch_splat(BatchVector *dest, u32 value)
+{
+    for (u32 lane = 0; lane < BATCH_VECTOR_LANES; ++lane)
+    {
+        batch_lane(*dest, lane) = value;
+    }
+}
+
+internal inline void
+batch_splat_all(BatchSim *sim, BatchVector *dest, u32 value)
+{
+    for (u32 groupIdx = 0; groupIdx < sim->groupCount; ++groupIdx)
+    {
+        batch_splat(dest + groupIdx, value);
+    }
+}
+
+internal inline void
+batch_copy(BatchSim *sim, BatchVector *dest, BatchVector *source)
+{
+    for (u32 groupIdx = 0; groupIdx < sim->groupCount; ++groupIdx)
+    {
+        dest[groupIdx] = source[groupIdx];
+    }
+}
+
+internal void
+batch_alu(OpCodeStats *stats, BatchSim *sim, enum AluOp op, BatchVector *a, BatchVector *b,
+          BatchVector *dest)
+{
+    // NOTE(michiel): Operands are masked, the low bits of a sum or product don't depend on
+    // the sign extension. Lanes shifting out of range shift by 0 and get masked after, a
+    // vector shift by the full lane width isn't defined.
+    u32 count = sim->groupCount;
+#if BATCH_VECTOR_TYPES
+    BatchVector mask = sim->mask;
+    BatchVector width = sim->width;
+    BatchVector maxShift = sim->maxShift;
+    s32 signShift = (s32)sim->signShift;
+    switch (op)
+    {
+        case Alu_Noop: { batch_copy(sim, dest, a); } break;
+        case Alu_And: { for (u32 idx = 0; idx < count; ++idx) { dest[idx] = a[idx] & b[idx]; } } break;
+        case Alu_Or: { for (u32 idx = 0; idx < count; ++idx) { dest[idx] = a[idx] | b[idx]; } } break;
+        case Alu_Xor: { for (u32 idx = 0; idx < count; ++idx) { dest[idx] = a[idx] ^ b[idx]; } } break;
+        case Alu_Add: { for (u32 idx = 0; idx < count; ++idx) { dest[idx] = (a[idx] + b[idx]) & mask; } } break;
+        case Alu_Sub: { for (u32 idx = 0; idx < count; ++idx) { dest[idx] = (a[idx] - b[idx]) & mask; } } break;
+        case Alu_Mul: { for (u32 idx = 0; idx < count; ++idx) { dest[idx] = (a[idx] * b[idx]) & mask; } } break;
+        case Alu_Sll:
+        {
+            for (u32 idx = 0; idx < count; ++idx)
+            {
+                BatchVector inRange = (BatchVector)(b[idx] < width);
+                dest[idx] = (a[idx] << (b[idx] & inRange)) & mask & inRange;
+            }
+        } break;
+        case Alu_Srl:
+        {
+            for (u32 idx = 0; idx < count; ++idx)
+            {
+                BatchVector inRange = (BatchVector)(b[idx] < width);
+                dest[idx] = (a[idx] >> (b[idx] & inRange)) & inRange;
+            }
+        } break;
+        case Alu_Sra:
+        {
+            for (u32 idx = 0; idx < count; ++idx)
+            {
+                BatchVector inRange = (BatchVector)(b[idx] < maxShift);
+                BatchVector amount = (b[idx] & inRange) | (maxShift & ~inRange);
+                BatchVectorSigned value = (BatchVectorSigned)(a[idx] << signShift) >> signShift;
+                dest[idx] = (BatchVector)(value >> (BatchVectorSigned)amount) & mask;
+            }
+        } break;
+        INVALID_DEFAULT_CASE;
+    }
+#else
+    for (u32 idx = 0; idx < count; ++idx)
+    {
+        for (u32 lane = 0; lane < BATCH_VECTOR_LANES; ++lane)
+        {
+            batch_lane(dest[idx], lane) = sim_alu(stats, op, batch_lane(a[idx], lane), batch_lane(b[idx], lane));
+        }
+    }
+#endif
+}
+
+internal void
+batch_hash(BatchSim *sim, BatchVector *value)
+{
+    for (u32 idx = 0; idx < sim->groupCount; ++idx)
+    {
+#if BATCH_VECTOR_TYPES
+        sim->outputHash[idx] = (sim->outputHash[idx] ^ value[idx]) * 16777619;
+#else
+        for (u32 lane = 0; lane < BATCH_VECTOR_LANES; ++lane)
+        {
+            batch_lane(sim->outputHash[idx], lane) =
+                (batch_lane(sim->outputHash[idx], lane) ^ batch_lane(value[idx], lane)) * 16777619;
+        }
+#endif
+    }
+}
+
+internal BatchVector *
+batch_select(OpCodeStats *stats, BatchSim *sim, enum Selection select)
+{
+    BatchVector *result = 0;
+    switch (select)
+    {
+        case Select_Zero: { result = sim->zero; } break;
+        case Select_MemoryA: { result = sim->memOutA; } break;
+        case Select_MemoryB: { result = sim->memOutB; } break;
+        case Select_Immediate: { result = sim->immediate; } break;
+        case Select_IO: { result = sim->ioIn; } break;
+        case Select_Alu:
+        case Select_Alu1:
+        case Select_Alu2:
+        case Select_Alu3:
+        {
+            i_expect((u32)(select - Select_Alu) < stats->aluCount);
+            result = sim->aluOut[select - Select_Alu];
+        } break;
+        INVALID_DEFAULT_CASE;
+    }
+    return result;
+}
+
+internal BatchVector *
+batch_push_arrays(BatchSim *sim, u32 arrayCount)
+{
+    BatchVector *result = sim->nextFree;
+    sim->nextFree += arrayCount * sim->groupCount;
+    return result;
+}
+
+internal void
+batch_setup(OpCodeStats *stats, BatchSim *sim, u32 laneCount, u32 inputCount, u32 *laneInputs)
+{
+    // NOTE(michiel): laneInputs has inputCount samples for every lane, they get transposed so
+    // a new sample for a group is one vector load.
+    i_expect(laneCount && ((laneCount % BATCH_VECTOR_LANES) == 0));
+    sim->laneCount = laneCount;
+    sim->groupCount = laneCount / BATCH_VECTOR_LANES;
+    sim->registerCount = 1 << stats->addressBits;
+    sim->aluLatency = get_alu_latency(&stats->pipeline);
+    i_expect(sim->aluLatency <= MAX_ALU_LATENCY);
+    sim->signShift = 32 - stats->bitWidth;
+    batch_splat(&sim->mask, sim_mask(stats, -1));
+    batch_splat(&sim->width, stats->bitWidth);
+    batch_splat(&sim->maxShift, stats->bitWidth - 1);
+
+    // NOTE(michiel): zero, immediate, ioIn, the memory outputs with their next values and
+    // the output hash, then the ALU stages, the registers and the inputs.
+    u32 arrayCount = 8 + stats->aluCount * (sim->aluLatency + 1) + sim->registerCount + inputCount;
+    sim->memory = allocate_size((arrayCount * sim->groupCount + 1) * sizeof(BatchVector), 0);
+    sim->nextFree = align_ptr_up(sim->memory, sizeof(BatchVector));
+
+    sim->zero = batch_push_arrays(sim, 1);
+    sim->immediate = batch_push_arrays(sim, 1);
+    sim->ioIn = batch_push_arrays(sim, 1);
+    sim->memOutA = batch_push_arrays(sim, 1);
+    sim->memOutB = batch_push_arrays(sim, 1);
+    sim->memNextA = batch_push_arrays(sim, 1);
+    sim->memNextB = batch_push_arrays(sim, 1);
+    sim->outputHash = batch_push_arrays(sim, 1);
+    for (u32 slot = 0; slot < stats->aluCount; ++slot)
+    {
+        sim->aluOut[slot] = batch_push_arrays(sim, 1);
+        sim->aluNext[slot] = batch_push_arrays(sim, 1);
+        for (u32 stage = 0; stage + 1 < sim->aluLatency; ++stage)
+        {
+            sim->aluPending[slot][stage] = batch_push_arrays(sim, 1);
+        }
+    }
+    sim->registers = batch_push_arrays(sim, sim->registerCount);
+    sim->inputs = batch_push_arrays(sim, inputCount);
+
+    batch_splat_all(sim, sim->outputHash, 2166136261u);
+    for (u32 inputIdx = 0; inputIdx < inputCount; ++inputIdx)
+    {
+        for (u32 laneIdx = 0; laneIdx < laneCount; ++laneIdx)
+        {
+            BatchVector *input = sim->inputs + inputIdx * sim->groupCount + laneIdx / BATCH_VECTOR_LANES;
+            batch_lane(*input, laneIdx % BATCH_VECTOR_LANES) =
+                sim_mask(stats, laneInputs[laneIdx * inputCount + inputIdx]);
+        }
+    }
+}
+
+internal u32 *
+batch_lane_inputs(u32 laneCount, u32 inputCount, u32 *inputs)
+{
+    // NOTE(michiel): Lane 0 gets the regular inputs so it can be checked against simulate(),
+    // the others get their own pseudo random stream of the same length.
+    u32 *result = allocate_array(laneCount * inputCount, u32, ALLOC_NOCLEAR);
+    for (u32 inputIdx = 0; inputIdx < inputCount; ++inputIdx)
+    {
+        result[inputIdx] = inputs[inputIdx];
+    }
+    for (u32 laneIdx = 1; laneIdx < laneCount; ++laneIdx)
+    {
+        u32 random = laneIdx * 0x9E3779B9;
+        for (u32 inputIdx = 0; inputIdx < inputCount; ++inputIdx)
+        {
+            random ^= random << 13;
+            random ^= random >> 17;
+            random ^= random << 5;
+            result[laneIdx * inputCount + inputIdx] = random;
+        }
+    }
+    return result;
+}
+
+internal void
+simulate_batch(OpCodeStats *stats, u32 opCodeCount, OpCode *opCodes, u32 laneCount,
+               u32 inputCount, u32 *laneInputs, u32 clockTicks, b32 tracing)
+{
+    i_expect(inputCount);
+    i_expect(opCodeCount);
+    i_expect(laneCount <= MAX_BATCH_LANES);
+    ModuloKernel *kernel = &stats->kernel;
+    i_expect(kernel->interval);
+    i_expect(kernel->start < opCodeCount);
+
+    BatchSim sim = {0};
+    batch_setup(stats, &sim, laneCount, inputCount, laneInputs);
+    u32 aluLatency = sim.aluLatency;
+
+    clock_t start = clock();
+    u32 inputIndex = 0;
+    u32 outputCount = 0;
+    u32 pc = 0;
+    for (u32 tick = 0; tick < clockTicks; ++tick)
+    {
+        OpCode *opCode = opCodes + pc;
+        if ((pc % kernel->interval) == 0)
+        {
+            batch_copy(&sim, sim.ioIn, sim.inputs + inputIndex * sim.groupCount);
+            inputIndex = (inputIndex + 1) % inputCount;
+        }
+        batch_splat_all(&sim, sim.immediate, sim_mask(stats, opCode->immediate));
+
+        for (u32 slot = 0; slot < stats->aluCount; ++slot)
+        {
+            AluSlot *alu = opCode->aluSlots + slot;
+            batch_alu(stats, &sim, alu->operation, batch_select(stats, &sim, alu->selectA),
+                      batch_select(stats, &sim, alu->selectB), sim.aluNext[slot]);
+        }
+
+        if (opCode->selectIO != Select_Zero)
+        {
+            BatchVector *value = batch_select(stats, &sim, opCode->selectIO);
+            batch_hash(&sim, value);
+            if (tracing)
+            {
+                fprintf(stdout, "Tick %4u: IO out %3u =", tick, outputCount);
+                for (u32 laneIdx = 0; laneIdx < laneCount; ++laneIdx)
+                {
+                    fprintf(stdout, " %d", sim_signed(stats, batch_lane(value[laneIdx / BATCH_VECTOR_LANES],
+                                                                        laneIdx % BATCH_VECTOR_LANES)));
+                }
+                fprintf(stdout, "\n");
+            }
+            ++outputCount;
+        }
+
+        // NOTE(michiel): Reads see the register contents from before the write of this cycle
+        batch_copy(&sim, sim.memNextA, opCode->memoryReadA ?
+                   sim.registers + opCode->memoryAddrA * sim.groupCount : sim.zero);
+        batch_copy(&sim, sim.memNextB, opCode->memoryReadB ?
+                   sim.registers + opCode->memoryAddrB * sim.groupCount : sim.zero);
+        if (opCode->memoryWrite)
+        {
+            batch_copy(&sim, sim.registers + opCode->memoryAddrA * sim.groupCount,
+                       batch_select(stats, &sim, opCode->selectMem));
+        }
+
+        BatchVector *swap = sim.memOutA;
+        sim.memOutA = sim.memNextA;
+        sim.memNextA = swap;
+        swap = sim.memOutB;
+        sim.memOutB = sim.memNextB;
+        sim.memNextB = swap;
+        for (u32 slot = 0; slot < stats->aluCount; ++slot)
+        {
+            swap = sim.aluOut[slot];
+            if (aluLatency == 1)
+            {
+                sim.aluOut[slot] = sim.aluNext[slot];
+            }
+            else
+            {
+                sim.aluOut[slot] = sim.aluPending[slot][aluLatency - 2];
+                for (u32 stage = aluLatency - 2; stage > 0; --stage)
+                {
+                    sim.aluPending[slot][stage] = sim.aluPending[slot][stage - 1];
+                }
+                sim.aluPending[slot][0] = sim.aluNext[slot];
+            }
+            sim.aluNext[slot] = swap;
+        }
+
+        ++pc;
+        if (pc == opCodeCount)
+        {
+            pc = kernel->start;
+        }
+    }
+    f64 seconds = (f64)(clock() - start) / (f64)CLOCKS_PER_SEC;
+
+    for (u32 laneIdx = 0; laneIdx < laneCount; ++laneIdx)
+    {
+        fprintf(stdout, "Lane %2u: %u outputs (hash %08X)\n", laneIdx, outputCount,
+                batch_lane(sim.outputHash[laneIdx / BATCH_VECTOR_LANES], laneIdx % BATCH_VECTOR_LANES));
+    }
+    fprintf(stdout, "Batch sim: %u lanes, %u ticks, %.1f Mticks/s, %.1f Mlane-ticks/s\n",
+            laneCount, clockTicks,
+            (seconds > 0.0) ? (f64)clockTicks / seconds * 1e-6 : 0.0,
+            (seconds > 0.0) ? (f64)clockTicks * (f64)laneCount / seconds * 1e-6 : 0.0);
+    deallocate(sim.memory);
+}
@@ -0,0 +1,149 @@
+// NOTE(michiel): Arbitrary width bit vectors, used for opcode words that don't fit in an u64.
+// Bit 0 is the least significant bit of words[0].
+
+typedef struct BitVector
+{
+    u32 bitCount;
+    u32 wordCount;
+    u64 *words;
+} BitVector;
+
+internal BitVector
+bitvec_allocate(u32 bitCount)
+{
+    BitVector result = {0};
+    result.bitCount = bitCount;
+    result.wordCount = (bitCount + 63) / 64;
+    if (result.wordCount)
+    {
+        result.words = allocate_array(result.wordCount, u64, 0);
+    }
+    return result;
+}
+
+internal void
+bitvec_free(BitVector *vector)
+{
+    deallocate(vector->words);
+    vector->words = 0;
+    vector->bitCount = 0;
+    vector->wordCount = 0;
+}
+
+internal BitVector
+bitvec_copy(BitVector *vector)
+{
+    BitVector result = bitvec_allocate(vector->bitCount);
+    memcpy(result.words, vector->words, result.wordCount * sizeof(u64));
+    return result;
+}
+
+internal inline void
+bitvec_clear(BitVector *vector)
+{
+    memset(vector->words, 0, vector->wordCount * sizeof(u64));
+}
+
+internal inline b32
+bitvec_get_bit(BitVector *vector, u32 bit)
+{
+    i_expect(bit < vector->bitCount);
+    b32 result = (vector->words[bit / 64] >> (bit % 64)) & 1;
+    return result;
+}
+
+internal inline void
+bitvec_set_bit(BitVector *vector, u32 bit, b32 value)
+{
+    i_expect(bit < vector->bitCount);
+    u64 mask = 1ULL << (bit % 64);
+    if (value)
+    {
+        vector->words[bit / 64] |= mask;
+    }
+    else
+    {
+        vector->words[bit / 64] &= ~mask;
+    }
+}
+
+internal void
+bitvec_set_field(BitVector *vector, u32 offset, u32 bits, u64 value)
+{
+    // NOTE(michiel): Sets bits [offset, offset + bits) to the lower bits of value, the field
+    // may straddle a word boundary.
+    i_expect(bits <= 64);
+    i_expect(offset + bits <= vector->bitCount);
+    for (u32 bit = 0; bit < bits; ++bit)
+    {
+        bitvec_set_bit(vector, offset + bit, (value >> bit) & 1);
+    }
+}
+
+internal u64
+bitvec_get_field(BitVector *vector, u32 offset, u32 bits)
+{
+    i_expect(bits <= 64);
+    i_expect(offset + bits <= vector->bitCount);
+    u64 result = 0;
+    for (u32 bit = 0; bit < bits; ++bit)
+    {
+        result |= (u64)bitvec_get_bit(vector, offset + bit) << bit;
+    }
+    return result;
+}
+
+internal BitVector
+bitvec_slice(BitVector *vector, u32 offset, u32 bits)
+{
+    BitVector result = bitvec_allocate(bits);
+    for (u32 bit = 0; bit < bits; ++bit)
+    {
+        bitvec_set_bit(&result, bit, bitvec_get_bit(vector, offset + bit));
+    }
+    return result;
+}
+
+internal b32
+bitvec_equal(BitVector *a, BitVector *b)
+{
+    b32 result = (a->bitCount == b->bitCount);
+    for (u32 wordIdx = 0; result && (wordIdx < a->wordCount); ++wordIdx)
+    {
+        result = (a->words[wordIdx] == b->words[wordIdx]);
+    }
+    return result;
+}
+
+internal char *
+bitvec_to_binary(BitVector *vector)
+{
+    // NOTE(michiel): Most significant bit first, as used in VHDL bit string literals
+    char *tempBuf = allocate_array(vector->bitCount + 1, char, ALLOC_NOCLEAR);
+    for (u32 bit = 0; bit < vector->bitCount; ++bit)
+    {
+        tempBuf[bit] = bitvec_get_bit(vector, vector->bitCount - bit - 1) ? '1' : '0';
+    }
+    tempBuf[vector->bitCount] = 0;
+    // NOTE(michiel): Intern the terminator as well, interned strings aren't zero terminated
+    String result = str_internalize((String){.size = vector->bitCount + 1, .data = (u8 *)tempBuf});
+    deallocate(tempBuf);
+    return (char *)result.data;
+}
+
+internal char *
+bitvec_to_hex(BitVector *vector)
+{
+    u32 nibbleCount = (vector->bitCount + 3) / 4;
+    char *tempBuf = allocate_array(nibbleCount + 1, char, ALLOC_NOCLEAR);
+    for (u32 nibble = 0; nibble < nibbleCount; ++nibble)
+    {
+        u32 offset = (nibbleCount - nibble - 1) * 4;
+        u32 bits = minimum(4, vector->bitCount - offset);
+        tempBuf[nibble] = "0123456789ABCDEF"[bitvec_get_field(vector, offset, bits)];
+    }
+    tempBuf[nibbleCount] = 0;
+    String result = str_internalize((String){.size = nibbleCount + 1, .data = (u8 *)tempBuf});
+    deallocate(tempBuf);
+    return (char *)result.data;
+}
@@ -4,8 +4,10 @@
 #include <stddef.h>
 #include <stdarg.h>
 #include <memory.h>
+#include <string.h>
 #include <assert.h>
 #include <math.h>
+#include <time.h>
 
 #define internal  static
 #define global    static
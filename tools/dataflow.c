@@ -0,0 +1,258 @@
+// NOTE(michiel): Fully spatial backend for stateless programs. Every variable is written
+// before it is read within one pass, so the outputs are a pure function of the input
+// sample. Instead of a core that spends a pass of opcodes per sample, every operation gets
+// its own registered operator and the values that skip stages get delay registers, so the
+// circuit takes a new sample every clock. All outputs of a sample leave at the same cycle,
+// one port per IO assignment.
+
+typedef enum DataflowOperandKind
+{
+    DataflowOperand_Constant,
+    DataflowOperand_Input,
+    DataflowOperand_Node,
+} DataflowOperandKind;
+
+typedef struct DataflowOperand
+{
+    DataflowOperandKind kind;
+    s32 value; // NOTE(michiel): Constant value or node index
+} DataflowOperand;
+
+typedef struct DataflowNode
+{
+    enum AluOp op;
+    DataflowOperand a;
+    DataflowOperand b;
+    u32 depth;    // NOTE(michiel): Clock cycle after the input register that holds the result
+    u32 stages;   // NOTE(michiel): Register stages of the operator, more than 1 for a multiplier
+    u32 maxDelay; // NOTE(michiel): Length of the delay chain behind the result
+} DataflowNode;
+
+typedef struct Dataflow
+{
+    b32 stateless;
+    DataflowNode *nodes;
+    DataflowOperand *outputs;
+    u32 latency;       // NOTE(michiel): Cycles from the input register to the outputs
+    u32 inputMaxDelay; // NOTE(michiel): Delay chain behind the input register
+    u32 mulStages;
+} Dataflow;
+
+internal DataflowOperand
+dataflow_operand(DataflowOperandKind kind, s32 value)
+{
+    DataflowOperand result = {kind, value};
+    return result;
+}
+
+internal inline u32
+dataflow_depth(Dataflow *dataflow, DataflowOperand operand)
+{
+    u32 result = 0;
+    if (operand.kind == DataflowOperand_Node)
+    {
+        result = dataflow->nodes[operand.value].depth;
+    }
+    return result;
+}
+
+internal void
+dataflow_need_delay(Dataflow *dataflow, DataflowOperand operand, u32 delay)
+{
+    if (operand.kind == DataflowOperand_Node)
+    {
+        DataflowNode *node = dataflow->nodes + operand.value;
+        node->maxDelay = maximum(node->maxDelay, delay);
+    }
+    else if (operand.kind == DataflowOperand_Input)
+    {
+        dataflow->inputMaxDelay = maximum(dataflow->inputMaxDelay, delay);
+    }
+}
+
+internal DataflowOperand
+dataflow_from_sched(Dataflow *dataflow, SchedProgram *program, DataflowOperand *registers,
+                    b32 *written, SchedOperand operand)
+{
+    DataflowOperand result = {0};
+    switch (operand.kind)
+    {
+        case SchedOperand_Zero:
+        {
+            result = dataflow_operand(DataflowOperand_Constant, 0);
+        } break;
+
+        case SchedOperand_Immediate:
+        {
+            result = dataflow_operand(DataflowOperand_Constant, operand.value);
+        } break;
+
+        case SchedOperand_IO:
+        {
+            result = dataflow_operand(DataflowOperand_Input, 0);
+        } break;
+
+        case SchedOperand_Register:
+        {
+            // NOTE(michiel): A read without a write earlier in the pass sees the previous
+            // sample, that is state the spatial circuit doesn't have.
+            if (written[operand.value])
+            {
+                result = registers[operand.value];
+            }
+            else
+            {
+                dataflow->stateless = false;
+            }
+        } break;
+
+        case SchedOperand_Node:
+        {
+            SchedNode *schedNode = program->nodes + operand.value;
+            DataflowOperand a = dataflow_from_sched(dataflow, program, registers, written, schedNode->a);
+            DataflowOperand b = dataflow_from_sched(dataflow, program, registers, written, schedNode->b);
+            if (schedNode->op == Alu_Noop)
+            {
+                // NOTE(michiel): Only moves a value into the ALU register, a wire here
+                result = a;
+            }
+            else
+            {
+                DataflowNode node = {0};
+                node.op = schedNode->op;
+                node.a = a;
+                node.b = b;
+                node.stages = (node.op == Alu_Mul) ? maximum(1, dataflow->mulStages) : 1;
+                node.depth = maximum(dataflow_depth(dataflow, a), dataflow_depth(dataflow, b)) + node.stages;
+                buf_push(dataflow->nodes, node);
+                result = dataflow_operand(DataflowOperand_Node, buf_len(dataflow->nodes) - 1);
+            }
+        } break;
+
+        INVALID_DEFAULT_CASE;
+    }
+    return result;
+}
+
+internal Dataflow
+build_dataflow(AstOptimizer *optimizer, u32 mulStages)
+{
+    // NOTE(michiel): Reuses the statement trees of the list scheduler, with its own register
+    // numbering so the CPU backend isn't disturbed. Multipliers get the same register stages
+    // as the one in the ALU.
+    Dataflow result = {0};
+    result.stateless = true;
+    result.mulStages = mulStages;
+
+    OpCodeBuilder builder = {0};
+    SchedProgram program = sched_build_program(&builder, optimizer);
+    DataflowOperand *registers = allocate_array(maximum(1, program.registerCount), DataflowOperand, 0);
+    b32 *written = allocate_array(maximum(1, program.registerCount), b32, 0);
+
+    for (u32 treeIdx = 0; treeIdx < buf_len(program.trees); ++treeIdx)
+    {
+        SchedTree *tree = program.trees + treeIdx;
+        DataflowOperand value = dataflow_from_sched(&result, &program, registers, written, tree->source);
+        if (tree->sink == SchedSink_Register)
+        {
+            registers[tree->address] = value;
+            written[tree->address] = true;
+        }
+        else
+        {
+            buf_push(result.outputs, value);
+        }
+    }
+
+    // NOTE(michiel): Every operand waits in a delay chain until its consumer starts, the
+    // outputs all wait until the deepest one is done.
+    for (u32 outputIdx = 0; outputIdx < buf_len(result.outputs); ++outputIdx)
+    {
+        result.latency = maximum(result.latency, dataflow_depth(&result, result.outputs[outputIdx]));
+    }
+    for (u32 nodeIdx = 0; nodeIdx < buf_len(result.nodes); ++nodeIdx)
+    {
+        DataflowNode *node = result.nodes + nodeIdx;
+        u32 start = node->depth - node->stages;
+        dataflow_need_delay(&result, node->a, start - dataflow_depth(&result, node->a));
+        dataflow_need_delay(&result, node->b, start - dataflow_depth(&result, node->b));
+    }
+    for (u32 outputIdx = 0; outputIdx < buf_len(result.outputs); ++outputIdx)
+    {
+        DataflowOperand output = result.outputs[outputIdx];
+        dataflow_need_delay(&result, output, result.latency - dataflow_depth(&result, output));
+    }
+
+    deallocate(written);
+    deallocate(registers);
+    buf_free(program.nodes);
+    buf_free(program.trees);
+    return result;
+}
+
+internal void
+free_dataflow(Dataflow *dataflow)
+{
+    buf_free(dataflow->nodes);
+    buf_free(dataflow->outputs);
+}
+
+internal u32
+get_dataflow_delay_words(Dataflow *dataflow)
+{
+    u32 result = dataflow->inputMaxDelay;
+    for (u32 nodeIdx = 0; nodeIdx < buf_len(dataflow->nodes); ++nodeIdx)
+    {
+        result += dataflow->nodes[nodeIdx].maxDelay;
+    }
+    return result;
+}
+
+internal void
+print_dataflow_report(FileStream output, Dataflow *dataflow, OpCodeStats *stats)
+{
+    // NOTE(michiel): Both backends use the same datapath width, so the registers are
+    // compared in bits and the logic in operators versus ALUs.
+    if (dataflow->stateless)
+    {
+        u32 opCounts[Alu_Count] = {0};
+        for (u32 nodeIdx = 0; nodeIdx < buf_len(dataflow->nodes); ++nodeIdx)
+        {
+            ++opCounts[dataflow->nodes[nodeIdx].op];
+        }
+        u32 delayWords = get_dataflow_delay_words(dataflow);
+        // NOTE(michiel): The input register, the operator stages and the delay chains
+        u32 stageWords = 0;
+        for (u32 nodeIdx = 0; nodeIdx < buf_len(dataflow->nodes); ++nodeIdx)
+        {
+            stageWords += dataflow->nodes[nodeIdx].stages;
+        }
+        u32 dataflowBits = (1 + stageWords + delayWords) * stats->bitWidth;
+        u32 registerBits = stats->addressBits ? (1 << stats->addressBits) * stats->bitWidth : 0;
+        u32 cpuBits = registerBits + stats->romBits;
+
+        fprintf(output.file, "Dataflow backend (stateless program):\n");
+        fprintf(output.file, "  Dataflow: 1 cycle/sample, latency %u cycles, %u operators",
+                dataflow->latency + 1, buf_len(dataflow->nodes));
+        b32 first = true;
+        for (u32 op = 0; op < Alu_Count; ++op)
+        {
+            if (opCounts[op])
+            {
+                fprintf(output.file, "%s%s %u", first ? " (" : ", ", gAluOpNames[op], opCounts[op]);
+                first = false;
+            }
+        }
+        fprintf(output.file, "%s, %u outputs, %u register bits (%u delay words)\n", first ? "" : ")",
+                buf_len(dataflow->outputs), dataflowBits, delayWords);
+        fprintf(output.file, "  CPU     : %u cycles/sample, %u ALU%s, %u register bits (%u register file + %u ROM)\n",
+                stats->kernel.interval, stats->aluCount, stats->aluCount > 1 ? "s" : "",
+                cpuBits, registerBits, stats->romBits);
+        fprintf(output.file, "  Dataflow is %.1fx the throughput for %.1fx the register bits\n",
+                (f64)stats->kernel.interval, (f64)dataflowBits / (f64)maximum(1, cpuBits));
+    }
+    else
+    {
+        fprintf(output.file, "Dataflow backend: not possible, the program keeps state between samples\n");
+    }
+}
@@ -0,0 +1,807 @@
+// NOTE(michiel): Predecoded simulator for long regression runs. Every opcode is turned into
+// a short list of micro ops that only does the work the opcode needs, with its operands
+// resolved to pointers into the machine state. The run loop jumps from micro op to micro op
+// without looking at the OpCode again. Same cycle model as simulate().
+
+typedef enum FastSimKind
+{
+    FastSim_Input,   // NOTE(michiel): New input sample, at the start of an interval
+    FastSim_InputStream, // NOTE(michiel): Same from a block of a stream, stops the run when it is used up
+    FastSim_InputHeld,   // NOTE(michiel): Reads the IO register the caller fills, only counts
+    FastSim_Sync,    // NOTE(michiel): Synced controller at pc 0, waits for the io_rdy pulse
+    FastSim_Profile, // NOTE(michiel): Counts the executions of the pc in next
+    FastSim_Noop,
+    FastSim_And,
+    FastSim_Or,
+    FastSim_Xor,
+    FastSim_Add,
+    FastSim_Sub,
+    FastSim_Sll,
+    FastSim_Srl,
+    FastSim_Sra,
+    FastSim_Mul,
+    FastSim_Output,
+    FastSim_Read,    // NOTE(michiel): Register read into the next memory output
+    FastSim_Write,
+    FastSim_Commit,  // NOTE(michiel): End of the opcode, the next state becomes the state
+    FastSim_CommitAlus,
+    FastSim_CommitPipelined,
+    FastSim_Count,
+} FastSimKind;
+
+global FastSimKind gFastSimAluKinds[Alu_Count] =
+{
+    [Alu_Noop] = FastSim_Noop,
+    [Alu_Or] = FastSim_Or,
+    [Alu_Xor] = FastSim_Xor,
+    [Alu_And] = FastSim_And,
+    [Alu_Add] = FastSim_Add,
+    [Alu_Sub] = FastSim_Sub,
+    [Alu_Sll] = FastSim_Sll,
+    [Alu_Srl] = FastSim_Srl,
+    [Alu_Sra] = FastSim_Sra,
+    [Alu_Mul] = FastSim_Mul,
+};
+
+typedef struct FastSimUop
+{
+    FastSimKind kind;
+    u32 next;   // NOTE(michiel): Micro op of the next opcode, for a commit
+    u32 *a;
+    u32 *b;
+    u32 *dest;
+} FastSimUop;
+
+typedef struct FastSim
+{
+    // NOTE(michiel): The uops point into this struct, so it stays where it is allocated
+    u32 bitWidth;
+    u32 aluCount;
+    u32 aluLatency;
+
+    u32 zero;
+    u32 ioIn;
+    u32 memOutA;
+    u32 memOutB;
+    u32 aluOut[MAX_ALU_COUNT];
+    u32 aluPending[MAX_ALU_COUNT][MAX_ALU_LATENCY - 1];
+
+    // NOTE(michiel): Values of the next state, made from the current one
+    u32 memNextA;
+    u32 memNextB;
+    u32 aluNext[MAX_ALU_COUNT];
+
+    u32 *registers;
+    u32 registerCount;
+    u32 *immediates;
+    FastSimUop *uops;
+    u32 *opStart;    // NOTE(michiel): First uop of every pc
+    u32 startUop;
+
+    u32 inputCount;
+    u32 *inputs;
+    u32 inputIndex;
+    u64 samplesStarted;
+
+    // NOTE(michiel): IO register handshake of a stream with a sample rate
+    u64 readyNext;   // NOTE(michiel): Tick that sees the io_rdy pulse of the last sample
+    b32 sampleRead;
+    u64 staleReads;
+    u64 stallTicks;
+    u32 syncCommit;  // NOTE(michiel): Commit of pc 0, continues at syncGo or stalls
+    u32 syncGo;
+
+    u64 tick;
+    u64 outputCount;
+    u64 outputLimit; // NOTE(michiel): The run stops at the end of the tick with this output
+    u32 outputHash;
+    u32 ioOut;
+    u32 *trace;  // NOTE(michiel): Pairs of tick and value, only if tracing
+    b32 tracing;
+    SimStream *sink;
+    u64 *opCounts;
+} FastSim;
+
+internal u32 *
+fastsim_select(FastSim *sim, u32 *immediate, enum Selection select)
+{
+    u32 *result = 0;
+    switch (select)
+    {
+        case Select_Zero: { result = &sim->zero; } break;
+        case Select_MemoryA: { result = &sim->memOutA; } break;
+        case Select_MemoryB: { result = &sim->memOutB; } break;
+        case Select_Immediate: { result = immediate; } break;
+        case Select_IO: { result = &sim->ioIn; } break;
+        case Select_Alu:
+        case Select_Alu1:
+        case Select_Alu2:
+        case Select_Alu3:
+        {
+            i_expect((u32)(select - Select_Alu) < sim->aluCount);
+            result = sim->aluOut + (select - Select_Alu);
+        } break;
+        INVALID_DEFAULT_CASE;
+    }
+    return result;
+}
+
+internal FastSimUop *
+fastsim_push(FastSim *sim, FastSimKind kind, u32 *a, u32 *b, u32 *dest)
+{
+    FastSimUop uop = {0};
+    uop.kind = kind;
+    uop.a = a;
+    uop.b = b;
+    uop.dest = dest;
+    buf_push(sim->uops, uop);
+    return sim->uops + buf_len(sim->uops) - 1;
+}
+
+internal FastSim *
+fastsim_decode(OpCodeStats *stats, u32 opCodeCount, OpCode *opCodes, u32 inputCount, u32 *inputs,
+               FastSimKind inputKind, SimProfile *profile)
+{
+    // NOTE(michiel): Without inputs the caller fills sim->inputs or the IO register itself
+    i_expect(inputCount);
+    i_expect(opCodeCount);
+    ModuloKernel *kernel = &stats->kernel;
+    i_expect(kernel->interval);
+    i_expect(kernel->start < opCodeCount);
+
+    FastSim *sim = allocate_struct(FastSim, 0);
+    sim->bitWidth = stats->bitWidth;
+    sim->aluCount = stats->aluCount;
+    sim->aluLatency = get_alu_latency(&stats->pipeline);
+    i_expect(sim->aluLatency <= MAX_ALU_LATENCY);
+    u32 registerCount = 1 << stats->addressBits;
+    sim->registers = allocate_array(registerCount, u32, 0);
+    sim->registerCount = registerCount;
+    sim->immediates = allocate_array(opCodeCount, u32, 0);
+
+    sim->outputHash = 2166136261u;
+    sim->outputLimit = U64_MAX;
+    sim->inputCount = inputCount;
+    sim->inputs = allocate_array(inputCount, u32, 0);
+    for (u32 inputIdx = 0; inputs && (inputIdx < inputCount); ++inputIdx)
+    {
+        sim->inputs[inputIdx] = sim_mask(stats, inputs[inputIdx]);
+    }
+
+    // NOTE(michiel): The commits point at the first uop of the next opcode, known after
+    // every opcode is decoded.
+    sim->opStart = allocate_array(opCodeCount, u32, 0);
+    u32 *opStart = sim->opStart;
+    // NOTE(michiel): A single ALU without extra stages writes its output register itself, as
+    // the last uop nothing after it reads the old value.
+    b32 directAlu = (sim->aluCount == 1) && (sim->aluLatency == 1);
+    for (u32 pc = 0; pc < opCodeCount; ++pc)
+    {
+        OpCode *opCode = opCodes + pc;
+        u32 *immediate = sim->immediates + pc;
+        *immediate = sim_mask(stats, opCode->immediate);
+        opStart[pc] = buf_len(sim->uops);
+
+        if ((pc == 0) && stats->synced && (inputKind == FastSim_InputHeld))
+        {
+            fastsim_push(sim, FastSim_Sync, 0, 0, 0);
+        }
+        if ((pc % kernel->interval) == 0)
+        {
+            fastsim_push(sim, inputKind, 0, 0, &sim->ioIn);
+        }
+        if (profile)
+        {
+            // NOTE(michiel): After the input, a stream that runs dry starts the opcode over
+            fastsim_push(sim, FastSim_Profile, 0, 0, 0)->next = pc;
+            sim->opCounts = profile->opCounts;
+        }
+        if (!directAlu)
+        {
+            for (u32 slot = 0; slot < stats->aluCount; ++slot)
+            {
+                AluSlot *alu = opCode->aluSlots + slot;
+                i_expect(alu->operation < Alu_Count);
+                fastsim_push(sim, gFastSimAluKinds[alu->operation],
+                             fastsim_select(sim, immediate, alu->selectA),
+                             fastsim_select(sim, immediate, alu->selectB), sim->aluNext + slot);
+            }
+        }
+        if (opCode->selectIO != Select_Zero)
+        {
+            fastsim_push(sim, FastSim_Output, fastsim_select(sim, immediate, opCode->selectIO), 0, 0);
+        }
+        // NOTE(michiel): Reads see the register contents from before the write of this cycle
+        if (opCode->memoryReadA)
+        {
+            i_expect(opCode->memoryAddrA < registerCount);
+            fastsim_push(sim, FastSim_Read, sim->registers + opCode->memoryAddrA, 0, &sim->memNextA);
+        }
+        if (opCode->memoryReadB)
+        {
+            i_expect(opCode->memoryAddrB < registerCount);
+            fastsim_push(sim, FastSim_Read, sim->registers + opCode->memoryAddrB, 0, &sim->memNextB);
+        }
+        if (opCode->memoryWrite)
+        {
+            i_expect(opCode->memoryAddrA < registerCount);
+            fastsim_push(sim, FastSim_Write, fastsim_select(sim, immediate, opCode->selectMem), 0,
+                         sim->registers + opCode->memoryAddrA);
+        }
+        if (directAlu)
+        {
+            AluSlot *alu = opCode->aluSlots;
+            i_expect(alu->operation < Alu_Count);
+            fastsim_push(sim, gFastSimAluKinds[alu->operation],
+                         fastsim_select(sim, immediate, alu->selectA),
+                         fastsim_select(sim, immediate, alu->selectB), sim->aluOut);
+            fastsim_push(sim, FastSim_Commit, 0, 0, 0);
+        }
+        else
+        {
+            fastsim_push(sim, (sim->aluLatency == 1) ? FastSim_CommitAlus : FastSim_CommitPipelined, 0, 0, 0);
+        }
+    }
+    for (u32 pc = 0; pc < opCodeCount; ++pc)
+    {
+        u32 commit = ((pc + 1 < opCodeCount) ? opStart[pc + 1] : buf_len(sim->uops)) - 1;
+        sim->uops[commit].next = opStart[(pc + 1 < opCodeCount) ? pc + 1 : kernel->start];
+        if (pc == 0)
+        {
+            sim->syncCommit = commit;
+            sim->syncGo = sim->uops[commit].next;
+        }
+    }
+    sim->startUop = opStart[0];
+
+    return sim;
+}
+
+internal void
+fastsim_free(FastSim *sim)
+{
+    buf_free(sim->uops);
+    buf_free(sim->trace);
+    deallocate(sim->opStart);
+    deallocate(sim->inputs);
+    deallocate(sim->immediates);
+    deallocate(sim->registers);
+    deallocate(sim);
+}
+
+internal void
+fastsim_restore(FastSim *sim, SimCheckpoint *checkpoint)
+{
+    // NOTE(michiel): The next state values are cleared by every commit, a checkpoint falls
+    // between two ticks so they are not part of it.
+    i_expect(checkpoint->registerCount == sim->registerCount);
+    memcpy(sim->registers, checkpoint->state.registers, sim->registerCount * sizeof(u32));
+    sim->ioIn = checkpoint->state.ioIn;
+    sim->ioOut = checkpoint->state.ioOut;
+    sim->memOutA = checkpoint->state.memOutA;
+    sim->memOutB = checkpoint->state.memOutB;
+    for (u32 slot = 0; slot < sim->aluCount; ++slot)
+    {
+        sim->aluOut[slot] = checkpoint->state.aluOut[slot];
+        for (u32 stage = 0; stage + 1 < sim->aluLatency; ++stage)
+        {
+            sim->aluPending[slot][stage] = checkpoint->state.aluPending[slot][stage];
+        }
+    }
+    sim->startUop = sim->opStart[checkpoint->pc];
+    sim->tick = checkpoint->tick;
+    sim->inputIndex = sim->inputCount ? checkpoint->inputIndex % sim->inputCount : 0;
+    sim->outputCount = checkpoint->outputCount;
+    sim->outputHash = checkpoint->outputHash;
+    sim->samplesStarted = checkpoint->samplesStarted;
+}
+
+internal void
+fastsim_checkpoint(FastSim *sim, SimCheckpoint *checkpoint, u32 opCodeCount)
+{
+    // NOTE(michiel): A run always stops at the first uop of an opcode
+    u32 pc = 0;
+    while ((pc < opCodeCount) && (sim->opStart[pc] != sim->startUop))
+    {
+        ++pc;
+    }
+    i_expect(pc < opCodeCount);
+    if (!checkpoint->state.registers)
+    {
+        checkpoint->state.registers = allocate_array(sim->registerCount, u32, 0);
+        checkpoint->registerCount = sim->registerCount;
+    }
+    memcpy(checkpoint->state.registers, sim->registers, sim->registerCount * sizeof(u32));
+    checkpoint->state.ioIn = sim->ioIn;
+    checkpoint->state.ioOut = sim->ioOut;
+    checkpoint->state.memOutA = sim->memOutA;
+    checkpoint->state.memOutB = sim->memOutB;
+    for (u32 slot = 0; slot < sim->aluCount; ++slot)
+    {
+        checkpoint->state.aluOut[slot] = sim->aluOut[slot];
+        for (u32 stage = 0; stage + 1 < sim->aluLatency; ++stage)
+        {
+            checkpoint->state.aluPending[slot][stage] = sim->aluPending[slot][stage];
+        }
+    }
+    checkpoint->pc = pc;
+    checkpoint->tick = sim->tick;
+    checkpoint->inputIndex = sim->inputIndex;
+    checkpoint->outputCount = sim->outputCount;
+    checkpoint->outputHash = sim->outputHash;
+    checkpoint->samplesStarted = sim->samplesStarted;
+}
+
+#if defined(__GNUC__)
+// NOTE(michiel): Labels as values are an extension, the switch is the portable fallback
+#define FASTSIM_COMPUTED_GOTO 1
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#else
+#define FASTSIM_COMPUTED_GOTO 0
+#endif
+
+#if FASTSIM_COMPUTED_GOTO
+#define FASTSIM_CASE(kind)  label_##kind:
+#define FASTSIM_DISPATCH()  goto *dispatch[uop->kind]
+#define FASTSIM_NEXT()      ++uop; FASTSIM_DISPATCH()
+#else
+#define FASTSIM_CASE(kind)  case kind:
+#define FASTSIM_DISPATCH()  continue
+#define FASTSIM_NEXT()      ++uop; continue
+#endif
+
+internal void
+fastsim_run(FastSim *sim, u64 clockTicks)
+{
+    // NOTE(michiel): Runs until sim->tick reaches clockTicks, or a stream input runs out of
+    // samples. A later call continues where this one stopped.
+    u32 mask = (u32)((1ULL << sim->bitWidth) - 1);
+    u32 signShift = 32 - sim->bitWidth;
+    u32 maxShift = sim->bitWidth - 1;
+    u64 tick = sim->tick;
+    FastSimUop *uop = sim->uops + sim->startUop;
+    if (tick >= clockTicks)
+    {
+        goto fastsim_done;
+    }
+
+#if FASTSIM_COMPUTED_GOTO
+    static void *dispatch[FastSim_Count] = {
+        [FastSim_Input] = &&label_FastSim_Input,
+        [FastSim_InputStream] = &&label_FastSim_InputStream,
+        [FastSim_InputHeld] = &&label_FastSim_InputHeld,
+        [FastSim_Sync] = &&label_FastSim_Sync,
+        [FastSim_Profile] = &&label_FastSim_Profile,
+        [FastSim_Noop] = &&label_FastSim_Noop,
+        [FastSim_And] = &&label_FastSim_And,
+        [FastSim_Or] = &&label_FastSim_Or,
+        [FastSim_Xor] = &&label_FastSim_Xor,
+        [FastSim_Add] = &&label_FastSim_Add,
+        [FastSim_Sub] = &&label_FastSim_Sub,
+        [FastSim_Sll] = &&label_FastSim_Sll,
+        [FastSim_Srl] = &&label_FastSim_Srl,
+        [FastSim_Sra] = &&label_FastSim_Sra,
+        [FastSim_Mul] = &&label_FastSim_Mul,
+        [FastSim_Output] = &&label_FastSim_Output,
+        [FastSim_Read] = &&label_FastSim_Read,
+        [FastSim_Write] = &&label_FastSim_Write,
+        [FastSim_Commit] = &&label_FastSim_Commit,
+        [FastSim_CommitAlus] = &&label_FastSim_CommitAlus,
+        [FastSim_CommitPipelined] = &&label_FastSim_CommitPipelined,
+    };
+    FASTSIM_DISPATCH();
+#else
+    for (;;)
+    {
+        switch (uop->kind)
+        {
+#endif
+            FASTSIM_CASE(FastSim_Input)
+            {
+                *uop->dest = sim->inputs[sim->inputIndex];
+                sim->inputIndex = (sim->inputIndex + 1 == sim->inputCount) ? 0 : sim->inputIndex + 1;
+                ++sim->samplesStarted;
+                FASTSIM_NEXT();
+            }
+            FASTSIM_CASE(FastSim_InputStream)
+            {
+                // NOTE(michiel): First uop of its opcode, the next run starts the opcode over
+                if (sim->inputIndex == sim->inputCount)
+                {
+                    goto fastsim_done;
+                }
+                *uop->dest = sim->inputs[sim->inputIndex++];
+                ++sim->samplesStarted;
+                FASTSIM_NEXT();
+            }
+            FASTSIM_CASE(FastSim_InputHeld)
+            {
+                sim->staleReads += sim->sampleRead;
+                sim->sampleRead = true;
+                ++sim->samplesStarted;
+                FASTSIM_NEXT();
+            }
+            FASTSIM_CASE(FastSim_Sync)
+            {
+                // NOTE(michiel): The controller saw pc 0 in the cycle before, it moves on when
+                // the IO pulsed io_rdy in that cycle. Until then pc 0 runs again.
+                b32 ready = (sim->readyNext == tick);
+                sim->uops[sim->syncCommit].next = ready ? sim->syncGo : (u32)(uop - sim->uops);
+                sim->stallTicks += !ready;
+                // NOTE(michiel): The input after this runs again with pc 0, a stall starts no sample
+                sim->samplesStarted -= !ready;
+                FASTSIM_NEXT();
+            }
+            FASTSIM_CASE(FastSim_Profile) { ++sim->opCounts[uop->next]; FASTSIM_NEXT(); }
+            // NOTE(michiel): Operands are already masked, the low bits of a sum or product
+            // don't depend on the sign extension.
+            FASTSIM_CASE(FastSim_Noop) { *uop->dest = *uop->a; FASTSIM_NEXT(); }
+            FASTSIM_CASE(FastSim_And) { *uop->dest = *uop->a & *uop->b; FASTSIM_NEXT(); }
+            FASTSIM_CASE(FastSim_Or) { *uop->dest = *uop->a | *uop->b; FASTSIM_NEXT(); }
+            FASTSIM_CASE(FastSim_Xor) { *uop->dest = *uop->a ^ *uop->b; FASTSIM_NEXT(); }
+            FASTSIM_CASE(FastSim_Add) { *uop->dest = (*uop->a + *uop->b) & mask; FASTSIM_NEXT(); }
+            FASTSIM_CASE(FastSim_Sub) { *uop->dest = (*uop->a - *uop->b) & mask; FASTSIM_NEXT(); }
+            FASTSIM_CASE(FastSim_Mul) { *uop->dest = (*uop->a * *uop->b) & mask; FASTSIM_NEXT(); }
+            FASTSIM_CASE(FastSim_Sll)
+            {
+                u32 b = *uop->b;
+                *uop->dest = (b <= maxShift) ? ((*uop->a << b) & mask) : 0;
+                FASTSIM_NEXT();
+            }
+            FASTSIM_CASE(FastSim_Srl)
+            {
+                u32 b = *uop->b;
+                *uop->dest = (b <= maxShift) ? (*uop->a >> b) : 0;
+                FASTSIM_NEXT();
+            }
+            FASTSIM_CASE(FastSim_Sra)
+            {
+                s32 a = ((s32)(*uop->a << signShift)) >> signShift;
+                *uop->dest = (u32)(a >> minimum(*uop->b, maxShift)) & mask;
+                FASTSIM_NEXT();
+            }
+            FASTSIM_CASE(FastSim_Output)
+            {
+                u32 value = *uop->a;
+                sim->ioOut = value;
+                sim->outputHash = (sim->outputHash ^ value) * 16777619;
+                if (++sim->outputCount == sim->outputLimit)
+                {
+                    clockTicks = tick + 1;
+                }
+                if (sim->tracing)
+                {
+                    buf_push(sim->trace, (u32)tick);
+                    buf_push(sim->trace, value);
+                }
+                if (sim->sink)
+                {
+                    sim_stream_write(sim->sink, value);
+                }
+                FASTSIM_NEXT();
+            }
+            FASTSIM_CASE(FastSim_Read) { *uop->dest = *uop->a; FASTSIM_NEXT(); }
+            FASTSIM_CASE(FastSim_Write) { *uop->dest = *uop->a; FASTSIM_NEXT(); }
+            FASTSIM_CASE(FastSim_Commit)
+            {
+                sim->memOutA = sim->memNextA;
+                sim->memOutB = sim->memNextB;
+                sim->memNextA = 0;
+                sim->memNextB = 0;
+                uop = sim->uops + uop->next;
+                if (++tick == clockTicks)
+                {
+                    goto fastsim_done;
+                }
+                FASTSIM_DISPATCH();
+            }
+            FASTSIM_CASE(FastSim_CommitAlus)
+            {
+                sim->memOutA = sim->memNextA;
+                sim->memOutB = sim->memNextB;
+                sim->memNextA = 0;
+                sim->memNextB = 0;
+                for (u32 slot = 0; slot < sim->aluCount; ++slot)
+                {
+                    sim->aluOut[slot] = sim->aluNext[slot];
+                }
+                uop = sim->uops + uop->next;
+                if (++tick == clockTicks)
+                {
+                    goto fastsim_done;
+                }
+                FASTSIM_DISPATCH();
+            }
+            FASTSIM_CASE(FastSim_CommitPipelined)
+            {
+                sim->memOutA = sim->memNextA;
+                sim->memOutB = sim->memNextB;
+                sim->memNextA = 0;
+                sim->memNextB = 0;
+                for (u32 slot = 0; slot < sim->aluCount; ++slot)
+                {
+                    u32 *pending = sim->aluPending[slot];
+                    sim->aluOut[slot] = pending[sim->aluLatency - 2];
+                    for (u32 stage = sim->aluLatency - 2; stage > 0; --stage)
+                    {
+                        pending[stage] = pending[stage - 1];
+                    }
+                    pending[0] = sim->aluNext[slot];
+                }
+                uop = sim->uops + uop->next;
+                if (++tick == clockTicks)
+                {
+                    goto fastsim_done;
+                }
+                FASTSIM_DISPATCH();
+            }
+#if !FASTSIM_COMPUTED_GOTO
+            INVALID_DEFAULT_CASE;
+        }
+    }
+#endif
+
+fastsim_done:
+    sim->tick = tick;
+    sim->startUop = (u32)(uop - sim->uops);
+}
+
+#undef FASTSIM_NEXT
+#undef FASTSIM_DISPATCH
+#undef FASTSIM_CASE
+#if FASTSIM_COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
+
+internal void
+simulate_fast(OpCodeStats *stats, u32 opCodeCount, OpCode *opCodes, u32 inputCount, u32 *inputs,
+              u32 clockTicks, b32 tracing, SimProfile *profile, SimCheckpoint *checkpoint)
+{
+    FastSim *sim = fastsim_decode(stats, opCodeCount, opCodes, inputCount, inputs, FastSim_Input, profile);
+    sim->tracing = tracing;
+    if (checkpoint && checkpoint->state.registers)
+    {
+        fastsim_restore(sim, checkpoint);
+    }
+    u64 startTick = sim->tick;
+    u64 startOutputs = sim->outputCount;
+    clock_t start = clock();
+    fastsim_run(sim, clockTicks);
+    f64 seconds = (f64)(clock() - start) / (f64)CLOCKS_PER_SEC;
+
+    for (u32 traceIdx = 0; traceIdx < buf_len(sim->trace); traceIdx += 2)
+    {
+        fprintf(stdout, "Tick %4u: IO out %3u = %d\n", sim->trace[traceIdx],
+                (u32)startOutputs + traceIdx / 2, sim_signed(stats, sim->trace[traceIdx + 1]));
+    }
+    fprintf(stdout, "Fast sim: %llu ticks, %u uops, %llu outputs (hash %08X), %.1f Mticks/s\n",
+            (unsigned long long)sim->tick, buf_len(sim->uops), (unsigned long long)sim->outputCount,
+            sim->outputHash,
+            (seconds > 0.0) ? (f64)(sim->tick - startTick) / seconds * 1e-6 : 0.0);
+    if (profile)
+    {
+        // NOTE(michiel): Every interval start takes a sample from the table
+        profile->ticks = sim->tick - startTick;
+        profile->samplesOut = sim->outputCount - startOutputs;
+        for (u32 pc = 0; pc < opCodeCount; pc += stats->kernel.interval)
+        {
+            profile->samplesIn += profile->opCounts[pc];
+        }
+    }
+    if (checkpoint)
+    {
+        fastsim_checkpoint(sim, checkpoint, opCodeCount);
+    }
+    fastsim_free(sim);
+}
+
+internal void
+simulate_forward(OpCodeStats *stats, u32 opCodeCount, OpCode *opCodes, u32 inputCount, u32 *inputs,
+                 SimCheckpoint *checkpoint, u64 untilTick, u64 untilOutputs)
+{
+    // NOTE(michiel): Runs the fast engine without tracing up to untilTick, or to the end of
+    // the tick that writes output untilOutputs when that comes first. The checkpoint is where
+    // it starts, if one was taken, and gets the state it stopped at.
+    FastSim *sim = fastsim_decode(stats, opCodeCount, opCodes, inputCount, inputs, FastSim_Input, 0);
+    if (checkpoint->state.registers)
+    {
+        fastsim_restore(sim, checkpoint);
+    }
+    u64 startTick = sim->tick;
+    clock_t start = clock();
+    if (!untilOutputs || (sim->outputCount < untilOutputs))
+    {
+        sim->outputLimit = untilOutputs ? untilOutputs : U64_MAX;
+        fastsim_run(sim, untilTick);
+    }
+    f64 seconds = (f64)(clock() - start) / (f64)CLOCKS_PER_SEC;
+    fastsim_checkpoint(sim, checkpoint, opCodeCount);
+
+    fprintf(stdout, "Fast-forward: %llu ticks to tick %llu, %llu outputs (hash %08X), %.1f Mticks/s\n",
+            (unsigned long long)(sim->tick - startTick), (unsigned long long)sim->tick,
+            (unsigned long long)sim->outputCount, sim->outputHash,
+            (seconds > 0.0) ? (f64)(sim->tick - startTick) / seconds * 1e-6 : 0.0);
+    fastsim_free(sim);
+}
+
+internal u32
+sim_outputs_per_sample(OpCodeStats *stats, u32 opCodeCount, OpCode *opCodes)
+{
+    // NOTE(michiel): The opcodes after the kernel start take a sample every interval, and
+    // write the outputs of that many samples between them.
+    ModuloKernel *kernel = &stats->kernel;
+    u32 sampleCount = 0;
+    u32 outputCount = 0;
+    for (u32 pc = kernel->start; pc < opCodeCount; ++pc)
+    {
+        sampleCount += (pc % kernel->interval) == 0;
+        outputCount += opCodes[pc].selectIO != Select_Zero;
+    }
+    i_expect(sampleCount);
+    i_expect((outputCount % sampleCount) == 0);
+    return outputCount / sampleCount;
+}
+
+internal void
+simulate_stream(OpCodeStats *stats, u32 opCodeCount, OpCode *opCodes, SimStream *input,
+                SimStream *output, u64 clockTicks, u32 sampleRate, SimProfile *profile,
+                SimCheckpoint *checkpoint, u64 untilTick, u64 untilOutputs)
+{
+    // NOTE(michiel): Runs the fast engine on a sample stream until it runs dry or clockTicks.
+    // With a sample rate of 0 the source keeps up with the core, every interval takes the
+    // next sample. Otherwise the source toggles load every sampleRate ticks and the IO
+    // register holds the last sample, like io.vhd. Intervals that find no new sample read
+    // it again and samples nobody read are dropped. A synced controller waits at pc 0 for
+    // the io_rdy pulse, running the opcode at pc 0 again every cycle it waits. A checkpoint
+    // skips the samples it already took. With untilTick or untilOutputs the run first
+    // fast-forwards like simulate_forward, the outputs up to there are not written and the
+    // profile only counts what comes after. When the stream runs dry the samples a modulo
+    // kernel still has in flight are finished, see below.
+    u32 blockCount = SIM_STREAM_BLOCK / sizeof(u32);
+    FastSim *sim = fastsim_decode(stats, opCodeCount, opCodes, blockCount, 0,
+                                  sampleRate ? FastSim_InputHeld : FastSim_InputStream, profile);
+    sim->sink = output;
+    sim->inputCount = 0;
+    sim->readyNext = U64_MAX;
+    sim->sampleRead = true;
+
+    u64 nextArrival = 0;
+    if (checkpoint && checkpoint->state.registers)
+    {
+        fastsim_restore(sim, checkpoint);
+        sim->inputIndex = 0;
+        sim->readyNext = checkpoint->readyNext;
+        sim->sampleRead = checkpoint->sampleRead;
+        nextArrival = checkpoint->nextArrival;
+        if (sim_stream_skip(input, checkpoint->samplesTaken) < checkpoint->samplesTaken)
+        {
+            fprintf(stderr, "The input stream ends before the %llu samples of the checkpoint\n",
+                    (unsigned long long)checkpoint->samplesTaken);
+        }
+    }
+    u64 startTick = sim->tick;
+    u64 startOutputs = sim->outputCount;
+    u64 startSamples = checkpoint ? checkpoint->samplesTaken : 0;
+    u64 startStalls = 0;
+    u64 dropped = 0;
+    b32 flowing = true;
+    b32 forwarding = (untilTick || untilOutputs) && (!untilOutputs || (sim->outputCount < untilOutputs));
+    u64 runTicks = clockTicks;
+    if (forwarding)
+    {
+        sim->sink = 0;
+        sim->outputLimit = untilOutputs ? untilOutputs : U64_MAX;
+        runTicks = untilTick ? minimum(clockTicks, untilTick) : clockTicks;
+    }
+    clock_t start = clock();
+    while (flowing && (sim->tick < clockTicks))
+    {
+        if (forwarding && ((sim->tick >= runTicks) || (sim->outputCount == sim->outputLimit)))
+        {
+            f64 seconds = (f64)(clock() - start) / (f64)CLOCKS_PER_SEC;
+            fprintf(stdout, "Fast-forward: %llu ticks to tick %llu, %llu outputs (hash %08X), %.1f Mticks/s\n",
+                    (unsigned long long)(sim->tick - startTick), (unsigned long long)sim->tick,
+                    (unsigned long long)sim->outputCount, sim->outputHash,
+                    (seconds > 0.0) ? (f64)(sim->tick - startTick) / seconds * 1e-6 : 0.0);
+            forwarding = false;
+            sim->sink = output;
+            sim->outputLimit = U64_MAX;
+            runTicks = clockTicks;
+            startTick = sim->tick;
+            startOutputs = sim->outputCount;
+            startSamples = input->count - (sim->inputCount - sim->inputIndex);
+            startStalls = sim->stallTicks;
+            if (profile)
+            {
+                memset(profile->opCounts, 0, opCodeCount * sizeof(u64));
+            }
+            start = clock();
+        }
+
+        if (sampleRate)
+        {
+            fastsim_run(sim, minimum(runTicks, nextArrival));
+            if (sim->tick == nextArrival)
+            {
+                u32 value = 0;
+                flowing = sim_stream_read(input, &value, 1) != 0;
+                if (flowing)
+                {
+                    dropped += !sim->sampleRead;
+                    sim->ioIn = sim_mask(stats, value);
+                    sim->sampleRead = false;
+                    sim->readyNext = nextArrival + 1;
+                    nextArrival += sampleRate;
+                }
+            }
+        }
+        else
+        {
+            if (sim->inputIndex == sim->inputCount)
+            {
+                sim->inputCount = sim_stream_read(input, sim->inputs, blockCount);
+                sim->inputIndex = 0;
+                for (u32 inputIdx = 0; inputIdx < sim->inputCount; ++inputIdx)
+                {
+                    sim->inputs[inputIdx] = sim_mask(stats, sim->inputs[inputIdx]);
+                }
+                flowing = sim->inputCount != 0;
+            }
+            if (flowing)
+            {
+                fastsim_run(sim, runTicks);
+            }
+        }
+    }
+    // NOTE(michiel): The rest of the last block was read, but never reached the core
+    u64 samples = input->count - (sim->inputCount - sim->inputIndex);
+
+    ModuloKernel *kernel = &stats->kernel;
+    if (!flowing && (kernel->stageCount > 1))
+    {
+        // NOTE(michiel): The kernel runs on for the stages of the last sample with the last
+        // input held. The samples it starts meanwhile were never taken, the outputs come in
+        // sample order so the run stops at the last output of the real ones.
+        u64 realOutputs = sim->samplesStarted * sim_outputs_per_sample(stats, opCodeCount, opCodes);
+        if (sim->outputCount < realOutputs)
+        {
+            for (u32 inputIdx = 0; inputIdx < blockCount; ++inputIdx)
+            {
+                sim->inputs[inputIdx] = sim->ioIn;
+            }
+            sim->inputCount = blockCount;
+            sim->inputIndex = 0;
+            sim->outputLimit = realOutputs;
+            fastsim_run(sim, minimum(clockTicks, sim->tick + (u64)(kernel->stageCount - 1) * kernel->interval));
+        }
+    }
+    f64 seconds = (f64)(clock() - start) / (f64)CLOCKS_PER_SEC;
+
+    fprintf(stdout, "Stream sim: %llu ticks, %llu samples in, %llu outputs (hash %08X), %.1f Mticks/s\n",
+            (unsigned long long)sim->tick, (unsigned long long)samples,
+            (unsigned long long)sim->outputCount, sim->outputHash,
+            (seconds > 0.0) ? (f64)(sim->tick - startTick) / seconds * 1e-6 : 0.0);
+    if (sampleRate)
+    {
+        fprintf(stdout, "  Sample every %u ticks: %llu stall ticks, %llu stale reads, %llu dropped samples\n",
+                sampleRate, (unsigned long long)sim->stallTicks, (unsigned long long)sim->staleReads,
+                (unsigned long long)dropped);
+    }
+    if (profile)
+    {
+        profile->ticks = sim->tick - startTick;
+        profile->stallTicks = sim->stallTicks - startStalls;
+        profile->samplesIn = samples - startSamples;
+        profile->samplesOut = sim->outputCount - startOutputs;
+    }
+    if (checkpoint)
+    {
+        fastsim_checkpoint(sim, checkpoint, opCodeCount);
+        checkpoint->samplesTaken = samples;
+        checkpoint->nextArrival = nextArrival;
+        checkpoint->readyNext = sim->readyNext;
+        checkpoint->sampleRead = sim->sampleRead;
+    }
+    fastsim_free(sim);
+}
@@ -0,0 +1,509 @@
+// NOTE(michiel): Golden model of a program, straight from the statements ast_from_tokens
+// made, before the AST optimizer touches them. Every statement becomes a few register slot
+// instructions with the variables, constants and temporaries resolved to slot indices, one
+// pass over them is one input sample. Nothing of the optimizer, range analysis, scheduler or
+// simulators is used, so its outputs are what every generated core should produce. Values
+// are always 32 bits wide and wrap around, a narrowed datapath has to give the same outputs.
+// Constant expressions fold with that same 32 bit arithmetic, division and powers only exist
+// for constants, like in the compiler.
+
+#define GOLDEN_SLOT_IO     0
+#define GOLDEN_SLOT_ALU    1
+// NOTE(michiel): Slots of temporaries and constants are numbered on their own while compiling,
+// they go after the variables when the count of those is known
+#define GOLDEN_TEMP_SLOT   0x8000
+#define GOLDEN_CONST_SLOT  0x4000
+#define GOLDEN_SLOT_INDEX  0x3FFF
+#define GOLDEN_MAX_SLOTS   0x10000
+
+typedef enum GoldenOpKind
+{
+    GoldenOp_Move,
+    GoldenOp_Output,
+    GoldenOp_Neg,
+    GoldenOp_Inv,
+    GoldenOp_Not,
+    GoldenOp_Inc,
+    GoldenOp_Dec,
+    GoldenOp_Add,
+    GoldenOp_Sub,
+    GoldenOp_Mul,
+    GoldenOp_And,
+    GoldenOp_Or,
+    GoldenOp_Xor,
+    GoldenOp_Sll,
+    GoldenOp_Srl,
+    GoldenOp_Sra,
+    // NOTE(michiel): Only folded, there is no ALU operation for these
+    GoldenOp_Div,
+    GoldenOp_Pow,
+} GoldenOpKind;
+
+typedef struct GoldenOp
+{
+    u16 kind;
+    u16 dest;
+    u16 a;
+    u16 b;
+} GoldenOp;
+
+typedef struct GoldenOperand
+{
+    b32 constant;
+    u32 value;
+    u16 slot;
+} GoldenOperand;
+
+typedef struct GoldenVariable
+{
+    String name;
+    u16 slot;
+    b32 constant;  // NOTE(michiel): The last assignment in source order was a constant
+    u32 value;
+} GoldenVariable;
+
+typedef struct GoldenProgram
+{
+    b32 valid;
+    GoldenOp *ops;
+    u32 slotCount;
+    u32 constantStart;  // NOTE(michiel): Slots of the constants, after the variables
+    u32 *constants;
+
+    // NOTE(michiel): Only used while compiling
+    GoldenVariable *variables;
+    u32 tempCount;
+    u32 maxTempCount;
+} GoldenProgram;
+
+internal GoldenOperand
+golden_constant(u32 value)
+{
+    GoldenOperand result = {0};
+    result.constant = true;
+    result.value = value;
+    return result;
+}
+
+internal GoldenOperand
+golden_slot(u32 slot)
+{
+    GoldenOperand result = {0};
+    result.slot = (u16)slot;
+    return result;
+}
+
+internal inline u32
+golden_apply(GoldenOpKind kind, u32 a, u32 b)
+{
+    // NOTE(michiel): Shift amounts are unsigned like in the ALU
+    u32 result = 0;
+    switch (kind)
+    {
+        case GoldenOp_Move: { result = a; } break;
+        case GoldenOp_Neg: { result = 0 - a; } break;
+        case GoldenOp_Inv: { result = ~a; } break;
+        case GoldenOp_Not: { result = (a == 0); } break;
+        case GoldenOp_Inc: { result = a + 1; } break;
+        case GoldenOp_Dec: { result = a - 1; } break;
+        case GoldenOp_Add: { result = a + b; } break;
+        case GoldenOp_Sub: { result = a - b; } break;
+        case GoldenOp_Mul: { result = a * b; } break;
+        case GoldenOp_And: { result = a & b; } break;
+        case GoldenOp_Or: { result = a | b; } break;
+        case GoldenOp_Xor: { result = a ^ b; } break;
+        case GoldenOp_Sll: { result = (b < 32) ? (a << b) : 0; } break;
+        case GoldenOp_Srl: { result = (b < 32) ? (a >> b) : 0; } break;
+        case GoldenOp_Sra: { result = (u32)((s32)a >> minimum(b, 31)); } break;
+        case GoldenOp_Div:
+        {
+            // NOTE(michiel): Rounds to zero, the one quotient that overflows wraps
+            i_expect(b);
+            result = ((a == 0x80000000) && (b == U32_MAX)) ? a : (u32)((s32)a / (s32)b);
+        } break;
+        case GoldenOp_Pow:
+        {
+            // NOTE(michiel): A negative power only leaves an integer for 1 and -1
+            if ((s32)b < 0)
+            {
+                result = (a == 1) ? 1 : ((a == U32_MAX) ? ((b & 1) ? U32_MAX : 1) : 0);
+            }
+            else
+            {
+                result = 1;
+                for (u32 power = 0; power < b; ++power)
+                {
+                    result *= a;
+                }
+            }
+        } break;
+        INVALID_DEFAULT_CASE;
+    }
+    return result;
+}
+
+internal GoldenVariable *
+golden_variable(GoldenProgram *program, String name)
+{
+    // NOTE(michiel): ALU is a plain variable here, the one cycle it lives in the core
+    // doesn't change its value
+    GoldenVariable *result = 0;
+    for (u32 varIdx = 0; varIdx < buf_len(program->variables); ++varIdx)
+    {
+        if (strings_are_equal(program->variables[varIdx].name, name))
+        {
+            result = program->variables + varIdx;
+            break;
+        }
+    }
+    if (!result)
+    {
+        i_expect(buf_len(program->variables) + GOLDEN_SLOT_ALU + 1 < GOLDEN_CONST_SLOT);
+        GoldenVariable variable = {0};
+        variable.name = name;
+        variable.slot = strings_are_equal(name, create_string("ALU")) ? GOLDEN_SLOT_ALU :
+            (u16)(GOLDEN_SLOT_ALU + buf_len(program->variables) + 1);
+        buf_push(program->variables, variable);
+        result = program->variables + buf_len(program->variables) - 1;
+    }
+    return result;
+}
+
+internal u16
+golden_materialize(GoldenProgram *program, GoldenOperand operand)
+{
+    // NOTE(michiel): Constants get a slot of their own, the same value shares it
+    u16 result = operand.slot;
+    if (operand.constant)
+    {
+        u32 constIdx = 0;
+        while ((constIdx < buf_len(program->constants)) && (program->constants[constIdx] != operand.value))
+        {
+            ++constIdx;
+        }
+        if (constIdx == buf_len(program->constants))
+        {
+            buf_push(program->constants, operand.value);
+        }
+        i_expect(constIdx <= GOLDEN_SLOT_INDEX);
+        result = (u16)(GOLDEN_CONST_SLOT | constIdx);
+    }
+    return result;
+}
+
+internal GoldenOperand
+golden_emit(GoldenProgram *program, GoldenOpKind kind, GoldenOperand a, GoldenOperand b)
+{
+    GoldenOp op = {0};
+    op.kind = kind;
+    op.a = golden_materialize(program, a);
+    op.b = golden_materialize(program, b);
+    i_expect(program->tempCount <= GOLDEN_SLOT_INDEX);
+    op.dest = (u16)(GOLDEN_TEMP_SLOT | program->tempCount++);
+    program->maxTempCount = maximum(program->maxTempCount, program->tempCount);
+    buf_push(program->ops, op);
+    return golden_slot(op.dest);
+}
+
+internal GoldenOperand
+golden_compile_expr(GoldenProgram *program, Expr *expr)
+{
+    GoldenOperand result = {0};
+    switch (expr->kind)
+    {
+        case Expr_Paren:
+        {
+            result = golden_compile_expr(program, expr->paren.expr);
+        } break;
+
+        case Expr_Int:
+        {
+            result = golden_constant(expr->intConst);
+        } break;
+
+        case Expr_Id:
+        {
+            if (strings_are_equal(expr->name, create_string("IO")))
+            {
+                // NOTE(michiel): Always the input sample, an IO assignment only drives the output
+                result = golden_slot(GOLDEN_SLOT_IO);
+            }
+            else
+            {
+                GoldenVariable *variable = golden_variable(program, expr->name);
+                result = variable->constant ? golden_constant(variable->value) : golden_slot(variable->slot);
+            }
+        } break;
+
+        case Expr_Unary:
+        {
+            GoldenOperand operand = golden_compile_expr(program, expr->unary.expr);
+            GoldenOpKind kind = GoldenOp_Move;
+            switch ((u32)expr->unary.op)
+            {
+                case '+': { } break;
+                case '-': { kind = GoldenOp_Neg; } break;
+                case '~': { kind = GoldenOp_Inv; } break;
+                case '!': { kind = GoldenOp_Not; } break;
+                case TOKEN_INC: { kind = GoldenOp_Inc; } break;
+                case TOKEN_DEC: { kind = GoldenOp_Dec; } break;
+                INVALID_DEFAULT_CASE;
+            }
+            if (operand.constant)
+            {
+                result = golden_constant(golden_apply(kind, operand.value, 0));
+            }
+            else if (kind == GoldenOp_Move)
+            {
+                result = operand;
+            }
+            else
+            {
+                result = golden_emit(program, kind, operand, operand);
+            }
+        } break;
+
+        case Expr_Binary:
+        {
+            GoldenOperand left = golden_compile_expr(program, expr->binary.left);
+            GoldenOperand right = golden_compile_expr(program, expr->binary.right);
+            GoldenOpKind kind = GoldenOp_Move;
+            switch ((u32)expr->binary.op)
+            {
+                case TOKEN_ADD: { kind = GoldenOp_Add; } break;
+                case TOKEN_SUB: { kind = GoldenOp_Sub; } break;
+                case TOKEN_MUL: { kind = GoldenOp_Mul; } break;
+                case TOKEN_AND: { kind = GoldenOp_And; } break;
+                case TOKEN_OR: { kind = GoldenOp_Or; } break;
+                case TOKEN_XOR: { kind = GoldenOp_Xor; } break;
+                case TOKEN_SLL: { kind = GoldenOp_Sll; } break;
+                case TOKEN_SRL: { kind = GoldenOp_Srl; } break;
+                case TOKEN_SRA: { kind = GoldenOp_Sra; } break;
+                case TOKEN_DIV: { kind = GoldenOp_Div; } break;
+                case TOKEN_POW: { kind = GoldenOp_Pow; } break;
+                INVALID_DEFAULT_CASE;
+            }
+
+            char *error = 0;
+            if ((kind == GoldenOp_Div) || (kind == GoldenOp_Pow))
+            {
+                if (!left.constant || !right.constant)
+                {
+                    error = "The golden model only divides and raises constants, like the ALU";
+                }
+                else if ((kind == GoldenOp_Div) && (right.value == 0))
+                {
+                    error = "Division by zero";
+                }
+            }
+
+            if (error)
+            {
+                fprintf(stderr, "%.*s:%d:%d: %s\n", expr->origin.filename.size, expr->origin.filename.data,
+                        expr->origin.lineNumber, expr->origin.colNumber, error);
+                program->valid = false;
+            }
+            else if (left.constant && right.constant)
+            {
+                result = golden_constant(golden_apply(kind, left.value, right.value));
+            }
+            else
+            {
+                result = golden_emit(program, kind, left, right);
+            }
+        } break;
+
+        INVALID_DEFAULT_CASE;
+    }
+    return result;
+}
+
+internal u16
+golden_resolve(GoldenProgram *program, u16 slot)
+{
+    // NOTE(michiel): Variables, then constants, then the temporaries of a statement
+    u16 result = slot;
+    if (slot & GOLDEN_CONST_SLOT)
+    {
+        result = (u16)(program->constantStart + (slot & GOLDEN_SLOT_INDEX));
+    }
+    else if (slot & GOLDEN_TEMP_SLOT)
+    {
+        result = (u16)(program->constantStart + buf_len(program->constants) + (slot & GOLDEN_SLOT_INDEX));
+    }
+    return result;
+}
+
+internal GoldenProgram
+golden_compile(StmtList *statements)
+{
+    GoldenProgram result = {0};
+    result.valid = true;
+    for (u32 stmtIdx = 0; stmtIdx < statements->stmtCount; ++stmtIdx)
+    {
+        Stmt *stmt = statements->stmts[stmtIdx];
+        if (stmt->kind == Stmt_Assign)
+        {
+            // NOTE(michiel): Temporaries only live within their statement
+            result.tempCount = 0;
+            i_expect(stmt->assign.left->kind == Expr_Id);
+            String name = stmt->assign.left->name;
+            GoldenOperand value = golden_compile_expr(&result, stmt->assign.right);
+            if (strings_are_equal(name, create_string("IO")))
+            {
+                GoldenOp op = {0};
+                op.kind = GoldenOp_Output;
+                op.a = golden_materialize(&result, value);
+                buf_push(result.ops, op);
+            }
+            else
+            {
+                GoldenVariable *variable = golden_variable(&result, name);
+                variable->constant = value.constant;
+                variable->value = value.value;
+                GoldenOp *last = buf_len(result.ops) ? result.ops + buf_len(result.ops) - 1 : 0;
+                if (!value.constant && (value.slot & GOLDEN_TEMP_SLOT) && last && (last->dest == value.slot))
+                {
+                    // NOTE(michiel): The last operation writes the variable itself
+                    last->dest = variable->slot;
+                }
+                else
+                {
+                    // NOTE(michiel): A constant still gets written, a read before this
+                    // statement in the next pass sees it
+                    GoldenOp op = {0};
+                    op.kind = GoldenOp_Move;
+                    op.dest = variable->slot;
+                    op.a = golden_materialize(&result, value);
+                    buf_push(result.ops, op);
+                }
+            }
+        }
+        else
+        {
+            i_expect(stmt->kind == Stmt_Hint);
+        }
+    }
+
+    result.constantStart = GOLDEN_SLOT_ALU + buf_len(result.variables) + 1;
+    result.slotCount = result.constantStart + buf_len(result.constants) + result.maxTempCount;
+    if (result.slotCount > GOLDEN_MAX_SLOTS)
+    {
+        fprintf(stderr, "The golden model holds up to %u values, the program needs %u\n",
+                GOLDEN_MAX_SLOTS, result.slotCount);
+        result.valid = false;
+    }
+    for (u32 opIdx = 0; opIdx < buf_len(result.ops); ++opIdx)
+    {
+        GoldenOp *op = result.ops + opIdx;
+        op->dest = golden_resolve(&result, op->dest);
+        op->a = golden_resolve(&result, op->a);
+        op->b = golden_resolve(&result, op->b);
+    }
+    buf_free(result.variables);
+    result.variables = 0;
+    return result;
+}
+
+internal void
+golden_free(GoldenProgram *program)
+{
+    buf_free(program->ops);
+    buf_free(program->constants);
+}
+
+typedef struct GoldenRun
+{
+    u32 *slots;
+    u64 samples;
+    u64 outputCount;
+    u32 outputHash;
+    b32 tracing;
+    SimStream *sink;
+} GoldenRun;
+
+internal void
+golden_evaluate(GoldenProgram *program, GoldenRun *run, u32 sampleCount, u32 *samples)
+{
+    u32 *slots = run->slots;
+    GoldenOp *ops = program->ops;
+    u32 opCount = buf_len(program->ops);
+    for (u32 sampleIdx = 0; sampleIdx < sampleCount; ++sampleIdx)
+    {
+        slots[GOLDEN_SLOT_IO] = samples[sampleIdx];
+        for (u32 opIdx = 0; opIdx < opCount; ++opIdx)
+        {
+            GoldenOp *op = ops + opIdx;
+            u32 a = slots[op->a];
+            if (op->kind == GoldenOp_Output)
+            {
+                run->outputHash = (run->outputHash ^ a) * 16777619;
+                if (run->tracing)
+                {
+                    fprintf(stdout, "Sample %4llu: IO out %3llu = %d\n", (unsigned long long)run->samples,
+                            (unsigned long long)run->outputCount, (s32)a);
+                }
+                if (run->sink)
+                {
+                    sim_stream_write(run->sink, a);
+                }
+                ++run->outputCount;
+            }
+            else
+            {
+                slots[op->dest] = golden_apply((GoldenOpKind)op->kind, a, slots[op->b]);
+            }
+        }
+        ++run->samples;
+    }
+}
+
+internal void
+simulate_golden(GoldenProgram *program, u32 inputCount, u32 *inputs, SimStream *input,
+                SimStream *output, u64 sampleCount, b32 tracing)
+{
+    // NOTE(michiel): Takes sampleCount samples of the input table, or of the stream until it
+    // runs out when sampleCount is 0. Variables start at 0 like the register file. The
+    // samples are taken as they are, they have to fit in the IO input width of the core.
+    i_expect(program->valid);
+    GoldenRun run = {0};
+    run.slots = allocate_array(program->slotCount, u32, 0);
+    run.outputHash = 2166136261u;
+    run.tracing = tracing;
+    run.sink = output;
+    for (u32 constIdx = 0; constIdx < buf_len(program->constants); ++constIdx)
+    {
+        run.slots[program->constantStart + constIdx] = program->constants[constIdx];
+    }
+
+    u32 blockCount = SIM_STREAM_BLOCK / sizeof(u32);
+    u32 *block = allocate_array(blockCount, u32, ALLOC_NOCLEAR);
+    u32 inputIndex = 0;
+    b32 flowing = true;
+    clock_t start = clock();
+    while (flowing && (!sampleCount || (run.samples < sampleCount)))
+    {
+        u32 count = sampleCount ? (u32)minimum(blockCount, sampleCount - run.samples) : blockCount;
+        if (input)
+        {
+            count = sim_stream_read(input, block, count);
+            flowing = count != 0;
+        }
+        else
+        {
+            for (u32 blockIdx = 0; blockIdx < count; ++blockIdx)
+            {
+                block[blockIdx] = inputs[inputIndex];
+                inputIndex = (inputIndex + 1 == inputCount) ? 0 : inputIndex + 1;
+            }
+        }
+        golden_evaluate(program, &run, count, block);
+    }
+    f64 seconds = (f64)(clock() - start) / (f64)CLOCKS_PER_SEC;
+
+    fprintf(stdout, "Golden model: %llu samples, %u ops, %llu outputs (hash %08X), %.1f Msamples/s\n",
+            (unsigned long long)run.samples, buf_len(program->ops), (unsigned long long)run.outputCount,
+            run.outputHash, (seconds > 0.0) ? (f64)run.samples / seconds * 1e-6 : 0.0);
+    deallocate(block);
+    deallocate(run.slots);
+}
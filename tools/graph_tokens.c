@@ -208,11 +208,14 @@ graph_token_expr1(TokenGraph *graph, Token **token, String connection)
     {
     while (((*token)->kind == '*') ||
            ((*token)->kind == '/') ||
-           ((*token)->kind == '&'))
+           ((*token)->kind == '&') ||
+           ((*token)->kind == TOKEN_SLL) ||
+           ((*token)->kind == TOKEN_SRA) ||
+           ((*token)->kind == TOKEN_SRL))
     {
         op = create_string_fmt("op%d", graph->id++);
-        fprintf(graph->output.file, "  %.*s [label=\"%c\"];\n", op.size, op.data,
-                (*token)->kind);
+        fprintf(graph->output.file, "  %.*s [label=\"%.*s\"];\n", op.size, op.data,
+                (*token)->value.size, (*token)->value.data);
         *token = (*token)->nextToken;
         graph_token_expr2(graph, token, op);
         
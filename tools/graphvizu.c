@@ -266,6 +266,9 @@ for (u32 opIdx = 0; opIdx < opCodeCount; ++opIdx)
                     opIdx, opIdx);
             layerHas |= LAYER_HAS_IOIN | LAYER_HAS_IOUT;
         } break;
+        case Select_Alu1:
+        case Select_Alu2:
+        case Select_Alu3:
         case Select_Alu: {
             fprintf(graphicStream.file, "    alu%03d:out -> ioOut%03d\n",
                     opIdx - 1, opIdx);
@@ -299,6 +302,9 @@ for (u32 opIdx = 0; opIdx < opCodeCount; ++opIdx)
                     opIdx, opIdx);
             layerHas |= LAYER_HAS_IOIN | LAYER_HAS_MEMI;
         } break;
+        case Select_Alu1:
+        case Select_Alu2:
+        case Select_Alu3:
         case Select_Alu: {
             fprintf(graphicStream.file, "    alu%03d:out -> memIn%03d\n",
                     opIdx - 1, opIdx);
@@ -332,6 +338,9 @@ for (u32 opIdx = 0; opIdx < opCodeCount; ++opIdx)
                     opIdx, opIdx);
             layerHas |= LAYER_HAS_IOIN;
         } break;
+        case Select_Alu1:
+        case Select_Alu2:
+        case Select_Alu3:
         case Select_Alu: {
             fprintf(graphicStream.file, "    alu%03d:out -> alu%03d:a\n",
                     opIdx - 1, opIdx);
@@ -364,6 +373,9 @@ for (u32 opIdx = 0; opIdx < opCodeCount; ++opIdx)
                     opIdx, opIdx);
             layerHas |= LAYER_HAS_IOIN;
         } break;
+        case Select_Alu1:
+        case Select_Alu2:
+        case Select_Alu3:
         case Select_Alu: {
             fprintf(graphicStream.file, "    alu%03d:out -> alu%03d:b\n",
                     opIdx - 1, opIdx);
@@ -522,6 +534,10 @@ test_graph(char *fileName, u32 registers, u32 opCodeCount, OpCode *opCodes, b32
             case Alu_And:  { aluOp = "and"; } break;
             case Alu_Add:  { aluOp = "add"; } break;
             case Alu_Sub:  { aluOp = "sub"; } break;
+            case Alu_Sll:  { aluOp = "sll"; } break;
+            case Alu_Srl:  { aluOp = "srl"; } break;
+            case Alu_Sra:  { aluOp = "sra"; } break;
+            case Alu_Mul:  { aluOp = "mul"; } break;
         INVALID_DEFAULT_CASE;
     }
         
@@ -0,0 +1,258 @@
+// NOTE(michiel): Detection of repeated opcode sequences. Unrolled kernels repeat the same
+// opcodes, often with register addresses that move by a fixed stride every iteration. The
+// controller can replay such a body with a loop counter, so the ROM only holds it once.
+
+// NOTE(michiel): The loop counter and its compare cost about as much as a ROM word
+#define LOOP_MIN_SAVED 2
+
+internal b32
+loop_fields_match(OpCode *a, OpCode *b)
+{
+    // NOTE(michiel): Everything except the register addresses has to be identical
+    b32 result = ((a->selectMem == b->selectMem) &&
+                  (a->selectIO == b->selectIO) &&
+                  (a->memoryReadA == b->memoryReadA) &&
+                  (a->memoryReadB == b->memoryReadB) &&
+                  (a->memoryWrite == b->memoryWrite) &&
+                  (a->immediate == b->immediate));
+    for (u32 slot = 0; result && (slot < MAX_ALU_COUNT); ++slot)
+    {
+        result = ((a->aluSlots[slot].selectA == b->aluSlots[slot].selectA) &&
+                  (a->aluSlots[slot].selectB == b->aluSlots[slot].selectB) &&
+                  (a->aluSlots[slot].operation == b->aluSlots[slot].operation));
+    }
+    return result;
+}
+
+internal inline b32
+loop_uses_addr_a(OpCode *opCode)
+{
+    b32 result = opCode->memoryReadA || opCode->memoryWrite;
+    return result;
+}
+
+internal inline b32
+loop_uses_addr_b(OpCode *opCode)
+{
+    b32 result = opCode->memoryReadB;
+    return result;
+}
+
+internal b32
+loop_find_strides(OpCode *body, OpCode *next, u32 length, HardwareLoop *loop)
+{
+    // NOTE(michiel): The strides follow from the first two iterations, every address field
+    // in use has to move by the same amount.
+    b32 result = true;
+    b32 hasStrideA = false;
+    b32 hasStrideB = false;
+    loop->strideA = 0;
+    loop->strideB = 0;
+    for (u32 bodyIdx = 0; result && (bodyIdx < length); ++bodyIdx)
+    {
+        OpCode *a = body + bodyIdx;
+        OpCode *b = next + bodyIdx;
+        if (!loop_fields_match(a, b))
+        {
+            result = false;
+        }
+        else
+        {
+            if (loop_uses_addr_a(a))
+            {
+                s32 stride = (s32)b->memoryAddrA - (s32)a->memoryAddrA;
+                if (!hasStrideA)
+                {
+                    hasStrideA = true;
+                    loop->strideA = stride;
+                }
+                result = result && (loop->strideA == stride);
+            }
+            if (loop_uses_addr_b(a))
+            {
+                s32 stride = (s32)b->memoryAddrB - (s32)a->memoryAddrB;
+                if (!hasStrideB)
+                {
+                    hasStrideB = true;
+                    loop->strideB = stride;
+                }
+                result = result && (loop->strideB == stride);
+            }
+        }
+    }
+    return result;
+}
+
+internal b32
+loop_block_matches(OpCode *body, OpCode *block, u32 length, u32 iteration, HardwareLoop *loop)
+{
+    b32 result = true;
+    for (u32 bodyIdx = 0; result && (bodyIdx < length); ++bodyIdx)
+    {
+        OpCode *a = body + bodyIdx;
+        OpCode *b = block + bodyIdx;
+        result = loop_fields_match(a, b);
+        if (result && loop_uses_addr_a(a))
+        {
+            result = ((s32)b->memoryAddrA == (s32)a->memoryAddrA + (s32)iteration * loop->strideA);
+        }
+        if (result && loop_uses_addr_b(a))
+        {
+            result = ((s32)b->memoryAddrB == (s32)a->memoryAddrB + (s32)iteration * loop->strideB);
+        }
+    }
+    return result;
+}
+
+internal HardwareLoop
+find_hardware_loop(u32 opCount, OpCode *opCodes, u32 firstPc)
+{
+    // NOTE(michiel): Picks the single loop that removes the most opcodes. The body never
+    // starts at pc 0, that is where the controller waits for input when synced. Loops
+    // start at or after firstPc, so the kernel start of a modulo schedule stays put.
+    HardwareLoop result = {0};
+    u32 bestSaved = 0;
+    for (u32 start = maximum(1, firstPc); start < opCount; ++start)
+    {
+        for (u32 length = 1; start + 2 * length <= opCount; ++length)
+        {
+            HardwareLoop loop = {0};
+            if (loop_find_strides(opCodes + start, opCodes + start + length, length, &loop))
+            {
+                loop.start = start;
+                loop.length = length;
+                loop.count = 2;
+                while ((start + (loop.count + 1) * length <= opCount) &&
+                       loop_block_matches(opCodes + start, opCodes + start + loop.count * length,
+                                          length, loop.count, &loop))
+                {
+                    ++loop.count;
+                }
+
+                u32 saved = (loop.count - 1) * length;
+                if ((saved >= LOOP_MIN_SAVED) && (saved > bestSaved))
+                {
+                    bestSaved = saved;
+                    result = loop;
+                    result.enabled = true;
+                }
+            }
+        }
+    }
+
+    if (result.enabled)
+    {
+        result.counterBits = maximum(1, log2_up(result.count - 1));
+    }
+
+    return result;
+}
+
+internal u32
+get_loop_saved_opcodes(HardwareLoop *loop)
+{
+    u32 result = 0;
+    if (loop->enabled)
+    {
+        result = (loop->count - 1) * loop->length;
+    }
+    return result;
+}
+
+internal OpCode *
+compress_hardware_loop(HardwareLoop *loop, u32 opCount, OpCode *opCodes)
+{
+    // NOTE(michiel): Drops every iteration after the first, the controller replays it
+    OpCode *result = 0;
+    u32 skipStart = loop->start + loop->length;
+    u32 skipEnd = skipStart + get_loop_saved_opcodes(loop);
+    for (u32 opIdx = 0; opIdx < opCount; ++opIdx)
+    {
+        if (!loop->enabled || (opIdx < skipStart) || (opIdx >= skipEnd))
+        {
+            buf_push(result, opCodes[opIdx]);
+        }
+    }
+    return result;
+}
+
+internal OpCode *
+replay_hardware_loop(HardwareLoop *loop, u32 romCount, OpCode *romOpCodes, u32 addressBits)
+{
+    // NOTE(michiel): C model of the loop controller, walks the ROM once from pc 0 like
+    // gen_controller.vhd does and gives the opcodes in the order they get decoded. The
+    // address offsets wrap at the register file size, as the unsigned adders do.
+    OpCode *result = 0;
+    u32 addressMask = (1 << addressBits) - 1;
+    u32 loopEnd = loop->start + loop->length - 1;
+    u32 loopIter = 0;
+    u32 offsetA = 0;
+    u32 offsetB = 0;
+    u32 pc = 0;
+    while (pc < romCount)
+    {
+        OpCode opCode = romOpCodes[pc];
+        opCode.memoryAddrA = (opCode.memoryAddrA + offsetA) & addressMask;
+        opCode.memoryAddrB = (opCode.memoryAddrB + offsetB) & addressMask;
+        buf_push(result, opCode);
+
+        if (loop->enabled && (pc == loopEnd) && (loopIter != loop->count - 1))
+        {
+            ++loopIter;
+            offsetA += (u32)loop->strideA;
+            offsetB += (u32)loop->strideB;
+            pc = loop->start;
+        }
+        else
+        {
+            if (loop->enabled && (pc == loopEnd))
+            {
+                loopIter = 0;
+                offsetA = 0;
+                offsetB = 0;
+            }
+            ++pc;
+        }
+    }
+    return result;
+}
+
+internal b32
+check_hardware_loop(u32 opCount, OpCode *opCodes, u32 replayCount, OpCode *replayOpCodes)
+{
+    // NOTE(michiel): The replayed ROM has to do the same as the scheduled opcodes, the
+    // addresses that are not used may differ.
+    b32 result = (opCount == replayCount);
+    for (u32 pc = 0; result && (pc < opCount); ++pc)
+    {
+        OpCode *a = opCodes + pc;
+        OpCode *b = replayOpCodes + pc;
+        result = (loop_fields_match(a, b) &&
+                  (!loop_uses_addr_a(a) || (a->memoryAddrA == b->memoryAddrA)) &&
+                  (!loop_uses_addr_b(a) || (a->memoryAddrB == b->memoryAddrB)));
+        if (!result)
+        {
+            fprintf(stderr, "The hardware loop replays another opcode at pc %u\n", pc);
+        }
+    }
+    if (opCount != replayCount)
+    {
+        fprintf(stderr, "The hardware loop replays %u opcodes instead of %u\n", replayCount, opCount);
+    }
+    return result;
+}
+
+internal void
+print_hardware_loop(FileStream output, HardwareLoop *loop)
+{
+    if (loop->enabled)
+    {
+        fprintf(output.file, "Hardware loop: pc %u - %u x %u, stride A %d, stride B %d, saves %u opcodes\n",
+                loop->start, loop->start + loop->length - 1, loop->count,
+                loop->strideA, loop->strideB, get_loop_saved_opcodes(loop));
+    }
+    else
+    {
+        fprintf(output.file, "Hardware loop: none\n");
+    }
+}
@@ -0,0 +1,360 @@
+// NOTE(michiel): Simulation by native code. The program is written out as straight-line C,
+// one block per opcode with every selection, address and immediate a constant, and the C
+// compiler of the host turns it into a shared library that gets loaded with dlopen. One
+// iteration of the main loop is one pass of the pc over the kernel. Same cycle model as
+// simulate(), the prologue and the last partial pass check the tick count per opcode.
+
+#include <dlfcn.h>
+
+// NOTE(michiel): Shared with the generated code, see native_emit_state
+typedef struct NativeSimState
+{
+    u32 *inputs;
+    u32 inputCount;
+    u32 inputIndex;
+    u32 tracing;
+    u32 outputCount;
+    u32 outputHash;
+    u32 traceCapacity;
+    u32 *trace;  // NOTE(michiel): Pairs of tick and value
+} NativeSimState;
+
+typedef void NativeSimRun(NativeSimState *state, u32 clockTicks);
+
+internal f64
+native_wall_seconds(void)
+{
+    // NOTE(michiel): clock() doesn't count the compiler, that runs in a child process
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (f64)now.tv_sec + (f64)now.tv_nsec * 1e-9;
+}
+
+internal void
+native_emit_state(FileStream output)
+{
+    fprintf(output.file, "typedef struct NativeSimState\n");
+    fprintf(output.file, "{\n");
+    fprintf(output.file, "    u32 *inputs;\n");
+    fprintf(output.file, "    u32 inputCount;\n");
+    fprintf(output.file, "    u32 inputIndex;\n");
+    fprintf(output.file, "    u32 tracing;\n");
+    fprintf(output.file, "    u32 outputCount;\n");
+    fprintf(output.file, "    u32 outputHash;\n");
+    fprintf(output.file, "    u32 traceCapacity;\n");
+    fprintf(output.file, "    u32 *trace;\n");
+    fprintf(output.file, "} NativeSimState;\n\n");
+}
+
+internal char *
+native_select(OpCodeStats *stats, OpCode *opCode, enum Selection select)
+{
+    String result = {0};
+    switch (select)
+    {
+        case Select_Zero: { result = create_string("0u"); } break;
+        case Select_MemoryA: { result = create_string("memOutA"); } break;
+        case Select_MemoryB: { result = create_string("memOutB"); } break;
+        case Select_Immediate: { result = create_string_fmt("0x%Xu", sim_mask(stats, opCode->immediate)); } break;
+        case Select_IO: { result = create_string("ioIn"); } break;
+        case Select_Alu:
+        case Select_Alu1:
+        case Select_Alu2:
+        case Select_Alu3:
+        {
+            i_expect((u32)(select - Select_Alu) < stats->aluCount);
+            result = create_string_fmt("alu%u", select - Select_Alu);
+        } break;
+        INVALID_DEFAULT_CASE;
+    }
+    return (char *)result.data;
+}
+
+internal void
+native_emit_alu(enum AluOp op, char *a, char *b, FileStream output)
+{
+    // NOTE(michiel): Operands are masked, the low bits of a sum or product don't depend on
+    // the sign extension.
+    switch (op)
+    {
+        case Alu_Noop: { fprintf(output.file, "%s", a); } break;
+        case Alu_And: { fprintf(output.file, "%s & %s", a, b); } break;
+        case Alu_Or: { fprintf(output.file, "%s | %s", a, b); } break;
+        case Alu_Xor: { fprintf(output.file, "%s ^ %s", a, b); } break;
+        case Alu_Add: { fprintf(output.file, "(%s + %s) & MASK", a, b); } break;
+        case Alu_Sub: { fprintf(output.file, "(%s - %s) & MASK", a, b); } break;
+        case Alu_Mul: { fprintf(output.file, "(%s * %s) & MASK", a, b); } break;
+        case Alu_Sll: { fprintf(output.file, "SLL(%s, %s)", a, b); } break;
+        case Alu_Srl: { fprintf(output.file, "SRL(%s, %s)", a, b); } break;
+        case Alu_Sra: { fprintf(output.file, "SRA(%s, %s)", a, b); } break;
+        INVALID_DEFAULT_CASE;
+    }
+}
+
+internal void
+native_emit_opcode(OpCodeStats *stats, OpCode *opCode, u32 pc, char *tickExpr, FileStream output)
+{
+    u32 aluLatency = get_alu_latency(&stats->pipeline);
+    fprintf(output.file, "        { // pc %u\n", pc);
+    if ((pc % stats->kernel.interval) == 0)
+    {
+        fprintf(output.file, "            ioIn = inputs[inputIndex];\n");
+        fprintf(output.file, "            inputIndex = (inputIndex + 1 == inputCount) ? 0 : inputIndex + 1;\n");
+    }
+    for (u32 slot = 0; slot < stats->aluCount; ++slot)
+    {
+        AluSlot *alu = opCode->aluSlots + slot;
+        fprintf(output.file, "            u32 next%u = ", slot);
+        native_emit_alu(alu->operation, native_select(stats, opCode, alu->selectA),
+                        native_select(stats, opCode, alu->selectB), output);
+        fprintf(output.file, ";\n");
+    }
+    if (opCode->selectIO != Select_Zero)
+    {
+        fprintf(output.file, "            OUTPUT(%s, %s);\n", tickExpr,
+                native_select(stats, opCode, opCode->selectIO));
+    }
+    // NOTE(michiel): Reads see the register contents from before the write of this cycle
+    fprintf(output.file, "            u32 nextA = ");
+    if (opCode->memoryReadA)
+    {
+        fprintf(output.file, "r%u;\n", opCode->memoryAddrA);
+    }
+    else
+    {
+        fprintf(output.file, "0u;\n");
+    }
+    fprintf(output.file, "            u32 nextB = ");
+    if (opCode->memoryReadB)
+    {
+        fprintf(output.file, "r%u;\n", opCode->memoryAddrB);
+    }
+    else
+    {
+        fprintf(output.file, "0u;\n");
+    }
+    if (opCode->memoryWrite)
+    {
+        fprintf(output.file, "            r%u = %s;\n", opCode->memoryAddrA,
+                native_select(stats, opCode, opCode->selectMem));
+    }
+    fprintf(output.file, "            memOutA = nextA;\n");
+    fprintf(output.file, "            memOutB = nextB;\n");
+    for (u32 slot = 0; slot < stats->aluCount; ++slot)
+    {
+        if (aluLatency == 1)
+        {
+            fprintf(output.file, "            alu%u = next%u;\n", slot, slot);
+        }
+        else
+        {
+            fprintf(output.file, "            alu%u = pending%u_%u;\n", slot, slot, aluLatency - 2);
+            for (u32 stage = aluLatency - 2; stage > 0; --stage)
+            {
+                fprintf(output.file, "            pending%u_%u = pending%u_%u;\n", slot, stage, slot, stage - 1);
+            }
+            fprintf(output.file, "            pending%u_0 = next%u;\n", slot, slot);
+        }
+    }
+    fprintf(output.file, "        }\n");
+}
+
+internal void
+native_emit_checked(OpCodeStats *stats, OpCode *opCodes, u32 firstPc, u32 onePastLastPc,
+                    FileStream output)
+{
+    for (u32 pc = firstPc; pc < onePastLastPc; ++pc)
+    {
+        fprintf(output.file, "        if (tick == clockTicks) goto done;\n");
+        native_emit_opcode(stats, opCodes + pc, pc, "tick", output);
+        fprintf(output.file, "        ++tick;\n");
+    }
+}
+
+internal void
+generate_native_simulator(OpCodeStats *stats, u32 opCodeCount, OpCode *opCodes, FileStream output)
+{
+    ModuloKernel *kernel = &stats->kernel;
+    i_expect(opCodeCount);
+    i_expect(kernel->interval);
+    i_expect(kernel->start < opCodeCount);
+    u32 aluLatency = get_alu_latency(&stats->pipeline);
+    u32 registerCount = 1 << stats->addressBits;
+    u32 passLength = opCodeCount - kernel->start;
+
+    fprintf(output.file, "// Generated with the TURD machine 0.v.X9.y --\n\n");
+    fprintf(output.file, "#include <stdint.h>\n\n");
+    fprintf(output.file, "typedef uint32_t u32;\n");
+    fprintf(output.file, "typedef int32_t s32;\n\n");
+    native_emit_state(output);
+    fprintf(output.file, "#define MASK      0x%Xu\n", sim_mask(stats, -1));
+    fprintf(output.file, "#define SHIFT     %uu\n", 32 - stats->bitWidth);
+    fprintf(output.file, "#define MAX_SHIFT %uu\n\n", stats->bitWidth - 1);
+    fprintf(output.file, "#define SLL(a, b) (((b) <= MAX_SHIFT) ? (((a) << (b)) & MASK) : 0u)\n");
+    fprintf(output.file, "#define SRL(a, b) (((b) <= MAX_SHIFT) ? ((a) >> (b)) : 0u)\n");
+    fprintf(output.file, "#define SRA(a, b) ((u32)(((s32)((a) << SHIFT) >> SHIFT) >> "
+            "(((b) < MAX_SHIFT) ? (b) : MAX_SHIFT)) & MASK)\n\n");
+    fprintf(output.file, "#define OUTPUT(t, v) do { u32 value_ = (v); hash = (hash ^ value_) * 16777619u; ++outputCount; \\\n");
+    fprintf(output.file, "    if (traceCount < traceCapacity) { \\\n");
+    fprintf(output.file, "        trace[2 * traceCount] = (t); trace[2 * traceCount + 1] = value_; ++traceCount; } \\\n");
+    fprintf(output.file, "    } while (0)\n\n");
+
+    fprintf(output.file, "void turd_sim_run(NativeSimState *state, u32 clockTicks)\n");
+    fprintf(output.file, "{\n");
+    fprintf(output.file, "    u32 tick = 0;\n");
+    fprintf(output.file, "    u32 *inputs = state->inputs;\n");
+    fprintf(output.file, "    u32 inputCount = state->inputCount;\n");
+    fprintf(output.file, "    u32 inputIndex = state->inputIndex;\n");
+    fprintf(output.file, "    u32 *trace = state->trace;\n");
+    fprintf(output.file, "    u32 traceCapacity = state->tracing ? state->traceCapacity : 0;\n");
+    fprintf(output.file, "    u32 outputCount = 0;\n");
+    fprintf(output.file, "    u32 traceCount = 0;\n");
+    fprintf(output.file, "    u32 hash = state->outputHash;\n");
+    fprintf(output.file, "    u32 ioIn = 0;\n");
+    fprintf(output.file, "    u32 memOutA = 0;\n");
+    fprintf(output.file, "    u32 memOutB = 0;\n");
+    for (u32 slot = 0; slot < stats->aluCount; ++slot)
+    {
+        fprintf(output.file, "    u32 alu%u = 0;\n", slot);
+        for (u32 stage = 0; stage + 1 < aluLatency; ++stage)
+        {
+            fprintf(output.file, "    u32 pending%u_%u = 0;\n", slot, stage);
+        }
+    }
+    for (u32 reg = 0; reg < registerCount; ++reg)
+    {
+        fprintf(output.file, "    u32 r%u = 0;\n", reg);
+    }
+    fprintf(output.file, "\n");
+
+    if (kernel->start)
+    {
+        fprintf(output.file, "    // NOTE: Prologue, only after a reset\n");
+        fprintf(output.file, "    {\n");
+        native_emit_checked(stats, opCodes, 0, kernel->start, output);
+        fprintf(output.file, "    }\n\n");
+    }
+
+    fprintf(output.file, "    while ((clockTicks - tick) >= %uu)\n", passLength);
+    fprintf(output.file, "    {\n");
+    for (u32 pc = kernel->start; pc < opCodeCount; ++pc)
+    {
+        char tickExpr[32];
+        snprintf(tickExpr, sizeof(tickExpr), "tick + %uu", pc - kernel->start);
+        native_emit_opcode(stats, opCodes + pc, pc, tickExpr, output);
+    }
+    fprintf(output.file, "        tick += %uu;\n", passLength);
+    fprintf(output.file, "    }\n\n");
+
+    fprintf(output.file, "    // NOTE: The last partial pass\n");
+    fprintf(output.file, "    {\n");
+    native_emit_checked(stats, opCodes, kernel->start, opCodeCount, output);
+    fprintf(output.file, "    }\n\n");
+
+    fprintf(output.file, "done:\n");
+    fprintf(output.file, "    state->inputIndex = inputIndex;\n");
+    fprintf(output.file, "    state->outputCount = outputCount;\n");
+    fprintf(output.file, "    state->outputHash = hash;\n");
+    fprintf(output.file, "    (void)traceCount;\n");
+    fprintf(output.file, "    (void)memOutA;\n");
+    fprintf(output.file, "    (void)memOutB;\n");
+    fprintf(output.file, "}\n");
+}
+
+internal b32
+simulate_native(OpCodeStats *stats, u32 opCodeCount, OpCode *opCodes, u32 inputCount, u32 *inputs,
+                u32 clockTicks, b32 tracing)
+{
+    // NOTE(michiel): Returns false if there is no working C compiler, CC picks another one
+    b32 result = false;
+    i_expect(inputCount);
+
+    FileStream output = {0};
+    output.file = fopen("gen_sim.c", "wb");
+    generate_native_simulator(stats, opCodeCount, opCodes, output);
+    fclose(output.file);
+
+    char *compiler = getenv("CC");
+    String command = create_string_fmt("%s -O2 -shared -fPIC -o ./gen_sim.so gen_sim.c",
+                                       compiler ? compiler : "cc");
+    f64 compileStart = native_wall_seconds();
+    if (system((char *)command.data) == 0)
+    {
+        void *library = dlopen("./gen_sim.so", RTLD_NOW | RTLD_LOCAL);
+        NativeSimRun *run = 0;
+        if (library)
+        {
+            // NOTE(michiel): The POSIX way around the ISO C ban on object to function pointer casts
+            *(void **)&run = dlsym(library, "turd_sim_run");
+        }
+        if (run)
+        {
+            f64 compileSeconds = native_wall_seconds() - compileStart;
+            NativeSimState state = {0};
+            state.inputCount = inputCount;
+            state.inputs = allocate_array(inputCount, u32, 0);
+            for (u32 inputIdx = 0; inputIdx < inputCount; ++inputIdx)
+            {
+                state.inputs[inputIdx] = sim_mask(stats, inputs[inputIdx]);
+            }
+            state.outputHash = 2166136261u;
+            state.tracing = tracing;
+            if (tracing)
+            {
+                // NOTE(michiel): Every pass started has all its outputs
+                u32 prologueOutputs = 0;
+                u32 passOutputs = 0;
+                for (u32 pc = 0; pc < opCodeCount; ++pc)
+                {
+                    if (opCodes[pc].selectIO != Select_Zero)
+                    {
+                        if (pc < stats->kernel.start)
+                        {
+                            ++prologueOutputs;
+                        }
+                        else
+                        {
+                            ++passOutputs;
+                        }
+                    }
+                }
+                u32 passLength = opCodeCount - stats->kernel.start;
+                state.traceCapacity = prologueOutputs + (clockTicks / passLength + 1) * passOutputs;
+                state.trace = allocate_array(2 * (u64)maximum(1, state.traceCapacity), u32, ALLOC_NOCLEAR);
+            }
+
+            clock_t start = clock();
+            run(&state, clockTicks);
+            f64 seconds = (f64)(clock() - start) / (f64)CLOCKS_PER_SEC;
+
+            for (u32 traceIdx = 0; traceIdx < minimum(state.outputCount, state.traceCapacity); ++traceIdx)
+            {
+                fprintf(stdout, "Tick %4u: IO out %3u = %d\n", state.trace[2 * traceIdx], traceIdx,
+                        sim_signed(stats, state.trace[2 * traceIdx + 1]));
+            }
+            fprintf(stdout, "Native sim: %u ticks, %u outputs (hash %08X), %.1f Mticks/s, compiled in %.2fs\n",
+                    clockTicks, state.outputCount, state.outputHash,
+                    (seconds > 0.0) ? (f64)clockTicks / seconds * 1e-6 : 0.0, compileSeconds);
+
+            if (state.trace)
+            {
+                deallocate(state.trace);
+            }
+            deallocate(state.inputs);
+            result = true;
+        }
+        else
+        {
+            fprintf(stderr, "Native sim: could not load gen_sim.so: %s\n", dlerror());
+        }
+        if (library)
+        {
+            dlclose(library);
+        }
+    }
+    else
+    {
+        fprintf(stderr, "Native sim: could not compile gen_sim.c with: %s\n", (char *)command.data);
+    }
+    return result;
+}
@@ -180,10 +180,28 @@ gen_opc_expr(OpCodeBuilder *builder, OpCodeEntry *assignee, Expr *expr)
                 case TOKEN_AND: { alu->alu.op = Alu_And; } break;
                 case TOKEN_ADD: { alu->alu.op = Alu_Add; } break;
                 case TOKEN_SUB: { alu->alu.op = Alu_Sub; } break;
-                case TOKEN_MUL: { fprintf(stderr, "Multiply not yet supported!\n"); INVALID_CODE_PATH; } break;
+                case TOKEN_SLL: { alu->alu.op = Alu_Sll; } break;
+                case TOKEN_SRL: { alu->alu.op = Alu_Srl; } break;
+                case TOKEN_SRA: { alu->alu.op = Alu_Sra; } break;
+                case TOKEN_MUL: { alu->alu.op = Alu_Mul; } break;
                 INVALID_DEFAULT_CASE;
             }
-            alu->alu.inputA = gen_opc_expr(builder, alu, expr->binary.left);
+            if ((expr->binary.left->kind == Expr_Int) && (expr->binary.right->kind == Expr_Int) &&
+                (expr->binary.left->intConst != expr->binary.right->intConst))
+            {
+                // NOTE(michiel): Both can't use the immediate, this happens for constants the
+                // AST can't fold, like a logical shift of a negative value.
+                OpCodeEntry load = {0};
+                load.useAlu = true;
+                load.alu.op = Alu_Noop;
+                load.alu.inputA = gen_opc_expr(builder, &load, expr->binary.left);
+                buf_push(builder->entries, load);
+                alu->alu.inputA = Select_Alu;
+            }
+            else
+            {
+                alu->alu.inputA = gen_opc_expr(builder, alu, expr->binary.left);
+            }
             alu->alu.inputB = gen_opc_expr(builder, alu, expr->binary.right);
             
             if (pushBack)
@@ -212,6 +230,7 @@ generate_opcodes(OpCodeBuilder *builder, AstOptimizer *optimizer)
             OpCodeEntry entry = {0};
             Selection *output = 0;
             String varName = stmt->assign.left->name;
+            u32 firstEntry = buf_len(builder->entries);
             if (strings_are_equal(varName, create_string("IO")))
             {
                 entry.useIOOut = true;
@@ -233,6 +252,10 @@ generate_opcodes(OpCodeBuilder *builder, AstOptimizer *optimizer)
             *output = gen_opc_expr(builder, &entry, stmt->assign.right);
             
             buf_push(builder->entries, entry);
+            for (u32 entryIdx = firstEntry; entryIdx < buf_len(builder->entries); ++entryIdx)
+            {
+                builder->entries[entryIdx].sourceLine = stmt->origin.lineNumber;
+            }
         }
         else
         {
@@ -257,6 +280,7 @@ flush_opcode(OpCode **buffer, OpCode *opc)
     opc->immediate = 0;
     opc->memoryAddrA = 0;
     opc->memoryAddrB = 0;
+    opc->sourceLine = 0;
 }
 
 internal OpCode *
@@ -270,6 +294,10 @@ layout_instructions(OpCodeBuilder *builder)
         // NOTE(michiel): These entries do not know about timing, so everything is
         // packed in one frame. We decompose and see what we can reuse.
         OpCodeEntry *entry = builder->entries + entryIdx;
+        if (!current.sourceLine)
+        {
+            current.sourceLine = entry->sourceLine;
+        }
         
         Selection replaceMemA = Select_Zero;
         Selection replaceMemB = Select_Zero;
@@ -552,10 +580,24 @@ layout_instructions(OpCodeBuilder *builder)
                 current.selectMem = entry->memory.input;
             }
         }
+        if (!current.sourceLine)
+        {
+            // NOTE(michiel): The rest of the entry went into a new opcode
+            current.sourceLine = entry->sourceLine;
+        }
     }
     
     flush_opcode(&result, &current);
     
+    // NOTE(michiel): A wait for a memory read is flushed empty, it belongs to the opcode after it
+    for (u32 opIdx = buf_len(result) - 1; opIdx > 0; --opIdx)
+    {
+        if (!result[opIdx - 1].sourceLine)
+        {
+            result[opIdx - 1].sourceLine = result[opIdx].sourceLine;
+        }
+    }
+    
     return result;
 }
 
@@ -8,6 +8,10 @@
 #include "./ast.c"
 #include "./parser.c"
 #include "./intermediaterep.c"
+#include "./bitvector.c"
+#include "./range_analysis.c"
+#include "./sim_stream.c"
+#include "./golden_model.c"
 
 #define REG_MAX (1 << 9)
 
@@ -19,6 +23,10 @@ typedef enum Selection
     Select_Immediate,
     Select_IO,
     Select_Alu,
+    // NOTE(michiel): Outputs of the extra ALUs in VLIW mode
+    Select_Alu1,
+    Select_Alu2,
+    Select_Alu3,
     
     Select_Count,
 } Selection;
@@ -31,6 +39,9 @@ global char *gSelectionNames[Select_Count] =
     [Select_Immediate] = "Imm",
     [Select_IO] = "In",
     [Select_Alu] = "Alu",
+    [Select_Alu1] = "Alu1",
+    [Select_Alu2] = "Alu2",
+    [Select_Alu3] = "Alu3",
 };
 
 typedef enum AluOp
@@ -41,6 +52,12 @@ typedef enum AluOp
     Alu_And,
     Alu_Add,
     Alu_Sub,
+    // NOTE(michiel): Shift A by B, amounts of the datapath width or more shift everything out
+    Alu_Sll,
+    Alu_Srl,
+    Alu_Sra,
+    // NOTE(michiel): Low half of the product, only built into cores that multiply
+    Alu_Mul,
     
     Alu_Count,
 } AluOp;
@@ -53,6 +70,10 @@ global char *gAluOpNames[Alu_Count] =
     [Alu_And] = "And",
     [Alu_Add] = "Add",
     [Alu_Sub] = "Sub",
+    [Alu_Sll] = "Sll",
+    [Alu_Srl] = "Srl",
+    [Alu_Sra] = "Sra",
+    [Alu_Mul] = "Mul",
 };
 
 typedef struct Alu
@@ -102,17 +123,35 @@ b32      useIOOut;
     
     b32      useImmediate;
     s32      immediate;
+    
+    u32      sourceLine;
     } OpCodeEntry;
 
+#define MAX_ALU_COUNT (Select_Alu3 - Select_Alu + 1)
+
+typedef struct AluSlot
+{
+    enum Selection selectA;
+    enum Selection selectB;
+    enum AluOp operation;
+} AluSlot;
+
 typedef struct OpCode
 {
-    enum Selection selectAluA;
-    enum Selection selectAluB;
+    union
+    {
+        // NOTE(michiel): The first ALU keeps its old names, the single ALU code paths use those
+        struct
+        {
+            enum Selection selectAluA;
+            enum Selection selectAluB;
+            enum AluOp aluOperation;
+        };
+        AluSlot aluSlots[MAX_ALU_COUNT];
+    };
     enum Selection selectMem;
     enum Selection selectIO;
     
-    enum AluOp aluOperation;
-    
     b32 memoryReadA;
     b32 memoryReadB;
     b32 memoryWrite;
@@ -120,29 +159,268 @@ typedef struct OpCode
     s32 immediate;
     u32 memoryAddrA;
     u32 memoryAddrB;
+    
+    // NOTE(michiel): First statement that put something in this opcode, 0 if none did. Only
+    // for reports, it is not part of the encoding.
+    u32 sourceLine;
 } OpCode;
 
+typedef enum RomLayout
+{
+    RomLayout_Auto,
+    RomLayout_Flat,       // NOTE(michiel): One full opcode per pc
+    RomLayout_Dictionary, // NOTE(michiel): Unique control words and operands, indexed per pc
+} RomLayout;
+
+typedef enum RomInit
+{
+    RomInit_Inline, // NOTE(michiel): The opcodes are VHDL literals in gen_opcodes.vhd
+    RomInit_File,   // NOTE(michiel): A block RAM loaded from gen_opcodes.mem at elaboration
+    RomInit_Update, // NOTE(michiel): Like file, but the HDL is only rewritten if its shape changed
+} RomInit;
+
+typedef enum CoreTarget
+{
+    Core_Program, // NOTE(michiel): A core cut to the program, with the opcodes in its ROM
+    Core_Generic, // NOTE(michiel): A fixed core with microcode RAM, loaded over the IO port
+} CoreTarget;
+
+// NOTE(michiel): Shape of the generic core, every program that fits runs on it unchanged
+#define GENERIC_PC_BITS        8
+#define GENERIC_ADDRESS_BITS   6
+#define GENERIC_IMMEDIATE_BITS 32
+
+typedef enum ImmediateMode
+{
+    Immediate_Auto,
+    Immediate_Inline,       // NOTE(michiel): The value itself in every opcode
+    Immediate_ConstantBank, // NOTE(michiel): An index into a preloaded constant ROM
+} ImmediateMode;
+
+typedef struct HardwareLoop
+{
+    // NOTE(michiel): The body [start, start + length) runs count times, the register
+    // addresses move by their stride every iteration.
+    b32 enabled;
+    u32 start;
+    u32 length;
+    u32 count;
+    u32 counterBits;
+    s32 strideA;
+    s32 strideB;
+} HardwareLoop;
+
+typedef struct ModuloKernel
+{
+    // NOTE(michiel): After the last opcode the pc wraps to start, the opcodes before it are
+    // the prologue of a modulo schedule.
+    u32 start;
+    u32 interval;   // NOTE(michiel): Cycles between two input samples
+    u32 stageCount; // NOTE(michiel): Iterations in flight in the kernel
+    u32 copyCount;  // NOTE(michiel): Register copies, the kernel is unrolled this many times
+    u32 minInterval; // NOTE(michiel): Lower bound from the resource usage
+} ModuloKernel;
+
+#define MAX_ALU_STAGES  3
+#define MAX_MUL_STAGES  3
+#define MAX_ALU_LATENCY (MAX_ALU_STAGES + MAX_MUL_STAGES)
+
+typedef struct PipelineConfig
+{
+    // NOTE(michiel): Extra register stages in the datapath. The compiler schedules around
+    // the latencies, the core never stalls on them.
+    b32 decodeStage;  // NOTE(michiel): Registers the opcode between the ROM and the controller
+    b32 operandStage; // NOTE(michiel): Registers the ALU operand muxes and operation
+    u32 aluStages;    // NOTE(michiel): Register stages in the ALU itself, at least 1
+    u32 mulStages;    // NOTE(michiel): Register stages of the multiplier, 0 without a multiplier
+} PipelineConfig;
+
+typedef enum OpCodeField
+{
+    // NOTE(michiel): The control fields above register address A, in ROM word order. The
+    // extra ALUs of the VLIW mode are stacked on top as [alu op, select B, select A].
+    OpField_AluOp,
+    OpField_UseB,
+    OpField_MemWrite,
+    OpField_MemReadB,
+    OpField_MemReadA,
+    OpField_SelectIO,
+    OpField_SelectMem,
+    OpField_SelectAluB,
+    OpField_SelectAluA,
+    OpField_Slot1AluOp,
+    OpField_Slot1SelectAluB,
+    OpField_Slot1SelectAluA,
+    OpField_Slot2AluOp,
+    OpField_Slot2SelectAluB,
+    OpField_Slot2SelectAluA,
+    OpField_Slot3AluOp,
+    OpField_Slot3SelectAluB,
+    OpField_Slot3SelectAluA,
+    
+    OpField_Count,
+} OpCodeField;
+
+global char *gOpFieldNames[OpField_Count] =
+{
+    [OpField_AluOp] = "alu_op",
+    [OpField_UseB] = "use_b",
+    [OpField_MemWrite] = "mem_write",
+    [OpField_MemReadB] = "mem_readb",
+    [OpField_MemReadA] = "mem_reada",
+    [OpField_SelectIO] = "io_sel",
+    [OpField_SelectMem] = "mem_sel",
+    [OpField_SelectAluB] = "alu_selb",
+    [OpField_SelectAluA] = "alu_sela",
+    [OpField_Slot1AluOp] = "alu1_op",
+    [OpField_Slot1SelectAluB] = "alu1_selb",
+    [OpField_Slot1SelectAluA] = "alu1_sela",
+    [OpField_Slot2AluOp] = "alu2_op",
+    [OpField_Slot2SelectAluB] = "alu2_selb",
+    [OpField_Slot2SelectAluA] = "alu2_sela",
+    [OpField_Slot3AluOp] = "alu3_op",
+    [OpField_Slot3SelectAluB] = "alu3_selb",
+    [OpField_Slot3SelectAluA] = "alu3_sela",
+};
+
+typedef enum OpFieldKind
+{
+    OpFieldKind_Stored,   // NOTE(michiel): Has its own bits in the ROM word
+    OpFieldKind_Constant, // NOTE(michiel): The same value in every opcode, hard-wired
+    OpFieldKind_Tied,     // NOTE(michiel): Always equal to an earlier stored field, reads its bits
+} OpFieldKind;
+
+typedef struct OpCodeFieldInfo
+{
+    OpFieldKind kind;
+    b32 isBit;    // NOTE(michiel): A std_logic instead of a std_logic_vector
+    u32 bits;     // NOTE(michiel): 0 for the fields of absent ALUs
+    u32 offset;   // NOTE(michiel): Position in the ROM word, of the stored field when tied
+    u32 value;    // NOTE(michiel): Value of a constant field
+    OpCodeField tiedTo;
+} OpCodeFieldInfo;
+
 typedef struct OpCodeStats
 {
     b32 synced;
+    RomLayout romLayout;
+    RomInit romInit;
+    CoreTarget core;
+    PipelineConfig pipeline;
     
     u32 bitWidth;
+    u32 aluCount;
     
     u32 maxSelect;
     u32 selectBits;
     u32 maxAluOp;
     u32 aluOpBits;
+    // NOTE(michiel): Masks of the selections every mux sees and of the ALU operations in the
+    // program. Only those get hardware, numbered densely into the select and ALU op fields.
+    u32 aluSelectsA[MAX_ALU_COUNT];
+    u32 aluSelectsB[MAX_ALU_COUNT];
+    u32 memSelects;
+    u32 ioSelects;
+    u32 aluOps;
+    u32 selectCodes[Select_Count];
+    u32 aluOpCodes[Alu_Count];
     u32 maxImmediate;
     u32 immediateBits;
+    ImmediateMode immediateMode;
+    u32 constantCount;
+    u32 constantIndexBits;
+    s32 *constants;
     u32 maxAddress;
     u32 addressBits;
     
     u32 opCodeCount;
     u32 opCodeBits;
+    HardwareLoop loop;
+    ModuloKernel kernel;
     
+    OpCodeFieldInfo fields[OpField_Count];
     u32 opCodeBitWidth;
+    u32 fullOpCodeBitWidth; // NOTE(michiel): Width with every control field stored
+    u32 romBits;    // NOTE(michiel): Size of the selected ROM layout
+    b32 fitsCore;   // NOTE(michiel): The program fits the widths of the generic core
 } OpCodeStats;
 
+typedef struct RomDictionary
+{
+    // NOTE(michiel): The control word is everything above the shared immediate/address B
+    // field, the operand is that shared field.
+    u32 controlCount;
+    u32 controlBits;
+    u32 controlIndexBits;
+    BitVector *controls;
+    
+    u32 operandCount;
+    u32 operandBits;
+    u32 operandIndexBits;
+    BitVector *operands;
+    
+    // NOTE(michiel): Per pc indices into the tables above
+    u32 *controlIndex;
+    u32 *operandIndex;
+} RomDictionary;
+
+typedef enum SchedulerKind
+{
+    Scheduler_Classic, // NOTE(michiel): layout_instructions, a single ALU with a single cycle latency
+    Scheduler_List,
+    Scheduler_Modulo,  // NOTE(michiel): List scheduler that overlaps program iterations
+} SchedulerKind;
+
+typedef enum Backend
+{
+    Backend_Cpu,
+    Backend_Dataflow, // NOTE(michiel): Spatial circuit for stateless programs, else the CPU
+} Backend;
+
+typedef enum SimEngine
+{
+    SimEngine_Reference, // NOTE(michiel): simulate(), decodes every opcode every tick
+    SimEngine_Fast,      // NOTE(michiel): Predecoded micro ops, see fast_simulator.c
+    SimEngine_Native,    // NOTE(michiel): Straight-line C compiled by the host, see native_simulator.c
+} SimEngine;
+
+typedef struct CompileOptions
+{
+    char *sourceFile;
+    RomLayout romLayout;
+    RomInit romInit;
+    CoreTarget core;
+    ImmediateMode immediateMode;
+    b32 hardwareLoops;
+    SchedulerKind scheduler;
+    Backend backend;
+    u32 aluCount;
+    PipelineConfig pipeline;
+    u32 ioInputBits;
+    u32 simulateTicks;
+    SimEngine simEngine;
+    b32 simTrace;
+    u32 simLanes;         // NOTE(michiel): Independent input streams, 0 is a single one
+    char *vcdFile;
+    u32 vcdStart;
+    u32 vcdEnd;           // NOTE(michiel): One past the last tick in the dump, 0 is the end of the run
+    char *vcdSignals;
+    b32 cosim;            // NOTE(michiel): Write a self checking testbench with the simulation results
+    char *simIn;          // NOTE(michiel): Sample stream instead of the inputs 1 to 15, "-" is stdin
+    char *simOut;
+    SimStreamFormat simFormat;
+    u32 simRate;          // NOTE(michiel): Ticks between input samples, 0 whenever the core takes one
+    b32 synced;
+    char *simProfile;     // NOTE(michiel): JSON report of the datapath utilization
+    char *simSave;        // NOTE(michiel): Checkpoint of the state at the end of the run
+    char *simLoad;
+    u32 simSkip;          // NOTE(michiel): Fast-forward without tracing up to this tick
+    u32 simSkipOutputs;
+    b32 golden;           // NOTE(michiel): Run the golden model of the source, see golden_model.c
+    u32 goldenSamples;    // NOTE(michiel): 0 is the whole -sim-in stream
+    char *goldenOut;
+} CompileOptions;
+
 typedef struct OpCodeBuilder
 {
     //u32 opCodeCount;
@@ -155,6 +433,8 @@ typedef struct OpCodeBuilder
 } OpCodeBuilder;
 
 #include "./opc_builder.c"
+#include "./scheduler.c"
+#include "./dataflow.c"
 
 internal b32 opc_only_selection(OpCode *opCode)
 {
@@ -210,6 +490,50 @@ internal u32 opc_max_immediate(u32 opCount, OpCode *opCodes)
     return maxImmediate;
 }
 
+internal u32 opc_immediate_bits(u32 opCount, OpCode *opCodes)
+{
+    // NOTE(michiel): Signed bits needed for the immediates, they get sign extended to the
+    // datapath width by the controller.
+    ValueRange range = {0};
+    for (u32 opIdx = 0; opIdx < opCount; ++opIdx)
+    {
+        OpCode opCode = opCodes[opIdx];
+        if (opc_has_select(&opCode, Select_Immediate))
+        {
+            range.min = minimum(range.min, opCode.immediate);
+            range.max = maximum(range.max, opCode.immediate);
+        }
+    }
+    return range_bits(range);
+}
+
+internal s32 *opc_collect_constants(u32 opCount, OpCode *opCodes)
+{
+    // NOTE(michiel): Distinct immediates, in order of first use
+    s32 *constants = 0;
+    for (u32 opIdx = 0; opIdx < opCount; ++opIdx)
+    {
+        OpCode opCode = opCodes[opIdx];
+        if (opc_has_select(&opCode, Select_Immediate))
+        {
+            b32 found = false;
+            for (u32 constIdx = 0; constIdx < buf_len(constants); ++constIdx)
+            {
+                if (constants[constIdx] == opCode.immediate)
+                {
+                    found = true;
+                    break;
+                }
+            }
+            if (!found)
+            {
+                buf_push(constants, opCode.immediate);
+            }
+        }
+    }
+    return constants;
+}
+
 internal s32 opc_max_address(u32 opCount, OpCode *opCodes)
 {
     s32 maxAddress = -1;
@@ -229,14 +553,91 @@ internal s32 opc_max_address(u32 opCount, OpCode *opCodes)
     return maxAddress;
 }
 
+internal void opc_collect_field_usage(OpCodeStats *stats, u32 opCount, OpCode *opCodes)
+{
+    // NOTE(michiel): Select_Zero is always there, the cleared opcode at reset and in the
+    // unused ROM words has to keep the IO and registers idle. An ALU slot that selects
+    // nothing does nothing, its operation doesn't need hardware.
+    stats->memSelects = 1 << Select_Zero;
+    stats->ioSelects = 1 << Select_Zero;
+    for (u32 slot = 0; slot < MAX_ALU_COUNT; ++slot)
+    {
+        stats->aluSelectsA[slot] = 1 << Select_Zero;
+        stats->aluSelectsB[slot] = 1 << Select_Zero;
+    }
+    stats->aluOps = 0;
+    for (u32 opIdx = 0; opIdx < opCount; ++opIdx)
+    {
+        OpCode *opCode = opCodes + opIdx;
+        stats->memSelects |= 1 << opCode->selectMem;
+        stats->ioSelects |= 1 << opCode->selectIO;
+        for (u32 slot = 0; slot < stats->aluCount; ++slot)
+        {
+            AluSlot *alu = opCode->aluSlots + slot;
+            stats->aluSelectsA[slot] |= 1 << alu->selectA;
+            stats->aluSelectsB[slot] |= 1 << alu->selectB;
+            if ((alu->selectA != Select_Zero) || (alu->selectB != Select_Zero) ||
+                (alu->operation != Alu_Noop))
+            {
+                stats->aluOps |= 1 << alu->operation;
+            }
+        }
+    }
+}
+
+internal u32 get_dense_codes(u32 usedMask, u32 count, u32 *codes)
+{
+    // NOTE(michiel): Unused entries get code 0, only idle ALU slots still carry them
+    u32 result = 0;
+    for (u32 index = 0; index < count; ++index)
+    {
+        codes[index] = 0;
+        if (usedMask & (1 << index))
+        {
+            codes[index] = result++;
+        }
+    }
+    return result;
+}
+
+#include "./hardware_loop.c"
+
+internal inline u32
+get_alu_latency(PipelineConfig *pipeline)
+{
+    // NOTE(michiel): Cycles from the opcode selecting the ALU operands to the opcode that can
+    // select the result. The decode stage delays every control signal alike, so it doesn't count.
+    // The other operations wait for the multiplier, so the ALU output never gets two results
+    // in the same cycle.
+    u32 result = (pipeline->operandStage ? 1 : 0) + pipeline->aluStages;
+    if (pipeline->mulStages)
+    {
+        result += pipeline->mulStages - 1;
+    }
+    return result;
+}
+
+internal inline u32
+get_immediate_field_bits(OpCodeStats *stats)
+{
+    // NOTE(michiel): With a constant bank the opcode only holds the index of the constant
+    u32 result = stats->immediateBits;
+    if (stats->immediateMode == Immediate_ConstantBank)
+    {
+        result = stats->constantIndexBits;
+    }
+    return result;
+}
+
 internal inline u32
 get_offset_immediate(OpCodeStats *stats)
 {
     u32 offset = 0;
-    u32 maxImmAddr = maximum(stats->immediateBits, stats->addressBits);
-    if (maxImmAddr > stats->immediateBits)
+    u32 immediateBits = get_immediate_field_bits(stats);
+    u32 maxImmAddr = maximum(immediateBits, stats->addressBits);
+    if (maxImmAddr > immediateBits)
     {
-        offset = maxImmAddr - stats->immediateBits;
+        offset = maxImmAddr - immediateBits;
     }
     return offset;
 }
@@ -245,7 +646,7 @@ internal inline u32
 get_offset_addr_b(OpCodeStats *stats)
 {
     u32 offset = 0;
-    u32 maxImmAddr = maximum(stats->immediateBits, stats->addressBits);
+    u32 maxImmAddr = maximum(get_immediate_field_bits(stats), stats->addressBits);
     if (maxImmAddr > stats->addressBits)
     {
         offset = maxImmAddr - stats->addressBits;
@@ -257,108 +658,266 @@ internal inline u32
 get_offset_addr_a(OpCodeStats *stats)
 {
     u32 offset = 0;
-    u32 maxImmAddr = maximum(stats->immediateBits, stats->addressBits);
+    u32 maxImmAddr = maximum(get_immediate_field_bits(stats), stats->addressBits);
     offset += maxImmAddr;
     return offset;
 }
 
-internal inline u32
-get_offset_alu_op(OpCodeStats *stats)
+internal inline OpCodeField
+get_slot_field(u32 slot, OpCodeField field)
 {
-    u32 offset = get_offset_addr_a(stats);
-    offset += stats->addressBits;
-    return offset;
+    // NOTE(michiel): The field of the given ALU slot that matches a field of the first ALU
+    OpCodeField result = field;
+    if (slot)
+    {
+        u32 index = 0;
+        switch (field)
+        {
+            case OpField_AluOp:      { index = 0; } break;
+            case OpField_SelectAluB: { index = 1; } break;
+            case OpField_SelectAluA: { index = 2; } break;
+            INVALID_DEFAULT_CASE;
+        }
+        result = (OpCodeField)(OpField_Slot1AluOp + 3 * (slot - 1) + index);
+    }
+    return result;
 }
 
-internal inline u32
-get_offset_useB(OpCodeStats *stats)
+internal b32
+get_alu_field(OpCodeField field, u32 *slot, u32 *index)
 {
-    u32 offset = get_offset_alu_op(stats);
-    offset += stats->aluOpBits;
-    return offset;
+    // NOTE(michiel): Splits an ALU field in its slot and its index in [alu op, select B, select A]
+    b32 result = true;
+    *slot = 0;
+    *index = 0;
+    switch (field)
+    {
+        case OpField_AluOp:      { *index = 0; } break;
+        case OpField_SelectAluB: { *index = 1; } break;
+        case OpField_SelectAluA: { *index = 2; } break;
+        default:
+        {
+            result = (field >= OpField_Slot1AluOp) && (field < OpField_Count);
+            if (result)
+            {
+                *slot = 1 + (field - OpField_Slot1AluOp) / 3;
+                *index = (field - OpField_Slot1AluOp) % 3;
+            }
+        } break;
+    }
+    return result;
 }
 
-internal inline u32
-get_offset_mem_write(OpCodeStats *stats)
+internal u32
+get_opcode_field_value(OpCodeStats *stats, OpCode *opCode, OpCodeField field)
 {
-    u32 offset = get_offset_useB(stats);
-    offset += 1;
-    return offset;
+    // NOTE(michiel): The encoded value as it goes into the ROM word
+    u32 result = 0;
+    u32 slot;
+    u32 index;
+    if (get_alu_field(field, &slot, &index))
+    {
+        AluSlot *alu = opCode->aluSlots + slot;
+        switch (index)
+        {
+            case 0: { result = stats->aluOpCodes[alu->operation]; } break;
+            case 1: { result = stats->selectCodes[alu->selectB]; } break;
+            case 2: { result = stats->selectCodes[alu->selectA]; } break;
+            INVALID_DEFAULT_CASE;
+        }
+    }
+    else
+    {
+        switch (field)
+        {
+            case OpField_UseB:      { result = opCode->memoryReadB ? 1 : 0; } break;
+            case OpField_MemWrite:  { result = opCode->memoryWrite ? 1 : 0; } break;
+            case OpField_MemReadB:  { result = opCode->memoryReadB ? 1 : 0; } break;
+            case OpField_MemReadA:  { result = opCode->memoryReadA ? 1 : 0; } break;
+            case OpField_SelectIO:  { result = stats->selectCodes[opCode->selectIO]; } break;
+            case OpField_SelectMem: { result = stats->selectCodes[opCode->selectMem]; } break;
+            INVALID_DEFAULT_CASE;
+        }
+    }
+    return result;
 }
 
-internal inline u32
-get_offset_mem_read_b(OpCodeStats *stats)
+internal u32
+get_constant_index(OpCodeStats *stats, s32 value)
 {
-    u32 offset = get_offset_mem_write(stats);
-    offset += 1;
-    return offset;
+    u32 result = stats->constantCount;
+    for (u32 constIdx = 0; constIdx < stats->constantCount; ++constIdx)
+    {
+        if (stats->constants[constIdx] == value)
+        {
+            result = constIdx;
+            break;
+        }
+    }
+    i_expect(result < stats->constantCount);
+    return result;
 }
 
-internal inline u32
-get_offset_mem_read_a(OpCodeStats *stats)
+internal void
+opcode_packing(OpCodeStats *stats, OpCode *opCode, BitVector *result)
 {
-    u32 offset = get_offset_mem_read_b(stats);
-    offset += 1;
-    return offset;
+    // NOTE(michiel): Packs into a preallocated vector of stats->opCodeBitWidth bits, so
+    // opcodes are not limited to 64 bits.
+    i_expect(result->bitCount == stats->opCodeBitWidth);
+    bitvec_clear(result);
+    
+    if (stats->immediateMode == Immediate_ConstantBank)
+    {
+        if (opc_has_select(opCode, Select_Immediate))
+        {
+            bitvec_set_field(result, get_offset_immediate(stats), stats->constantIndexBits,
+                             get_constant_index(stats, opCode->immediate));
+        }
+        else if (opCode->memoryAddrB)
+        {
+            bitvec_set_field(result, get_offset_addr_b(stats), stats->addressBits, opCode->memoryAddrB);
+        }
+    }
+    else if (opCode->immediate)
+    {
+        bitvec_set_field(result, get_offset_immediate(stats), stats->immediateBits,
+                         (u64)(u32)opCode->immediate);
+    }
+    else if (opCode->memoryAddrB)
+    {
+        bitvec_set_field(result, get_offset_addr_b(stats), stats->addressBits, opCode->memoryAddrB);
+    }
+    bitvec_set_field(result, get_offset_addr_a(stats), stats->addressBits, opCode->memoryAddrA);
+    for (u32 field = 0; field < OpField_Count; ++field)
+    {
+        OpCodeFieldInfo *info = stats->fields + field;
+        if (info->bits && (info->kind == OpFieldKind_Stored))
+        {
+            bitvec_set_field(result, info->offset, info->bits,
+                             get_opcode_field_value(stats, opCode, (OpCodeField)field));
+        }
+    }
 }
 
-internal inline u32
-get_offset_sel_io(OpCodeStats *stats)
+internal u32
+rom_find_or_add(BitVector **table, BitVector *value)
 {
-    u32 offset = get_offset_mem_read_a(stats);
-    offset += 1;
-    return offset;
+    u32 result = buf_len(*table);
+    for (u32 entryIdx = 0; entryIdx < buf_len(*table); ++entryIdx)
+    {
+        if (bitvec_equal((*table) + entryIdx, value))
+        {
+            result = entryIdx;
+            break;
+        }
+    }
+    if (result == buf_len(*table))
+    {
+        buf_push(*table, bitvec_copy(value));
+    }
+    return result;
 }
 
-internal inline u32
-get_offset_sel_mem(OpCodeStats *stats)
+internal RomDictionary
+build_rom_dictionary(OpCodeStats *stats, OpCode *opCodes)
 {
-    u32 offset = get_offset_sel_io(stats);
-    offset += stats->selectBits;
-    return offset;
+    RomDictionary result = {0};
+
+    result.operandBits = get_offset_addr_a(stats);
+    i_expect(result.operandBits > 0);
+    i_expect(result.operandBits < stats->opCodeBitWidth);
+    result.controlBits = stats->opCodeBitWidth - result.operandBits;
+
+    BitVector opcValue = bitvec_allocate(stats->opCodeBitWidth);
+    for (u32 opcIdx = 0; opcIdx < stats->opCodeCount; ++opcIdx)
+    {
+        opcode_packing(stats, opCodes + opcIdx, &opcValue);
+        BitVector control = bitvec_slice(&opcValue, result.operandBits, result.controlBits);
+        BitVector operand = bitvec_slice(&opcValue, 0, result.operandBits);
+        buf_push(result.controlIndex, rom_find_or_add(&result.controls, &control));
+        buf_push(result.operandIndex, rom_find_or_add(&result.operands, &operand));
+        bitvec_free(&control);
+        bitvec_free(&operand);
+    }
+    bitvec_free(&opcValue);
+
+    result.controlCount = buf_len(result.controls);
+    result.operandCount = buf_len(result.operands);
+    // NOTE(michiel): The control index always gets at least one bit, a single operand
+    // doesn't need an index at all.
+    result.controlIndexBits = maximum(1, log2_up(result.controlCount - 1));
+    result.operandIndexBits = result.operandCount > 1 ? log2_up(result.operandCount - 1) : 0;
+
+    return result;
+}
+
+internal void
+free_rom_dictionary(RomDictionary *dictionary)
+{
+    for (u32 controlIdx = 0; controlIdx < buf_len(dictionary->controls); ++controlIdx)
+    {
+        bitvec_free(dictionary->controls + controlIdx);
+    }
+    for (u32 operandIdx = 0; operandIdx < buf_len(dictionary->operands); ++operandIdx)
+    {
+        bitvec_free(dictionary->operands + operandIdx);
+    }
+    buf_free(dictionary->controls);
+    buf_free(dictionary->operands);
+    buf_free(dictionary->controlIndex);
+    buf_free(dictionary->operandIndex);
 }
 
 internal inline u32
-get_offset_sel_alu_b(OpCodeStats *stats)
+get_rom_bits_flat(OpCodeStats *stats)
 {
-    u32 offset = get_offset_sel_mem(stats);
-    offset += stats->selectBits;
-    return offset;
+    u32 result = (1 << stats->opCodeBits) * stats->opCodeBitWidth;
+    return result;
 }
 
 internal inline u32
-get_offset_sel_alu_a(OpCodeStats *stats)
+get_rom_bits_dictionary(OpCodeStats *stats, RomDictionary *dictionary)
 {
-    u32 offset = get_offset_sel_alu_b(stats);
-    offset += stats->selectBits;
-    return offset;
+    u32 result = (1 << stats->opCodeBits) * (dictionary->controlIndexBits + dictionary->operandIndexBits);
+    result += dictionary->controlCount * dictionary->controlBits;
+    result += dictionary->operandCount * dictionary->operandBits;
+    return result;
 }
 
-internal inline u64
-opcode_packing(OpCodeStats *stats, OpCode *opCode)
+internal RomLayout
+select_rom_layout(OpCodeStats *stats, OpCode *opCodes, RomLayout requested)
 {
-    u64 result = 0;
-    
-    // TODO(michiel): Masking?
-    if (opCode->immediate)
+    RomDictionary dictionary = build_rom_dictionary(stats, opCodes);
+    u32 flatBits = get_rom_bits_flat(stats);
+    u32 dictBits = get_rom_bits_dictionary(stats, &dictionary);
+
+    RomLayout result = requested;
+    if (result == RomLayout_Auto)
     {
-        result |= ((opCode->immediate & ((1ULL << stats->bitWidth) - 1)) << get_offset_immediate(stats));
+        result = (dictBits < flatBits) ? RomLayout_Dictionary : RomLayout_Flat;
     }
-    else if (opCode->memoryAddrB)
+    stats->romBits = (result == RomLayout_Dictionary) ? dictBits : flatBits;
+
+    fprintf(stdout, "ROM layout:\n");
+    fprintf(stdout, "  Flat      : %u x %u = %u bits\n", 1 << stats->opCodeBits,
+            stats->opCodeBitWidth, flatBits);
+    fprintf(stdout, "  Dictionary: %u bits (%u unique control words of %u bits, "
+            "%u unique operands of %u bits)\n", dictBits,
+            dictionary.controlCount, dictionary.controlBits,
+            dictionary.operandCount, dictionary.operandBits);
+    if (result == RomLayout_Dictionary)
     {
-        result |= ((u64)opCode->memoryAddrB << get_offset_addr_b(stats));
+        s32 saved = (s32)flatBits - (s32)dictBits;
+        fprintf(stdout, "  Using dictionary, saving %d bits (%.1f%%)\n", saved,
+                100.0 * (f64)saved / (f64)flatBits);
     }
-    result |= ((u64)opCode->memoryAddrA << get_offset_addr_a(stats));
-    result |= ((u64)(opCode->memoryReadB ? 1 : 0) << get_offset_useB(stats)); // TODO(michiel): Remove
-    result |= ((u64)(opCode->memoryWrite) << get_offset_mem_write(stats));
-    result |= ((u64)(opCode->memoryReadA) << get_offset_mem_read_a(stats));
-    result |= ((u64)(opCode->memoryReadB) << get_offset_mem_read_b(stats));
-    result |= ((u64)opCode->aluOperation << get_offset_alu_op(stats));
-    result |= ((u64)opCode->selectAluA << get_offset_sel_alu_a(stats));
-    result |= ((u64)opCode->selectAluB << get_offset_sel_alu_b(stats));
-    result |= ((u64)opCode->selectMem << get_offset_sel_mem(stats));
-    result |= ((u64)opCode->selectIO << get_offset_sel_io(stats));
-    
+    else
+    {
+        fprintf(stdout, "  Using flat\n");
+    }
+
+    free_rom_dictionary(&dictionary);
+
     return result;
 }
 
@@ -374,6 +933,9 @@ select_to_string(enum Selection select)
         case Select_Immediate: { result = "Immediate"; } break;
         case Select_IO:        { result = "IO"; } break;
         case Select_Alu:       { result = "Alu Out"; } break;
+        case Select_Alu1:      { result = "Alu 1 Out"; } break;
+        case Select_Alu2:      { result = "Alu 2 Out"; } break;
+        case Select_Alu3:      { result = "Alu 3 Out"; } break;
         INVALID_DEFAULT_CASE;
     }
     return result;
@@ -391,6 +953,10 @@ alu_op_to_string(enum AluOp aluOp)
         case Alu_And:  { result = "And"; } break;
         case Alu_Add:  { result = "Add"; } break;
         case Alu_Sub:  { result = "Sub"; } break;
+        case Alu_Sll:  { result = "Shift left"; } break;
+        case Alu_Srl:  { result = "Shift right"; } break;
+        case Alu_Sra:  { result = "Shift right arithmetic"; } break;
+        case Alu_Mul:  { result = "Multiply"; } break;
         INVALID_DEFAULT_CASE;
     }
     return result;
@@ -424,15 +990,22 @@ print_opcode_single(OpCode *opcode)
 #include "./graphvizu.c"
 #include "./graph_tokens.c"
 #include "./graph_ast.c"
+#include "./vcd_writer.c"
+#include "./sim_profile.c"
 #include "./simulator.c"
+#include "./sim_checkpoint.c"
+#include "./fast_simulator.c"
+#include "./native_simulator.c"
+#include "./batch_simulator.c"
 #include "./optimizer.c"
 
 internal void
 print_opcode(FileStream output, OpCodeStats *stats, OpCode *opcode)
 {
-    fprintf(output.file, "OpCode: 0x%.*lX\n",
-            (get_offset_sel_alu_a(stats) + stats->selectBits + 3) / 4,
-            opcode_packing(stats, opcode));
+    BitVector opcValue = bitvec_allocate(stats->opCodeBitWidth);
+    opcode_packing(stats, opcode, &opcValue);
+    fprintf(output.file, "OpCode: 0x%s\n", bitvec_to_hex(&opcValue));
+    bitvec_free(&opcValue);
     if (output.verbose)
     {
         fprintf(output.file, "  Alu A  : %s\n", select_to_string(opcode->selectAluA));
@@ -444,6 +1017,12 @@ print_opcode(FileStream output, OpCodeStats *stats, OpCode *opcode)
                 opcode->memoryWrite ? "| write" : (!(opcode->memoryReadA || opcode->memoryReadB) ? "none" : ""));
         fprintf(output.file, "  Use B  : %s\n", opcode->memoryReadB ? "yes" : "no");
         fprintf(output.file, "  Alu op : %s\n", alu_op_to_string(opcode->aluOperation));
+        for (u32 slot = 1; slot < stats->aluCount; ++slot)
+        {
+            AluSlot *alu = opcode->aluSlots + slot;
+            fprintf(output.file, "  Alu %u  : %s %s %s\n", slot, select_to_string(alu->selectA),
+                    alu_op_to_string(alu->operation), select_to_string(alu->selectB));
+        }
         fprintf(output.file, "  Addr A : %u\n", opcode->memoryAddrA);
         if (opcode->memoryReadB)
         {
@@ -456,72 +1035,280 @@ print_opcode(FileStream output, OpCodeStats *stats, OpCode *opcode)
     }
 }
 
-internal OpCodeStats
-get_opcode_stats(u32 opCount, OpCode *opCodes, u32 bitWidth)
+internal void
+select_immediate_mode(OpCodeStats *stats, u32 opCount, OpCode *opCodes, ImmediateMode requested)
 {
-    OpCodeStats result = {0};
-    
-    result.bitWidth = bitWidth;
-    
-    result.maxSelect = Select_Count - 1;
-    result.selectBits = log2_up(result.maxSelect);
-    result.maxAluOp = Alu_Count - 1;
-    result.aluOpBits = log2_up(result.maxAluOp);
-    
-    //result.maxImmediate = opc_max_immediate(opCount, opCodes);
-    //result.immediateBits = log2_up(result.maxImmediate);
-    result.maxImmediate = (u32)((1ULL << bitWidth) - 1);
-    result.immediateBits = bitWidth;
-    i_expect(opc_max_immediate(opCount, opCodes) <= result.maxImmediate);
-    
-    s32 maxAddress = opc_max_address(opCount, opCodes);
-    if (maxAddress < 0)
-    {
-        result.maxAddress = 0;
-        result.addressBits = 0;
-    }
-    else if (maxAddress == 0)
-    {
-        result.maxAddress = 0;
-        result.addressBits = 1;
-    }
-    else
+    // NOTE(michiel): Inline immediates take immediateBits in every opcode, the constant
+    // bank only an index, but then the bank holds an immediateBits word per distinct
+    // constant. Both share their field with address B, so the bank only pays off if the
+    // immediate is the widest of the two. Ties keep the immediates inline, that is one ROM
+    // less.
+    stats->constants = opc_collect_constants(opCount, opCodes);
+    if (buf_len(stats->constants) == 0)
     {
-        result.maxAddress = (u32)maxAddress;
-    result.addressBits = log2_up(result.maxAddress);
+        buf_push(stats->constants, 0);
     }
-    fprintf(stdout, "Max addr: %u, addr bits: %u\n", result.maxAddress, result.addressBits);
+    stats->constantCount = buf_len(stats->constants);
+    stats->constantIndexBits = maximum(1, log2_up(stats->constantCount - 1));
     
-    result.opCodeCount = opCount;
-    result.opCodeBits = log2_up(opCount);
+    u32 romDepth = 1 << stats->opCodeBits;
+    u32 inlineField = maximum(stats->immediateBits, stats->addressBits);
+    u32 bankField = maximum(stats->constantIndexBits, stats->addressBits);
+    u32 inlineCost = romDepth * inlineField;
+    u32 bankCost = romDepth * bankField + stats->constantCount * stats->immediateBits;
     
-    result.opCodeBitWidth = result.selectBits * 4 + result.aluOpBits + maximum(result.immediateBits, result.addressBits) + result.addressBits + 3 + 1;
+    stats->immediateMode = requested;
+    if (stats->immediateMode == Immediate_Auto)
+    {
+        if ((bankField < inlineField) && (bankCost < inlineCost))
+        {
+            stats->immediateMode = Immediate_ConstantBank;
+        }
+        else
+        {
+            stats->immediateMode = Immediate_Inline;
+        }
+    }
     
-    return result;
+    fprintf(stdout, "Immediates: inline %u bits/opcode (%u bits), constant bank %u x %u bits "
+            "with %u bits/opcode (%u bits), using %s\n", inlineField, inlineCost,
+            stats->constantCount, stats->immediateBits, bankField, bankCost,
+            stats->immediateMode == Immediate_ConstantBank ? "constant bank" : "inline");
 }
 
-#if 0
-internal void
-push_opc(OpCodeBuilder *builder, OpCodeEntry *entry)
+internal inline b32
+uses_full_encoding(OpCodeStats *stats)
 {
-    i_expect(builder->opCodeCount < builder->maxOpCodes);
-    OpCodeEntry *op = builder->entries + builder->opCodeCount++;
-    *op = *entry;
-    // TODO(michiel): update stats
+    // NOTE(michiel): Hardware that has to run other programs than this one can't be pruned
+    // to it, it keeps the superset of inputs, operations and fields.
+    b32 result = (stats->romInit != RomInit_Inline) || (stats->core == Core_Generic);
+    return result;
 }
 
-internal inline u32
-get_register_address(Map *registerMap, String name, u32 *registerCount)
+internal void
+select_opcode_fields(OpCodeStats *stats, u32 opCount, OpCode *opCodes)
 {
-    u32 *result = map_get(registerMap, name.data);
-    if (!result)
+    // NOTE(michiel): Control fields with the same value in every opcode get hard-wired in the
+    // controller, fields that always equal an earlier one read its bits. Neither takes ROM
+    // bits. The cleared opcode at reset has to stay idle, so the fields that write the IO or
+    // the registers are only hard-wired when they are always off. With an init file every
+    // field is stored, the next program may need it.
+    i_expect(opCount);
+    b32 prune = !uses_full_encoding(stats);
+    u32 controlStart = get_offset_addr_a(stats) + stats->addressBits;
+    u32 offset = controlStart;
+    stats->fullOpCodeBitWidth = controlStart;
+    u32 storedCount = 0;
+    for (u32 field = 0; field < OpField_Count; ++field)
     {
-        i_expect(*registerCount < MAX_REG);
-        result = allocate_size(sizeof(u32), 0);
-        *result = (*registerCount)++;
-        map_put(registerMap, name.data, result);
-    }
-    i_expect(*result < REG_MAX);
+        OpCodeFieldInfo *info = stats->fields + field;
+        info->kind = OpFieldKind_Stored;
+        info->isBit = ((field == OpField_UseB) || (field == OpField_MemWrite) ||
+                       (field == OpField_MemReadB) || (field == OpField_MemReadA));
+        info->bits = info->isBit ? 1 : stats->selectBits;
+        u32 slot;
+        u32 index;
+        if (get_alu_field((OpCodeField)field, &slot, &index))
+        {
+            info->bits = (slot >= stats->aluCount) ? 0 : (index == 0) ? stats->aluOpBits : stats->selectBits;
+        }
+        stats->fullOpCodeBitWidth += info->bits;
+        
+        if (info->bits)
+        {
+            b32 sideEffect = (field == OpField_SelectIO) || (field == OpField_MemWrite);
+            u32 value = get_opcode_field_value(stats, opCodes, (OpCodeField)field);
+            b32 constant = prune && (!sideEffect || (value == 0));
+            for (u32 opIdx = 1; constant && (opIdx < opCount); ++opIdx)
+            {
+                constant = (get_opcode_field_value(stats, opCodes + opIdx, (OpCodeField)field) == value);
+            }
+            
+            if (constant)
+            {
+                info->kind = OpFieldKind_Constant;
+                info->value = value;
+            }
+            else if (prune)
+            {
+                for (u32 other = 0; other < field; ++other)
+                {
+                    OpCodeFieldInfo *otherInfo = stats->fields + other;
+                    if ((otherInfo->kind == OpFieldKind_Stored) && (otherInfo->bits == info->bits) &&
+                        (otherInfo->isBit == info->isBit))
+                    {
+                        b32 tied = true;
+                        for (u32 opIdx = 0; tied && (opIdx < opCount); ++opIdx)
+                        {
+                            tied = (get_opcode_field_value(stats, opCodes + opIdx, (OpCodeField)field) ==
+                                    get_opcode_field_value(stats, opCodes + opIdx, (OpCodeField)other));
+                        }
+                        if (tied)
+                        {
+                            info->kind = OpFieldKind_Tied;
+                            info->tiedTo = (OpCodeField)other;
+                            info->offset = otherInfo->offset;
+                            break;
+                        }
+                    }
+                }
+            }
+            
+            if (info->kind == OpFieldKind_Stored)
+            {
+                info->offset = offset;
+                offset += info->bits;
+                ++storedCount;
+            }
+        }
+    }
+    
+    if (storedCount == 0)
+    {
+        // NOTE(michiel): Keeps a control word, the dictionary ROM splits on it
+        OpCodeFieldInfo *info = stats->fields + OpField_AluOp;
+        info->kind = OpFieldKind_Stored;
+        info->offset = offset;
+        offset += info->bits;
+    }
+    stats->opCodeBitWidth = offset;
+    
+    fprintf(stdout, "Opcode fields: %u bits, %u with every field stored", stats->opCodeBitWidth,
+            stats->fullOpCodeBitWidth);
+    b32 first = true;
+    for (u32 field = 0; field < OpField_Count; ++field)
+    {
+        OpCodeFieldInfo *info = stats->fields + field;
+        if (info->bits && (info->kind != OpFieldKind_Stored))
+        {
+            fprintf(stdout, "%s%s", first ? " (" : ", ", gOpFieldNames[field]);
+            if (info->kind == OpFieldKind_Constant)
+            {
+                fprintf(stdout, " = %u", info->value);
+            }
+            else
+            {
+                fprintf(stdout, " = %s", gOpFieldNames[info->tiedTo]);
+            }
+            first = false;
+        }
+    }
+    fprintf(stdout, "%s\n", first ? "" : ")");
+}
+
+internal OpCodeStats
+get_opcode_stats(u32 opCount, OpCode *opCodes, HardwareLoop *loop, u32 bitWidth,
+                 CompileOptions *options)
+{
+    OpCodeStats result = {0};
+    
+    result.bitWidth = bitWidth;
+    result.pipeline = options->pipeline;
+    result.romInit = options->romInit;
+    result.core = options->core;
+    result.aluCount = options->aluCount;
+    i_expect(result.aluCount > 0);
+    i_expect(result.aluCount <= MAX_ALU_COUNT);
+    
+    opc_collect_field_usage(&result, opCount, opCodes);
+    if (uses_full_encoding(&result))
+    {
+        u32 allSelects = (1 << (Select_Alu + result.aluCount)) - 1;
+        result.memSelects = allSelects;
+        result.ioSelects = allSelects;
+        for (u32 slot = 0; slot < result.aluCount; ++slot)
+        {
+            result.aluSelectsA[slot] = allSelects;
+            result.aluSelectsB[slot] = allSelects;
+        }
+        result.aluOps = (1 << Alu_Count) - 1;
+        if (!result.pipeline.mulStages)
+        {
+            result.aluOps &= ~(1 << Alu_Mul);
+        }
+    }
+    u32 selects = result.memSelects | result.ioSelects;
+    for (u32 slot = 0; slot < result.aluCount; ++slot)
+    {
+        selects |= result.aluSelectsA[slot] | result.aluSelectsB[slot];
+    }
+    u32 selectCount = get_dense_codes(selects, Select_Count, result.selectCodes);
+    u32 aluOpCount = get_dense_codes(result.aluOps, Alu_Count, result.aluOpCodes);
+    result.maxSelect = selectCount - 1;
+    result.selectBits = maximum(1, log2_up(result.maxSelect));
+    result.maxAluOp = aluOpCount ? aluOpCount - 1 : 0;
+    result.aluOpBits = maximum(1, log2_up(result.maxAluOp));
+    
+    result.immediateBits = minimum(opc_immediate_bits(opCount, opCodes), bitWidth);
+    result.maxImmediate = (u32)((1ULL << result.immediateBits) - 1);
+    
+    s32 maxAddress = opc_max_address(opCount, opCodes);
+    if (maxAddress < 0)
+    {
+        result.maxAddress = 0;
+        result.addressBits = 0;
+    }
+    else if (maxAddress == 0)
+    {
+        result.maxAddress = 0;
+        result.addressBits = 1;
+    }
+    else
+    {
+        result.maxAddress = (u32)maxAddress;
+    result.addressBits = log2_up(result.maxAddress);
+    }
+    fprintf(stdout, "Max addr: %u, addr bits: %u\n", result.maxAddress, result.addressBits);
+    
+    // NOTE(michiel): The ROM only holds the first iteration of a hardware loop
+    result.loop = *loop;
+    result.opCodeCount = opCount - get_loop_saved_opcodes(loop);
+    result.opCodeBits = log2_up(result.opCodeCount);
+    
+    if (result.core == Core_Generic)
+    {
+        result.fitsCore = ((result.opCodeCount <= (1 << GENERIC_PC_BITS)) &&
+                           (result.addressBits <= GENERIC_ADDRESS_BITS) &&
+                           (result.immediateBits <= GENERIC_IMMEDIATE_BITS));
+        result.bitWidth = MAX_DATAPATH_BITS;
+        result.immediateBits = GENERIC_IMMEDIATE_BITS;
+        result.maxImmediate = (u32)((1ULL << GENERIC_IMMEDIATE_BITS) - 1);
+        result.addressBits = GENERIC_ADDRESS_BITS;
+        result.opCodeBits = GENERIC_PC_BITS;
+    }
+    
+    // NOTE(michiel): A constant bank would put program data in the HDL, with an init file or
+    // a loader the immediates stay in the ROM word.
+    select_immediate_mode(&result, opCount, opCodes,
+                          uses_full_encoding(&result) ? Immediate_Inline : options->immediateMode);
+    
+    select_opcode_fields(&result, opCount, opCodes);
+    
+    return result;
+}
+
+#if 0
+internal void
+push_opc(OpCodeBuilder *builder, OpCodeEntry *entry)
+{
+    i_expect(builder->opCodeCount < builder->maxOpCodes);
+    OpCodeEntry *op = builder->entries + builder->opCodeCount++;
+    *op = *entry;
+    // TODO(michiel): update stats
+}
+
+internal inline u32
+get_register_address(Map *registerMap, String name, u32 *registerCount)
+{
+    u32 *result = map_get(registerMap, name.data);
+    if (!result)
+    {
+        i_expect(*registerCount < MAX_REG);
+        result = allocate_size(sizeof(u32), 0);
+        *result = (*registerCount)++;
+        map_put(registerMap, name.data, result);
+    }
+    i_expect(*result < REG_MAX);
     return *result;
 }
 
@@ -768,6 +1555,310 @@ push_assignment(Assignment *assign, OpCode **opCodes)
     buf_push(*opCodes, store);
 }
 
+internal void
+print_usage(char *program)
+{
+    fprintf(stderr, "Usage: %s [options] <input-file>\n", program);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -rom=auto|flat|dict    Opcode ROM layout, auto picks the smallest (default auto)\n");
+    fprintf(stderr, "  -rom-init=inline|file|update  ROM contents in the VHDL or in gen_opcodes.mem, update only rewrites the HDL if its shape changed (default inline)\n");
+    fprintf(stderr, "  -core=program|generic  Generic emits a fixed core with microcode RAM and gen_microcode.bin to load over its IO port (default program)\n");
+    fprintf(stderr, "  -imm=auto|inline|bank  Immediates in the opcode or in a constant bank (default auto)\n");
+    fprintf(stderr, "  -alus=N                Number of ALUs, more than one makes a VLIW core (default 1, max %u)\n", MAX_ALU_COUNT);
+    fprintf(stderr, "  -sched=classic|list|modulo  Opcode scheduler, VLIW and pipelined cores use list at least (default classic)\n");
+    fprintf(stderr, "  -pipe=N                Extra pipeline stages: 1 decode, 2 +operands, 3-%u +ALU stages (default 0)\n", MAX_ALU_STAGES + 1);
+    fprintf(stderr, "  -mul=N                 Multiplier register stages, only built when the program multiplies (default 1, max %u)\n", MAX_MUL_STAGES);
+    fprintf(stderr, "  -loops=on|off          Replay repeated opcode sequences with a hardware loop (default on)\n");
+    fprintf(stderr, "  -backend=cpu|dataflow  Dataflow emits a circuit taking a sample per clock for stateless programs (default cpu)\n");
+    fprintf(stderr, "  -io-bits=N             Width of the IO input, the datapath width is inferred from it (default 32)\n");
+    fprintf(stderr, "  -sim=N                 Simulate N clock ticks with the inputs 1 to 15 (default off)\n");
+    fprintf(stderr, "  -sim-engine=ref|fast|native  Fast predecodes the opcodes for long runs, native compiles them with $CC (default ref)\n");
+    fprintf(stderr, "  -sim-trace=on|off      Print every IO output of the fast, native and batch engines, else only their count and hash (default on)\n");
+    fprintf(stderr, "  -sim-lanes=N           Simulate N independent input streams at once, lane 0 gets the regular inputs (multiple of %u, max %u)\n",
+            BATCH_VECTOR_LANES, MAX_BATCH_LANES);
+    fprintf(stderr, "  -vcd=FILE              Write a VCD wave of the simulation with the signal names of gen_cpu.vhd, uses the ref engine\n");
+    fprintf(stderr, "  -vcd-window=A:B        Only dump ticks A up to B, an empty B is the end of the run (default all)\n");
+    fprintf(stderr, "  -vcd-signals=LIST      Only dump the comma separated signals, name* matches a prefix (default all)\n");
+    fprintf(stderr, "  -cosim                 Write gen_tb_cpu.vhd with the stimulus and expected outputs of -sim for GHDL, uses the ref engine\n");
+    fprintf(stderr, "  -sim-in=FILE           Simulate on the samples of a file, pipe or - for stdin until they run out, -sim=N stops earlier\n");
+    fprintf(stderr, "  -sim-out=FILE          Write the IO outputs of a -sim-in run to a file or pipe\n");
+    fprintf(stderr, "  -sim-format=s8|s16|s32|text  Samples of -sim-in and -sim-out, binary ones are little-endian (default s32)\n");
+    fprintf(stderr, "  -sim-rate=N            The -sim-in source toggles load every N ticks, 0 keeps up with the core (default 0)\n");
+    fprintf(stderr, "  -synced                The controller waits at pc 0 for a new input sample\n");
+    fprintf(stderr, "  -sim-profile=FILE      Print the datapath utilization of the simulation and write it as JSON, uses the ref or fast engine\n");
+    fprintf(stderr, "  -sim-save=FILE         Write a checkpoint of the simulator state at the end of the run\n");
+    fprintf(stderr, "  -sim-load=FILE         Start the simulation from a checkpoint, -sim=N stays the tick it ends at\n");
+    fprintf(stderr, "  -sim-skip=N            Fast-forward to tick N without tracing, then simulate the rest with the chosen engine\n");
+    fprintf(stderr, "                         With -sim-in the skipped outputs are not written to -sim-out\n");
+    fprintf(stderr, "  -sim-skip-outputs=N    Fast-forward until N outputs were written, or -sim-skip is reached\n");
+    fprintf(stderr, "  -golden=N              Evaluate the unoptimized source on N samples of the inputs 1 to 15 or of -sim-in, 0 is the whole stream\n");
+    fprintf(stderr, "  -golden-out=FILE       Write the outputs of the golden model in the -sim-format\n");
+}
+
+internal b32
+parse_options(int argc, char **argv, CompileOptions *options)
+{
+    b32 result = true;
+    
+    for (s32 argIdx = 1; argIdx < argc; ++argIdx)
+    {
+        char *arg = argv[argIdx];
+        if (arg[0] == '-')
+        {
+            if (strcmp(arg, "-rom=auto") == 0)
+            {
+                options->romLayout = RomLayout_Auto;
+            }
+            else if (strcmp(arg, "-rom=flat") == 0)
+            {
+                options->romLayout = RomLayout_Flat;
+            }
+            else if (strcmp(arg, "-rom=dict") == 0)
+            {
+                options->romLayout = RomLayout_Dictionary;
+            }
+            else if (strcmp(arg, "-rom-init=inline") == 0)
+            {
+                options->romInit = RomInit_Inline;
+            }
+            else if (strcmp(arg, "-rom-init=file") == 0)
+            {
+                options->romInit = RomInit_File;
+            }
+            else if (strcmp(arg, "-rom-init=update") == 0)
+            {
+                options->romInit = RomInit_Update;
+            }
+            else if (strcmp(arg, "-core=program") == 0)
+            {
+                options->core = Core_Program;
+            }
+            else if (strcmp(arg, "-core=generic") == 0)
+            {
+                options->core = Core_Generic;
+            }
+            else if (strcmp(arg, "-imm=auto") == 0)
+            {
+                options->immediateMode = Immediate_Auto;
+            }
+            else if (strcmp(arg, "-imm=inline") == 0)
+            {
+                options->immediateMode = Immediate_Inline;
+            }
+            else if (strcmp(arg, "-imm=bank") == 0)
+            {
+                options->immediateMode = Immediate_ConstantBank;
+            }
+            else if (strncmp(arg, "-alus=", 6) == 0)
+            {
+                options->aluCount = atoi(arg + 6);
+                if ((options->aluCount == 0) || (options->aluCount > MAX_ALU_COUNT))
+                {
+                    fprintf(stderr, "ALU count should be between 1 and %u\n", MAX_ALU_COUNT);
+                    result = false;
+                }
+            }
+            else if (strcmp(arg, "-sched=classic") == 0)
+            {
+                options->scheduler = Scheduler_Classic;
+            }
+            else if (strcmp(arg, "-sched=list") == 0)
+            {
+                options->scheduler = Scheduler_List;
+            }
+            else if (strcmp(arg, "-sched=modulo") == 0)
+            {
+                options->scheduler = Scheduler_Modulo;
+            }
+            else if (strncmp(arg, "-pipe=", 6) == 0)
+            {
+                // NOTE(michiel): Stages get added from the ROM towards the ALU output, every
+                // stage after the decode stage adds a cycle of ALU latency.
+                u32 depth = atoi(arg + 6);
+                if (depth > MAX_ALU_STAGES + 1)
+                {
+                    fprintf(stderr, "Pipeline depth should be between 0 and %u\n", MAX_ALU_STAGES + 1);
+                    result = false;
+                }
+                else
+                {
+                    options->pipeline.decodeStage = depth >= 1;
+                    options->pipeline.operandStage = depth >= 2;
+                    options->pipeline.aluStages = depth >= 2 ? depth - 1 : 1;
+                }
+            }
+            else if (strncmp(arg, "-mul=", 5) == 0)
+            {
+                options->pipeline.mulStages = atoi(arg + 5);
+                if ((options->pipeline.mulStages == 0) || (options->pipeline.mulStages > MAX_MUL_STAGES))
+                {
+                    fprintf(stderr, "Multiplier stages should be between 1 and %u\n", MAX_MUL_STAGES);
+                    result = false;
+                }
+            }
+            else if (strcmp(arg, "-backend=cpu") == 0)
+            {
+                options->backend = Backend_Cpu;
+            }
+            else if (strcmp(arg, "-backend=dataflow") == 0)
+            {
+                options->backend = Backend_Dataflow;
+            }
+            else if (strcmp(arg, "-loops=on") == 0)
+            {
+                options->hardwareLoops = true;
+            }
+            else if (strcmp(arg, "-loops=off") == 0)
+            {
+                options->hardwareLoops = false;
+            }
+            else if (strncmp(arg, "-io-bits=", 9) == 0)
+            {
+                options->ioInputBits = atoi(arg + 9);
+                if ((options->ioInputBits == 0) || (options->ioInputBits > MAX_DATAPATH_BITS))
+                {
+                    fprintf(stderr, "IO width should be between 1 and %u bits\n", MAX_DATAPATH_BITS);
+                    result = false;
+                }
+            }
+            else if (strncmp(arg, "-sim=", 5) == 0)
+            {
+                options->simulateTicks = atoi(arg + 5);
+            }
+            else if (strcmp(arg, "-sim-engine=ref") == 0)
+            {
+                options->simEngine = SimEngine_Reference;
+            }
+            else if (strcmp(arg, "-sim-engine=fast") == 0)
+            {
+                options->simEngine = SimEngine_Fast;
+            }
+            else if (strcmp(arg, "-sim-engine=native") == 0)
+            {
+                options->simEngine = SimEngine_Native;
+            }
+            else if (strcmp(arg, "-sim-trace=on") == 0)
+            {
+                options->simTrace = true;
+            }
+            else if (strcmp(arg, "-sim-trace=off") == 0)
+            {
+                options->simTrace = false;
+            }
+            else if (strncmp(arg, "-sim-lanes=", 11) == 0)
+            {
+                options->simLanes = atoi(arg + 11);
+                if ((options->simLanes == 0) || (options->simLanes > MAX_BATCH_LANES) ||
+                    (options->simLanes % BATCH_VECTOR_LANES))
+                {
+                    fprintf(stderr, "Lane count should be a multiple of %u up to %u\n",
+                            BATCH_VECTOR_LANES, MAX_BATCH_LANES);
+                    result = false;
+                }
+            }
+            else if (strncmp(arg, "-vcd=", 5) == 0)
+            {
+                options->vcdFile = arg + 5;
+            }
+            else if (strncmp(arg, "-vcd-window=", 12) == 0)
+            {
+                char *end = strchr(arg + 12, ':');
+                options->vcdStart = atoi(arg + 12);
+                options->vcdEnd = end ? atoi(end + 1) : 0;
+                if (!end || (options->vcdEnd && (options->vcdEnd <= options->vcdStart)))
+                {
+                    fprintf(stderr, "VCD window should be START:END with END after START\n");
+                    result = false;
+                }
+            }
+            else if (strncmp(arg, "-vcd-signals=", 13) == 0)
+            {
+                options->vcdSignals = arg + 13;
+            }
+            else if (strcmp(arg, "-cosim") == 0)
+            {
+                options->cosim = true;
+            }
+            else if (strncmp(arg, "-sim-in=", 8) == 0)
+            {
+                options->simIn = arg + 8;
+            }
+            else if (strncmp(arg, "-sim-out=", 9) == 0)
+            {
+                options->simOut = arg + 9;
+            }
+            else if (strncmp(arg, "-sim-format=", 12) == 0)
+            {
+                if (!parse_sim_stream_format(arg + 12, &options->simFormat))
+                {
+                    fprintf(stderr, "Sample format should be s8, s16, s32 or text\n");
+                    result = false;
+                }
+            }
+            else if (strncmp(arg, "-sim-rate=", 10) == 0)
+            {
+                options->simRate = atoi(arg + 10);
+            }
+            else if (strcmp(arg, "-synced") == 0)
+            {
+                options->synced = true;
+            }
+            else if (strncmp(arg, "-sim-profile=", 13) == 0)
+            {
+                options->simProfile = arg + 13;
+            }
+            else if (strncmp(arg, "-sim-save=", 10) == 0)
+            {
+                options->simSave = arg + 10;
+            }
+            else if (strncmp(arg, "-sim-load=", 10) == 0)
+            {
+                options->simLoad = arg + 10;
+            }
+            else if (strncmp(arg, "-sim-skip=", 10) == 0)
+            {
+                options->simSkip = atoi(arg + 10);
+            }
+            else if (strncmp(arg, "-sim-skip-outputs=", 18) == 0)
+            {
+                options->simSkipOutputs = atoi(arg + 18);
+            }
+            else if (strncmp(arg, "-golden=", 8) == 0)
+            {
+                options->golden = true;
+                options->goldenSamples = atoi(arg + 8);
+            }
+            else if (strncmp(arg, "-golden-out=", 12) == 0)
+            {
+                options->golden = true;
+                options->goldenOut = arg + 12;
+            }
+            else
+            {
+                fprintf(stderr, "Unknown option: %s\n", arg);
+                result = false;
+            }
+        }
+        else if (!options->sourceFile)
+        {
+            options->sourceFile = arg;
+        }
+        else
+        {
+            fprintf(stderr, "Only one input file is supported, got %s and %s\n",
+                    options->sourceFile, arg);
+            result = false;
+        }
+    }
+    
+    if (!options->sourceFile)
+    {
+        result = false;
+    }
+    
+    return result;
+}
+
 int main(int argc, char **argv)
 {
     // TODO(michiel): ROM Tables
@@ -778,19 +1869,39 @@ int main(int argc, char **argv)
     outputStream.file = stdout;
     // outputStream.verbose = true;
     
-    if (argc == 2)
+    CompileOptions options = {0};
+    options.hardwareLoops = true;
+    options.aluCount = 1;
+    options.pipeline.aluStages = 1;
+    options.pipeline.mulStages = 1;
+    options.ioInputBits = MAX_DATAPATH_BITS;
+    options.simTrace = true;
+    options.simFormat = SimStream_S32;
+    if (parse_options(argc, argv, &options))
     {
-        //fprintf(stdout, "Tokenize file: %s\n", argv[1]);
+        //fprintf(stdout, "Tokenize file: %s\n", options.sourceFile);
         
-        Token *tokens = tokenize_file(argv[1]);
+        Token *tokens = tokenize_file(options.sourceFile);
         if (tokens)
         {
             graph_tokens(tokens, "tokens.dot");
             StmtList *stmts = ast_from_tokens(tokens);
+            // NOTE(michiel): The optimizer rewrites the statements, the golden model keeps
+            // its own copy of what the source says
+            GoldenProgram golden = {0};
+            if (options.golden)
+            {
+                golden = golden_compile(stmts);
+            }
             
             AstOptimizer astOptimizer = {0};
             astOptimizer.statements = *stmts;
             ast_optimize(&astOptimizer);
+            if (!ast_uses_multiplier(&astOptimizer) && (options.core != Core_Generic))
+            {
+                // NOTE(michiel): Keeps the multiplier and its latency out of the core
+                options.pipeline.mulStages = 0;
+            }
             graph_ast(&astOptimizer.statements, "ast.dot");
             //print_ast((FileStream){.file=stdout}, stmts);
             generate_ir(&astOptimizer, (FileStream){.file=stdout});
@@ -810,25 +1921,285 @@ int main(int argc, char **argv)
             // see generate_ir for proper handling of nested expressions
             OpCodeBuilder builder = {0};
             
-            generate_opcodes(&builder, &astOptimizer);
-            //print_opcodes(buf_len(builder.entries), builder.entries);
+            OpCode *opCodes = 0;
+            // NOTE(michiel): The classic layout only knows a single cycle ALU latency
+            u32 aluLatency = get_alu_latency(&options.pipeline);
+            ModuloKernel kernel = {0};
+            if ((options.scheduler != Scheduler_Classic) || (options.aluCount > 1) || (aluLatency > 1))
+            {
+                SchedConfig schedConfig = {0};
+                schedConfig.aluCount = options.aluCount;
+                schedConfig.aluLatency = aluLatency;
+                schedConfig.modulo = options.scheduler == Scheduler_Modulo;
+                SchedProgram program = sched_build_program(&builder, &astOptimizer);
+                print_schedule_report(outputStream, &program, schedConfig);
+                opCodes = schedule_program(&program, schedConfig, &builder.registerCount, &kernel);
+            }
+            else
+            {
+                generate_opcodes(&builder, &astOptimizer);
+                //print_opcodes(buf_len(builder.entries), builder.entries);
+                
+                opCodes = layout_instructions(&builder);
+                kernel.interval = buf_len(opCodes);
+                kernel.stageCount = 1;
+                kernel.copyCount = 1;
+            }
+            print_modulo_kernel(outputStream, &kernel);
+            
+            RangeAnalysis ranges = analyse_value_ranges(&astOptimizer, options.ioInputBits);
+            print_value_ranges(outputStream, &ranges);
             
-            OpCode *opCodes = layout_instructions(&builder);
+            HardwareLoop loop = {0};
+            // NOTE(michiel): The loop registers of the generic core would be program data
+            if (options.hardwareLoops && (options.core != Core_Generic))
+            {
+                loop = find_hardware_loop(buf_len(opCodes), opCodes, kernel.start);
+            }
+            print_hardware_loop(outputStream, &loop);
+            OpCode *romOpCodes = compress_hardware_loop(&loop, buf_len(opCodes), opCodes);
             
-             builder.stats = get_opcode_stats(buf_len(opCodes), opCodes, 32);
-            builder.stats.synced = false;
+            builder.stats = get_opcode_stats(buf_len(opCodes), opCodes, &loop, ranges.maxValueBits,
+                                             &options);
+            builder.stats.kernel = kernel;
+            builder.stats.synced = options.synced;
             
             fprintf(stdout, "Stats:\n");
             fprintf(stdout, "  SEL: Max = %u, Bits = %u\n", builder.stats.maxSelect, builder.stats.selectBits);
             fprintf(stdout, "  ALU: Max = %u, Bits = %u\n", builder.stats.maxAluOp, builder.stats.aluOpBits);
             fprintf(stdout, "  IMM: Max = %u, Bits = %u\n", builder.stats.maxImmediate, builder.stats.immediateBits);
+            if (builder.stats.immediateMode == Immediate_ConstantBank)
+            {
+                fprintf(stdout, "  CON: Max = %u, Bits = %u\n", builder.stats.constantCount - 1, builder.stats.constantIndexBits);
+            }
             fprintf(stdout, "  ADR: Max = %u, Bits = %u\n", builder.stats.maxAddress, builder.stats.addressBits);
+            fprintf(stdout, "  PIP: Decode = %s, Operands = %s, ALU stages = %u, Multiplier stages = %u, ALU latency = %u\n",
+                    builder.stats.pipeline.decodeStage ? "on" : "off",
+                    builder.stats.pipeline.operandStage ? "on" : "off",
+                    builder.stats.pipeline.aluStages, builder.stats.pipeline.mulStages, aluLatency);
+            
+            // NOTE(michiel): A block RAM holds whole opcodes, the dictionary only saves LUTs
+            builder.stats.romLayout = select_rom_layout(&builder.stats, romOpCodes,
+                                                        uses_full_encoding(&builder.stats) ?
+                                                        RomLayout_Flat : options.romLayout);
+            
+            Dataflow dataflow = build_dataflow(&astOptimizer, options.pipeline.mulStages);
+            print_dataflow_report(outputStream, &dataflow, &builder.stats);
+            b32 spatial = ((options.backend == Backend_Dataflow) && dataflow.stateless &&
+                           (options.core != Core_Generic));
 
-#if 0            
-            u32 inputs[] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
-            simulate(&builder.stats, buf_len(opCodes), opCodes, array_count(inputs), inputs,
-                     100);
-            #endif
+            // NOTE(michiel): The simulators run the ROM as the controller walks it, so the
+            // hardware loop gets checked along with everything else.
+            OpCode *simOpCodes = replay_hardware_loop(&loop, buf_len(romOpCodes), romOpCodes,
+                                                      builder.stats.addressBits);
+            if (!check_hardware_loop(buf_len(opCodes), opCodes, buf_len(simOpCodes), simOpCodes))
+            {
+                errors = 1;
+            }
+            
+            if (options.simulateTicks || options.simIn)
+            {
+                u32 inputs[] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
+                SimProfile profile = {0};
+                SimProfile *profiling = 0;
+                if (options.simProfile && !spatial)
+                {
+                    sim_profile_init(&profile, buf_len(simOpCodes));
+                    profiling = &profile;
+                }
+
+                // NOTE(michiel): A checkpoint is taken by every run that loads, saves or
+                // fast-forwards, the ref, fast and stream engines start from it.
+                SimCheckpoint checkpoint = {0};
+                SimCheckpoint *resuming = 0;
+                b32 running = true;
+                if ((options.simSave || options.simLoad || options.simSkip || options.simSkipOutputs) && !spatial)
+                {
+                    resuming = &checkpoint;
+                    if (options.simLoad)
+                    {
+                        running = sim_checkpoint_load(&builder.stats, buf_len(simOpCodes), simOpCodes, &checkpoint,
+                                                      options.simLoad);
+                    }
+                    if (options.cosim)
+                    {
+                        fprintf(stderr, "The co-simulation testbench starts from reset, it is not made for a resumed run\n");
+                        options.cosim = false;
+                    }
+                    // NOTE(michiel): A stream can't be read twice, simulate_stream fast-forwards
+                    // over it by itself
+                    if (running && !options.simIn && (options.simSkip || options.simSkipOutputs))
+                    {
+                        simulate_forward(&builder.stats, buf_len(simOpCodes), simOpCodes, array_count(inputs), inputs,
+                                         &checkpoint, options.simSkip ? options.simSkip : options.simulateTicks,
+                                         options.simSkipOutputs);
+                    }
+                    errors = running ? errors : 1;
+                }
+                
+                if (spatial)
+                {
+                    simulate_dataflow(&builder.stats, &dataflow, array_count(inputs), inputs,
+                                      options.simulateTicks);
+                    if (options.cosim || options.simIn || options.simProfile ||
+                        options.simSave || options.simLoad || options.simSkip || options.simSkipOutputs)
+                    {
+                        fprintf(stderr, "The co-simulation testbench, sample streams, profiles and checkpoints are only made for the CPU, not the spatial dataflow core\n");
+                    }
+                }
+                else if (!running)
+                {
+                    // NOTE(michiel): Nothing to resume from
+                }
+                else if (options.simIn)
+                {
+                    SimStream input = {0};
+                    SimStream output = {0};
+                    if (sim_stream_open_input(&input, options.simIn, options.simFormat) &&
+                        (!options.simOut || sim_stream_open_output(&output, options.simOut, options.simFormat,
+                                                                   builder.stats.bitWidth)))
+                    {
+                        simulate_stream(&builder.stats, buf_len(simOpCodes), simOpCodes, &input,
+                                        options.simOut ? &output : 0,
+                                        options.simulateTicks ? options.simulateTicks : U64_MAX, options.simRate,
+                                        profiling, resuming, options.simSkip, options.simSkipOutputs);
+                    }
+                    else
+                    {
+                        errors = 1;
+                    }
+                    if (input.file)
+                    {
+                        sim_stream_close(&input);
+                    }
+                    if (output.file)
+                    {
+                        sim_stream_close(&output);
+                    }
+                }
+                else if (options.vcdFile || options.cosim)
+                {
+                    VcdWriter vcd = {0};
+                    SimRecord record = {0};
+                    b32 dumping = options.vcdFile && vcd_open(&vcd, options.vcdFile, options.vcdStart,
+                                                              options.vcdEnd, options.vcdSignals);
+                    if (dumping)
+                    {
+                        sim_vcd_signals(&builder.stats, &vcd);
+                    }
+                    else if (options.vcdFile)
+                    {
+                        errors = 1;
+                    }
+                    simulate(&builder.stats, buf_len(simOpCodes), simOpCodes, array_count(inputs), inputs,
+                             options.simulateTicks, dumping ? &vcd : 0, options.cosim ? &record : 0, profiling,
+                             resuming);
+                    if (dumping)
+                    {
+                        fprintf(stdout, "VCD: %llu changes written to %s\n",
+                                (unsigned long long)vcd.changeCount, options.vcdFile);
+                        vcd_close(&vcd);
+                    }
+                    if (options.cosim)
+                    {
+                        if (builder.stats.core == Core_Program)
+                        {
+                            sim_write_record(&builder.stats, record.inputs, "gen_stimulus.txt");
+                            sim_write_record(&builder.stats, record.outputs, "gen_expected.txt");
+                            FileStream tbStream = {0};
+                            tbStream.file = fopen("gen_tb_cpu.vhd", "wb");
+                            generate_cosim_testbench(&builder.stats, tbStream);
+                            fclose(tbStream.file);
+                            fprintf(stdout, "Co-simulation: %u samples, %u expected outputs for gen_tb_cpu.vhd\n",
+                                    buf_len(record.inputs) / 2, buf_len(record.outputs) / 2);
+                        }
+                        else
+                        {
+                            fprintf(stderr, "The co-simulation testbench needs a program core, the generic core loads its microcode first\n");
+                        }
+                        buf_free(record.inputs);
+                        buf_free(record.outputs);
+                    }
+                }
+                else if (options.simLanes && !profiling && !resuming)
+                {
+                    // NOTE(michiel): Only the ref and fast engines count opcodes and take
+                    // checkpoints, a profile or checkpoint runs on one of those.
+                    u32 *laneInputs = batch_lane_inputs(options.simLanes, array_count(inputs), inputs);
+                    simulate_batch(&builder.stats, buf_len(simOpCodes), simOpCodes, options.simLanes,
+                                   array_count(inputs), laneInputs, options.simulateTicks, options.simTrace);
+                    deallocate(laneInputs);
+                }
+                else if ((options.simEngine == SimEngine_Native) && !profiling && !resuming &&
+                         simulate_native(&builder.stats, buf_len(simOpCodes), simOpCodes, array_count(inputs),
+                                         inputs, options.simulateTicks, options.simTrace))
+                {
+                    // NOTE(michiel): Without a C compiler the fast engine runs instead
+                }
+                else if (options.simEngine != SimEngine_Reference)
+                {
+                    simulate_fast(&builder.stats, buf_len(simOpCodes), simOpCodes, array_count(inputs), inputs,
+                                  options.simulateTicks, options.simTrace, profiling, resuming);
+                }
+                else
+                {
+                    simulate(&builder.stats, buf_len(simOpCodes), simOpCodes, array_count(inputs), inputs,
+                             options.simulateTicks, 0, 0, profiling, resuming);
+                }
+                
+                if (options.simSave && checkpoint.state.registers &&
+                    !sim_checkpoint_save(&builder.stats, buf_len(simOpCodes), simOpCodes, &checkpoint, options.simSave))
+                {
+                    errors = 1;
+                }
+                sim_checkpoint_free(&checkpoint);
+                if (profiling)
+                {
+                    if (running)
+                    {
+                        sim_profile_report(&builder.stats, buf_len(simOpCodes), simOpCodes, profiling,
+                                           options.sourceFile, options.simProfile);
+                    }
+                    sim_profile_free(profiling);
+                }
+            }
+
+            if (options.golden)
+            {
+                u32 inputs[] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
+                SimStream input = {0};
+                SimStream output = {0};
+                if (!golden.valid)
+                {
+                    errors = 1;
+                }
+                else if (!options.simIn && !options.goldenSamples)
+                {
+                    fprintf(stderr, "The golden model needs a sample count for the inputs 1 to 15\n");
+                    errors = 1;
+                }
+                else if ((!options.simIn || sim_stream_open_input(&input, options.simIn, options.simFormat)) &&
+                         (!options.goldenOut || sim_stream_open_output(&output, options.goldenOut, options.simFormat,
+                                                                       MAX_DATAPATH_BITS)))
+                {
+                    simulate_golden(&golden, array_count(inputs), inputs,
+                                    options.simIn ? &input : 0, options.goldenOut ? &output : 0,
+                                    options.goldenSamples, options.simTrace && !options.goldenOut);
+                }
+                else
+                {
+                    errors = 1;
+                }
+                if (input.file)
+                {
+                    sim_stream_close(&input);
+                }
+                if (output.file)
+                {
+                    sim_stream_close(&output);
+                }
+                golden_free(&golden);
+            }
             
 #if 0
             FileStream printStream = {0};
@@ -844,28 +2215,94 @@ int main(int argc, char **argv)
             //save_graph("opcodes.dot", gRegisterCount, buf_len(opCodes), opCodes);
             
             FileStream opCodeStream = {0};
-            opCodeStream.file = fopen("gen_opcodes.vhd", "wb");
-            generate_opcode_vhdl(&builder.stats, opCodes, opCodeStream);
-            fclose(opCodeStream.file);
-            
-            opCodeStream.file = fopen("gen_controller.vhd", "wb");
-            generate_controller(&builder.stats, opCodeStream);
-            fclose(opCodeStream.file);
-            
-            opCodeStream.file = fopen("gen_constants.vhd", "wb");
-            generate_constants(&builder.stats, opCodeStream);
-            fclose(opCodeStream.file);
-            
-            if (builder.stats.addressBits > 0)
+            if (spatial)
             {
-            opCodeStream.file = fopen("gen_registers.vhd", "wb");
-            generate_registers(&builder.stats, opCodeStream);
-            fclose(opCodeStream.file);
+                opCodeStream.file = fopen("gen_dataflow.vhd", "wb");
+                generate_dataflow_vhdl(&builder.stats, &dataflow, opCodeStream);
+                fclose(opCodeStream.file);
             }
-            
-            opCodeStream.file = fopen("gen_cpu.vhd", "wb");
-            generate_cpu_main(&builder.stats, opCodeStream);
-            fclose(opCodeStream.file);
+            else if ((options.core == Core_Generic) && !builder.stats.fitsCore)
+            {
+                fprintf(stderr, "The program doesn't fit the generic core, it takes at most %u opcodes, "
+                        "%u registers and %u bit immediates\n", 1 << GENERIC_PC_BITS,
+                        1 << GENERIC_ADDRESS_BITS, GENERIC_IMMEDIATE_BITS);
+                errors = 1;
+            }
+            else
+            {
+                HdlFile *hdlFiles = 0;
+                opCodeStream = hdl_file_open(&hdlFiles, "gen_opcodes.vhd");
+                generate_opcode_vhdl(&builder.stats, romOpCodes, opCodeStream);
+                opCodeStream = hdl_file_open(&hdlFiles, "gen_controller.vhd");
+                generate_controller(&builder.stats, opCodeStream);
+                opCodeStream = hdl_file_open(&hdlFiles, "gen_constants.vhd");
+                generate_constants(&builder.stats, opCodeStream);
+                if (builder.stats.addressBits > 0)
+                {
+                    opCodeStream = hdl_file_open(&hdlFiles, "gen_registers.vhd");
+                    generate_registers(&builder.stats, opCodeStream);
+                }
+                opCodeStream = hdl_file_open(&hdlFiles, "gen_alu.vhd");
+                generate_alu(&builder.stats, opCodeStream);
+                opCodeStream = hdl_file_open(&hdlFiles, "gen_cpu.vhd");
+                generate_cpu_main(&builder.stats, opCodeStream);
+                
+                if (options.romInit == RomInit_Inline)
+                {
+                    hdl_write_files(hdlFiles);
+                }
+                else
+                {
+                    opCodeStream.file = fopen("gen_opcodes.mem", "wb");
+                    generate_opcode_init_file(&builder.stats, romOpCodes, opCodeStream);
+                    fclose(opCodeStream.file);
+                    
+                    // NOTE(michiel): The shape key of the previous run tells if its synthesized
+                    // design can take the new init file as is.
+                    u64 shapeKey = hdl_shape_key(hdlFiles);
+                    u64 oldShapeKey = 0;
+                    b32 hasOldShape = false;
+                    if (options.romInit == RomInit_Update)
+                    {
+                        FILE *shapeFile = fopen("gen_shape.txt", "rb");
+                        if (shapeFile)
+                        {
+                            unsigned long long readKey = 0;
+                            hasOldShape = (fscanf(shapeFile, "%llx", &readKey) == 1);
+                            oldShapeKey = readKey;
+                            fclose(shapeFile);
+                        }
+                    }
+                    
+                    if (hasOldShape && (oldShapeKey == shapeKey))
+                    {
+                        fprintf(outputStream.file, "ROM init: shape %016llX unchanged, only gen_opcodes.mem written\n",
+                                (unsigned long long)shapeKey);
+                    }
+                    else
+                    {
+                        hdl_write_files(hdlFiles);
+                        FILE *shapeFile = fopen("gen_shape.txt", "wb");
+                        fprintf(shapeFile, "%016llX\n", (unsigned long long)shapeKey);
+                        fclose(shapeFile);
+                        fprintf(outputStream.file, "ROM init: shape %016llX%s, HDL written\n",
+                                (unsigned long long)shapeKey,
+                                (options.romInit == RomInit_Update) ?
+                                (hasOldShape ? " changed" : " is new") : "");
+                    }
+                }
+                hdl_close_files(hdlFiles);
+                
+                if (options.core == Core_Generic)
+                {
+                    opCodeStream.file = fopen("gen_microcode.bin", "wb");
+                    generate_microcode_image(&builder.stats, romOpCodes, opCodeStream);
+                    fclose(opCodeStream.file);
+                    fprintf(outputStream.file, "Generic core: %u opcodes of %u bits in gen_microcode.bin\n",
+                            builder.stats.opCodeCount, builder.stats.opCodeBitWidth);
+                }
+            }
+            free_dataflow(&dataflow);
             
         #if 0
         for (u32 stmtIdx = 0; stmtIdx < program->nrStatements; ++stmtIdx)
@@ -939,12 +2376,12 @@ optimize_combine_write(&opCodes);
     }
         else
         {
-            fprintf(stderr, "Could not find file: %s\n", argv[1]);
+            fprintf(stderr, "Could not find file: %s\n", options.sourceFile);
         }
     }
     else
     {
-        fprintf(stderr, "Usage: %s <input-file>\n", argv[0]);
+        print_usage(argv[0]);
         errors = 1;
     }
     
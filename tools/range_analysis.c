@@ -0,0 +1,328 @@
+// NOTE(michiel): Value range analysis over the optimized AST. Every value is tracked as a
+// signed interval, starting from the declared width of the IO input. The widest value that
+// has to travel through the ALU, registers or IO decides the datapath width.
+
+#define MAX_DATAPATH_BITS 32
+
+typedef struct ValueRange
+{
+    s64 min;
+    s64 max;
+} ValueRange;
+
+typedef struct RangeEntry
+{
+    String name;
+    ValueRange range;
+    u32 bits;
+} RangeEntry;
+
+typedef struct RangeAnalysis
+{
+    u32 ioInputBits;
+
+    ValueRange aluRange;     // NOTE(michiel): Last assignment to the ALU pseudo variable
+    Map entryMap;            // NOTE(michiel): Name -> index + 1 into entries
+    RangeEntry *entries;
+
+    u32 maxValueBits;        // NOTE(michiel): Widest intermediate or stored value
+    u32 ioOutputBits;
+} RangeAnalysis;
+
+internal inline ValueRange
+range_full(u32 bits)
+{
+    i_expect(bits > 0);
+    i_expect(bits < 64);
+    ValueRange result;
+    result.min = -((s64)1 << (bits - 1));
+    result.max = ((s64)1 << (bits - 1)) - 1;
+    return result;
+}
+
+internal inline ValueRange
+range_constant(s64 value)
+{
+    ValueRange result = {value, value};
+    return result;
+}
+
+internal inline ValueRange
+range_clamp(ValueRange range)
+{
+    // NOTE(michiel): Anything outside of the widest datapath wraps around in hardware, so
+    // it could end up being any value.
+    ValueRange full = range_full(MAX_DATAPATH_BITS);
+    if ((range.min < full.min) || (range.max > full.max))
+    {
+        range = full;
+    }
+    return range;
+}
+
+internal inline u32
+range_bits(ValueRange range)
+{
+    // NOTE(michiel): Signed two's complement bits needed to hold every value in the range
+    u32 result = 1;
+    if (range.max > 0)
+    {
+        result = maximum(result, log2_up((u32)minimum(range.max, (s64)U32_MAX)) + 1);
+    }
+    if (range.min < -1)
+    {
+        result = maximum(result, log2_up((u32)minimum(-range.min - 1, (s64)U32_MAX)) + 1);
+    }
+    return minimum(result, MAX_DATAPATH_BITS);
+}
+
+internal inline ValueRange
+range_from_values(s64 a, s64 b, s64 c, s64 d)
+{
+    ValueRange result;
+    result.min = minimum(minimum(a, b), minimum(c, d));
+    result.max = maximum(maximum(a, b), maximum(c, d));
+    return result;
+}
+
+internal ValueRange
+range_bitwise(TokenKind op, ValueRange left, ValueRange right)
+{
+    ValueRange result;
+    if ((left.min >= 0) && (right.min >= 0))
+    {
+        if (op == TOKEN_AND)
+        {
+            result.min = 0;
+            result.max = minimum(left.max, right.max);
+        }
+        else
+        {
+            u32 bits = maximum(log2_up((u32)left.max), log2_up((u32)right.max));
+            result.min = 0;
+            result.max = ((s64)1 << bits) - 1;
+        }
+    }
+    else if ((op == TOKEN_AND) && ((left.min >= 0) || (right.min >= 0)))
+    {
+        // NOTE(michiel): Masking with a positive value keeps it positive and smaller
+        result.min = 0;
+        result.max = (left.min >= 0) ? left.max : right.max;
+    }
+    else
+    {
+        result = range_full(maximum(range_bits(left), range_bits(right)));
+    }
+    return result;
+}
+
+internal ValueRange
+range_shift(TokenKind op, ValueRange left, ValueRange right)
+{
+    s64 minShift = maximum(0, minimum(right.min, MAX_DATAPATH_BITS - 1));
+    s64 maxShift = maximum(0, minimum(right.max, MAX_DATAPATH_BITS - 1));
+    ValueRange result;
+    switch ((u32)op)
+    {
+        case TOKEN_SLL:
+        {
+            // NOTE(michiel): Multiply, shifting negative values left is undefined in C
+            s64 minScale = (s64)1 << minShift;
+            s64 maxScale = (s64)1 << maxShift;
+            result = range_from_values(left.min * minScale, left.min * maxScale,
+                                       left.max * minScale, left.max * maxScale);
+        } break;
+
+        case TOKEN_SRA:
+        {
+            result = range_from_values(left.min >> minShift, left.min >> maxShift,
+                                       left.max >> minShift, left.max >> maxShift);
+        } break;
+
+        case TOKEN_SRL:
+        {
+            if (left.min >= 0)
+            {
+                result = range_from_values(left.min >> minShift, left.min >> maxShift,
+                                           left.max >> minShift, left.max >> maxShift);
+            }
+            else
+            {
+                // NOTE(michiel): Negative values shift in zeroes from the top of the datapath,
+                // this only holds for the full width which range_expr forces.
+                result.min = 0;
+                result.max = ((s64)U32_MAX) >> minShift;
+            }
+        } break;
+
+        INVALID_DEFAULT_CASE;
+    }
+    return result;
+}
+
+internal void
+range_record(RangeAnalysis *analysis, ValueRange range)
+{
+    u32 bits = range_bits(range);
+    analysis->maxValueBits = maximum(analysis->maxValueBits, bits);
+}
+
+internal ValueRange
+range_expr(RangeAnalysis *analysis, Expr *expr)
+{
+    ValueRange result = {0};
+    switch (expr->kind)
+    {
+        case Expr_Paren:
+        {
+            result = range_expr(analysis, expr->paren.expr);
+        } break;
+
+        case Expr_Int:
+        {
+            result = range_constant(expr->intConst);
+        } break;
+
+        case Expr_Id:
+        {
+            if (strings_are_equal(expr->name, create_string("IO")))
+            {
+                result = range_full(analysis->ioInputBits);
+            }
+            else if (strings_are_equal(expr->name, create_string("ALU")))
+            {
+                result = analysis->aluRange;
+            }
+            else
+            {
+                u64 index = map_get_u64(&analysis->entryMap, expr->name.data);
+                i_expect(index);
+                result = analysis->entries[index - 1].range;
+            }
+        } break;
+
+        case Expr_Unary:
+        {
+            ValueRange operand = range_expr(analysis, expr->unary.expr);
+            switch ((u32)expr->unary.op)
+            {
+                case '+': { result = operand; } break;
+                case '-': { result.min = -operand.max; result.max = -operand.min; } break;
+                case '~': { result.min = ~operand.max; result.max = ~operand.min; } break;
+                case '!': { result.min = 0; result.max = 1; } break;
+                case TOKEN_INC: { result.min = operand.min + 1; result.max = operand.max + 1; } break;
+                case TOKEN_DEC: { result.min = operand.min - 1; result.max = operand.max - 1; } break;
+                INVALID_DEFAULT_CASE;
+            }
+        } break;
+
+        case Expr_Binary:
+        {
+            ValueRange left = range_expr(analysis, expr->binary.left);
+            ValueRange right = range_expr(analysis, expr->binary.right);
+            switch ((u32)expr->binary.op)
+            {
+                case '+': { result.min = left.min + right.min; result.max = left.max + right.max; } break;
+                case '-': { result.min = left.min - right.max; result.max = left.max - right.min; } break;
+                case '*':
+                {
+                    result = range_from_values(left.min * right.min, left.min * right.max,
+                                               left.max * right.min, left.max * right.max);
+                } break;
+
+                case '&':
+                case '|':
+                case '^':
+                {
+                    result = range_bitwise(expr->binary.op, left, right);
+                } break;
+
+                case TOKEN_SLL:
+                case TOKEN_SRA:
+                case TOKEN_SRL:
+                {
+                    result = range_shift(expr->binary.op, left, right);
+                    if ((expr->binary.op == TOKEN_SRL) && (left.min < 0))
+                    {
+                        // NOTE(michiel): A narrower datapath would shift in the zeroes at
+                        // another bit and give another value.
+                        range_record(analysis, range_full(MAX_DATAPATH_BITS));
+                    }
+                } break;
+
+                default:
+                {
+                    // NOTE(michiel): Division and powers only survive as constants, be
+                    // pessimistic about anything else.
+                    result = range_full(MAX_DATAPATH_BITS);
+                } break;
+            }
+        } break;
+
+        INVALID_DEFAULT_CASE;
+    }
+
+    result = range_clamp(result);
+    range_record(analysis, result);
+    return result;
+}
+
+internal RangeAnalysis
+analyse_value_ranges(AstOptimizer *optimizer, u32 ioInputBits)
+{
+    i_expect(ioInputBits > 0);
+    i_expect(ioInputBits <= MAX_DATAPATH_BITS);
+
+    RangeAnalysis result = {0};
+    result.ioInputBits = ioInputBits;
+    result.maxValueBits = ioInputBits;
+
+    for (u32 stmtIdx = 0; stmtIdx < optimizer->statements.stmtCount; ++stmtIdx)
+    {
+        Stmt *stmt = optimizer->statements.stmts[stmtIdx];
+        if (stmt->kind == Stmt_Assign)
+        {
+            i_expect(stmt->assign.left->kind == Expr_Id);
+            String name = stmt->assign.left->name;
+            ValueRange range = range_expr(&result, stmt->assign.right);
+
+            if (strings_are_equal(name, create_string("IO")))
+            {
+                result.ioOutputBits = maximum(result.ioOutputBits, range_bits(range));
+            }
+            else if (strings_are_equal(name, create_string("ALU")))
+            {
+                result.aluRange = range;
+            }
+            else
+            {
+                RangeEntry entry = {0};
+                entry.name = name;
+                entry.range = range;
+                entry.bits = range_bits(range);
+                buf_push(result.entries, entry);
+                map_put_u64(&result.entryMap, name.data, buf_len(result.entries));
+            }
+        }
+        else
+        {
+            i_expect(stmt->kind == Stmt_Hint);
+        }
+    }
+
+    return result;
+}
+
+internal void
+print_value_ranges(FileStream output, RangeAnalysis *analysis)
+{
+    fprintf(output.file, "Value ranges (IO input %u bits):\n", analysis->ioInputBits);
+    for (u32 entryIdx = 0; entryIdx < buf_len(analysis->entries); ++entryIdx)
+    {
+        RangeEntry *entry = analysis->entries + entryIdx;
+        fprintf(output.file, "  %-10.*s: [%ld, %ld] %u bits\n", entry->name.size, entry->name.data,
+                entry->range.min, entry->range.max, entry->bits);
+    }
+    fprintf(output.file, "  IO output : %u bits\n", analysis->ioOutputBits);
+    fprintf(output.file, "  Datapath  : %u bits\n", analysis->maxValueBits);
+}
@@ -0,0 +1,1247 @@
+// NOTE(michiel): List scheduler working directly on the optimized AST, used for the VLIW
+// cores. Every statement becomes a tree of ALU operations with a fixed shape: an operation
+// runs exactly one ALU latency before the operation that consumes it, because the ALU
+// output register is overwritten every cycle. A tree is placed as a whole at the earliest
+// cycle where its reservation pattern fits next to the trees placed before it. Subtrees
+// that can never fit, like three operations at the same depth on two ALUs, are spilled to
+// a temporary register first.
+//
+// The modulo scheduler places the same trees in a reservation table of one initiation
+// interval, so a new program iteration starts every interval while the previous ones are
+// still running. Every variable has its own register and is written before it is read,
+// so there are no dependencies between iterations. What remains is that a register has to
+// be read before a later iteration overwrites it, that all IO reads of an iteration see
+// the same input sample and that the outputs stay in order. Values that live longer than
+// an interval get a register copy per iteration in flight, the kernel is unrolled to
+// rotate through them.
+
+#define SCHED_MEMORY_LATENCY 1
+// NOTE(michiel): Register copies of a modulo schedule, so a value can outlive an interval
+#define SCHED_MAX_COPIES     4
+
+typedef enum SchedOperandKind
+{
+    SchedOperand_Zero,
+    SchedOperand_Register,
+    SchedOperand_Immediate,
+    SchedOperand_IO,
+    SchedOperand_Node,
+} SchedOperandKind;
+
+typedef struct SchedOperand
+{
+    SchedOperandKind kind;
+    s32 value; // NOTE(michiel): Register address, immediate value or node index
+} SchedOperand;
+
+typedef struct SchedNode
+{
+    enum AluOp op;
+    SchedOperand a;
+    SchedOperand b;
+
+    s32 offset; // NOTE(michiel): Cycle relative to the sink of its tree
+    u32 cycle;
+    u32 slot;
+} SchedNode;
+
+typedef enum SchedSink
+{
+    SchedSink_Register,
+    SchedSink_IO,
+} SchedSink;
+
+typedef struct SchedTree
+{
+    SchedSink sink;
+    u32 address;
+    SchedOperand source;
+    u32 cycle;
+    u32 sourceLine;
+} SchedTree;
+
+typedef enum SchedUseKind
+{
+    SchedUse_Alu,
+    SchedUse_Read,
+    SchedUse_Immediate,
+    SchedUse_IORead,
+    SchedUse_Write,
+    SchedUse_Output,
+} SchedUseKind;
+
+typedef struct SchedUse
+{
+    SchedUseKind kind;
+    s32 offset;
+    s32 value;
+} SchedUse;
+
+typedef struct SchedCycle
+{
+    u32 aluCount;
+    u32 readCount;
+    u32 readAddress[2];
+    u32 readStage[2];    // NOTE(michiel): In a modulo schedule another stage reads another copy
+    b32 write;
+    b32 output;
+    b32 useImmediate;
+    s32 immediate;
+    b32 overflow; // NOTE(michiel): Only used while checking a placement
+} SchedCycle;
+
+typedef struct SchedConfig
+{
+    u32 aluCount;
+    u32 aluLatency;
+    b32 modulo;
+} SchedConfig;
+
+typedef struct SchedProgram
+{
+    // NOTE(michiel): The trees in program order, shared by every schedule run
+    SchedNode *nodes;
+    SchedTree *trees;
+    u32 registerCount;
+} SchedProgram;
+
+typedef struct Scheduler
+{
+    SchedConfig config;
+    SchedNode *nodes;
+    SchedTree *placed;
+    SchedCycle *cycles;
+    s32 *writeCycles;     // NOTE(michiel): Per register, -1 while it isn't written
+    s32 firstOutputCycle;
+    s32 lastOutputCycle;
+    s32 lastIOReadCycle;
+    u32 registerCount;
+    u32 cycleCount;       // NOTE(michiel): Length of one iteration
+    u32 interval;         // NOTE(michiel): Initiation interval, 0 for a plain list schedule
+    u32 maxLifetime;      // NOTE(michiel): Longest time between a write and a read
+    s32 *treeReleases;    // NOTE(michiel): Earliest sink cycle per program tree, can be 0
+    s32 *writerTrees;     // NOTE(michiel): Per register, the program tree writing it
+    s32 currentTree;
+    s32 firstOutputTree;
+    s32 failTree;         // NOTE(michiel): Tree to move after a failed modulo placement
+    s32 failRelease;
+} Scheduler;
+
+internal inline SchedCycle *
+sched_table_cycle(Scheduler *sched, u32 cycle)
+{
+    SchedCycle *result = sched->cycles + (sched->interval ? cycle % sched->interval : cycle);
+    return result;
+}
+
+internal inline u32
+sched_table_stage(Scheduler *sched, u32 cycle)
+{
+    u32 result = sched->interval ? cycle / sched->interval : 0;
+    return result;
+}
+
+internal SchedOperand
+sched_operand(SchedOperandKind kind, s32 value)
+{
+    SchedOperand result = {kind, value};
+    return result;
+}
+
+internal SchedOperand
+sched_push_node(SchedProgram *program, enum AluOp op, SchedOperand a, SchedOperand b)
+{
+    SchedNode node = {0};
+    node.op = op;
+    node.a = a;
+    node.b = b;
+    buf_push(program->nodes, node);
+    return sched_operand(SchedOperand_Node, buf_len(program->nodes) - 1);
+}
+
+internal SchedOperand
+sched_build_expr(SchedProgram *program, OpCodeBuilder *builder, Expr *expr, SchedOperand *pendingAlu)
+{
+    SchedOperand result = {0};
+    switch (expr->kind)
+    {
+        case Expr_Paren:
+        {
+            result = sched_build_expr(program, builder, expr->paren.expr, pendingAlu);
+        } break;
+
+        case Expr_Int:
+        {
+            result = sched_operand(SchedOperand_Immediate, safe_truncate_to_s32(expr->intConst));
+        } break;
+
+        case Expr_Id:
+        {
+            if (strings_are_equal(expr->name, create_string("IO")))
+            {
+                result = sched_operand(SchedOperand_IO, 0);
+            }
+            else if (strings_are_equal(expr->name, create_string("ALU")))
+            {
+                // NOTE(michiel): The ALU value only lives for one cycle, so it can only be
+                // used once.
+                i_expect(pendingAlu->kind == SchedOperand_Node);
+                result = *pendingAlu;
+                *pendingAlu = sched_operand(SchedOperand_Zero, 0);
+            }
+            else
+            {
+                result = sched_operand(SchedOperand_Register, get_var_address(builder, expr->name));
+            }
+        } break;
+
+        case Expr_Unary:
+        {
+            SchedOperand operand = sched_build_expr(program, builder, expr->unary.expr, pendingAlu);
+            switch (expr->unary.op)
+            {
+                case TOKEN_NOT: {
+                    fprintf(stderr, "'NOT'/'!' not implemented yet!\n");
+                    INVALID_CODE_PATH;
+                } break;
+                case TOKEN_INV: {
+                    result = sched_push_node(program, Alu_Xor, sched_operand(SchedOperand_Immediate, -1),
+                                             operand);
+                } break;
+                case TOKEN_NEG: {
+                    result = sched_push_node(program, Alu_Sub, sched_operand(SchedOperand_Zero, 0),
+                                             operand);
+                } break;
+                INVALID_DEFAULT_CASE;
+            }
+        } break;
+
+        case Expr_Binary:
+        {
+            enum AluOp op = Alu_Noop;
+            switch (expr->binary.op)
+            {
+                case TOKEN_OR: { op = Alu_Or; } break;
+                case TOKEN_XOR: { op = Alu_Xor; } break;
+                case TOKEN_AND: { op = Alu_And; } break;
+                case TOKEN_ADD: { op = Alu_Add; } break;
+                case TOKEN_SUB: { op = Alu_Sub; } break;
+                case TOKEN_SLL: { op = Alu_Sll; } break;
+                case TOKEN_SRL: { op = Alu_Srl; } break;
+                case TOKEN_SRA: { op = Alu_Sra; } break;
+                case TOKEN_MUL: { op = Alu_Mul; } break;
+                INVALID_DEFAULT_CASE;
+            }
+            SchedOperand left = sched_build_expr(program, builder, expr->binary.left, pendingAlu);
+            SchedOperand right = sched_build_expr(program, builder, expr->binary.right, pendingAlu);
+            if ((left.kind == SchedOperand_Immediate) && (right.kind == SchedOperand_Immediate) &&
+                (left.value != right.value))
+            {
+                // NOTE(michiel): Only one immediate per cycle, this happens for constants
+                // the AST can't fold, like a logical shift of a negative value.
+                left = sched_push_node(program, Alu_Noop, left, sched_operand(SchedOperand_Zero, 0));
+            }
+            result = sched_push_node(program, op, left, right);
+        } break;
+
+        INVALID_DEFAULT_CASE;
+    }
+    return result;
+}
+
+internal SchedProgram
+sched_build_program(OpCodeBuilder *builder, AstOptimizer *optimizer)
+{
+    SchedProgram result = {0};
+    SchedOperand pendingAlu = {0};
+    for (u32 stmtIdx = 0; stmtIdx < optimizer->statements.stmtCount; ++stmtIdx)
+    {
+        Stmt *stmt = optimizer->statements.stmts[stmtIdx];
+        if (stmt->kind == Stmt_Assign)
+        {
+            i_expect(stmt->assign.left->kind == Expr_Id);
+            String varName = stmt->assign.left->name;
+            if (strings_are_equal(varName, create_string("ALU")))
+            {
+                // NOTE(michiel): Becomes part of the tree of the statement that uses it
+                SchedOperand value = sched_build_expr(&result, builder, stmt->assign.right, &pendingAlu);
+                if (value.kind != SchedOperand_Node)
+                {
+                    value = sched_push_node(&result, Alu_Noop, value, sched_operand(SchedOperand_Zero, 0));
+                }
+                pendingAlu = value;
+            }
+            else
+            {
+                SchedTree tree = {0};
+                tree.sourceLine = stmt->origin.lineNumber;
+                if (strings_are_equal(varName, create_string("IO")))
+                {
+                    tree.sink = SchedSink_IO;
+                }
+                else
+                {
+                    tree.sink = SchedSink_Register;
+                    tree.address = get_write_address(builder, varName);
+                }
+                tree.source = sched_build_expr(&result, builder, stmt->assign.right, &pendingAlu);
+                buf_push(result.trees, tree);
+            }
+        }
+        else
+        {
+            i_expect(stmt->kind == Stmt_Hint);
+        }
+    }
+    result.registerCount = builder->registerCount;
+    return result;
+}
+
+internal void
+sched_collect_uses(Scheduler *sched, SchedOperand operand, s32 consumerOffset, SchedUse **uses)
+{
+    switch (operand.kind)
+    {
+        case SchedOperand_Zero: {} break;
+
+        case SchedOperand_Register:
+        {
+            SchedUse use = {SchedUse_Read, consumerOffset - SCHED_MEMORY_LATENCY, operand.value};
+            buf_push(*uses, use);
+        } break;
+
+        case SchedOperand_Immediate:
+        {
+            SchedUse use = {SchedUse_Immediate, consumerOffset, operand.value};
+            buf_push(*uses, use);
+        } break;
+
+        case SchedOperand_IO:
+        {
+            SchedUse use = {SchedUse_IORead, consumerOffset, 0};
+            buf_push(*uses, use);
+        } break;
+
+        case SchedOperand_Node:
+        {
+            SchedNode *node = sched->nodes + operand.value;
+            node->offset = consumerOffset - (s32)sched->config.aluLatency;
+            SchedUse use = {SchedUse_Alu, node->offset, operand.value};
+            buf_push(*uses, use);
+            sched_collect_uses(sched, node->a, node->offset, uses);
+            sched_collect_uses(sched, node->b, node->offset, uses);
+        } break;
+
+        INVALID_DEFAULT_CASE;
+    }
+}
+
+internal void
+sched_collect_tree_uses(Scheduler *sched, SchedTree *tree, SchedUse **uses)
+{
+    buf_clear(*uses);
+    SchedUse sinkUse = {0};
+    if (tree->sink == SchedSink_Register)
+    {
+        sinkUse.kind = SchedUse_Write;
+        sinkUse.value = tree->address;
+    }
+    else
+    {
+        sinkUse.kind = SchedUse_Output;
+    }
+    buf_push(*uses, sinkUse);
+    sched_collect_uses(sched, tree->source, 0, uses);
+}
+
+internal void
+sched_apply_use(SchedCycle *cycle, SchedUse *use, u32 stage)
+{
+    switch (use->kind)
+    {
+        case SchedUse_Alu:
+        {
+            ++cycle->aluCount;
+        } break;
+
+        case SchedUse_Read:
+        {
+            // NOTE(michiel): Reads of the same register in the same cycle share a port
+            b32 found = false;
+            for (u32 readIdx = 0; readIdx < minimum(cycle->readCount, 2); ++readIdx)
+            {
+                if ((cycle->readAddress[readIdx] == (u32)use->value) &&
+                    (cycle->readStage[readIdx] == stage))
+                {
+                    found = true;
+                }
+            }
+            if (!found)
+            {
+                if (cycle->readCount < 2)
+                {
+                    cycle->readAddress[cycle->readCount] = use->value;
+                    cycle->readStage[cycle->readCount] = stage;
+                }
+                ++cycle->readCount;
+            }
+        } break;
+
+        case SchedUse_Immediate:
+        {
+            if (cycle->useImmediate && (cycle->immediate != use->value))
+            {
+                cycle->overflow = true;
+            }
+            cycle->useImmediate = true;
+            cycle->immediate = use->value;
+        } break;
+
+        case SchedUse_IORead: {} break;
+
+        case SchedUse_Write:
+        {
+            cycle->overflow |= cycle->write;
+            cycle->write = true;
+        } break;
+
+        case SchedUse_Output:
+        {
+            cycle->overflow |= cycle->output;
+            cycle->output = true;
+        } break;
+
+        INVALID_DEFAULT_CASE;
+    }
+}
+
+internal b32
+sched_cycle_fits(SchedConfig *config, SchedCycle *cycle)
+{
+    // NOTE(michiel): A write takes port A, so with a write only port B can read. The
+    // immediate shares its opcode field with address B.
+    u32 portsUsed = cycle->readCount + (cycle->write ? 1 : 0);
+    b32 result = (!cycle->overflow &&
+                  (cycle->aluCount <= config->aluCount) &&
+                  (portsUsed <= 2) &&
+                  !(cycle->useImmediate && (portsUsed == 2)));
+    return result;
+}
+
+internal s32
+sched_min_offset(SchedUse *uses)
+{
+    s32 result = 0;
+    for (u32 useIdx = 0; useIdx < buf_len(uses); ++useIdx)
+    {
+        result = minimum(result, uses[useIdx].offset);
+    }
+    return result;
+}
+
+internal b32
+sched_fits(Scheduler *sched, SchedUse *uses, s32 sinkCycle, b32 emptyTable, s32 *failOffset)
+{
+    // NOTE(michiel): Checks the tree on top of the reserved resources, or on its own with
+    // an empty table to see if it needs spilling.
+    // The modulo table is checked as a whole, a long tree can collide with itself there.
+    s32 minOffset = sched_min_offset(uses);
+    b32 modulo = !emptyTable && sched->interval;
+    u32 window = modulo ? sched->interval : -minOffset + 1;
+    SchedCycle *scratch = allocate_array(window, SchedCycle, 0);
+    if (modulo)
+    {
+        memcpy(scratch, sched->cycles, window * sizeof(SchedCycle));
+    }
+    else if (!emptyTable)
+    {
+        for (u32 windowIdx = 0; windowIdx < window; ++windowIdx)
+        {
+            u32 cycle = sinkCycle + minOffset + windowIdx;
+            if (cycle < buf_len(sched->cycles))
+            {
+                scratch[windowIdx] = sched->cycles[cycle];
+            }
+        }
+    }
+    for (u32 useIdx = 0; useIdx < buf_len(uses); ++useIdx)
+    {
+        u32 windowIdx = uses[useIdx].offset - minOffset;
+        u32 stage = 0;
+        if (modulo)
+        {
+            windowIdx = (sinkCycle + uses[useIdx].offset) % sched->interval;
+            stage = (sinkCycle + uses[useIdx].offset) / sched->interval;
+        }
+        sched_apply_use(scratch + windowIdx, uses + useIdx, stage);
+    }
+
+    b32 result = true;
+    for (u32 windowIdx = 0; windowIdx < window; ++windowIdx)
+    {
+        if (!sched_cycle_fits(&sched->config, scratch + windowIdx))
+        {
+            if (failOffset)
+            {
+                i_expect(!modulo);
+                *failOffset = minOffset + (s32)windowIdx;
+            }
+            result = false;
+            break;
+        }
+    }
+    deallocate(scratch);
+    return result;
+}
+
+internal b32
+sched_subtree_hits(Scheduler *sched, SchedOperand operand, s32 offset)
+{
+    b32 result = false;
+    SchedUse *uses = 0;
+    SchedNode *node = sched->nodes + operand.value;
+    sched_collect_uses(sched, operand, node->offset + sched->config.aluLatency, &uses);
+    for (u32 useIdx = 0; useIdx < buf_len(uses); ++useIdx)
+    {
+        if (uses[useIdx].offset == offset)
+        {
+            result = true;
+            break;
+        }
+    }
+    buf_free(uses);
+    return result;
+}
+
+internal void
+sched_find_spill(Scheduler *sched, SchedOperand *operand, s32 failOffset, SchedOperand **best)
+{
+    // NOTE(michiel): Finds the operation closest to the root whose subtree takes part in
+    // the overflowing cycle. The root itself is never spilled, that wouldn't help.
+    if (operand->kind == SchedOperand_Node)
+    {
+        SchedNode *node = sched->nodes + operand->value;
+        if (*best)
+        {
+            SchedNode *bestNode = sched->nodes + (*best)->value;
+            if ((node->offset > bestNode->offset) && sched_subtree_hits(sched, *operand, failOffset))
+            {
+                *best = operand;
+            }
+        }
+        else if (sched_subtree_hits(sched, *operand, failOffset))
+        {
+            *best = operand;
+        }
+        sched_find_spill(sched, &node->a, failOffset, best);
+        sched_find_spill(sched, &node->b, failOffset, best);
+    }
+}
+
+internal void
+sched_reserve_cycles(Scheduler *sched, u32 count)
+{
+    while (buf_len(sched->cycles) < count)
+    {
+        SchedCycle empty = {0};
+        buf_push(sched->cycles, empty);
+    }
+}
+
+internal s32
+sched_earliest_cycle(Scheduler *sched, SchedUse *uses)
+{
+    s32 result = -sched_min_offset(uses);
+    for (u32 useIdx = 0; useIdx < buf_len(uses); ++useIdx)
+    {
+        SchedUse *use = uses + useIdx;
+        switch (use->kind)
+        {
+            case SchedUse_Read:
+            {
+                // NOTE(michiel): A write is visible to reads from the next cycle on
+                s32 writeCycle = sched->writeCycles[use->value];
+                i_expect(writeCycle >= 0);
+                result = maximum(result, writeCycle + 1 - use->offset);
+            } break;
+
+            case SchedUse_IORead:
+            {
+                // NOTE(michiel): IO stays in program order, an input after an output may
+                // depend on it. A modulo schedule works on a stream of samples, there the
+                // input is the same for the whole iteration.
+                if (!sched->interval)
+                {
+                    result = maximum(result, sched->lastOutputCycle + 1 - use->offset);
+                }
+            } break;
+
+            case SchedUse_Output:
+            {
+                result = maximum(result, sched->lastOutputCycle + 1 - use->offset);
+                if (!sched->interval)
+                {
+                    result = maximum(result, sched->lastIOReadCycle - use->offset);
+                }
+            } break;
+
+            default: {} break;
+        }
+    }
+    return result;
+}
+
+internal b32
+sched_within_lifetimes(Scheduler *sched, SchedUse *uses, s32 sinkCycle)
+{
+    // NOTE(michiel): Upper bounds for a modulo schedule, they only get worse for later cycles
+    b32 result = true;
+    for (u32 useIdx = 0; useIdx < buf_len(uses); ++useIdx)
+    {
+        SchedUse *use = uses + useIdx;
+        s32 cycle = sinkCycle + use->offset;
+        switch (use->kind)
+        {
+            case SchedUse_Read:
+            {
+                // NOTE(michiel): The iteration using the same register copy writes it the
+                // copy count times the interval later, a read in that same cycle still gets
+                // the old value.
+                s32 maxLifetime = SCHED_MAX_COPIES * sched->interval;
+                b32 alive = cycle <= sched->writeCycles[use->value] + maxLifetime;
+                if (result && !alive && ((u32)use->value < buf_len(sched->writerTrees)))
+                {
+                    sched->failTree = sched->writerTrees[use->value];
+                    sched->failRelease = cycle - maxLifetime;
+                }
+                result = result && alive;
+            } break;
+
+            case SchedUse_IORead:
+            {
+                // NOTE(michiel): A new input sample arrives every interval
+                result = result && (cycle < (s32)sched->interval);
+            } break;
+
+            case SchedUse_Output:
+            {
+                if (sched->firstOutputCycle >= 0)
+                {
+                    b32 inWindow = cycle < sched->firstOutputCycle + (s32)sched->interval;
+                    if (result && !inWindow)
+                    {
+                        sched->failTree = sched->firstOutputTree;
+                        sched->failRelease = cycle - (s32)sched->interval + 1;
+                    }
+                    result = result && inWindow;
+                }
+            } break;
+
+            default: {} break;
+        }
+    }
+    return result;
+}
+
+internal void
+sched_commit(Scheduler *sched, SchedTree *tree, SchedUse *uses, s32 sinkCycle)
+{
+    if (!sched->interval)
+    {
+        sched_reserve_cycles(sched, sinkCycle + 1);
+    }
+    for (u32 useIdx = 0; useIdx < buf_len(uses); ++useIdx)
+    {
+        SchedUse *use = uses + useIdx;
+        u32 cycle = sinkCycle + use->offset;
+        SchedCycle *reserved = sched_table_cycle(sched, cycle);
+        switch (use->kind)
+        {
+            case SchedUse_Alu:
+            {
+                SchedNode *node = sched->nodes + use->value;
+                node->cycle = cycle;
+                node->slot = reserved->aluCount;
+            } break;
+
+            case SchedUse_Read:
+            {
+                s32 writeCycle = sched->writeCycles[use->value];
+                if (writeCycle >= 0)
+                {
+                    sched->maxLifetime = maximum(sched->maxLifetime, (u32)((s32)cycle - writeCycle));
+                }
+            } break;
+
+            case SchedUse_IORead:
+            {
+                sched->lastIOReadCycle = maximum(sched->lastIOReadCycle, (s32)cycle);
+            } break;
+
+            case SchedUse_Write:
+            {
+                sched->writeCycles[use->value] = cycle;
+            } break;
+
+            case SchedUse_Output:
+            {
+                if (sched->firstOutputCycle < 0)
+                {
+                    sched->firstOutputCycle = cycle;
+                    sched->firstOutputTree = sched->currentTree;
+                }
+                sched->lastOutputCycle = cycle;
+            } break;
+
+            default: {} break;
+        }
+        sched_apply_use(reserved, use, sched_table_stage(sched, cycle));
+        i_expect(sched_cycle_fits(&sched->config, reserved));
+    }
+
+    tree->cycle = sinkCycle;
+    buf_push(sched->placed, *tree);
+    sched->cycleCount = maximum(sched->cycleCount, sinkCycle + 1);
+}
+
+internal b32
+sched_place_tree(Scheduler *sched, SchedTree tree, s32 release)
+{
+    b32 result = true;
+    SchedUse *uses = 0;
+    sched_collect_tree_uses(sched, &tree, &uses);
+
+    s32 failOffset = 0;
+    while (result && !sched_fits(sched, uses, 0, true, &failOffset))
+    {
+        SchedOperand *spill = 0;
+        i_expect(tree.source.kind == SchedOperand_Node);
+        SchedNode *root = sched->nodes + tree.source.value;
+        sched_find_spill(sched, &root->a, failOffset, &spill);
+        sched_find_spill(sched, &root->b, failOffset, &spill);
+        i_expect(spill);
+
+        SchedTree spillTree = {0};
+        spillTree.sink = SchedSink_Register;
+        spillTree.address = sched->registerCount++;
+        spillTree.source = *spill;
+        buf_push(sched->writeCycles, -1);
+        *spill = sched_operand(SchedOperand_Register, spillTree.address);
+        result = sched_place_tree(sched, spillTree, 0);
+
+        sched_collect_tree_uses(sched, &tree, &uses);
+    }
+
+    if (result)
+    {
+        s32 sinkCycle = maximum(release, sched_earliest_cycle(sched, uses));
+        if (sched->interval)
+        {
+            // NOTE(michiel): The reservation table repeats every interval, so a tree that
+            // doesn't fit in one interval worth of cycles never will.
+            s32 lastCycle = sinkCycle + sched->interval - 1;
+            result = false;
+            while (!result && (sinkCycle <= lastCycle) &&
+                   sched_within_lifetimes(sched, uses, sinkCycle))
+            {
+                result = sched_fits(sched, uses, sinkCycle, false, 0);
+                if (!result)
+                {
+                    ++sinkCycle;
+                }
+            }
+        }
+        else
+        {
+            while (!sched_fits(sched, uses, sinkCycle, false, 0))
+            {
+                ++sinkCycle;
+            }
+        }
+        if (result)
+        {
+            sched_commit(sched, &tree, uses, sinkCycle);
+        }
+    }
+    buf_free(uses);
+    return result;
+}
+
+internal inline void
+sched_emit_line(OpCode *opCode, u32 sourceLine)
+{
+    // NOTE(michiel): Trees are emitted in placement order, the first one keeps the opcode
+    if (!opCode->sourceLine)
+    {
+        opCode->sourceLine = sourceLine;
+    }
+}
+
+internal enum Selection
+sched_emit_operand(Scheduler *sched, OpCode *opCodes, SchedOperand operand, u32 consumerCycle,
+                   u32 sourceLine)
+{
+    enum Selection result = Select_Zero;
+    switch (operand.kind)
+    {
+        case SchedOperand_Zero: {} break;
+
+        case SchedOperand_Register:
+        {
+            u32 readCycle = consumerCycle - SCHED_MEMORY_LATENCY;
+            SchedCycle *cycle = sched_table_cycle(sched, readCycle);
+            OpCode *opCode = opCodes + readCycle;
+            sched_emit_line(opCode, sourceLine);
+            u32 readStage = sched_table_stage(sched, readCycle);
+            u32 readIdx = 0;
+            while ((cycle->readAddress[readIdx] != (u32)operand.value) ||
+                   (cycle->readStage[readIdx] != readStage))
+            {
+                ++readIdx;
+                i_expect(readIdx < cycle->readCount);
+            }
+            if (cycle->write || (readIdx == 1))
+            {
+                opCode->memoryReadB = true;
+                opCode->memoryAddrB = operand.value;
+                result = Select_MemoryB;
+            }
+            else
+            {
+                opCode->memoryReadA = true;
+                opCode->memoryAddrA = operand.value;
+                result = Select_MemoryA;
+            }
+        } break;
+
+        case SchedOperand_Immediate:
+        {
+            opCodes[consumerCycle].immediate = operand.value;
+            sched_emit_line(opCodes + consumerCycle, sourceLine);
+            result = Select_Immediate;
+        } break;
+
+        case SchedOperand_IO:
+        {
+            result = Select_IO;
+        } break;
+
+        case SchedOperand_Node:
+        {
+            SchedNode *node = sched->nodes + operand.value;
+            i_expect(node->cycle + sched->config.aluLatency == consumerCycle);
+            AluSlot *slot = opCodes[node->cycle].aluSlots + node->slot;
+            sched_emit_line(opCodes + node->cycle, sourceLine);
+            slot->operation = node->op;
+            slot->selectA = sched_emit_operand(sched, opCodes, node->a, node->cycle, sourceLine);
+            slot->selectB = sched_emit_operand(sched, opCodes, node->b, node->cycle, sourceLine);
+            result = (enum Selection)(Select_Alu + node->slot);
+        } break;
+
+        INVALID_DEFAULT_CASE;
+    }
+    return result;
+}
+
+internal OpCode *
+sched_emit(Scheduler *sched)
+{
+    OpCode *result = 0;
+    u32 opCount = maximum(1, sched->cycleCount);
+    OpCode *opCodes = buf_add(result, opCount);
+    memset(opCodes, 0, opCount * sizeof(OpCode));
+
+    for (u32 treeIdx = 0; treeIdx < buf_len(sched->placed); ++treeIdx)
+    {
+        SchedTree *tree = sched->placed + treeIdx;
+        OpCode *opCode = opCodes + tree->cycle;
+        sched_emit_line(opCode, tree->sourceLine);
+        enum Selection select = sched_emit_operand(sched, opCodes, tree->source, tree->cycle,
+                                                   tree->sourceLine);
+        if (tree->sink == SchedSink_Register)
+        {
+            opCode->memoryWrite = true;
+            opCode->memoryAddrA = tree->address;
+            opCode->selectMem = select;
+        }
+        else
+        {
+            opCode->selectIO = select;
+        }
+    }
+    return result;
+}
+
+internal void
+sched_merge_opcode(OpCode *dest, OpCode *source)
+{
+    // NOTE(michiel): The reservation table keeps the stages of a modulo schedule apart, so
+    // only one of them sets a field.
+    for (u32 slot = 0; slot < MAX_ALU_COUNT; ++slot)
+    {
+        AluSlot *alu = source->aluSlots + slot;
+        if (alu->operation || alu->selectA || alu->selectB)
+        {
+            dest->aluSlots[slot] = *alu;
+        }
+    }
+    if (source->selectIO)
+    {
+        dest->selectIO = source->selectIO;
+    }
+    if (source->memoryWrite)
+    {
+        dest->memoryWrite = true;
+        dest->memoryAddrA = source->memoryAddrA;
+        dest->selectMem = source->selectMem;
+    }
+    if (source->memoryReadA)
+    {
+        dest->memoryReadA = true;
+        dest->memoryAddrA = source->memoryAddrA;
+    }
+    if (source->memoryReadB)
+    {
+        dest->memoryReadB = true;
+        dest->memoryAddrB = source->memoryAddrB;
+    }
+    if (source->immediate)
+    {
+        dest->immediate = source->immediate;
+    }
+    if (!dest->sourceLine)
+    {
+        dest->sourceLine = source->sourceLine;
+    }
+}
+
+internal OpCode *
+sched_fold_kernel(Scheduler *sched, OpCode *iteration, ModuloKernel *kernel)
+{
+    // NOTE(michiel): Block b of the ROM runs the iterations up to b at once, iteration j
+    // being b - j intervals in. The blocks before the kernel are the prologue, after a reset
+    // they keep the iterations that don't exist yet from writing registers and outputs. The
+    // kernel repeats, the program never ends so there is no epilogue.
+    // When a value lives longer than an interval, iteration j uses register copy j % copies.
+    // The kernel is unrolled that many times, so every block knows its copies up front.
+    u32 iterationLength = buf_len(iteration);
+    kernel->interval = sched->interval;
+    kernel->stageCount = (iterationLength + sched->interval - 1) / sched->interval;
+    kernel->copyCount = maximum(1, (sched->maxLifetime + sched->interval - 1) / sched->interval);
+    i_expect(kernel->copyCount <= SCHED_MAX_COPIES);
+    kernel->start = (kernel->stageCount - 1) * sched->interval;
+
+    OpCode *result = 0;
+    u32 blockCount = kernel->stageCount - 1 + kernel->copyCount;
+    u32 opCount = blockCount * sched->interval;
+    OpCode *opCodes = buf_add(result, opCount);
+    memset(opCodes, 0, opCount * sizeof(OpCode));
+    for (u32 block = 0; block < blockCount; ++block)
+    {
+        for (u32 cycle = 0; cycle < sched->interval; ++cycle)
+        {
+            OpCode *opCode = opCodes + block * sched->interval + cycle;
+            for (u32 stage = 0; stage <= minimum(block, kernel->stageCount - 1); ++stage)
+            {
+                u32 iterationCycle = stage * sched->interval + cycle;
+                if (iterationCycle < iterationLength)
+                {
+                    OpCode source = iteration[iterationCycle];
+                    u32 addrOffset = ((block - stage) % kernel->copyCount) * sched->registerCount;
+                    if (source.memoryWrite || source.memoryReadA)
+                    {
+                        source.memoryAddrA += addrOffset;
+                    }
+                    if (source.memoryReadB)
+                    {
+                        source.memoryAddrB += addrOffset;
+                    }
+                    sched_merge_opcode(opCode, &source);
+                }
+            }
+        }
+    }
+    return result;
+}
+
+internal b32
+sched_run(SchedProgram *program, SchedConfig config, u32 interval, s32 *treeReleases,
+          Scheduler *sched)
+{
+    // NOTE(michiel): Works on a copy of the nodes, spilling rewrites them
+    b32 result = true;
+    sched->config = config;
+    sched->interval = interval;
+    sched->treeReleases = treeReleases;
+    sched->firstOutputTree = -1;
+    sched->failTree = -1;
+    sched->firstOutputCycle = -1;
+    sched->lastOutputCycle = -1;
+    sched->lastIOReadCycle = -1;
+    sched->registerCount = program->registerCount;
+    if (buf_len(program->nodes))
+    {
+        SchedNode *nodes = buf_add(sched->nodes, buf_len(program->nodes));
+        memcpy(nodes, program->nodes, buf_len(program->nodes) * sizeof(SchedNode));
+    }
+    for (u32 regIdx = 0; regIdx < program->registerCount; ++regIdx)
+    {
+        buf_push(sched->writeCycles, -1);
+        buf_push(sched->writerTrees, -1);
+    }
+    if (interval)
+    {
+        SchedCycle *cycles = buf_add(sched->cycles, interval);
+        memset(cycles, 0, interval * sizeof(SchedCycle));
+    }
+
+    for (u32 treeIdx = 0; result && (treeIdx < buf_len(program->trees)); ++treeIdx)
+    {
+        SchedTree *tree = program->trees + treeIdx;
+        sched->currentTree = treeIdx;
+        result = sched_place_tree(sched, *tree, treeReleases ? treeReleases[treeIdx] : 0);
+        if (tree->sink == SchedSink_Register)
+        {
+            sched->writerTrees[tree->address] = treeIdx;
+        }
+    }
+    return result;
+}
+
+internal void
+sched_free(Scheduler *sched)
+{
+    buf_free(sched->nodes);
+    buf_free(sched->placed);
+    buf_free(sched->cycles);
+    buf_free(sched->writeCycles);
+    buf_free(sched->writerTrees);
+}
+
+internal void
+sched_count_operand(SchedOperand operand, b32 *readRegisters, s32 **immediates)
+{
+    if (operand.kind == SchedOperand_Register)
+    {
+        readRegisters[operand.value] = true;
+    }
+    else if (operand.kind == SchedOperand_Immediate)
+    {
+        b32 found = false;
+        for (u32 immIdx = 0; immIdx < buf_len(*immediates); ++immIdx)
+        {
+            found |= (*immediates)[immIdx] == operand.value;
+        }
+        if (!found)
+        {
+            buf_push(*immediates, operand.value);
+        }
+    }
+}
+
+internal u32
+sched_min_interval(SchedProgram *program, SchedConfig config)
+{
+    // NOTE(michiel): Resource bound, every operation needs an ALU slot and every write and
+    // output their own cycle. The two register ports are shared by the writes, at least one
+    // read of every register and the immediates, which take the address B field. Spills
+    // only add to this.
+    u32 writes = 0;
+    u32 outputs = 0;
+    b32 *readRegisters = allocate_array(maximum(1, program->registerCount), b32, 0);
+    s32 *immediates = 0;
+    for (u32 treeIdx = 0; treeIdx < buf_len(program->trees); ++treeIdx)
+    {
+        SchedTree *tree = program->trees + treeIdx;
+        if (tree->sink == SchedSink_Register)
+        {
+            ++writes;
+        }
+        else
+        {
+            ++outputs;
+        }
+        sched_count_operand(tree->source, readRegisters, &immediates);
+    }
+    for (u32 nodeIdx = 0; nodeIdx < buf_len(program->nodes); ++nodeIdx)
+    {
+        sched_count_operand(program->nodes[nodeIdx].a, readRegisters, &immediates);
+        sched_count_operand(program->nodes[nodeIdx].b, readRegisters, &immediates);
+    }
+    u32 portUses = writes + buf_len(immediates);
+    for (u32 regIdx = 0; regIdx < program->registerCount; ++regIdx)
+    {
+        portUses += readRegisters[regIdx] ? 1 : 0;
+    }
+    deallocate(readRegisters);
+    buf_free(immediates);
+
+    u32 result = (buf_len(program->nodes) + config.aluCount - 1) / config.aluCount;
+    result = maximum(result, writes);
+    result = maximum(result, outputs);
+    result = maximum(result, (portUses + 1) / 2);
+    result = maximum(result, 1);
+    return result;
+}
+
+internal OpCode *
+schedule_program(SchedProgram *program, SchedConfig config, u32 *registerCount,
+                 ModuloKernel *kernel)
+{
+    // NOTE(michiel): The plain list schedule always works, a modulo schedule is only used
+    // when it starts iterations faster than that.
+    Scheduler sched = {0};
+    b32 placed = sched_run(program, config, 0, 0, &sched);
+    i_expect(placed);
+    OpCode *result = sched_emit(&sched);
+
+    ModuloKernel found = {0};
+    found.interval = buf_len(result);
+    found.stageCount = 1;
+    found.copyCount = 1;
+    found.minInterval = sched_min_interval(program, config);
+    if (config.modulo)
+    {
+        u32 treeCount = buf_len(program->trees);
+        s32 *treeReleases = allocate_array(maximum(1, treeCount), s32, 0);
+        b32 scheduled = false;
+        for (u32 interval = found.minInterval;
+             !scheduled && (interval < found.interval);
+             ++interval)
+        {
+            // NOTE(michiel): A placement that fails on a register lifetime or on the window
+            // for the outputs moves the tree at the other end of it to a later cycle, after
+            // which the same interval is tried again. The second seed holds back the outputs
+            // to the last output of the plain schedule from the start, that keeps the chains
+            // leading to early outputs out of the way.
+            for (u32 seed = 0; !scheduled && (seed < 2); ++seed)
+            {
+                memset(treeReleases, 0, maximum(1, treeCount) * sizeof(s32));
+                if (seed)
+                {
+                    for (u32 treeIdx = 0; treeIdx < treeCount; ++treeIdx)
+                    {
+                        if (program->trees[treeIdx].sink == SchedSink_IO)
+                        {
+                            treeReleases[treeIdx] = maximum(0, sched.lastOutputCycle - (s32)interval + 1);
+                        }
+                    }
+                }
+                b32 retry = true;
+                for (u32 attempt = 0; !scheduled && retry && (attempt < 4 * treeCount); ++attempt)
+                {
+                    Scheduler modulo = {0};
+                    retry = false;
+                    if (sched_run(program, config, interval, treeReleases, &modulo))
+                    {
+                        OpCode *iteration = sched_emit(&modulo);
+                        buf_free(result);
+                        result = sched_fold_kernel(&modulo, iteration, &found);
+                        buf_free(iteration);
+
+                        sched_free(&sched);
+                        sched = modulo;
+                        sched.registerCount *= found.copyCount;
+                        scheduled = true;
+                    }
+                    else
+                    {
+                        if ((modulo.failTree >= 0) && (modulo.failRelease > treeReleases[modulo.failTree]))
+                        {
+                            treeReleases[modulo.failTree] = modulo.failRelease;
+                            retry = true;
+                        }
+                        sched_free(&modulo);
+                    }
+                }
+            }
+        }
+        deallocate(treeReleases);
+    }
+
+    if (registerCount)
+    {
+        *registerCount = sched.registerCount;
+    }
+    if (kernel)
+    {
+        *kernel = found;
+    }
+
+    sched_free(&sched);
+    return result;
+}
+
+internal u32
+sched_alu_operations(u32 opCount, OpCode *opCodes, u32 aluCount)
+{
+    u32 result = 0;
+    for (u32 opIdx = 0; opIdx < opCount; ++opIdx)
+    {
+        for (u32 slot = 0; slot < aluCount; ++slot)
+        {
+            AluSlot *alu = opCodes[opIdx].aluSlots + slot;
+            if (alu->operation || alu->selectA || alu->selectB)
+            {
+                ++result;
+            }
+        }
+    }
+    return result;
+}
+
+internal void
+print_schedule_report(FileStream output, SchedProgram *program, SchedConfig config)
+{
+    // NOTE(michiel): Program iterations per cycle for every ALU count up to the requested one.
+    // For a modulo schedule that is set by the kernel, the prologue only runs once.
+    fprintf(output.file, "%s (%u cycle ALU latency):\n", config.modulo ? "Modulo schedule" : "Schedule",
+            config.aluLatency);
+    u32 baseCycles = 0;
+    for (u32 aluCount = 1; aluCount <= config.aluCount; ++aluCount)
+    {
+        SchedConfig runConfig = config;
+        runConfig.aluCount = aluCount;
+        ModuloKernel kernel = {0};
+        OpCode *opCodes = schedule_program(program, runConfig, 0, &kernel);
+        u32 cycles = kernel.interval;
+        u32 aluOps = sched_alu_operations(cycles * kernel.copyCount, opCodes + kernel.start,
+                                          aluCount) / kernel.copyCount;
+        fprintf(output.file, "  %u ALU%s: %3u cycles, %.4f iterations/cycle, ALU use %.1f%%",
+                aluCount, aluCount > 1 ? "s" : " ", cycles, 1.0 / (f64)cycles,
+                100.0 * (f64)aluOps / (f64)(cycles * aluCount));
+        if (config.modulo)
+        {
+            fprintf(output.file, ", %u stage%s, %u register cop%s, resource bound %u",
+                    kernel.stageCount, kernel.stageCount > 1 ? "s" : "",
+                    kernel.copyCount, kernel.copyCount > 1 ? "ies" : "y", kernel.minInterval);
+        }
+        if (aluCount == 1)
+        {
+            baseCycles = cycles;
+            fprintf(output.file, "\n");
+        }
+        else
+        {
+            f64 speedup = (f64)baseCycles / (f64)cycles;
+            fprintf(output.file, ", speedup %.2fx, %.2fx per extra ALU\n", speedup,
+                    (speedup - 1.0) / (f64)(aluCount - 1));
+        }
+        buf_free(opCodes);
+    }
+}
+
+internal void
+print_modulo_kernel(FileStream output, ModuloKernel *kernel)
+{
+    if (kernel->start)
+    {
+        fprintf(output.file, "Modulo kernel: pc %u - %u, a new sample every %u cycles, %u stages, %u register copies\n",
+                kernel->start, kernel->start + kernel->copyCount * kernel->interval - 1,
+                kernel->interval, kernel->stageCount, kernel->copyCount);
+    }
+    else
+    {
+        fprintf(output.file, "Modulo kernel: none, a new sample every %u cycles\n", kernel->interval);
+    }
+}
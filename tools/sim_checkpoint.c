@@ -0,0 +1,241 @@
+// NOTE(michiel): Simulator checkpoints, so a long run can go on from where an earlier one
+// stopped. The file is a header that ties it to the machine and the program, followed by
+// the state of the tick the run stopped at. All fields are little-endian u32 or u64 and
+// only the used ALU slots and pipeline stages are written.
+
+#define SIM_CHECKPOINT_MAGIC    0x54504B43   // NOTE(michiel): "CKPT"
+#define SIM_CHECKPOINT_VERSION  2
+
+internal inline u32
+sim_checkpoint_hash(u32 hash, u32 value)
+{
+    for (u32 byte = 0; byte < 4; ++byte)
+    {
+        hash = (hash ^ ((value >> (byte * 8)) & 0xFF)) * 16777619;
+    }
+    return hash;
+}
+
+internal u32
+sim_checkpoint_program_hash(OpCodeStats *stats, u32 opCodeCount, OpCode *opCodes)
+{
+    // NOTE(michiel): FNV-1a over everything that changes what a tick does, the source lines
+    // don't matter
+    u32 hash = 2166136261u;
+    hash = sim_checkpoint_hash(hash, stats->kernel.start);
+    hash = sim_checkpoint_hash(hash, stats->kernel.interval);
+    hash = sim_checkpoint_hash(hash, stats->synced);
+    for (u32 pc = 0; pc < opCodeCount; ++pc)
+    {
+        OpCode *opCode = opCodes + pc;
+        hash = sim_checkpoint_hash(hash, (u32)opCode->immediate);
+        hash = sim_checkpoint_hash(hash, opCode->memoryAddrA);
+        hash = sim_checkpoint_hash(hash, opCode->memoryAddrB);
+        hash = sim_checkpoint_hash(hash, (opCode->memoryReadA ? 1 : 0) | (opCode->memoryReadB ? 2 : 0) |
+                                   (opCode->memoryWrite ? 4 : 0));
+        hash = sim_checkpoint_hash(hash, opCode->selectMem);
+        hash = sim_checkpoint_hash(hash, opCode->selectIO);
+        for (u32 slot = 0; slot < stats->aluCount; ++slot)
+        {
+            AluSlot *alu = opCode->aluSlots + slot;
+            hash = sim_checkpoint_hash(hash, alu->operation);
+            hash = sim_checkpoint_hash(hash, alu->selectA);
+            hash = sim_checkpoint_hash(hash, alu->selectB);
+        }
+    }
+    return hash;
+}
+
+internal void
+sim_checkpoint_put_u32(FILE *file, u32 value)
+{
+    u8 bytes[4] = {(u8)value, (u8)(value >> 8), (u8)(value >> 16), (u8)(value >> 24)};
+    fwrite(bytes, 1, sizeof(bytes), file);
+}
+
+internal void
+sim_checkpoint_put_u64(FILE *file, u64 value)
+{
+    sim_checkpoint_put_u32(file, (u32)value);
+    sim_checkpoint_put_u32(file, (u32)(value >> 32));
+}
+
+internal u32
+sim_checkpoint_get_u32(FILE *file, b32 *valid)
+{
+    // NOTE(michiel): A short read clears valid and gives 0, so the caller checks once
+    u8 bytes[4] = {0};
+    if (fread(bytes, 1, sizeof(bytes), file) != sizeof(bytes))
+    {
+        *valid = false;
+    }
+    return (u32)bytes[0] | ((u32)bytes[1] << 8) | ((u32)bytes[2] << 16) | ((u32)bytes[3] << 24);
+}
+
+internal u64
+sim_checkpoint_get_u64(FILE *file, b32 *valid)
+{
+    u64 low = sim_checkpoint_get_u32(file, valid);
+    u64 high = sim_checkpoint_get_u32(file, valid);
+    return low | (high << 32);
+}
+
+internal void
+sim_checkpoint_free(SimCheckpoint *checkpoint)
+{
+    deallocate(checkpoint->state.registers);
+    checkpoint->state.registers = 0;
+}
+
+internal b32
+sim_checkpoint_save(OpCodeStats *stats, u32 opCodeCount, OpCode *opCodes, SimCheckpoint *checkpoint,
+                    char *fileName)
+{
+    i_expect(checkpoint->state.registers);
+    u32 aluLatency = get_alu_latency(&stats->pipeline);
+    FILE *file = fopen(fileName, "wb");
+    if (file)
+    {
+        sim_checkpoint_put_u32(file, SIM_CHECKPOINT_MAGIC);
+        sim_checkpoint_put_u32(file, SIM_CHECKPOINT_VERSION);
+        sim_checkpoint_put_u32(file, sim_checkpoint_program_hash(stats, opCodeCount, opCodes));
+        sim_checkpoint_put_u32(file, opCodeCount);
+        sim_checkpoint_put_u32(file, checkpoint->registerCount);
+        sim_checkpoint_put_u32(file, stats->bitWidth);
+        sim_checkpoint_put_u32(file, stats->aluCount);
+        sim_checkpoint_put_u32(file, aluLatency);
+
+        sim_checkpoint_put_u64(file, checkpoint->tick);
+        sim_checkpoint_put_u32(file, checkpoint->pc);
+        sim_checkpoint_put_u32(file, checkpoint->inputIndex);
+        sim_checkpoint_put_u64(file, checkpoint->outputCount);
+        sim_checkpoint_put_u32(file, checkpoint->outputHash);
+        sim_checkpoint_put_u64(file, checkpoint->samplesStarted);
+        sim_checkpoint_put_u64(file, checkpoint->samplesTaken);
+        sim_checkpoint_put_u64(file, checkpoint->nextArrival);
+        sim_checkpoint_put_u64(file, checkpoint->readyNext);
+        sim_checkpoint_put_u32(file, checkpoint->sampleRead);
+
+        SimState *state = &checkpoint->state;
+        sim_checkpoint_put_u32(file, state->ioIn);
+        sim_checkpoint_put_u32(file, state->ioOut);
+        sim_checkpoint_put_u32(file, state->memOutA);
+        sim_checkpoint_put_u32(file, state->memOutB);
+        for (u32 slot = 0; slot < stats->aluCount; ++slot)
+        {
+            sim_checkpoint_put_u32(file, state->aluOut[slot]);
+            for (u32 stage = 0; stage + 1 < aluLatency; ++stage)
+            {
+                sim_checkpoint_put_u32(file, state->aluPending[slot][stage]);
+            }
+        }
+        for (u32 address = 0; address < checkpoint->registerCount; ++address)
+        {
+            sim_checkpoint_put_u32(file, state->registers[address]);
+        }
+
+        b32 written = !ferror(file);
+        fclose(file);
+        if (written)
+        {
+            fprintf(stdout, "Checkpoint: tick %llu, pc %u, %llu outputs written to %s\n",
+                    (unsigned long long)checkpoint->tick, checkpoint->pc,
+                    (unsigned long long)checkpoint->outputCount, fileName);
+        }
+        else
+        {
+            fprintf(stderr, "Could not write the checkpoint %s\n", fileName);
+        }
+        return written;
+    }
+    fprintf(stderr, "Could not open %s for the checkpoint\n", fileName);
+    return false;
+}
+
+internal b32
+sim_checkpoint_load(OpCodeStats *stats, u32 opCodeCount, OpCode *opCodes, SimCheckpoint *checkpoint,
+                    char *fileName)
+{
+    // NOTE(michiel): Only loads a checkpoint of the same program on the same machine, the
+    // registers of anything else mean nothing.
+    FILE *file = fopen(fileName, "rb");
+    if (!file)
+    {
+        fprintf(stderr, "Could not open the checkpoint %s\n", fileName);
+        return false;
+    }
+
+    b32 valid = true;
+    u32 registerCount = 1 << stats->addressBits;
+    u32 aluLatency = get_alu_latency(&stats->pipeline);
+    u32 magic = sim_checkpoint_get_u32(file, &valid);
+    u32 version = sim_checkpoint_get_u32(file, &valid);
+    b32 sameFormat = valid && (magic == SIM_CHECKPOINT_MAGIC) && (version == SIM_CHECKPOINT_VERSION);
+    b32 sameProgram = sameFormat &&
+        (sim_checkpoint_get_u32(file, &valid) == sim_checkpoint_program_hash(stats, opCodeCount, opCodes)) &&
+        (sim_checkpoint_get_u32(file, &valid) == opCodeCount) &&
+        (sim_checkpoint_get_u32(file, &valid) == registerCount) &&
+        (sim_checkpoint_get_u32(file, &valid) == stats->bitWidth) &&
+        (sim_checkpoint_get_u32(file, &valid) == stats->aluCount) &&
+        (sim_checkpoint_get_u32(file, &valid) == aluLatency);
+
+    if (sameProgram)
+    {
+        SimCheckpoint loaded = {0};
+        loaded.registerCount = registerCount;
+        loaded.tick = sim_checkpoint_get_u64(file, &valid);
+        loaded.pc = sim_checkpoint_get_u32(file, &valid);
+        loaded.inputIndex = sim_checkpoint_get_u32(file, &valid);
+        loaded.outputCount = sim_checkpoint_get_u64(file, &valid);
+        loaded.outputHash = sim_checkpoint_get_u32(file, &valid);
+        loaded.samplesStarted = sim_checkpoint_get_u64(file, &valid);
+        loaded.samplesTaken = sim_checkpoint_get_u64(file, &valid);
+        loaded.nextArrival = sim_checkpoint_get_u64(file, &valid);
+        loaded.readyNext = sim_checkpoint_get_u64(file, &valid);
+        loaded.sampleRead = sim_checkpoint_get_u32(file, &valid);
+
+        SimState *state = &loaded.state;
+        state->ioIn = sim_checkpoint_get_u32(file, &valid);
+        state->ioOut = sim_checkpoint_get_u32(file, &valid);
+        state->memOutA = sim_checkpoint_get_u32(file, &valid);
+        state->memOutB = sim_checkpoint_get_u32(file, &valid);
+        for (u32 slot = 0; slot < stats->aluCount; ++slot)
+        {
+            state->aluOut[slot] = sim_checkpoint_get_u32(file, &valid);
+            for (u32 stage = 0; stage + 1 < aluLatency; ++stage)
+            {
+                state->aluPending[slot][stage] = sim_checkpoint_get_u32(file, &valid);
+            }
+        }
+        state->registers = allocate_array(registerCount, u32, 0);
+        for (u32 address = 0; address < registerCount; ++address)
+        {
+            state->registers[address] = sim_checkpoint_get_u32(file, &valid);
+        }
+
+        if (valid && (loaded.pc < opCodeCount))
+        {
+            sim_checkpoint_free(checkpoint);
+            *checkpoint = loaded;
+            fprintf(stdout, "Checkpoint: resuming at tick %llu, pc %u, after %llu outputs from %s\n",
+                    (unsigned long long)loaded.tick, loaded.pc, (unsigned long long)loaded.outputCount,
+                    fileName);
+        }
+        else
+        {
+            fprintf(stderr, "The checkpoint %s is cut short\n", fileName);
+            sim_checkpoint_free(&loaded);
+            sameProgram = false;
+        }
+    }
+    else if (sameFormat)
+    {
+        fprintf(stderr, "The checkpoint %s was taken of another program or machine\n", fileName);
+    }
+    else
+    {
+        fprintf(stderr, "%s is not a simulator checkpoint\n", fileName);
+    }
+    fclose(file);
+    return sameProgram;
+}
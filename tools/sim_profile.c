@@ -0,0 +1,251 @@
+// NOTE(michiel): Datapath utilization of a simulation run. The engines only count how often
+// every pc ran, everything else follows from the opcodes: an ALU slot, port or register is
+// busy in every cycle its opcode runs. The report goes to stdout, the same numbers go to a
+// JSON file for scripts.
+
+#define SIM_PROFILE_HOT_REGISTERS 8
+
+typedef struct SimProfile
+{
+    u32 opCodeCount;
+    u64 *opCounts;    // NOTE(michiel): Executions per pc, a stalled pc 0 counts every cycle
+
+    u64 ticks;
+    u64 stallTicks;   // NOTE(michiel): Cycles a synced controller waited for io_rdy
+    u64 samplesIn;
+    u64 samplesOut;
+} SimProfile;
+
+internal void
+sim_profile_init(SimProfile *profile, u32 opCodeCount)
+{
+    profile->opCodeCount = opCodeCount;
+    profile->opCounts = allocate_array(opCodeCount, u64, 0);
+}
+
+internal void
+sim_profile_free(SimProfile *profile)
+{
+    deallocate(profile->opCounts);
+    profile->opCounts = 0;
+}
+
+internal b32
+sim_alu_slot_busy(AluSlot *alu)
+{
+    // NOTE(michiel): A pass through of zero is what an unused slot does
+    return (alu->operation != Alu_Noop) || (alu->selectA != Select_Zero) || (alu->selectB != Select_Zero);
+}
+
+internal String
+sim_profile_source_line(Buffer source, u32 lineNumber)
+{
+    // NOTE(michiel): Line numbers start at 1, the text is without its line end
+    String result = {0};
+    u32 line = 1;
+    u32 at = 0;
+    while ((at < source.size) && (line < lineNumber))
+    {
+        if (source.data[at++] == '\n')
+        {
+            ++line;
+        }
+    }
+    if (lineNumber && (line == lineNumber))
+    {
+        while ((at < source.size) && ((source.data[at] == ' ') || (source.data[at] == '\t')))
+        {
+            ++at;
+        }
+        result.data = source.data + at;
+        while ((at < source.size) && (source.data[at] != '\n') && (source.data[at] != '\r'))
+        {
+            ++at;
+        }
+        result.size = (u32)(at - (result.data - source.data));
+    }
+    return result;
+}
+
+internal void
+sim_profile_json_string(FILE *file, String string)
+{
+    fputc('"', file);
+    for (u32 charIdx = 0; charIdx < string.size; ++charIdx)
+    {
+        u8 c = string.data[charIdx];
+        if ((c == '"') || (c == '\\'))
+        {
+            fputc('\\', file);
+            fputc(c, file);
+        }
+        else if (c < 0x20)
+        {
+            fprintf(file, "\\u%04x", c);
+        }
+        else
+        {
+            fputc(c, file);
+        }
+    }
+    fputc('"', file);
+}
+
+internal f64
+sim_profile_share(u64 count, u64 total)
+{
+    return total ? 100.0 * (f64)count / (f64)total : 0.0;
+}
+
+internal void
+sim_profile_report(OpCodeStats *stats, u32 opCodeCount, OpCode *opCodes, SimProfile *profile,
+                   char *sourceFile, char *reportFile)
+{
+    i_expect(profile->opCodeCount == opCodeCount);
+    u32 registerCount = 1 << stats->addressBits;
+    u64 *registerReads = allocate_array(registerCount, u64, 0);
+    u64 *registerWrites = allocate_array(registerCount, u64, 0);
+    u64 aluBusy[MAX_ALU_COUNT] = {0};
+    u64 readsA = 0;
+    u64 readsB = 0;
+    u64 writes = 0;
+    for (u32 pc = 0; pc < opCodeCount; ++pc)
+    {
+        OpCode *opCode = opCodes + pc;
+        u64 count = profile->opCounts[pc];
+        for (u32 slot = 0; slot < stats->aluCount; ++slot)
+        {
+            if (sim_alu_slot_busy(opCode->aluSlots + slot))
+            {
+                aluBusy[slot] += count;
+            }
+        }
+        if (opCode->memoryReadA)
+        {
+            readsA += count;
+            registerReads[opCode->memoryAddrA] += count;
+        }
+        if (opCode->memoryReadB)
+        {
+            readsB += count;
+            registerReads[opCode->memoryAddrB] += count;
+        }
+        if (opCode->memoryWrite)
+        {
+            writes += count;
+            registerWrites[opCode->memoryAddrA] += count;
+        }
+    }
+
+    u64 ticks = profile->ticks;
+    fprintf(stdout, "Profile: %llu ticks, %llu stalled on io_rdy, %llu samples in (%.3f per tick), %llu out (%.3f per tick)\n",
+            (unsigned long long)ticks, (unsigned long long)profile->stallTicks,
+            (unsigned long long)profile->samplesIn, ticks ? (f64)profile->samplesIn / (f64)ticks : 0.0,
+            (unsigned long long)profile->samplesOut, ticks ? (f64)profile->samplesOut / (f64)ticks : 0.0);
+    for (u32 slot = 0; slot < stats->aluCount; ++slot)
+    {
+        fprintf(stdout, "  ALU %u: %llu busy, %llu idle (%.1f%% busy)\n", slot,
+                (unsigned long long)aluBusy[slot], (unsigned long long)(ticks - aluBusy[slot]),
+                sim_profile_share(aluBusy[slot], ticks));
+    }
+    fprintf(stdout, "  Ports: read A %.1f%%, read B %.1f%%, write %.1f%%\n",
+            sim_profile_share(readsA, ticks), sim_profile_share(readsB, ticks),
+            sim_profile_share(writes, ticks));
+
+    // NOTE(michiel): Picks the most accessed registers one at a time, there are only a few
+    fprintf(stdout, "  Hot registers:");
+    b32 *listed = allocate_array(registerCount, b32, 0);
+    for (u32 rank = 0; rank < minimum(SIM_PROFILE_HOT_REGISTERS, registerCount); ++rank)
+    {
+        u32 hottest = registerCount;
+        for (u32 address = 0; address < registerCount; ++address)
+        {
+            u64 accesses = registerReads[address] + registerWrites[address];
+            if (!listed[address] && accesses &&
+                ((hottest == registerCount) ||
+                 (accesses > registerReads[hottest] + registerWrites[hottest])))
+            {
+                hottest = address;
+            }
+        }
+        if (hottest < registerCount)
+        {
+            listed[hottest] = true;
+            fprintf(stdout, " r%u %llu/%llu", hottest, (unsigned long long)registerReads[hottest],
+                    (unsigned long long)registerWrites[hottest]);
+        }
+    }
+    fprintf(stdout, " (reads/writes)\n");
+    deallocate(listed);
+
+    Buffer source = read_entire_file(sourceFile);
+    fprintf(stdout, "  %5s %12s %6s %5s  %s\n", "PC", "Count", "Share", "Line", "Source");
+    for (u32 pc = 0; pc < opCodeCount; ++pc)
+    {
+        String text = sim_profile_source_line(source, opCodes[pc].sourceLine);
+        fprintf(stdout, "  %5u %12llu %5.1f%% %5u  %.*s\n", pc, (unsigned long long)profile->opCounts[pc],
+                sim_profile_share(profile->opCounts[pc], ticks), opCodes[pc].sourceLine,
+                text.size, text.data);
+    }
+
+    FILE *file = reportFile ? fopen(reportFile, "wb") : 0;
+    if (file)
+    {
+        fprintf(file, "{\n");
+        fprintf(file, "  \"ticks\": %llu,\n", (unsigned long long)ticks);
+        fprintf(file, "  \"stallTicks\": %llu,\n", (unsigned long long)profile->stallTicks);
+        fprintf(file, "  \"samplesIn\": %llu,\n", (unsigned long long)profile->samplesIn);
+        fprintf(file, "  \"samplesOut\": %llu,\n", (unsigned long long)profile->samplesOut);
+        fprintf(file, "  \"alus\": [");
+        for (u32 slot = 0; slot < stats->aluCount; ++slot)
+        {
+            fprintf(file, "%s{\"busy\": %llu, \"idle\": %llu}", slot ? ", " : "",
+                    (unsigned long long)aluBusy[slot], (unsigned long long)(ticks - aluBusy[slot]));
+        }
+        fprintf(file, "],\n");
+        fprintf(file, "  \"ports\": {\"readA\": %llu, \"readB\": %llu, \"write\": %llu},\n",
+                (unsigned long long)readsA, (unsigned long long)readsB, (unsigned long long)writes);
+        fprintf(file, "  \"registers\": [");
+        b32 first = true;
+        for (u32 address = 0; address < registerCount; ++address)
+        {
+            if (registerReads[address] || registerWrites[address])
+            {
+                fprintf(file, "%s\n    {\"address\": %u, \"reads\": %llu, \"writes\": %llu}",
+                        first ? "" : ",", address, (unsigned long long)registerReads[address],
+                        (unsigned long long)registerWrites[address]);
+                first = false;
+            }
+        }
+        fprintf(file, "\n  ],\n");
+        fprintf(file, "  \"opcodes\": [");
+        for (u32 pc = 0; pc < opCodeCount; ++pc)
+        {
+            OpCode *opCode = opCodes + pc;
+            fprintf(file, "%s\n    {\"pc\": %u, \"count\": %llu, \"aluBusy\": [", pc ? "," : "", pc,
+                    (unsigned long long)profile->opCounts[pc]);
+            for (u32 slot = 0; slot < stats->aluCount; ++slot)
+            {
+                fprintf(file, "%s%s", slot ? ", " : "",
+                        sim_alu_slot_busy(opCode->aluSlots + slot) ? "true" : "false");
+            }
+            fprintf(file, "], \"readA\": %s, \"readB\": %s, \"write\": %s, \"line\": %u, \"source\": ",
+                    opCode->memoryReadA ? "true" : "false", opCode->memoryReadB ? "true" : "false",
+                    opCode->memoryWrite ? "true" : "false", opCode->sourceLine);
+            sim_profile_json_string(file, sim_profile_source_line(source, opCode->sourceLine));
+            fprintf(file, "}");
+        }
+        fprintf(file, "\n  ]\n");
+        fprintf(file, "}\n");
+        fclose(file);
+        fprintf(stdout, "Profile written to %s\n", reportFile);
+    }
+    else if (reportFile)
+    {
+        fprintf(stderr, "Could not open %s for the profile\n", reportFile);
+    }
+
+    deallocate(source.data);
+    deallocate(registerWrites);
+    deallocate(registerReads);
+}
@@ -0,0 +1,302 @@
+// NOTE(michiel): Sample streams for the simulator, so it can run on captured signal data
+// instead of the fixed input table. An input is a regular file, which gets mapped, or stdin
+// or a named pipe, which are read in blocks. Outputs go through a block buffer to a file or
+// a pipe. Binary samples are little-endian, text is whitespace or comma separated decimals.
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SIM_STREAM_BLOCK  (64 * 1024)
+
+typedef enum SimStreamFormat
+{
+    SimStream_S8,
+    SimStream_S16,
+    SimStream_S32,
+    SimStream_Text,
+} SimStreamFormat;
+
+typedef struct SimStream
+{
+    FILE *file;
+    SimStreamFormat format;
+    u32 bitWidth;    // NOTE(michiel): Outputs are sign extended from this width
+
+    u8 *data;        // NOTE(michiel): The mapped file or the block buffer
+    uptr size;
+    uptr at;
+    b32 mapped;
+    b32 writing;
+    b32 ended;       // NOTE(michiel): Nothing more comes in after data[size - 1]
+
+    u64 count;
+} SimStream;
+
+internal b32
+parse_sim_stream_format(char *name, SimStreamFormat *format)
+{
+    b32 result = true;
+    if (strcmp(name, "s8") == 0)
+    {
+        *format = SimStream_S8;
+    }
+    else if (strcmp(name, "s16") == 0)
+    {
+        *format = SimStream_S16;
+    }
+    else if (strcmp(name, "s32") == 0)
+    {
+        *format = SimStream_S32;
+    }
+    else if (strcmp(name, "text") == 0)
+    {
+        *format = SimStream_Text;
+    }
+    else
+    {
+        result = false;
+    }
+    return result;
+}
+
+internal u32
+sim_stream_sample_bytes(SimStreamFormat format)
+{
+    u32 result = 0;
+    switch (format)
+    {
+        case SimStream_S8: { result = 1; } break;
+        case SimStream_S16: { result = 2; } break;
+        case SimStream_S32: { result = 4; } break;
+        case SimStream_Text: { result = 0; } break;
+        INVALID_DEFAULT_CASE;
+    }
+    return result;
+}
+
+internal b32
+sim_stream_open_input(SimStream *stream, char *fileName, SimStreamFormat format)
+{
+    // NOTE(michiel): "-" is stdin. Pipes and character devices can't be mapped, they keep
+    // the stdio file.
+    stream->format = format;
+    stream->file = (strcmp(fileName, "-") == 0) ? stdin : fopen(fileName, "rb");
+    if (stream->file)
+    {
+        struct stat fileStat;
+        if ((stream->file != stdin) && (fstat(fileno(stream->file), &fileStat) == 0) &&
+            S_ISREG(fileStat.st_mode) && (fileStat.st_size > 0))
+        {
+            void *mapping = mmap(0, fileStat.st_size, PROT_READ, MAP_PRIVATE, fileno(stream->file), 0);
+            if (mapping != MAP_FAILED)
+            {
+                madvise(mapping, fileStat.st_size, MADV_SEQUENTIAL);
+                stream->data = mapping;
+                stream->size = fileStat.st_size;
+                stream->mapped = true;
+                stream->ended = true;
+            }
+        }
+        if (!stream->mapped)
+        {
+            stream->data = allocate_array(SIM_STREAM_BLOCK, u8, ALLOC_NOCLEAR);
+        }
+    }
+    else
+    {
+        fprintf(stderr, "Could not open %s for the simulation input\n", fileName);
+    }
+    return stream->file != 0;
+}
+
+internal b32
+sim_stream_open_output(SimStream *stream, char *fileName, SimStreamFormat format, u32 bitWidth)
+{
+    stream->format = format;
+    stream->bitWidth = bitWidth;
+    stream->writing = true;
+    stream->file = fopen(fileName, "wb");
+    if (stream->file)
+    {
+        stream->data = allocate_array(SIM_STREAM_BLOCK, u8, ALLOC_NOCLEAR);
+    }
+    else
+    {
+        fprintf(stderr, "Could not open %s for the simulation output\n", fileName);
+    }
+    return stream->file != 0;
+}
+
+internal void
+sim_stream_fill(SimStream *stream)
+{
+    // NOTE(michiel): Keeps the unread tail, a sample split over two blocks comes out whole
+    if (!stream->ended)
+    {
+        uptr left = stream->size - stream->at;
+        memmove(stream->data, stream->data + stream->at, left);
+        uptr bytesRead = fread(stream->data + left, 1, SIM_STREAM_BLOCK - left, stream->file);
+        stream->size = left + bytesRead;
+        stream->at = 0;
+        stream->ended = (bytesRead == 0);
+    }
+}
+
+internal inline b32
+sim_stream_is_separator(u8 c)
+{
+    return (c == ' ') || (c == '\t') || (c == '\r') || (c == '\n') || (c == ',');
+}
+
+internal u32
+sim_stream_read(SimStream *stream, u32 *values, u32 maxCount)
+{
+    // NOTE(michiel): Returns the number of samples, 0 at the end of the stream. A partial
+    // sample at the end is dropped.
+    u32 count = 0;
+    u32 sampleBytes = sim_stream_sample_bytes(stream->format);
+    b32 dry = false;
+    while ((count < maxCount) && !dry)
+    {
+        if (sampleBytes)
+        {
+            if (stream->size - stream->at < sampleBytes)
+            {
+                sim_stream_fill(stream);
+                dry = (stream->size - stream->at < sampleBytes) && stream->ended;
+            }
+            else
+            {
+                u8 *at = stream->data + stream->at;
+                switch (stream->format)
+                {
+                    case SimStream_S8: { values[count] = (u32)(s32)(s8)at[0]; } break;
+                    case SimStream_S16: { values[count] = (u32)(s32)(s16)(at[0] | (at[1] << 8)); } break;
+                    case SimStream_S32:
+                    {
+                        values[count] = (u32)at[0] | ((u32)at[1] << 8) | ((u32)at[2] << 16) | ((u32)at[3] << 24);
+                    } break;
+                    INVALID_DEFAULT_CASE;
+                }
+                stream->at += sampleBytes;
+                ++count;
+            }
+        }
+        else
+        {
+            // NOTE(michiel): A number touching the end of the block waits for the next one,
+            // it could continue there.
+            uptr at = stream->at;
+            while ((at < stream->size) && sim_stream_is_separator(stream->data[at]))
+            {
+                ++at;
+            }
+            uptr end = at;
+            while ((end < stream->size) && !sim_stream_is_separator(stream->data[end]))
+            {
+                ++end;
+            }
+            stream->at = at;
+            if ((end == stream->size) && !stream->ended)
+            {
+                sim_stream_fill(stream);
+            }
+            else if (at == end)
+            {
+                dry = true;
+            }
+            else
+            {
+                b32 negative = stream->data[at] == '-';
+                if (negative || (stream->data[at] == '+'))
+                {
+                    ++at;
+                }
+                u32 value = 0;
+                while ((at < end) && (stream->data[at] >= '0') && (stream->data[at] <= '9'))
+                {
+                    value = value * 10 + (stream->data[at++] - '0');
+                }
+                values[count++] = negative ? (u32)-value : value;
+                stream->at = end;
+            }
+        }
+    }
+    stream->count += count;
+    return count;
+}
+
+internal u64
+sim_stream_skip(SimStream *stream, u64 count)
+{
+    // NOTE(michiel): Reads and drops count samples, they still count as read
+    u32 scratch[1024];
+    u64 skipped = 0;
+    u32 readCount = 1;
+    while ((skipped < count) && readCount)
+    {
+        readCount = sim_stream_read(stream, scratch, (u32)minimum(count - skipped, array_count(scratch)));
+        skipped += readCount;
+    }
+    return skipped;
+}
+
+internal void
+sim_stream_flush(SimStream *stream)
+{
+    if (stream->size)
+    {
+        fwrite(stream->data, 1, stream->size, stream->file);
+        stream->size = 0;
+    }
+}
+
+internal inline void
+sim_stream_write(SimStream *stream, u32 value)
+{
+    if (stream->size + 16 > SIM_STREAM_BLOCK)
+    {
+        sim_stream_flush(stream);
+    }
+    u8 *at = stream->data + stream->size;
+    u32 signShift = 32 - stream->bitWidth;
+    s32 sample = ((s32)(value << signShift)) >> signShift;
+    u32 bytes = sim_stream_sample_bytes(stream->format);
+    switch (stream->format)
+    {
+        case SimStream_S8: { at[0] = (u8)sample; } break;
+        case SimStream_S16: { at[0] = (u8)sample; at[1] = (u8)(sample >> 8); } break;
+        case SimStream_S32:
+        {
+            at[0] = (u8)sample;
+            at[1] = (u8)(sample >> 8);
+            at[2] = (u8)(sample >> 16);
+            at[3] = (u8)(sample >> 24);
+        } break;
+        case SimStream_Text: { bytes = sprintf((char *)at, "%d\n", sample); } break;
+        INVALID_DEFAULT_CASE;
+    }
+    stream->size += bytes;
+    ++stream->count;
+}
+
+internal void
+sim_stream_close(SimStream *stream)
+{
+    if (stream->mapped)
+    {
+        munmap(stream->data, stream->size);
+    }
+    else
+    {
+        if (stream->writing)
+        {
+            sim_stream_flush(stream);
+        }
+        deallocate(stream->data);
+    }
+    if (stream->file != stdin)
+    {
+        fclose(stream->file);
+    }
+}
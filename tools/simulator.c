@@ -1,129 +1,401 @@
 #define MAX_REG 2048
-global u32 gSimRegisters[MAX_REG];
-    typedef struct SimState
+
+typedef struct SimState
 {
-    u32 memAddrA;
-    u32 memAddrB;
-    u32 aluOut;
+    // NOTE(michiel): Everything here is a register in the generated core, so it holds the
+    // value set by the previous opcode.
+    u32 *registers;
+    u32 memOutA;
+    u32 memOutB;
+    u32 aluOut[MAX_ALU_COUNT];
+    // NOTE(michiel): Results still in the operand register or the extra ALU stages
+    u32 aluPending[MAX_ALU_COUNT][MAX_ALU_LATENCY - 1];
     u32 ioIn;
     u32 ioOut;
 } SimState;
 
+typedef struct SimRecord
+{
+    // NOTE(michiel): Pairs of tick and value, the stimulus and expected results of a
+    // co-simulation run
+    u32 *inputs;
+    u32 *outputs;
+} SimRecord;
+
+typedef struct SimCheckpoint
+{
+    // NOTE(michiel): Machine state between two ticks, see sim_checkpoint.c. Without registers
+    // nothing was taken yet and a run starts from reset.
+    SimState state;
+    u32 registerCount;
+    u32 pc;
+    u64 tick;
+    u32 inputIndex;   // NOTE(michiel): Next entry of the input table
+    u64 outputCount;
+    u32 outputHash;
+    u64 samplesStarted; // NOTE(michiel): Interval starts since reset, finished or in flight
+
+    // NOTE(michiel): Position and IO handshake of a -sim-in stream
+    u64 samplesTaken;
+    u64 nextArrival;
+    u64 readyNext;
+    b32 sampleRead;
+} SimCheckpoint;
+
+internal inline u32
+sim_mask(OpCodeStats *stats, s64 value)
+{
+    u32 mask = (u32)((1ULL << stats->bitWidth) - 1);
+    return (u32)value & mask;
+}
+
+internal inline s32
+sim_signed(OpCodeStats *stats, u32 value)
+{
+    u32 shift = 32 - stats->bitWidth;
+    return ((s32)(value << shift)) >> shift;
+}
+
+internal u32
+sim_select(OpCodeStats *stats, SimState *state, OpCode *opCode, enum Selection select)
+{
+    u32 result = 0;
+    switch (select)
+    {
+        case Select_Zero: { result = 0; } break;
+        case Select_MemoryA: { result = state->memOutA; } break;
+        case Select_MemoryB: { result = state->memOutB; } break;
+        case Select_Immediate: { result = sim_mask(stats, opCode->immediate); } break;
+        case Select_IO: { result = state->ioIn; } break;
+        case Select_Alu:
+        case Select_Alu1:
+        case Select_Alu2:
+        case Select_Alu3:
+        {
+            i_expect((u32)(select - Select_Alu) < stats->aluCount);
+            result = state->aluOut[select - Select_Alu];
+        } break;
+        INVALID_DEFAULT_CASE;
+    }
+    return result;
+}
+
+internal u32
+sim_alu(OpCodeStats *stats, enum AluOp op, u32 a, u32 b)
+{
+    // NOTE(michiel): The shift amount is unsigned, shifting by the width or more leaves
+    // only zeroes or sign bits.
+    s64 result = 0;
+    switch (op)
+    {
+        case Alu_Noop: { result = a; } break;
+        case Alu_And: { result = a & b; } break;
+        case Alu_Or: { result = a | b; } break;
+        case Alu_Xor: { result = a ^ b; } break;
+        case Alu_Add: { result = (s64)sim_signed(stats, a) + (s64)sim_signed(stats, b); } break;
+        case Alu_Sub: { result = (s64)sim_signed(stats, a) - (s64)sim_signed(stats, b); } break;
+        case Alu_Sll: { result = (b < stats->bitWidth) ? ((u64)a << b) : 0; } break;
+        case Alu_Srl: { result = (b < stats->bitWidth) ? (a >> b) : 0; } break;
+        case Alu_Sra: { result = sim_signed(stats, a) >> minimum(b, stats->bitWidth - 1); } break;
+        case Alu_Mul: { result = (s64)sim_signed(stats, a) * (s64)sim_signed(stats, b); } break;
+        INVALID_DEFAULT_CASE;
+    }
+    return sim_mask(stats, result);
+}
+
+internal char *
+sim_alu_signal_name(char *field, u32 slot)
+{
+    // NOTE(michiel): Same names as gen_cpu.vhd, the first ALU has no number
+    String result = slot ? create_string_fmt("alu%u_%s", slot, field) : create_string_fmt("alu_%s", field);
+    return (char *)result.data;
+}
+
+internal void
+sim_vcd_signals(OpCodeStats *stats, VcdWriter *vcd)
+{
+    // NOTE(michiel): Keep the order the same as sim_vcd_tick
+    vcd_add_signal(vcd, "clk", 1);
+    vcd_add_signal(vcd, "pc", stats->opCodeBits);
+    vcd_add_signal(vcd, "immediate", stats->bitWidth);
+    if (stats->addressBits)
+    {
+        vcd_add_signal(vcd, "mem_addra", stats->addressBits);
+        vcd_add_signal(vcd, "mem_addrb", stats->addressBits);
+    }
+    vcd_add_signal(vcd, "mem_reada", 1);
+    vcd_add_signal(vcd, "mem_readb", 1);
+    vcd_add_signal(vcd, "mem_write", 1);
+    vcd_add_signal(vcd, "mem_sel", stats->selectBits);
+    for (u32 slot = 0; slot < stats->aluCount; ++slot)
+    {
+        vcd_add_signal(vcd, sim_alu_signal_name("op", slot), stats->aluOpBits);
+        vcd_add_signal(vcd, sim_alu_signal_name("sela", slot), stats->selectBits);
+        vcd_add_signal(vcd, sim_alu_signal_name("selb", slot), stats->selectBits);
+    }
+    vcd_add_signal(vcd, "io_sel", stats->selectBits);
+    vcd_add_signal(vcd, "io_load", 1);
+    vcd_add_signal(vcd, "io_cpu", stats->bitWidth);
+    vcd_add_signal(vcd, "cpu_io", stats->bitWidth);
+    vcd_add_signal(vcd, "mem_outa", stats->bitWidth);
+    vcd_add_signal(vcd, "mem_outb", stats->bitWidth);
+    for (u32 slot = 0; slot < stats->aluCount; ++slot)
+    {
+        // NOTE(michiel): Without the carry bit of the VHDL signal
+        vcd_add_signal(vcd, sim_alu_signal_name("out", slot), stats->bitWidth);
+    }
+    vcd_write_header(vcd, "cpu");
+}
+
+internal void
+sim_vcd_tick(OpCodeStats *stats, VcdWriter *vcd, SimState *state, OpCode *opCode, u32 pc, u32 tick)
+{
+    // NOTE(michiel): The control signals are those of the opcode that executes this tick, so
+    // the VHDL shows them one decode cycle after its pc. Selections and operations get the
+    // codes of gen_constants.vhd.
+    vcd_begin_tick(vcd, tick);
+    vcd_value(vcd, pc);
+    vcd_value(vcd, sim_mask(stats, opCode->immediate));
+    if (stats->addressBits)
+    {
+        vcd_value(vcd, opCode->memoryAddrA);
+        vcd_value(vcd, opCode->memoryAddrB);
+    }
+    vcd_value(vcd, opCode->memoryReadA);
+    vcd_value(vcd, opCode->memoryReadB);
+    vcd_value(vcd, opCode->memoryWrite);
+    vcd_value(vcd, get_opcode_field_value(stats, opCode, OpField_SelectMem));
+    for (u32 slot = 0; slot < stats->aluCount; ++slot)
+    {
+        vcd_value(vcd, get_opcode_field_value(stats, opCode, get_slot_field(slot, OpField_AluOp)));
+        vcd_value(vcd, get_opcode_field_value(stats, opCode, get_slot_field(slot, OpField_SelectAluA)));
+        vcd_value(vcd, get_opcode_field_value(stats, opCode, get_slot_field(slot, OpField_SelectAluB)));
+    }
+    vcd_value(vcd, get_opcode_field_value(stats, opCode, OpField_SelectIO));
+    vcd_value(vcd, opCode->selectIO != Select_Zero);
+    vcd_value(vcd, state->ioIn);
+    vcd_value(vcd, sim_select(stats, state, opCode, opCode->selectIO));
+    vcd_value(vcd, state->memOutA);
+    vcd_value(vcd, state->memOutB);
+    for (u32 slot = 0; slot < stats->aluCount; ++slot)
+    {
+        vcd_value(vcd, state->aluOut[slot]);
+    }
+    vcd_end_tick(vcd);
+}
+
+internal void
+sim_write_record(OpCodeStats *stats, u32 *pairs, char *fileName)
+{
+    // NOTE(michiel): One 'tick value' line per pair, read by gen_tb_cpu.vhd
+    FILE *file = fopen(fileName, "wb");
+    for (u32 pairIdx = 0; pairIdx < buf_len(pairs); pairIdx += 2)
+    {
+        fprintf(file, "%u %d\n", pairs[pairIdx], sim_signed(stats, pairs[pairIdx + 1]));
+    }
+    fclose(file);
+}
+
 internal void
 simulate(OpCodeStats *stats, u32 opCodeCount, OpCode *opCodes, u32 inputCount, u32 *inputs,
-         u32 clockTicks)
+         u32 clockTicks, VcdWriter *vcd, SimRecord *record, SimProfile *profile,
+         SimCheckpoint *checkpoint)
 {
+    // NOTE(michiel): Cycle accurate model of the datapath. A new input sample is presented
+    // every kernel interval, for a plain schedule that is every pass through the program.
+    // The decode stage delays everything by the same cycle, so only the ALU latency is
+    // modelled. With a VcdWriter every tick also goes into the wave dump, with a SimRecord
+    // the inputs and outputs are kept and a SimProfile counts the opcodes. A taken checkpoint
+    // is where the run starts, clockTicks stays the absolute end, and it gets the final state.
     i_expect(inputCount);
+    i_expect(opCodeCount);
     SimState state = {0};
-    
+    u32 registerCount = 1 << stats->addressBits;
+    u32 aluLatency = get_alu_latency(&stats->pipeline);
+    i_expect(aluLatency <= MAX_ALU_LATENCY);
+    state.registers = allocate_array(registerCount, u32, 0);
+
+    ModuloKernel *kernel = &stats->kernel;
+    i_expect(kernel->interval);
+    i_expect(kernel->start < opCodeCount);
+
     u32 inputIndex = 0;
-    state.ioIn = inputs[inputIndex];
-    inputIndex = (inputIndex + 1) % inputCount;
-    
-    fprintf(stdout, "Tick %3d: ", 0);
-    fprintf(stdout, "State: AddrA(%2d), AddrB(%2d), Alu(%2d), ioIn(%2d), ioOut(%2d) | ", state.memAddrA, state.memAddrB,
-            state.aluOut, state.ioIn, state.ioOut);
-    fprintf(stdout, "Mem  : 0(%2d), 1(%2d), 2(%2d), 3(%2d), 4(%2d), 5(%2d), 6(%2d)\n",
-            gSimRegisters[0], gSimRegisters[1], gSimRegisters[2], gSimRegisters[3], gSimRegisters[4], 
-            gSimRegisters[5], gSimRegisters[6]);
-    
-    for (u32 tick = 0; (tick < clockTicks) && (tick < opCodeCount); ++tick)
+    u32 sampleCount = 0;
+    u64 startSamples = 0;
+    u32 outputCount = 0;
+    u32 outputHash = 2166136261u;
+    u32 pc = 0;
+    u32 startTick = 0;
+    if (checkpoint && checkpoint->state.registers)
     {
-        OpCode *opCode = opCodes + tick;
-        SimState nextState = {0};
-        
-        u32 aluA = 0;
-        u32 aluB = 0;
-        switch (opCode->selectAluA)
+        i_expect(checkpoint->registerCount == registerCount);
+        u32 *registers = state.registers;
+        state = checkpoint->state;
+        state.registers = registers;
+        memcpy(state.registers, checkpoint->state.registers, registerCount * sizeof(u32));
+        pc = checkpoint->pc;
+        startTick = (u32)checkpoint->tick;
+        inputIndex = checkpoint->inputIndex % inputCount;
+        outputCount = (u32)checkpoint->outputCount;
+        outputHash = checkpoint->outputHash;
+        startSamples = checkpoint->samplesStarted;
+    }
+    u32 startOutputs = outputCount;
+
+    u32 tick = startTick;
+    for (; tick < clockTicks; ++tick)
+    {
+        if ((pc % kernel->interval) == 0)
         {
-            case Select_Zero: { aluA = 0; } break;
-            case Select_MemoryA: { aluA = gSimRegisters[state.memAddrA]; } break;
-            case Select_MemoryB: { aluA = gSimRegisters[state.memAddrB]; } break;
-             case Select_Immediate: { aluA = opCode->immediate; } break;
-            case Select_IO: { aluA = state.ioIn; } break;
-            case Select_Alu: { aluA = state.aluOut; } break;
-            INVALID_DEFAULT_CASE;
+            state.ioIn = sim_mask(stats, inputs[inputIndex]);
+            inputIndex = (inputIndex + 1) % inputCount;
+            ++sampleCount;
+            if (record)
+            {
+                buf_push(record->inputs, tick);
+                buf_push(record->inputs, state.ioIn);
+            }
         }
-        switch (opCode->selectAluB)
+
+        OpCode *opCode = opCodes + pc;
+        SimState nextState = state;
+        if (profile)
         {
-            case Select_Zero: { aluB = 0; } break;
-            case Select_MemoryA: { aluB = gSimRegisters[state.memAddrA]; } break;
-            case Select_MemoryB: { aluB = gSimRegisters[state.memAddrB]; } break;
-            case Select_Immediate: { aluB = opCode->immediate; } break;
-            case Select_IO: { aluB = state.ioIn; } break;
-            case Select_Alu: { aluB = state.aluOut; } break;
-            INVALID_DEFAULT_CASE;
+            ++profile->opCounts[pc];
         }
-        
-        switch (opCode->aluOperation)
+        if (vcd)
         {
-            case Alu_Noop:
-            {
-                nextState.aluOut = aluA;
-            } break;
-            
-            case Alu_And:
-            {
-                nextState.aluOut = aluA & aluB;
-            } break;
-            
-            case Alu_Or:
-            {
-                nextState.aluOut = aluA | aluB;
-            } break;
-            
-            case Alu_Add:
-            {
-                nextState.aluOut = aluA + aluB;
-            } break;
-            
-            INVALID_DEFAULT_CASE;
+            sim_vcd_tick(stats, vcd, &state, opCode, pc, tick);
         }
-        
-            switch (opCode->selectIO)
+
+        for (u32 slot = 0; slot < stats->aluCount; ++slot)
+        {
+            AluSlot *alu = opCode->aluSlots + slot;
+            u32 value = sim_alu(stats, alu->operation,
+                                sim_select(stats, &state, opCode, alu->selectA),
+                                sim_select(stats, &state, opCode, alu->selectB));
+            if (aluLatency == 1)
             {
-                case Select_Zero: { } break;
-            case Select_MemoryA: { nextState.ioOut = gSimRegisters[state.memAddrA]; } break;
-            case Select_MemoryB: { nextState.ioOut = gSimRegisters[state.memAddrB]; } break;
-            case Select_Immediate: { nextState.ioOut = opCode->immediate; } break;
-            case Select_IO: { nextState.ioOut = state.ioIn; } break;
-            case Select_Alu: { nextState.ioOut = state.aluOut; } break;
-                INVALID_DEFAULT_CASE;
+                nextState.aluOut[slot] = value;
             }
-        
-        if (opCode->memoryWrite)
+            else
+            {
+                nextState.aluOut[slot] = state.aluPending[slot][aluLatency - 2];
+                for (u32 stage = aluLatency - 2; stage > 0; --stage)
+                {
+                    nextState.aluPending[slot][stage] = state.aluPending[slot][stage - 1];
+                }
+                nextState.aluPending[slot][0] = value;
+            }
+        }
+
+        if (opCode->selectIO != Select_Zero)
         {
-            switch (opCode->selectMem)
+            nextState.ioOut = sim_select(stats, &state, opCode, opCode->selectIO);
+            fprintf(stdout, "Tick %4u: IO out %3u = %d\n", tick, outputCount++,
+                    sim_signed(stats, nextState.ioOut));
+            outputHash = (outputHash ^ nextState.ioOut) * 16777619;
+            if (record)
             {
-                case Select_Zero     : { gSimRegisters[opCode->memoryAddrA] = 0; } break;
-                case Select_MemoryA  : { gSimRegisters[opCode->memoryAddrA] = gSimRegisters[state.memAddrA]; } break;
-                case Select_MemoryB  : { gSimRegisters[opCode->memoryAddrA] = gSimRegisters[state.memAddrB]; } break;
-                case Select_Immediate: { gSimRegisters[opCode->memoryAddrA] = opCode->immediate; } break;
-                case Select_IO       : { gSimRegisters[opCode->memoryAddrA] = state.ioIn; } break;
-                case Select_Alu      : { gSimRegisters[opCode->memoryAddrA] = state.aluOut; } break;
-                
-                INVALID_DEFAULT_CASE;
+                buf_push(record->outputs, tick);
+                buf_push(record->outputs, nextState.ioOut);
             }
         }
-        
+
+        // NOTE(michiel): Reads see the register contents from before the write of this cycle
+        nextState.memOutA = 0;
+        nextState.memOutB = 0;
         if (opCode->memoryReadA)
         {
-            nextState.memAddrA = opCode->memoryAddrA;
+            i_expect(opCode->memoryAddrA < registerCount);
+            nextState.memOutA = state.registers[opCode->memoryAddrA];
         }
         if (opCode->memoryReadB)
         {
-            nextState.memAddrB = opCode->memoryAddrB;
+            i_expect(opCode->memoryAddrB < registerCount);
+            nextState.memOutB = state.registers[opCode->memoryAddrB];
+        }
+        if (opCode->memoryWrite)
+        {
+            i_expect(opCode->memoryAddrA < registerCount);
+            state.registers[opCode->memoryAddrA] = sim_select(stats, &state, opCode, opCode->selectMem);
         }
-        
-        nextState.ioIn = inputs[inputIndex];
+
         state = nextState;
-        inputIndex = (inputIndex + 1) % inputCount;
-        
-        fprintf(stdout, "Tick %3d: ", tick + 1);
-        fprintf(stdout, "State: AddrA(%2d), AddrB(%2d), Alu(%2d), ioIn(%2d), ioOut(%2d) | ", 
-                state.memAddrA, state.memAddrB, state.aluOut, state.ioIn, state.ioOut);
-        fprintf(stdout, "Mem  : 0(%2d), 1(%2d), 2(%2d), 3(%2d), 4(%2d), 5(%2d), 6(%2d)\n",
-                gSimRegisters[0], gSimRegisters[1], gSimRegisters[2], gSimRegisters[3], 
-                gSimRegisters[4], gSimRegisters[5], gSimRegisters[6]);
+        ++pc;
+        if (pc == opCodeCount)
+        {
+            pc = kernel->start;
+        }
+    }
+
+    if (profile)
+    {
+        profile->ticks = tick - startTick;
+        profile->samplesIn = sampleCount;
+        profile->samplesOut = outputCount - startOutputs;
+    }
+    if (checkpoint)
+    {
+        if (!checkpoint->state.registers)
+        {
+            checkpoint->state.registers = allocate_array(registerCount, u32, 0);
+            checkpoint->registerCount = registerCount;
+        }
+        u32 *registers = checkpoint->state.registers;
+        checkpoint->state = state;
+        checkpoint->state.registers = registers;
+        memcpy(registers, state.registers, registerCount * sizeof(u32));
+        checkpoint->pc = pc;
+        checkpoint->tick = tick;
+        checkpoint->inputIndex = inputIndex;
+        checkpoint->outputCount = outputCount;
+        checkpoint->outputHash = outputHash;
+        checkpoint->samplesStarted = startSamples + sampleCount;
+    }
+    deallocate(state.registers);
+}
+
+internal u32
+dataflow_evaluate(OpCodeStats *stats, Dataflow *dataflow, u32 *values, u32 input, DataflowOperand operand)
+{
+    u32 result = 0;
+    switch (operand.kind)
+    {
+        case DataflowOperand_Constant: { result = sim_mask(stats, operand.value); } break;
+        case DataflowOperand_Input: { result = input; } break;
+        case DataflowOperand_Node: { result = values[operand.value]; } break;
+        INVALID_DEFAULT_CASE;
+    }
+    return result;
+}
+
+internal void
+simulate_dataflow(OpCodeStats *stats, Dataflow *dataflow, u32 inputCount, u32 *inputs,
+                  u32 clockTicks)
+{
+    // NOTE(michiel): Sample accurate, a sample entering the input register at tick t has its
+    // outputs at tick t + latency + 1. Nodes are in dependency order.
+    i_expect(inputCount);
+    u32 *values = allocate_array(maximum(1, buf_len(dataflow->nodes)), u32, 0);
+    u32 latency = dataflow->latency + 1;
+    u32 outputCount = 0;
+    for (u32 tick = latency; tick < clockTicks; ++tick)
+    {
+        u32 input = sim_mask(stats, inputs[(tick - latency) % inputCount]);
+        for (u32 nodeIdx = 0; nodeIdx < buf_len(dataflow->nodes); ++nodeIdx)
+        {
+            DataflowNode *node = dataflow->nodes + nodeIdx;
+            values[nodeIdx] = sim_alu(stats, node->op,
+                                      dataflow_evaluate(stats, dataflow, values, input, node->a),
+                                      dataflow_evaluate(stats, dataflow, values, input, node->b));
+        }
+        for (u32 outputIdx = 0; outputIdx < buf_len(dataflow->outputs); ++outputIdx)
+        {
+            u32 value = dataflow_evaluate(stats, dataflow, values, input, dataflow->outputs[outputIdx]);
+            fprintf(stdout, "Tick %4u: IO out %3u = %d\n", tick, outputCount++,
+                    sim_signed(stats, value));
+        }
     }
+    deallocate(values);
 }
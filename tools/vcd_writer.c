@@ -0,0 +1,253 @@
+// NOTE(michiel): Value change dump writer for the simulator, for comparing a run with a GHDL
+// wave in GTKWave. Signals are added once, then every tick gets all their values in the same
+// order and only the changes are written. The text goes through its own buffer, a long run
+// writes whole blocks. A tick is one clock period of the testbench (tb_cpu.vhd), with the
+// rising edge at the start.
+
+#define VCD_BUFFER_SIZE  (256 * 1024)
+#define VCD_HALF_PERIOD  10  // NOTE(michiel): In ns, same clock as tb_cpu
+
+typedef struct VcdSignal
+{
+    char *name;
+    u32 bits;
+    b32 enabled;
+    char id[8];
+    u64 value;
+} VcdSignal;
+
+typedef struct VcdWriter
+{
+    FILE *file;
+    u8 *buffer;
+    u32 used;
+
+    u32 windowStart;
+    u32 windowEnd;   // NOTE(michiel): One past the last tick that is dumped, 0 for no end
+    char *filter;    // NOTE(michiel): Comma separated names, a trailing * matches a prefix
+
+    VcdSignal *signals;
+    u32 cursor;      // NOTE(michiel): Signal that gets the next value of this tick
+    u64 time;
+    b32 timeWritten;
+    b32 dumping;
+    b32 dumpAll;     // NOTE(michiel): First tick in the window writes every value
+    u64 changeCount;
+} VcdWriter;
+
+internal void
+vcd_flush(VcdWriter *vcd)
+{
+    if (vcd->used)
+    {
+        fwrite(vcd->buffer, 1, vcd->used, vcd->file);
+        vcd->used = 0;
+    }
+}
+
+internal inline void
+vcd_put(VcdWriter *vcd, u8 c)
+{
+    if (vcd->used == VCD_BUFFER_SIZE)
+    {
+        vcd_flush(vcd);
+    }
+    vcd->buffer[vcd->used++] = c;
+}
+
+internal void
+vcd_put_string(VcdWriter *vcd, char *string)
+{
+    while (*string)
+    {
+        vcd_put(vcd, *string++);
+    }
+}
+
+internal void
+vcd_put_u64(VcdWriter *vcd, u64 value)
+{
+    char digits[24];
+    u32 count = 0;
+    do
+    {
+        digits[count++] = '0' + (value % 10);
+        value /= 10;
+    } while (value);
+    while (count)
+    {
+        vcd_put(vcd, digits[--count]);
+    }
+}
+
+internal b32
+vcd_filter_match(char *filter, char *name)
+{
+    b32 result = (filter == 0);
+    char *at = filter;
+    while (!result && at && *at)
+    {
+        char *end = strchr(at, ',');
+        u32 length = end ? (u32)(end - at) : (u32)strlen(at);
+        if (length && (at[length - 1] == '*'))
+        {
+            result = strncmp(at, name, length - 1) == 0;
+        }
+        else
+        {
+            result = (strlen(name) == length) && (strncmp(at, name, length) == 0);
+        }
+        at = end ? end + 1 : 0;
+    }
+    return result;
+}
+
+internal b32
+vcd_open(VcdWriter *vcd, char *fileName, u32 windowStart, u32 windowEnd, char *filter)
+{
+    vcd->file = fopen(fileName, "wb");
+    if (vcd->file)
+    {
+        vcd->buffer = allocate_array(VCD_BUFFER_SIZE, u8, ALLOC_NOCLEAR);
+        vcd->windowStart = windowStart;
+        vcd->windowEnd = windowEnd;
+        vcd->filter = filter;
+    }
+    else
+    {
+        fprintf(stderr, "Could not open %s for the wave dump\n", fileName);
+    }
+    return vcd->file != 0;
+}
+
+internal void
+vcd_add_signal(VcdWriter *vcd, char *name, u32 bits)
+{
+    // NOTE(michiel): Identifiers are base 94 in the printable characters
+    VcdSignal signal = {0};
+    signal.name = name;
+    signal.bits = maximum(1, bits);
+    signal.enabled = vcd_filter_match(vcd->filter, name);
+    u32 index = buf_len(vcd->signals);
+    u32 idLength = 0;
+    do
+    {
+        signal.id[idLength++] = '!' + (index % 94);
+        index /= 94;
+    } while (index);
+    buf_push(vcd->signals, signal);
+}
+
+internal void
+vcd_write_header(VcdWriter *vcd, char *scope)
+{
+    vcd_put_string(vcd, "$version TURD machine simulator $end\n");
+    vcd_put_string(vcd, "$timescale 1ns $end\n");
+    vcd_put_string(vcd, "$scope module ");
+    vcd_put_string(vcd, scope);
+    vcd_put_string(vcd, " $end\n");
+    for (u32 signalIdx = 0; signalIdx < buf_len(vcd->signals); ++signalIdx)
+    {
+        VcdSignal *signal = vcd->signals + signalIdx;
+        if (signal->enabled)
+        {
+            vcd_put_string(vcd, "$var wire ");
+            vcd_put_u64(vcd, signal->bits);
+            vcd_put(vcd, ' ');
+            vcd_put_string(vcd, signal->id);
+            vcd_put(vcd, ' ');
+            vcd_put_string(vcd, signal->name);
+            if (signal->bits > 1)
+            {
+                vcd_put_string(vcd, " [");
+                vcd_put_u64(vcd, signal->bits - 1);
+                vcd_put_string(vcd, ":0]");
+            }
+            vcd_put_string(vcd, " $end\n");
+        }
+    }
+    vcd_put_string(vcd, "$upscope $end\n");
+    vcd_put_string(vcd, "$enddefinitions $end\n");
+}
+
+internal void
+vcd_set_time(VcdWriter *vcd, u64 time)
+{
+    // NOTE(michiel): The time is only written in front of the first change
+    vcd->time = time;
+    vcd->timeWritten = false;
+    vcd->cursor = 0;
+}
+
+internal void
+vcd_value(VcdWriter *vcd, u64 value)
+{
+    i_expect(vcd->cursor < buf_len(vcd->signals));
+    VcdSignal *signal = vcd->signals + vcd->cursor++;
+    if (signal->bits < 64)
+    {
+        value &= (1ULL << signal->bits) - 1;
+    }
+    if (signal->enabled && vcd->dumping && (vcd->dumpAll || (value != signal->value)))
+    {
+        if (!vcd->timeWritten)
+        {
+            vcd_put(vcd, '#');
+            vcd_put_u64(vcd, vcd->time);
+            vcd_put(vcd, '\n');
+            vcd->timeWritten = true;
+        }
+        if (signal->bits == 1)
+        {
+            vcd_put(vcd, '0' + (u8)value);
+        }
+        else
+        {
+            vcd_put(vcd, 'b');
+            u32 bit = signal->bits;
+            while ((bit > 1) && !(value & (1ULL << (bit - 1))))
+            {
+                --bit;
+            }
+            while (bit)
+            {
+                --bit;
+                vcd_put(vcd, (value & (1ULL << bit)) ? '1' : '0');
+            }
+            vcd_put(vcd, ' ');
+        }
+        vcd_put_string(vcd, signal->id);
+        vcd_put(vcd, '\n');
+        ++vcd->changeCount;
+    }
+    signal->value = value;
+}
+
+internal void
+vcd_begin_tick(VcdWriter *vcd, u32 tick)
+{
+    // NOTE(michiel): Signal 0 is the clock, the values of the other signals come after this
+    b32 inWindow = (tick >= vcd->windowStart) && (!vcd->windowEnd || (tick < vcd->windowEnd));
+    vcd->dumpAll = inWindow && !vcd->dumping;
+    vcd->dumping = inWindow;
+    vcd_set_time(vcd, (u64)tick * 2 * VCD_HALF_PERIOD);
+    vcd_value(vcd, 1);
+}
+
+internal void
+vcd_end_tick(VcdWriter *vcd)
+{
+    i_expect(vcd->cursor == buf_len(vcd->signals));
+    vcd->dumpAll = false;
+    vcd_set_time(vcd, vcd->time + VCD_HALF_PERIOD);
+    vcd_value(vcd, 0);
+}
+
+internal void
+vcd_close(VcdWriter *vcd)
+{
+    vcd_flush(vcd);
+    fclose(vcd->file);
+    deallocate(vcd->buffer);
+    buf_free(vcd->signals);
+}
@@ -43,16 +43,25 @@ generate_bitvalue_cstr(u64 value, u32 bits)
 }
 
 internal void
-generate_vhdl_header(FileStream output)
+generate_vhdl_libraries(FileStream output)
 {
-    fprintf(output.file, "-- Generated with the TURD machine 0.v.X9.y --\n\n");
-    
     fprintf(output.file, "library IEEE;\n");
     fprintf(output.file, "use IEEE.std_logic_1164.all;\n");
     fprintf(output.file, "use IEEE.numeric_std.all;\n\n");
 }
 
-#define PRINT_CONSTANT(con, bits) fprintf(output.file, "    constant %s : std_logic_vector(%u downto 0) := \"%s\";\n", #con, bits - 1, generate_bitvalue_cstr(con, bits))
+internal void
+generate_vhdl_header(FileStream output)
+{
+    fprintf(output.file, "-- Generated with the TURD machine 0.v.X9.y --\n\n");
+    
+    generate_vhdl_libraries(output);
+}
+
+// NOTE(michiel): Only the operations and selections the program uses get a constant
+#define PRINT_CONSTANT(con, used, codes, bits) if (used & (1 << con)) { fprintf(output.file, "    constant %s : std_logic_vector(%u downto 0) := \"%s\";\n", #con, bits - 1, generate_bitvalue_cstr(codes[con], bits)); }
+#define PRINT_ALU_OP(con) PRINT_CONSTANT(con, stats->aluOps, stats->aluOpCodes, stats->aluOpBits)
+#define PRINT_SELECT(con) PRINT_CONSTANT(con, selects, stats->selectCodes, stats->selectBits)
 
 internal void
 generate_constants(OpCodeStats *stats, FileStream output)
@@ -61,27 +70,325 @@ generate_constants(OpCodeStats *stats, FileStream output)
     
     fprintf(output.file, "package constants_and_co is\n\n");
     
-    PRINT_CONSTANT(Alu_Noop, stats->aluOpBits);
-    PRINT_CONSTANT(Alu_Or, stats->aluOpBits);
-    PRINT_CONSTANT(Alu_Xor, stats->aluOpBits);
-    PRINT_CONSTANT(Alu_And, stats->aluOpBits);
-    PRINT_CONSTANT(Alu_Add, stats->aluOpBits);
-    PRINT_CONSTANT(Alu_Sub, stats->aluOpBits);
+    PRINT_ALU_OP(Alu_Noop);
+    PRINT_ALU_OP(Alu_Or);
+    PRINT_ALU_OP(Alu_Xor);
+    PRINT_ALU_OP(Alu_And);
+    PRINT_ALU_OP(Alu_Add);
+    PRINT_ALU_OP(Alu_Sub);
+    PRINT_ALU_OP(Alu_Sll);
+    PRINT_ALU_OP(Alu_Srl);
+    PRINT_ALU_OP(Alu_Sra);
+    PRINT_ALU_OP(Alu_Mul);
     fprintf(output.file, "\n");
     
-    PRINT_CONSTANT(Select_Zero, stats->selectBits);
-    PRINT_CONSTANT(Select_MemoryA, stats->selectBits);
-    PRINT_CONSTANT(Select_MemoryB, stats->selectBits);
-    PRINT_CONSTANT(Select_Immediate, stats->selectBits);
-    PRINT_CONSTANT(Select_IO, stats->selectBits);
-    PRINT_CONSTANT(Select_Alu, stats->selectBits);
+    u32 selects = stats->memSelects | stats->ioSelects;
+    for (u32 slot = 0; slot < stats->aluCount; ++slot)
+    {
+        selects |= stats->aluSelectsA[slot] | stats->aluSelectsB[slot];
+    }
+    PRINT_SELECT(Select_Zero);
+    PRINT_SELECT(Select_MemoryA);
+    PRINT_SELECT(Select_MemoryB);
+    PRINT_SELECT(Select_Immediate);
+    PRINT_SELECT(Select_IO);
+    PRINT_SELECT(Select_Alu);
+    PRINT_SELECT(Select_Alu1);
+    PRINT_SELECT(Select_Alu2);
+    PRINT_SELECT(Select_Alu3);
     fprintf(output.file, "\n");
     
     fprintf(output.file, "end constants_and_co;\n");
 }
 
+#undef PRINT_SELECT
+#undef PRINT_ALU_OP
 #undef PRINT_CONSTANT
 
+internal void
+generate_opcode_flat_vhdl(OpCodeStats *stats, OpCode *opCodes, FileStream output)
+{
+    fprintf(output.file, "architecture RTL of OpCode is\n\n");
+    fprintf(output.file, "    type rom_block is array(0 to %u) ", (1 << stats->opCodeBits) - 1);
+    fprintf(output.file, "of std_logic_vector(%u downto 0);\n\n", stats->opCodeBitWidth - 1);
+    fprintf(output.file, "    signal rom_mem : rom_block := (\n");
+    BitVector opcValue = bitvec_allocate(stats->opCodeBitWidth);
+    for (u32 opcIdx = 0; opcIdx < stats->opCodeCount; ++opcIdx)
+    {
+        opcode_packing(stats, &opCodes[opcIdx], &opcValue);
+        fprintf(stdout, "OPCODE: %s\n", bitvec_to_hex(&opcValue));
+        fprintf(output.file, "         %2u => \"%s\"%s\n", opcIdx, bitvec_to_binary(&opcValue),
+                opcIdx < ((1 << stats->opCodeBits) - 1) ? "," : "");
+    }
+    bitvec_clear(&opcValue);
+    for (u32 opcIdx = stats->opCodeCount; opcIdx < (1 << stats->opCodeBits); ++opcIdx)
+    {
+        fprintf(output.file, "        %2u => \"%s\"%s\n", opcIdx, bitvec_to_binary(&opcValue),
+                opcIdx < ((1 << stats->opCodeBits) - 1) ? "," : "");
+    }
+    bitvec_free(&opcValue);
+    fprintf(output.file, "    );\n\n");
+    
+    fprintf(output.file, "begin\n\n");
+    fprintf(output.file, "    clocker : process(clk)\n");
+    fprintf(output.file, "    begin\n");
+    fprintf(output.file, "        if (clk'event and clk = '1') then\n");
+    fprintf(output.file, "            if (nrst = '0') then\n");
+    fprintf(output.file, "                opc <= (others => '0');\n");
+    fprintf(output.file, "            else\n");
+    fprintf(output.file, "                opc <= rom_mem(to_integer(unsigned(pc)));\n");
+    fprintf(output.file, "            end if;\n");
+    fprintf(output.file, "        end if;\n");
+    fprintf(output.file, "    end process;\n\n");
+    
+    fprintf(output.file, "end architecture ; -- RTL\n\n");
+}
+
+internal void
+generate_opcode_file_vhdl(OpCodeStats *stats, FileStream output)
+{
+    // NOTE(michiel): Synchronous read of a plain array, so synthesis infers a block RAM. The
+    // contents come from gen_opcodes.mem at elaboration, a program with the same shape only
+    // needs a new init file.
+    u32 paddedBits = ((stats->opCodeBitWidth + 3) / 4) * 4;
+    fprintf(output.file, "architecture RTL of OpCode is\n\n");
+    fprintf(output.file, "    type rom_block is array(0 to %u) ", (1 << stats->opCodeBits) - 1);
+    fprintf(output.file, "of std_logic_vector(%u downto 0);\n\n", stats->opCodeBitWidth - 1);
+    fprintf(output.file, "    impure function load_rom(file_name : string) return rom_block is\n");
+    fprintf(output.file, "        file rom_file     : text open read_mode is file_name;\n");
+    fprintf(output.file, "        variable rom_line : line;\n");
+    fprintf(output.file, "        variable word     : std_logic_vector(%u downto 0);\n", paddedBits - 1);
+    fprintf(output.file, "        variable result   : rom_block := (others => (others => '0'));\n");
+    fprintf(output.file, "    begin\n");
+    fprintf(output.file, "        for idx in rom_block'range loop\n");
+    fprintf(output.file, "            exit when endfile(rom_file);\n");
+    fprintf(output.file, "            readline(rom_file, rom_line);\n");
+    fprintf(output.file, "            hread(rom_line, word);\n");
+    fprintf(output.file, "            result(idx) := word(%u downto 0);\n", stats->opCodeBitWidth - 1);
+    fprintf(output.file, "        end loop;\n");
+    fprintf(output.file, "        return result;\n");
+    fprintf(output.file, "    end function;\n\n");
+    fprintf(output.file, "    signal rom_mem : rom_block := load_rom(\"gen_opcodes.mem\");\n\n");
+    
+    fprintf(output.file, "begin\n\n");
+    fprintf(output.file, "    clocker : process(clk)\n");
+    fprintf(output.file, "    begin\n");
+    fprintf(output.file, "        if (clk'event and clk = '1') then\n");
+    fprintf(output.file, "            if (nrst = '0') then\n");
+    fprintf(output.file, "                opc <= (others => '0');\n");
+    fprintf(output.file, "            else\n");
+    fprintf(output.file, "                opc <= rom_mem(to_integer(unsigned(pc)));\n");
+    fprintf(output.file, "            end if;\n");
+    fprintf(output.file, "        end if;\n");
+    fprintf(output.file, "    end process;\n\n");
+    
+    fprintf(output.file, "end architecture ; -- RTL\n\n");
+}
+
+internal void
+generate_opcode_loader_vhdl(OpCodeStats *stats, FileStream output)
+{
+    // NOTE(michiel): Microcode RAM of the generic core. While prog is high the rest of the
+    // core is held in reset and every word from the IO port goes to the loader: the last pc,
+    // the pc to restart at, then every opcode as words of BITS bits, least significant first.
+    u32 parts = (stats->opCodeBitWidth + stats->bitWidth - 1) / stats->bitWidth;
+    fprintf(output.file, "architecture RTL of OpCode is\n\n");
+    fprintf(output.file, "    constant PARTS : integer := %u;\n\n", parts);
+    fprintf(output.file, "    type rom_block is array(0 to %u) ", (1 << stats->opCodeBits) - 1);
+    fprintf(output.file, "of std_logic_vector(%u downto 0);\n\n", stats->opCodeBitWidth - 1);
+    fprintf(output.file, "    signal rom_mem       : rom_block := (others => (others => '0'));\n");
+    fprintf(output.file, "    signal load_header   : unsigned(1 downto 0);\n");
+    fprintf(output.file, "    signal load_part     : integer range 0 to PARTS - 1;\n");
+    fprintf(output.file, "    signal load_addr     : unsigned(%u downto 0);\n", stats->opCodeBits - 1);
+    fprintf(output.file, "    signal load_word     : std_logic_vector(PARTS * BITS - 1 downto 0);\n");
+    fprintf(output.file, "    signal pc_last_q     : std_logic_vector(%u downto 0) := (others => '0');\n", stats->opCodeBits - 1);
+    fprintf(output.file, "    signal pc_restart_q  : std_logic_vector(%u downto 0) := (others => '0');\n\n", stats->opCodeBits - 1);
+    
+    fprintf(output.file, "begin\n\n");
+    fprintf(output.file, "    pc_last    <= pc_last_q;\n");
+    fprintf(output.file, "    pc_restart <= pc_restart_q;\n\n");
+    
+    fprintf(output.file, "    loader : process(clk)\n");
+    fprintf(output.file, "        variable word : std_logic_vector(PARTS * BITS - 1 downto 0);\n");
+    fprintf(output.file, "    begin\n");
+    fprintf(output.file, "        if (clk'event and clk = '1') then\n");
+    fprintf(output.file, "            if (prog = '0') then\n");
+    fprintf(output.file, "                load_header <= \"00\";\n");
+    fprintf(output.file, "                load_part <= 0;\n");
+    fprintf(output.file, "                load_addr <= (others => '0');\n");
+    fprintf(output.file, "            elsif (wr_valid = '1') then\n");
+    fprintf(output.file, "                if (load_header = \"00\") then\n");
+    fprintf(output.file, "                    pc_last_q <= wr_data(%u downto 0);\n", stats->opCodeBits - 1);
+    fprintf(output.file, "                    load_header <= \"01\";\n");
+    fprintf(output.file, "                elsif (load_header = \"01\") then\n");
+    fprintf(output.file, "                    pc_restart_q <= wr_data(%u downto 0);\n", stats->opCodeBits - 1);
+    fprintf(output.file, "                    load_header <= \"10\";\n");
+    fprintf(output.file, "                else\n");
+    if (parts > 1)
+    {
+        fprintf(output.file, "                    word := wr_data & load_word(PARTS * BITS - 1 downto BITS);\n");
+    }
+    else
+    {
+        fprintf(output.file, "                    word := wr_data;\n");
+    }
+    fprintf(output.file, "                    load_word <= word;\n");
+    fprintf(output.file, "                    if (load_part = PARTS - 1) then\n");
+    fprintf(output.file, "                        rom_mem(to_integer(load_addr)) <= word(%u downto 0);\n",
+            stats->opCodeBitWidth - 1);
+    fprintf(output.file, "                        load_addr <= load_addr + 1;\n");
+    fprintf(output.file, "                        load_part <= 0;\n");
+    fprintf(output.file, "                    else\n");
+    fprintf(output.file, "                        load_part <= load_part + 1;\n");
+    fprintf(output.file, "                    end if;\n");
+    fprintf(output.file, "                end if;\n");
+    fprintf(output.file, "            end if;\n");
+    fprintf(output.file, "        end if;\n");
+    fprintf(output.file, "    end process;\n\n");
+    
+    fprintf(output.file, "    clocker : process(clk)\n");
+    fprintf(output.file, "    begin\n");
+    fprintf(output.file, "        if (clk'event and clk = '1') then\n");
+    fprintf(output.file, "            if (nrst = '0') then\n");
+    fprintf(output.file, "                opc <= (others => '0');\n");
+    fprintf(output.file, "            else\n");
+    fprintf(output.file, "                opc <= rom_mem(to_integer(unsigned(pc)));\n");
+    fprintf(output.file, "            end if;\n");
+    fprintf(output.file, "        end if;\n");
+    fprintf(output.file, "    end process;\n\n");
+    
+    fprintf(output.file, "end architecture ; -- RTL\n\n");
+}
+
+internal void
+generate_microcode_image(OpCodeStats *stats, OpCode *opCodes, FileStream output)
+{
+    // NOTE(michiel): The words the loader of the generic core expects, as little endian
+    // 32 bit words in the order they go over the IO port.
+    u32 parts = (stats->opCodeBitWidth + stats->bitWidth - 1) / stats->bitWidth;
+    u32 *words = 0;
+    buf_push(words, stats->opCodeCount - 1);
+    buf_push(words, stats->kernel.start);
+    BitVector opcValue = bitvec_allocate(stats->opCodeBitWidth);
+    for (u32 opcIdx = 0; opcIdx < stats->opCodeCount; ++opcIdx)
+    {
+        opcode_packing(stats, &opCodes[opcIdx], &opcValue);
+        for (u32 part = 0; part < parts; ++part)
+        {
+            u32 offset = part * stats->bitWidth;
+            u32 bits = minimum(stats->bitWidth, stats->opCodeBitWidth - offset);
+            buf_push(words, (u32)bitvec_get_field(&opcValue, offset, bits));
+        }
+    }
+    bitvec_free(&opcValue);
+    
+    for (u32 wordIdx = 0; wordIdx < buf_len(words); ++wordIdx)
+    {
+        for (u32 byte = 0; byte < 4; ++byte)
+        {
+            fputc((words[wordIdx] >> (byte * 8)) & 0xFF, output.file);
+        }
+    }
+    buf_free(words);
+}
+
+internal void
+generate_opcode_init_file(OpCodeStats *stats, OpCode *opCodes, FileStream output)
+{
+    // NOTE(michiel): One hex word per line for every ROM address, the padding stays idle
+    BitVector opcValue = bitvec_allocate(stats->opCodeBitWidth);
+    for (u32 opcIdx = 0; opcIdx < (1 << stats->opCodeBits); ++opcIdx)
+    {
+        bitvec_clear(&opcValue);
+        if (opcIdx < stats->opCodeCount)
+        {
+            opcode_packing(stats, &opCodes[opcIdx], &opcValue);
+        }
+        fprintf(output.file, "%s\n", bitvec_to_hex(&opcValue));
+    }
+    bitvec_free(&opcValue);
+}
+
+internal void
+generate_opcode_dictionary_vhdl(OpCodeStats *stats, OpCode *opCodes, FileStream output)
+{
+    // NOTE(michiel): The pc indexes a narrow ROM holding a control word index and an
+    // operand index. Both are looked up in the same cycle, so the opc output keeps the
+    // timing of the flat ROM.
+    RomDictionary dictionary = build_rom_dictionary(stats, opCodes);
+    u32 indexBits = dictionary.controlIndexBits + dictionary.operandIndexBits;
+    
+    fprintf(output.file, "architecture RTL of OpCode is\n\n");
+    fprintf(output.file, "    type index_block is array(0 to %u) ", (1 << stats->opCodeBits) - 1);
+    fprintf(output.file, "of std_logic_vector(%u downto 0);\n", indexBits - 1);
+    fprintf(output.file, "    type control_block is array(0 to %u) ", dictionary.controlCount - 1);
+    fprintf(output.file, "of std_logic_vector(%u downto 0);\n", dictionary.controlBits - 1);
+    fprintf(output.file, "    type operand_block is array(0 to %u) ", dictionary.operandCount - 1);
+    fprintf(output.file, "of std_logic_vector(%u downto 0);\n\n", dictionary.operandBits - 1);
+    
+    fprintf(output.file, "    signal index_mem : index_block := (\n");
+    for (u32 opcIdx = 0; opcIdx < (1 << stats->opCodeBits); ++opcIdx)
+    {
+        // NOTE(michiel): Padding entries are never reached, they point to the first entries.
+        u64 index = 0;
+        if (opcIdx < stats->opCodeCount)
+        {
+            index = ((u64)dictionary.controlIndex[opcIdx] << dictionary.operandIndexBits) |
+                dictionary.operandIndex[opcIdx];
+        }
+        fprintf(output.file, "        %2u => \"%s\"%s\n", opcIdx, generate_bitvalue_cstr(index, indexBits),
+                opcIdx < ((1 << stats->opCodeBits) - 1) ? "," : "");
+    }
+    fprintf(output.file, "    );\n\n");
+    
+    fprintf(output.file, "    signal control_mem : control_block := (\n");
+    for (u32 controlIdx = 0; controlIdx < dictionary.controlCount; ++controlIdx)
+    {
+        fprintf(output.file, "        %2u => \"%s\"%s\n", controlIdx,
+                bitvec_to_binary(dictionary.controls + controlIdx),
+                controlIdx < (dictionary.controlCount - 1) ? "," : "");
+    }
+    fprintf(output.file, "    );\n\n");
+    
+    fprintf(output.file, "    signal operand_mem : operand_block := (\n");
+    for (u32 operandIdx = 0; operandIdx < dictionary.operandCount; ++operandIdx)
+    {
+        fprintf(output.file, "        %2u => \"%s\"%s\n", operandIdx,
+                bitvec_to_binary(dictionary.operands + operandIdx),
+                operandIdx < (dictionary.operandCount - 1) ? "," : "");
+    }
+    fprintf(output.file, "    );\n\n");
+    
+    fprintf(output.file, "    signal rom_index : std_logic_vector(%u downto 0);\n\n", indexBits - 1);
+    
+    fprintf(output.file, "begin\n\n");
+    fprintf(output.file, "    rom_index <= index_mem(to_integer(unsigned(pc)));\n\n");
+    fprintf(output.file, "    clocker : process(clk)\n");
+    fprintf(output.file, "    begin\n");
+    fprintf(output.file, "        if (clk'event and clk = '1') then\n");
+    fprintf(output.file, "            if (nrst = '0') then\n");
+    fprintf(output.file, "                opc <= (others => '0');\n");
+    fprintf(output.file, "            else\n");
+    fprintf(output.file, "                opc <= control_mem(to_integer(unsigned(rom_index(%u downto %u)))) &\n",
+            indexBits - 1, dictionary.operandIndexBits);
+    if (dictionary.operandIndexBits)
+    {
+        fprintf(output.file, "                       operand_mem(to_integer(unsigned(rom_index(%u downto 0))));\n",
+                dictionary.operandIndexBits - 1);
+    }
+    else
+    {
+        fprintf(output.file, "                       operand_mem(0);\n");
+    }
+    fprintf(output.file, "            end if;\n");
+    fprintf(output.file, "        end if;\n");
+    fprintf(output.file, "    end process;\n\n");
+    
+    fprintf(output.file, "end architecture ; -- RTL\n\n");
+    
+    free_rom_dictionary(&dictionary);
+}
+
 internal void
 generate_opcode_vhdl(OpCodeStats *stats, OpCode *opCodes, FileStream output)
 {
@@ -89,47 +396,256 @@ generate_opcode_vhdl(OpCodeStats *stats, OpCode *opCodes, FileStream output)
     i_expect(stats->opCodeBitWidth);
     
     generate_vhdl_header(output);
+    if ((stats->romInit != RomInit_Inline) && (stats->core != Core_Generic))
+    {
+        fprintf(output.file, "use std.textio.all;\n");
+        fprintf(output.file, "use IEEE.std_logic_textio.all;\n\n");
+    }
     
     fprintf(output.file, "entity OpCode is\n");
+    if (stats->core == Core_Generic)
+    {
+        fprintf(output.file, "    generic (\n");
+        fprintf(output.file, "        BITS   : integer := %u\n", stats->bitWidth);
+        fprintf(output.file, "    );\n");
+    }
     fprintf(output.file, "    port (\n");
     fprintf(output.file, "        clk    : in  std_logic;\n");
     fprintf(output.file, "        nrst   : in  std_logic;\n\n");
+    if (stats->core == Core_Generic)
+    {
+        fprintf(output.file, "        prog       : in  std_logic;\n");
+        fprintf(output.file, "        wr_valid   : in  std_logic;\n");
+        fprintf(output.file, "        wr_data    : in  std_logic_vector(BITS - 1 downto 0);\n");
+        fprintf(output.file, "        pc_last    : out std_logic_vector(%u downto 0);\n", stats->opCodeBits - 1);
+        fprintf(output.file, "        pc_restart : out std_logic_vector(%u downto 0);\n\n", stats->opCodeBits - 1);
+    }
     fprintf(output.file, "        pc     : in  std_logic_vector(%u downto 0);\n", stats->opCodeBits - 1);
     fprintf(output.file, "        opc    : out std_logic_vector(%u downto 0)\n", stats->opCodeBitWidth - 1);
     fprintf(output.file, "    );\n");
     fprintf(output.file, "end entity; -- OpCode\n\n");
     
-    fprintf(output.file, "architecture RTL of OpCode is\n\n");
-    fprintf(output.file, "    type rom_block is array(0 to %u) ", (1 << stats->opCodeBits) - 1);
-    fprintf(output.file, "of std_logic_vector(%u downto 0);\n\n", stats->opCodeBitWidth - 1);
-    fprintf(output.file, "    signal rom_mem : rom_block := (\n");
-    for (u32 opcIdx = 0; opcIdx < stats->opCodeCount; ++opcIdx)
+    if (stats->core == Core_Generic)
     {
-        u64 opcValue = opcode_packing(stats, &opCodes[opcIdx]);
-        fprintf(stdout, "OPCODE: %016lX\n", opcValue);
-        fprintf(output.file, "         %2u => \"%s\"%s\n", opcIdx, generate_bitvalue_cstr(opcValue, stats->opCodeBitWidth),
-                opcIdx < ((1 << stats->opCodeBits) - 1) ? "," : "");
+        generate_opcode_loader_vhdl(stats, output);
     }
-    for (u32 opcIdx = stats->opCodeCount; opcIdx < (1 << stats->opCodeBits); ++opcIdx)
+    else if (stats->romInit != RomInit_Inline)
     {
-        fprintf(output.file, "        %2u => \"%s\"%s\n", opcIdx, generate_bitvalue_cstr(0UL, stats->opCodeBitWidth),
-                opcIdx < ((1 << stats->opCodeBits) - 1) ? "," : "");
+        generate_opcode_file_vhdl(stats, output);
     }
-    fprintf(output.file, "    );\n\n");
+    else if (stats->romLayout == RomLayout_Dictionary)
+    {
+        generate_opcode_dictionary_vhdl(stats, opCodes, output);
+    }
+    else
+    {
+        generate_opcode_flat_vhdl(stats, opCodes, output);
+    }
+}
+
+internal void
+generate_constant_bank(OpCodeStats *stats, FileStream output)
+{
+    // NOTE(michiel): Asynchronous ROM with every distinct immediate, the controller reads it
+    // with the index from the opcode. The words are immediateBits wide and get sign extended
+    // like inline immediates. Lives in the controller file, it is only used there.
+    i_expect(stats->constantCount);
+    
+    fprintf(output.file, "entity ConstantBank is\n");
+    fprintf(output.file, "    generic (\n");
+    fprintf(output.file, "        BITS : integer := %u\n", stats->immediateBits);
+    fprintf(output.file, "    );\n");
+    fprintf(output.file, "    port (\n");
+    fprintf(output.file, "        addr : in  std_logic_vector(%u downto 0);\n", stats->constantIndexBits - 1);
+    fprintf(output.file, "        data : out std_logic_vector(BITS - 1 downto 0)\n");
+    fprintf(output.file, "    );\n");
+    fprintf(output.file, "end entity; -- ConstantBank\n\n");
     
+    fprintf(output.file, "architecture RTL of ConstantBank is\n\n");
+    fprintf(output.file, "    type rom_block is array(0 to %u) ", (1 << stats->constantIndexBits) - 1);
+    fprintf(output.file, "of std_logic_vector(BITS - 1 downto 0);\n\n");
+    fprintf(output.file, "    constant rom_mem : rom_block := (\n");
+    for (u32 constIdx = 0; constIdx < stats->constantCount; ++constIdx)
+    {
+        fprintf(output.file, "        %2u => std_logic_vector(to_signed(%d, BITS)),\n", constIdx,
+                stats->constants[constIdx]);
+    }
+    fprintf(output.file, "        others => (others => '0')\n");
+    fprintf(output.file, "    );\n\n");
     fprintf(output.file, "begin\n\n");
-    fprintf(output.file, "    clocker : process(clk)\n");
+    fprintf(output.file, "    data <= rom_mem(to_integer(unsigned(addr)));\n\n");
+    fprintf(output.file, "end architecture ; -- RTL\n\n");
+}
+
+internal void
+generate_loop_signals(OpCodeStats *stats, FileStream output)
+{
+    HardwareLoop *loop = &stats->loop;
+    String loopStart = generate_bitvalue(loop->start, stats->opCodeBits);
+    String loopEnd = generate_bitvalue(loop->start + loop->length - 1, stats->opCodeBits);
+    String loopLast = generate_bitvalue(loop->count - 1, loop->counterBits);
+    fprintf(output.file, "    constant LOOP_START     : unsigned(%u downto 0) := \"%.*s\";\n",
+            stats->opCodeBits - 1, loopStart.size, loopStart.data);
+    fprintf(output.file, "    constant LOOP_END       : unsigned(%u downto 0) := \"%.*s\";\n",
+            stats->opCodeBits - 1, loopEnd.size, loopEnd.data);
+    fprintf(output.file, "    constant LOOP_LAST      : unsigned(%u downto 0) := \"%.*s\";\n",
+            loop->counterBits - 1, loopLast.size, loopLast.data);
+    fprintf(output.file, "    signal loop_iter        : unsigned(%u downto 0);\n", loop->counterBits - 1);
+    if (loop->strideA)
+    {
+        // NOTE(michiel): Negative strides wrap around, the addresses stay in range
+        String stride = generate_bitvalue((u32)loop->strideA, stats->addressBits);
+        fprintf(output.file, "    constant STRIDE_A       : unsigned(%u downto 0) := \"%.*s\";\n",
+                stats->addressBits - 1, stride.size, stride.data);
+        fprintf(output.file, "    signal addr_offset_a    : unsigned(%u downto 0);\n", stats->addressBits - 1);
+        fprintf(output.file, "    signal addr_offset_a_d  : unsigned(%u downto 0);\n", stats->addressBits - 1);
+        if (stats->pipeline.decodeStage)
+        {
+            fprintf(output.file, "    signal addr_offset_a_p  : unsigned(%u downto 0);\n", stats->addressBits - 1);
+        }
+    }
+    if (loop->strideB)
+    {
+        String stride = generate_bitvalue((u32)loop->strideB, stats->addressBits);
+        fprintf(output.file, "    constant STRIDE_B       : unsigned(%u downto 0) := \"%.*s\";\n",
+                stats->addressBits - 1, stride.size, stride.data);
+        fprintf(output.file, "    signal addr_offset_b    : unsigned(%u downto 0);\n", stats->addressBits - 1);
+        fprintf(output.file, "    signal addr_offset_b_d  : unsigned(%u downto 0);\n", stats->addressBits - 1);
+        if (stats->pipeline.decodeStage)
+        {
+            fprintf(output.file, "    signal addr_offset_b_p  : unsigned(%u downto 0);\n", stats->addressBits - 1);
+        }
+    }
+}
+
+internal void
+generate_loop_counter(OpCodeStats *stats, FileStream output)
+{
+    // NOTE(michiel): The opcode ROM output lags the pc by a cycle, so the address offsets
+    // used to decode opc are delayed by a cycle as well. The decode stage adds another one.
+    HardwareLoop *loop = &stats->loop;
+    fprintf(output.file, "    loop_clk : process(clk)\n");
     fprintf(output.file, "    begin\n");
     fprintf(output.file, "        if (clk'event and clk = '1') then\n");
     fprintf(output.file, "            if (nrst = '0') then\n");
-    fprintf(output.file, "                opc <= (others => '0');\n");
+    fprintf(output.file, "                loop_iter <= (others => '0');\n");
+    if (loop->strideA)
+    {
+        fprintf(output.file, "                addr_offset_a <= (others => '0');\n");
+        fprintf(output.file, "                addr_offset_a_d <= (others => '0');\n");
+        if (stats->pipeline.decodeStage)
+        {
+            fprintf(output.file, "                addr_offset_a_p <= (others => '0');\n");
+        }
+    }
+    if (loop->strideB)
+    {
+        fprintf(output.file, "                addr_offset_b <= (others => '0');\n");
+        fprintf(output.file, "                addr_offset_b_d <= (others => '0');\n");
+        if (stats->pipeline.decodeStage)
+        {
+            fprintf(output.file, "                addr_offset_b_p <= (others => '0');\n");
+        }
+    }
     fprintf(output.file, "            else\n");
-    fprintf(output.file, "                opc <= rom_mem(to_integer(unsigned(pc)));\n");
+    if (loop->strideA)
+    {
+        if (stats->pipeline.decodeStage)
+        {
+            fprintf(output.file, "                addr_offset_a_p <= addr_offset_a;\n");
+            fprintf(output.file, "                addr_offset_a_d <= addr_offset_a_p;\n");
+        }
+        else
+        {
+            fprintf(output.file, "                addr_offset_a_d <= addr_offset_a;\n");
+        }
+    }
+    if (loop->strideB)
+    {
+        if (stats->pipeline.decodeStage)
+        {
+            fprintf(output.file, "                addr_offset_b_p <= addr_offset_b;\n");
+            fprintf(output.file, "                addr_offset_b_d <= addr_offset_b_p;\n");
+        }
+        else
+        {
+            fprintf(output.file, "                addr_offset_b_d <= addr_offset_b;\n");
+        }
+    }
+    fprintf(output.file, "                if (pc_counter = LOOP_END) then\n");
+    fprintf(output.file, "                    if (loop_iter /= LOOP_LAST) then\n");
+    fprintf(output.file, "                        loop_iter <= loop_iter + 1;\n");
+    if (loop->strideA)
+    {
+        fprintf(output.file, "                        addr_offset_a <= addr_offset_a + STRIDE_A;\n");
+    }
+    if (loop->strideB)
+    {
+        fprintf(output.file, "                        addr_offset_b <= addr_offset_b + STRIDE_B;\n");
+    }
+    fprintf(output.file, "                    else\n");
+    fprintf(output.file, "                        loop_iter <= (others => '0');\n");
+    if (loop->strideA)
+    {
+        fprintf(output.file, "                        addr_offset_a <= (others => '0');\n");
+    }
+    if (loop->strideB)
+    {
+        fprintf(output.file, "                        addr_offset_b <= (others => '0');\n");
+    }
+    fprintf(output.file, "                    end if;\n");
+    fprintf(output.file, "                end if;\n");
     fprintf(output.file, "            end if;\n");
     fprintf(output.file, "        end if;\n");
     fprintf(output.file, "    end process;\n\n");
-    
-    fprintf(output.file, "end architecture ; -- RTL\n\n");
+}
+
+internal char *
+generate_opcode_field(OpCodeStats *stats, OpCodeField field)
+{
+    // NOTE(michiel): The bits of a control field in the opcode, or its hard-wired value
+    OpCodeFieldInfo *info = stats->fields + field;
+    i_expect(info->bits);
+    String result = {0};
+    if (info->kind == OpFieldKind_Constant)
+    {
+        if (info->isBit)
+        {
+            result = create_string(info->value ? "'1'" : "'0'");
+        }
+        else
+        {
+            result = create_string_fmt("\"%s\"", generate_bitvalue_cstr(info->value, info->bits));
+        }
+    }
+    else if (info->isBit)
+    {
+        result = create_string_fmt("opc(%u)", info->offset);
+    }
+    else
+    {
+        result = create_string_fmt("opc(%u downto %u)", info->offset + info->bits - 1, info->offset);
+    }
+    return (char *)result.data;
+}
+
+internal char *
+generate_use_b_select(OpCodeStats *stats, char *value, b32 whenSet)
+{
+    // NOTE(michiel): The value when use B matches, zero otherwise. A hard-wired use B picks
+    // one of the two right away.
+    OpCodeFieldInfo *info = stats->fields + OpField_UseB;
+    String result = {0};
+    if (info->kind == OpFieldKind_Constant)
+    {
+        result = create_string(((info->value != 0) == whenSet) ? value : "(others => '0')");
+    }
+    else
+    {
+        result = create_string_fmt("%s when (%s = '%c') else (others => '0')", value,
+                                   generate_opcode_field(stats, OpField_UseB), whenSet ? '1' : '0');
+    }
+    return (char *)result.data;
 }
 
 internal void
@@ -140,6 +656,11 @@ generate_controller(OpCodeStats *stats, FileStream output)
     i_expect(stats->immediateBits <= stats->bitWidth);
     
     generate_vhdl_header(output);
+    if (stats->immediateMode == Immediate_ConstantBank)
+    {
+        generate_constant_bank(stats, output);
+        generate_vhdl_libraries(output);
+    }
     fprintf(output.file, "entity Controller is\n");
     fprintf(output.file, "    generic (\n");
     fprintf(output.file, "        BITS : integer := %u\n", stats->bitWidth);
@@ -149,6 +670,11 @@ generate_controller(OpCodeStats *stats, FileStream output)
     fprintf(output.file, "        nrst      : in  std_logic;\n\n");
     fprintf(output.file, "        io_rdy    : in  std_logic;\n");
     fprintf(output.file, "        opc       : in  std_logic_vector(%u downto 0);\n\n", stats->opCodeBitWidth - 1);
+    if (stats->core == Core_Generic)
+    {
+        fprintf(output.file, "        pc_last    : in  std_logic_vector(%u downto 0);\n", stats->opCodeBits - 1);
+        fprintf(output.file, "        pc_restart : in  std_logic_vector(%u downto 0);\n\n", stats->opCodeBits - 1);
+    }
     fprintf(output.file, "        pc        : out std_logic_vector(%u downto 0);\n", stats->opCodeBits - 1);
     fprintf(output.file, "        immediate : out std_logic_vector(BITS - 1 downto 0);\n\n");
     
@@ -165,48 +691,100 @@ generate_controller(OpCodeStats *stats, FileStream output)
     fprintf(output.file, "        alu_op    : out std_logic_vector(%u downto 0);\n\n", stats->aluOpBits - 1);
     fprintf(output.file, "        alu_sela  : out std_logic_vector(%u downto 0);\n", stats->selectBits - 1);
     fprintf(output.file, "        alu_selb  : out std_logic_vector(%u downto 0);\n", stats->selectBits - 1);
+    for (u32 slot = 1; slot < stats->aluCount; ++slot)
+    {
+        fprintf(output.file, "        alu%u_op   : out std_logic_vector(%u downto 0);\n", slot, stats->aluOpBits - 1);
+        fprintf(output.file, "        alu%u_sela : out std_logic_vector(%u downto 0);\n", slot, stats->selectBits - 1);
+        fprintf(output.file, "        alu%u_selb : out std_logic_vector(%u downto 0);\n", slot, stats->selectBits - 1);
+    }
     fprintf(output.file, "        io_sel    : out std_logic_vector(%u downto 0)\n", stats->selectBits - 1);
     fprintf(output.file, "    );\n");
     fprintf(output.file, "end entity ; -- Controller\n\n");
     
     fprintf(output.file, "architecture FSM of Controller is\n\n");
-    fprintf(output.file, "    signal pc_counter       : unsigned(%u downto 0);\n\n", stats->opCodeBits - 1);
+    fprintf(output.file, "    signal pc_counter       : unsigned(%u downto 0);\n", stats->opCodeBits - 1);
+    if (stats->kernel.start && (stats->core != Core_Generic))
+    {
+        String kernelStart = generate_bitvalue(stats->kernel.start, stats->opCodeBits);
+        fprintf(output.file, "    constant KERNEL_START   : unsigned(%u downto 0) := \"%.*s\";\n",
+                stats->opCodeBits - 1, kernelStart.size, kernelStart.data);
+    }
+    if (stats->loop.enabled)
+    {
+        generate_loop_signals(stats, output);
+    }
+    if (stats->immediateMode == Immediate_ConstantBank)
+    {
+        fprintf(output.file, "    signal constant_data    : std_logic_vector(%u downto 0);\n",
+                stats->immediateBits - 1);
+    }
+    fprintf(output.file, "\n");
     fprintf(output.file, "begin\n\n");
     
     fprintf(output.file, "    pc        <= std_logic_vector(pc_counter);\n");
-    if (stats->immediateBits < stats->bitWidth)
+    if (stats->immediateMode == Immediate_ConstantBank)
     {
-        fprintf(output.file, "    immediate(%u downto 0) <= opc(%u downto %u) when (opc(%u) = '0') else (others => '0');\n", stats->immediateBits - 1,
-                get_offset_immediate(stats) + stats->immediateBits - 1, get_offset_immediate(stats), get_offset_useB(stats));
-        fprintf(output.file, "    immediate(%u downto %u) <= (others => '0');\n\n",
-                stats->bitWidth - 1, stats->immediateBits);
+        fprintf(output.file, "    immediate <= %s;\n\n",
+                generate_use_b_select(stats, "std_logic_vector(resize(signed(constant_data), BITS))", false));
+        fprintf(output.file, "    constants : entity work.ConstantBank\n");
+        fprintf(output.file, "    generic map (BITS => %u)\n", stats->immediateBits);
+        fprintf(output.file, "    port map (\n");
+        fprintf(output.file, "        addr       => opc(%u downto %u),\n",
+                get_offset_immediate(stats) + stats->constantIndexBits - 1, get_offset_immediate(stats));
+        fprintf(output.file, "        data       => constant_data);\n\n");
     }
     else
     {
-                fprintf(output.file, "    immediate <= opc(BITS - 1 downto 0) when (opc(%u) = '0') else (others => '0');\n\n", get_offset_useB(stats));
+        // NOTE(michiel): Immediates are signed, so they get sign extended to the datapath width
+        char *value = (char *)create_string_fmt("std_logic_vector(resize(signed(opc(%u downto %u)), BITS))",
+                                                get_offset_immediate(stats) + stats->immediateBits - 1,
+                                                get_offset_immediate(stats)).data;
+        fprintf(output.file, "    immediate <= %s;\n\n", generate_use_b_select(stats, value, false));
     }
     
     if (stats->addressBits > 0)
     {
-    fprintf(output.file, "    mem_write <= opc(%u);\n", get_offset_mem_write(stats));
-    fprintf(output.file, "    mem_reada <= opc(%u);\n", get_offset_mem_read_a(stats));
-    fprintf(output.file, "    mem_readb <= opc(%u);\n", get_offset_mem_read_b(stats));
+    fprintf(output.file, "    mem_write <= %s;\n", generate_opcode_field(stats, OpField_MemWrite));
+    fprintf(output.file, "    mem_reada <= %s;\n", generate_opcode_field(stats, OpField_MemReadA));
+    fprintf(output.file, "    mem_readb <= %s;\n", generate_opcode_field(stats, OpField_MemReadB));
+    if (stats->loop.strideA)
+    {
+        fprintf(output.file, "    mem_addra <= std_logic_vector(unsigned(opc(%u downto %u)) + addr_offset_a_d);\n",
+                get_offset_addr_a(stats) + stats->addressBits - 1, get_offset_addr_a(stats));
+    }
+    else
+    {
     fprintf(output.file, "    mem_addra <= opc(%u downto %u);\n",
             get_offset_addr_a(stats) + stats->addressBits - 1, get_offset_addr_a(stats));
-    fprintf(output.file, "    mem_addrb <= opc(%u downto %u) when (opc(%u) = '1') "
-            "else (others => '0');\n\n", 
-                get_offset_addr_b(stats) + stats->addressBits - 1, get_offset_addr_b(stats), get_offset_useB(stats));
-        fprintf(output.file, "    mem_sel   <= opc(%u downto %u);\n",
-                get_offset_sel_mem(stats) + stats->selectBits - 1, get_offset_sel_mem(stats));
-    }
-    fprintf(output.file, "    alu_op    <= opc(%u downto %u);\n\n",
-            get_offset_alu_op(stats) + stats->aluOpBits - 1, get_offset_alu_op(stats));
-    fprintf(output.file, "    alu_sela  <= opc(%u downto %u);\n",
-            get_offset_sel_alu_a(stats) + stats->selectBits - 1, get_offset_sel_alu_a(stats));
-    fprintf(output.file, "    alu_selb  <= opc(%u downto %u);\n",
-            get_offset_sel_alu_b(stats) + stats->selectBits - 1, get_offset_sel_alu_b(stats));
-    fprintf(output.file, "    io_sel    <= opc(%u downto %u);\n\n",
-            get_offset_sel_io(stats) + stats->selectBits - 1, get_offset_sel_io(stats));
+    }
+    if (stats->loop.strideB)
+    {
+        char *value = (char *)create_string_fmt("std_logic_vector(unsigned(opc(%u downto %u)) + addr_offset_b_d)",
+                                                get_offset_addr_b(stats) + stats->addressBits - 1,
+                                                get_offset_addr_b(stats)).data;
+        fprintf(output.file, "    mem_addrb <= %s;\n\n", generate_use_b_select(stats, value, true));
+    }
+    else
+    {
+        char *value = (char *)create_string_fmt("opc(%u downto %u)", get_offset_addr_b(stats) + stats->addressBits - 1,
+                                                get_offset_addr_b(stats)).data;
+        fprintf(output.file, "    mem_addrb <= %s;\n\n", generate_use_b_select(stats, value, true));
+    }
+        fprintf(output.file, "    mem_sel   <= %s;\n", generate_opcode_field(stats, OpField_SelectMem));
+    }
+    fprintf(output.file, "    alu_op    <= %s;\n\n", generate_opcode_field(stats, OpField_AluOp));
+    fprintf(output.file, "    alu_sela  <= %s;\n", generate_opcode_field(stats, OpField_SelectAluA));
+    fprintf(output.file, "    alu_selb  <= %s;\n", generate_opcode_field(stats, OpField_SelectAluB));
+    for (u32 slot = 1; slot < stats->aluCount; ++slot)
+    {
+        fprintf(output.file, "    alu%u_op   <= %s;\n", slot,
+                generate_opcode_field(stats, get_slot_field(slot, OpField_AluOp)));
+        fprintf(output.file, "    alu%u_sela <= %s;\n", slot,
+                generate_opcode_field(stats, get_slot_field(slot, OpField_SelectAluA)));
+        fprintf(output.file, "    alu%u_selb <= %s;\n", slot,
+                generate_opcode_field(stats, get_slot_field(slot, OpField_SelectAluB)));
+    }
+    fprintf(output.file, "    io_sel    <= %s;\n\n", generate_opcode_field(stats, OpField_SelectIO));
     
     fprintf(output.file, "    fsm_clk : process(clk)\n");
     fprintf(output.file, "    begin\n");
@@ -214,31 +792,68 @@ generate_controller(OpCodeStats *stats, FileStream output)
     fprintf(output.file, "            if (nrst = '0') then\n");
     fprintf(output.file, "                pc_counter <= (others => '0');\n");
     fprintf(output.file, "            else\n");
+    // NOTE(michiel): The generic core gets the program length from its loader
     String pcCountMax = generate_bitvalue(stats->opCodeCount - 1, stats->opCodeBits);
+    if (stats->core == Core_Generic)
+    {
+        pcCountMax = create_string("unsigned(pc_last)");
+    }
+    else
+    {
+        pcCountMax = create_string_fmt("\"%.*s\"", pcCountMax.size, pcCountMax.data);
+    }
+    if (stats->loop.enabled)
+    {
+        // NOTE(michiel): Jump back in the same cycle, so a loop iteration costs nothing
+        fprintf(output.file, "                if (pc_counter = LOOP_END) and (loop_iter /= LOOP_LAST) then\n");
+        fprintf(output.file, "                    pc_counter <= LOOP_START;\n");
+        fprintf(output.file, "                els");
+    }
+    else
+    {
+        fprintf(output.file, "                ");
+    }
     if (stats->synced)
     {
         String pcZero = generate_bitvalue(0, stats->opCodeBits);
         fprintf(output.file,
-                "                if (pc_counter = \"%.*s\") and (io_rdy = '1') then\n",
+                "if (pc_counter = \"%.*s\") and (io_rdy = '1') then\n",
                 pcZero.size, pcZero.data);
         fprintf(output.file, "                    pc_counter <= pc_counter + 1;\n");
         fprintf(output.file,
-                "                elsif (pc_counter /= \"%.*s\") and (pc_counter < \"%.*s\") then",
+                "                elsif (pc_counter /= \"%.*s\") and (pc_counter < %.*s) then",
                 pcZero.size, pcZero.data, pcCountMax.size, pcCountMax.data);
     }
     else
     {
-    fprintf(output.file, "                if (pc_counter < \"%.*s\") then\n",
+    fprintf(output.file, "if (pc_counter < %.*s) then\n",
                 pcCountMax.size, pcCountMax.data);
     }
     fprintf(output.file, "                    pc_counter <= pc_counter + 1;\n");
     fprintf(output.file, "                else\n");
+    if (stats->core == Core_Generic)
+    {
+        fprintf(output.file, "                    pc_counter <= unsigned(pc_restart);\n");
+    }
+    else if (stats->kernel.start)
+    {
+        // NOTE(michiel): The prologue of a modulo schedule only runs after a reset
+        fprintf(output.file, "                    pc_counter <= KERNEL_START;\n");
+    }
+    else
+    {
     fprintf(output.file, "                    pc_counter <= (others => '0');\n");
+    }
     fprintf(output.file, "                end if;\n");
     fprintf(output.file, "            end if;\n");
     fprintf(output.file, "        end if;\n");
     fprintf(output.file, "    end process;\n\n");
     
+    if (stats->loop.enabled)
+    {
+        generate_loop_counter(stats, output);
+    }
+    
     fprintf(output.file, "end architecture; -- FSM\n\n");
 }
 
@@ -273,46 +888,243 @@ generate_registers(OpCodeStats *stats, FileStream output)
     fprintf(output.file, "    signal ram_mem : ram_block := (others => (others => '0'));\n\n");
     fprintf(output.file, "    signal out_a, out_b : std_logic_vector(BITS - 1 downto 0);\n\n");
     
-    fprintf(output.file, "begin\n\n");
-    fprintf(output.file, "    data_out_a <= out_a;\n");
-    fprintf(output.file, "    data_out_b <= out_b;\n\n");
+    fprintf(output.file, "begin\n\n");
+    fprintf(output.file, "    data_out_a <= out_a;\n");
+    fprintf(output.file, "    data_out_b <= out_b;\n\n");
+    fprintf(output.file, "    clocker : process(clk)\n");
+    fprintf(output.file, "    begin\n");
+    fprintf(output.file, "        if (clk'event and clk = '1') then\n");
+    fprintf(output.file, "            if (nrst = '0') then\n");
+    fprintf(output.file, "                out_a <= (others => '0');\n");
+    fprintf(output.file, "                out_b <= (others => '0');\n");
+    fprintf(output.file, "            else\n");
+    fprintf(output.file, "                -- Read\n");
+    fprintf(output.file, "                if (rd_a = '1') then\n");
+    //fprintf(output.file, "                    if (we = '1') then\n");
+    //fprintf(output.file, "                        out_a <= data_in;\n");
+    //fprintf(output.file, "                    else\n");
+    fprintf(output.file, "                        out_a <= ram_mem(to_integer(unsigned(addr_a)));\n");
+    //fprintf(output.file, "                    end if;\n");
+    fprintf(output.file, "                else\n");
+    fprintf(output.file, "                    out_a <= (others => '0');\n");
+    fprintf(output.file, "                end if;\n");
+    fprintf(output.file, "                if (rd_b = '1') then\n");
+    fprintf(output.file, "                    out_b <= ram_mem(to_integer(unsigned(addr_b)));\n");
+    fprintf(output.file, "                else\n");
+    fprintf(output.file, "                    out_b <= (others => '0');\n");
+    fprintf(output.file, "                end if;\n\n");
+    fprintf(output.file, "                -- Write\n");
+    fprintf(output.file, "                if (we = '1') then\n");
+    fprintf(output.file, "                    ram_mem(to_integer(unsigned(addr_a))) <= data_in;\n");
+    fprintf(output.file, "                end if;\n");
+    fprintf(output.file, "            end if;\n");
+    fprintf(output.file, "        end if;\n");
+    fprintf(output.file, "    end process;\n\n");
+    fprintf(output.file, "end architecture ; -- RTL\n\n");
+}
+
+internal void
+generate_alu(OpCodeStats *stats, FileStream output)
+{
+    // NOTE(michiel): Same interface as hwsrc/alu.vhd, but only with the operations the
+    // program uses. The multiplier section follows the one in hwsrc/alu.vhd.
+    u32 shifts = (1 << Alu_Sll) | (1 << Alu_Srl) | (1 << Alu_Sra);
+    b32 hasShifter = (stats->aluOps & shifts) != 0;
+    b32 hasMultiplier = (stats->aluOps & (1 << Alu_Mul)) != 0;
+    
+    generate_vhdl_header(output);
+    fprintf(output.file, "use work.constants_and_co.all;\n\n");
+    
+    fprintf(output.file, "entity ALU is\n");
+    fprintf(output.file, "    generic (\n");
+    fprintf(output.file, "        BITS       : integer := %u;\n", stats->bitWidth);
+    fprintf(output.file, "        OP_BITS    : integer := %u;\n", stats->aluOpBits);
+    fprintf(output.file, "        STAGES     : integer := 1;\n");
+    fprintf(output.file, "        MUL_STAGES : integer := 0\n");
+    fprintf(output.file, "    );\n");
+    fprintf(output.file, "    port (\n");
+    fprintf(output.file, "        clk  : in  std_logic;\n");
+    fprintf(output.file, "        nrst : in  std_logic;\n\n");
+    fprintf(output.file, "        a    : in  std_logic_vector(BITS - 1 downto 0);\n");
+    fprintf(output.file, "        b    : in  std_logic_vector(BITS - 1 downto 0);\n\n");
+    fprintf(output.file, "        op   : in  std_logic_vector(OP_BITS - 1 downto 0);\n\n");
+    fprintf(output.file, "        p    : out std_logic_vector(BITS downto 0)\n");
+    fprintf(output.file, "    );\n");
+    fprintf(output.file, "end entity; -- ALU\n\n");
+    
+    fprintf(output.file, "architecture RTL of ALU is\n\n");
+    fprintf(output.file, "    type stage_array is array(0 to STAGES - 1) of std_logic_vector(BITS downto 0);\n\n");
+    if (hasShifter)
+    {
+        fprintf(output.file, "    -- Bits of b the barrel shifter looks at, enough to count to BITS - 1\n");
+        fprintf(output.file, "    function amount_bits(width : integer) return integer is\n");
+        fprintf(output.file, "        variable result : integer := 1;\n");
+        fprintf(output.file, "    begin\n");
+        fprintf(output.file, "        while (2 ** result < width) loop\n");
+        fprintf(output.file, "            result := result + 1;\n");
+        fprintf(output.file, "        end loop;\n");
+        fprintf(output.file, "        return result;\n");
+        fprintf(output.file, "    end function;\n\n");
+        fprintf(output.file, "    constant SHIFT_BITS : integer := amount_bits(BITS);\n\n");
+    }
+    fprintf(output.file, "    signal result   : std_logic_vector(BITS downto 0);\n");
+    fprintf(output.file, "    signal selected : std_logic_vector(BITS downto 0);\n");
+    fprintf(output.file, "    signal stage    : stage_array;\n\n");
+    if (hasShifter)
+    {
+        fprintf(output.file, "    signal amount    : natural range 0 to 2 ** SHIFT_BITS - 1;\n");
+        fprintf(output.file, "    signal shift_out : std_logic;\n\n");
+    }
+    
+    fprintf(output.file, "begin\n\n");
+    fprintf(output.file, "    p <= stage(STAGES - 1);\n\n");
+    if (hasShifter)
+    {
+        fprintf(output.file, "    amount <= to_integer(unsigned(b(SHIFT_BITS - 1 downto 0)));\n");
+        fprintf(output.file, "    shift_out <= '1' when (unsigned(b) >= BITS) else '0';\n\n");
+    }
+    
+    if (hasMultiplier)
+    {
+        i_expect(stats->pipeline.mulStages);
+        fprintf(output.file, "    multiplier : block\n");
+        fprintf(output.file, "        signal product : std_logic_vector(BITS downto 0);\n");
+        if (stats->pipeline.mulStages > 1)
+        {
+            fprintf(output.file, "        type delay_array is array(1 to MUL_STAGES - 1) of std_logic_vector(BITS downto 0);\n");
+            fprintf(output.file, "        type op_array is array(1 to MUL_STAGES - 1) of std_logic_vector(OP_BITS - 1 downto 0);\n\n");
+            fprintf(output.file, "        signal products : delay_array;\n");
+            fprintf(output.file, "        signal results  : delay_array;\n");
+            fprintf(output.file, "        signal ops      : op_array;\n");
+        }
+        fprintf(output.file, "    begin\n");
+        fprintf(output.file, "        product <= std_logic_vector(resize(signed(a) * signed(b), BITS + 1));\n\n");
+        if (stats->pipeline.mulStages > 1)
+        {
+            fprintf(output.file, "        selected <= products(MUL_STAGES - 1) when (ops(MUL_STAGES - 1) = Alu_Mul) else\n");
+            fprintf(output.file, "                    results(MUL_STAGES - 1);\n\n");
+            fprintf(output.file, "        -- Directly behind the multiply, so they fit in the DSP pipeline registers\n");
+            fprintf(output.file, "        delays : process(clk)\n");
+            fprintf(output.file, "        begin\n");
+            fprintf(output.file, "            if (clk'event and clk = '1') then\n");
+            fprintf(output.file, "                products(1) <= product;\n");
+            fprintf(output.file, "                results(1) <= result;\n");
+            fprintf(output.file, "                ops(1) <= op;\n");
+            fprintf(output.file, "                for idx in 2 to MUL_STAGES - 1 loop\n");
+            fprintf(output.file, "                    products(idx) <= products(idx - 1);\n");
+            fprintf(output.file, "                    results(idx) <= results(idx - 1);\n");
+            fprintf(output.file, "                    ops(idx) <= ops(idx - 1);\n");
+            fprintf(output.file, "                end loop;\n");
+            fprintf(output.file, "            end if;\n");
+            fprintf(output.file, "        end process;\n");
+        }
+        else
+        {
+            fprintf(output.file, "        selected <= product when (op = Alu_Mul) else result;\n");
+        }
+        fprintf(output.file, "    end block;\n\n");
+    }
+    else
+    {
+        fprintf(output.file, "    selected <= result;\n\n");
+    }
+    
+    fprintf(output.file, "    operation : process(a, b, op%s)\n", hasShifter ? ", amount, shift_out" : "");
+    fprintf(output.file, "    begin\n");
+    fprintf(output.file, "        case (op) is\n");
+    if (stats->aluOps & (1 << Alu_Noop))
+    {
+        fprintf(output.file, "            when Alu_Noop =>\n");
+        fprintf(output.file, "                result(BITS - 1 downto 0) <= a;\n");
+        fprintf(output.file, "                result(BITS) <= a(BITS - 1);\n");
+    }
+    if (stats->aluOps & (1 << Alu_And))
+    {
+        fprintf(output.file, "            when Alu_And =>\n");
+        fprintf(output.file, "                result(BITS - 1 downto 0) <= a and b;\n");
+        fprintf(output.file, "                result(BITS) <= '0';\n");
+    }
+    if (stats->aluOps & (1 << Alu_Or))
+    {
+        fprintf(output.file, "            when Alu_Or =>\n");
+        fprintf(output.file, "                result(BITS - 1 downto 0) <= a or b;\n");
+        fprintf(output.file, "                result(BITS) <= '0';\n");
+    }
+    if (stats->aluOps & (1 << Alu_Xor))
+    {
+        fprintf(output.file, "            when Alu_Xor =>\n");
+        fprintf(output.file, "                result(BITS - 1 downto 0) <= a xor b;\n");
+        fprintf(output.file, "                result(BITS) <= '0';\n");
+    }
+    if (stats->aluOps & (1 << Alu_Add))
+    {
+        fprintf(output.file, "            when Alu_Add =>\n");
+        fprintf(output.file, "                result <= std_logic_vector(signed(a(BITS - 1) & a) +\n");
+        fprintf(output.file, "                                           signed(b(BITS - 1) & b));\n");
+    }
+    if (stats->aluOps & (1 << Alu_Sub))
+    {
+        fprintf(output.file, "            when Alu_Sub =>\n");
+        fprintf(output.file, "                result <= std_logic_vector(signed(a(BITS - 1) & a) -\n");
+        fprintf(output.file, "                                           signed(b(BITS - 1) & b));\n");
+    }
+    if (stats->aluOps & (1 << Alu_Sll))
+    {
+        fprintf(output.file, "            when Alu_Sll =>\n");
+        fprintf(output.file, "                if (shift_out = '1') then\n");
+        fprintf(output.file, "                    result(BITS - 1 downto 0) <= (others => '0');\n");
+        fprintf(output.file, "                else\n");
+        fprintf(output.file, "                    result(BITS - 1 downto 0) <= std_logic_vector(shift_left(unsigned(a), amount));\n");
+        fprintf(output.file, "                end if;\n");
+        fprintf(output.file, "                result(BITS) <= '0';\n");
+    }
+    if (stats->aluOps & (1 << Alu_Srl))
+    {
+        fprintf(output.file, "            when Alu_Srl =>\n");
+        fprintf(output.file, "                if (shift_out = '1') then\n");
+        fprintf(output.file, "                    result(BITS - 1 downto 0) <= (others => '0');\n");
+        fprintf(output.file, "                else\n");
+        fprintf(output.file, "                    result(BITS - 1 downto 0) <= std_logic_vector(shift_right(unsigned(a), amount));\n");
+        fprintf(output.file, "                end if;\n");
+        fprintf(output.file, "                result(BITS) <= '0';\n");
+    }
+    if (stats->aluOps & (1 << Alu_Sra))
+    {
+        fprintf(output.file, "            when Alu_Sra =>\n");
+        fprintf(output.file, "                if (shift_out = '1') then\n");
+        fprintf(output.file, "                    result(BITS - 1 downto 0) <= (others => a(BITS - 1));\n");
+        fprintf(output.file, "                else\n");
+        fprintf(output.file, "                    result(BITS - 1 downto 0) <= std_logic_vector(shift_right(signed(a), amount));\n");
+        fprintf(output.file, "                end if;\n");
+        fprintf(output.file, "                result(BITS) <= a(BITS - 1);\n");
+    }
+    fprintf(output.file, "            when others =>\n");
+    fprintf(output.file, "                result <= (others => '0');\n");
+    fprintf(output.file, "        end case;\n");
+    fprintf(output.file, "    end process;\n\n");
+    
     fprintf(output.file, "    clocker : process(clk)\n");
     fprintf(output.file, "    begin\n");
     fprintf(output.file, "        if (clk'event and clk = '1') then\n");
     fprintf(output.file, "            if (nrst = '0') then\n");
-    fprintf(output.file, "                out_a <= (others => '0');\n");
-    fprintf(output.file, "                out_b <= (others => '0');\n");
+    fprintf(output.file, "                stage <= (others => (others => '0'));\n");
     fprintf(output.file, "            else\n");
-    fprintf(output.file, "                -- Read\n");
-    fprintf(output.file, "                if (rd_a = '1') then\n");
-    //fprintf(output.file, "                    if (we = '1') then\n");
-    //fprintf(output.file, "                        out_a <= data_in;\n");
-    //fprintf(output.file, "                    else\n");
-    fprintf(output.file, "                        out_a <= ram_mem(to_integer(unsigned(addr_a)));\n");
-    //fprintf(output.file, "                    end if;\n");
-    fprintf(output.file, "                else\n");
-    fprintf(output.file, "                    out_a <= (others => '0');\n");
-    fprintf(output.file, "                end if;\n");
-    fprintf(output.file, "                if (rd_b = '1') then\n");
-    fprintf(output.file, "                    out_b <= ram_mem(to_integer(unsigned(addr_b)));\n");
-    fprintf(output.file, "                else\n");
-    fprintf(output.file, "                    out_b <= (others => '0');\n");
-    fprintf(output.file, "                end if;\n\n");
-    fprintf(output.file, "                -- Write\n");
-    fprintf(output.file, "                if (we = '1') then\n");
-    fprintf(output.file, "                    ram_mem(to_integer(unsigned(addr_a))) <= data_in;\n");
-    fprintf(output.file, "                end if;\n");
+    fprintf(output.file, "                stage(0) <= selected;\n");
+    fprintf(output.file, "                for idx in 1 to STAGES - 1 loop\n");
+    fprintf(output.file, "                    stage(idx) <= stage(idx - 1);\n");
+    fprintf(output.file, "                end loop;\n");
     fprintf(output.file, "            end if;\n");
     fprintf(output.file, "        end if;\n");
     fprintf(output.file, "    end process;\n\n");
-    fprintf(output.file, "end architecture ; -- RTL\n\n");
+    fprintf(output.file, "end architecture ; -- RTL\n");
 }
 
-#define PRINT_OPTION(name, type) fprintf(output.file, "        %s when %s,\n", name, #type)
+#define PRINT_OPTION(name, type) if (selects & (1 << type)) { fprintf(output.file, "        %s when %s,\n", name, #type); }
 #define PRINT_CASE_OPTION(name, assign, type) fprintf(output.file, "                when %s => %s <= %s;\n", #type, assign, name);
 internal void
-generate_select_statement_(char *name, char *selName, FileStream output)
+generate_select_statement_(OpCodeStats *stats, char *name, char *selName, u32 selects, FileStream output)
 {
+    // NOTE(michiel): Only the inputs this mux selects somewhere in the program
     #if 0
     fprintf(output.file, "    proc_%s : process(clk)\n", name);
     fprintf(output.file, "    begin\n");
@@ -334,12 +1146,65 @@ generate_select_statement_(char *name, char *selName, FileStream output)
     PRINT_OPTION("immediate", Select_Immediate);
     PRINT_OPTION("io_cpu   ", Select_IO);
     PRINT_OPTION("alu_trunc", Select_Alu);
+    for (u32 slot = 1; slot < stats->aluCount; ++slot)
+    {
+        if (selects & (1 << (Select_Alu + slot)))
+        {
+            fprintf(output.file, "        alu%u_trunc when Select_Alu%u,\n", slot, slot);
+        }
+    }
     fprintf(output.file, "        (others => '0') when others;\n\n");
     #endif
 }
             #undef PRINT_CASE_OPTION
             #undef PRINT_OPTION
 
+internal void
+generate_pipeline_registers(OpCodeStats *stats, FileStream output)
+{
+    // NOTE(michiel): The compiler scheduled around these, nothing stalls on them
+    fprintf(output.file, "    pipeline_clk : process(clk)\n");
+    fprintf(output.file, "    begin\n");
+    fprintf(output.file, "        if (clk'event and clk = '1') then\n");
+    fprintf(output.file, "            if (synced_nrst = '0') then\n");
+    if (stats->pipeline.decodeStage)
+    {
+        fprintf(output.file, "                opc <= (others => '0');\n");
+    }
+    if (stats->pipeline.operandStage)
+    {
+        fprintf(output.file, "                alu_a_q <= (others => '0');\n");
+        fprintf(output.file, "                alu_b_q <= (others => '0');\n");
+        fprintf(output.file, "                alu_op_q <= (others => '0');\n");
+        for (u32 slot = 1; slot < stats->aluCount; ++slot)
+        {
+            fprintf(output.file, "                alu%u_a_q <= (others => '0');\n", slot);
+            fprintf(output.file, "                alu%u_b_q <= (others => '0');\n", slot);
+            fprintf(output.file, "                alu%u_op_q <= (others => '0');\n", slot);
+        }
+    }
+    fprintf(output.file, "            else\n");
+    if (stats->pipeline.decodeStage)
+    {
+        fprintf(output.file, "                opc <= opc_rom;\n");
+    }
+    if (stats->pipeline.operandStage)
+    {
+        fprintf(output.file, "                alu_a_q <= alu_a;\n");
+        fprintf(output.file, "                alu_b_q <= alu_b;\n");
+        fprintf(output.file, "                alu_op_q <= alu_op;\n");
+        for (u32 slot = 1; slot < stats->aluCount; ++slot)
+        {
+            fprintf(output.file, "                alu%u_a_q <= alu%u_a;\n", slot, slot);
+            fprintf(output.file, "                alu%u_b_q <= alu%u_b;\n", slot, slot);
+            fprintf(output.file, "                alu%u_op_q <= alu%u_op;\n", slot, slot);
+        }
+    }
+    fprintf(output.file, "            end if;\n");
+    fprintf(output.file, "        end if;\n");
+    fprintf(output.file, "    end process;\n\n");
+}
+
 #define CSTR_(x) #x
 #define CSTR(x) CSTR_(x)
 
@@ -360,6 +1225,10 @@ generate_cpu_main(OpCodeStats *stats, FileStream output)
     fprintf(output.file, "    port (\n");
     fprintf(output.file, "        clk     : in  std_logic;\n");
     fprintf(output.file, "        nrst    : in  std_logic;\n\n");
+    if (stats->core == Core_Generic)
+    {
+        fprintf(output.file, "        prog    : in  std_logic; -- Loads the words on d_in as microcode\n");
+    }
     fprintf(output.file, "        load    : in  std_logic;\n");
     fprintf(output.file, "        d_in    : in  std_logic_vector(BITS - 1 downto 0);\n");
     fprintf(output.file, "        ready   : out std_logic;\n");
@@ -369,10 +1238,19 @@ generate_cpu_main(OpCodeStats *stats, FileStream output)
     
     fprintf(output.file, "architecture RTL of CPU is\n\n");
     fprintf(output.file, "    signal synced_nrst : std_logic;\n\n");
+    if (stats->core == Core_Generic)
+    {
+        fprintf(output.file, "    signal io_nrst : std_logic;\n");
+        fprintf(output.file, "    signal pc_last, pc_restart : std_logic_vector(%u downto 0);\n\n", stats->opCodeBits - 1);
+    }
     fprintf(output.file, "    signal cpu_io, io_cpu : std_logic_vector(BITS - 1 downto 0);\n");
     fprintf(output.file, "    signal io_load, io_rdy : std_logic;\n\n");
     fprintf(output.file, "    signal pc  : std_logic_vector(%u downto 0);\n", stats->opCodeBits - 1);
     fprintf(output.file, "    signal opc : std_logic_vector(%u downto 0);\n\n", stats->opCodeBitWidth - 1);
+    if (stats->pipeline.decodeStage)
+    {
+        fprintf(output.file, "    signal opc_rom : std_logic_vector(%u downto 0);\n\n", stats->opCodeBitWidth - 1);
+    }
     fprintf(output.file, "    signal cpu_mem, mem_outa, mem_outb : std_logic_vector(BITS - 1 downto 0);\n\n");
     if (stats->addressBits > 0)
     {
@@ -383,28 +1261,78 @@ generate_cpu_main(OpCodeStats *stats, FileStream output)
     fprintf(output.file, "    signal alu_out : std_logic_vector(BITS downto 0);\n");
     fprintf(output.file, "    signal alu_trunc : std_logic_vector(BITS - 1 downto 0);\n\n");
     fprintf(output.file, "    signal alu_op : std_logic_vector(%u downto 0);\n\n", stats->aluOpBits - 1);
+    for (u32 slot = 1; slot < stats->aluCount; ++slot)
+    {
+        fprintf(output.file, "    signal alu%u_a, alu%u_b : std_logic_vector(BITS - 1 downto 0);\n", slot, slot);
+        fprintf(output.file, "    signal alu%u_out : std_logic_vector(BITS downto 0);\n", slot);
+        fprintf(output.file, "    signal alu%u_trunc : std_logic_vector(BITS - 1 downto 0);\n", slot);
+        fprintf(output.file, "    signal alu%u_op : std_logic_vector(%u downto 0);\n", slot, stats->aluOpBits - 1);
+        fprintf(output.file, "    signal alu%u_sela, alu%u_selb : std_logic_vector(%u downto 0);\n\n", slot, slot,
+                stats->selectBits - 1);
+    }
+    if (stats->pipeline.operandStage)
+    {
+        fprintf(output.file, "    signal alu_a_q, alu_b_q : std_logic_vector(BITS - 1 downto 0);\n");
+        fprintf(output.file, "    signal alu_op_q : std_logic_vector(%u downto 0);\n", stats->aluOpBits - 1);
+        for (u32 slot = 1; slot < stats->aluCount; ++slot)
+        {
+            fprintf(output.file, "    signal alu%u_a_q, alu%u_b_q : std_logic_vector(BITS - 1 downto 0);\n", slot, slot);
+            fprintf(output.file, "    signal alu%u_op_q : std_logic_vector(%u downto 0);\n", slot, stats->aluOpBits - 1);
+        }
+        fprintf(output.file, "\n");
+    }
     fprintf(output.file, "    signal immediate : std_logic_vector(BITS - 1 downto 0);\n\n");
     fprintf(output.file, "    signal alu_sela, alu_selb, mem_sel, io_sel : std_logic_vector(%u downto 0);\n\n", stats->selectBits - 1);
     
     fprintf(output.file, "begin\n\n");
-    fprintf(output.file, "    alu_trunc <= alu_out(BITS - 1 downto 0);\n\n");
-    generate_select_statement_("alu_a", "alu_sela", output);
-    generate_select_statement_("alu_b", "alu_selb", output);
-    generate_select_statement_("cpu_mem", "mem_sel", output);
-    generate_select_statement_("cpu_io", "io_sel", output);
+    fprintf(output.file, "    alu_trunc <= alu_out(BITS - 1 downto 0);\n");
+    for (u32 slot = 1; slot < stats->aluCount; ++slot)
+    {
+        fprintf(output.file, "    alu%u_trunc <= alu%u_out(BITS - 1 downto 0);\n", slot, slot);
+    }
+    fprintf(output.file, "\n");
+    generate_select_statement_(stats, "alu_a", "alu_sela", stats->aluSelectsA[0], output);
+    generate_select_statement_(stats, "alu_b", "alu_selb", stats->aluSelectsB[0], output);
+    for (u32 slot = 1; slot < stats->aluCount; ++slot)
+    {
+        char aluName[32];
+        char selName[32];
+        snprintf(aluName, sizeof(aluName), "alu%u_a", slot);
+        snprintf(selName, sizeof(selName), "alu%u_sela", slot);
+        generate_select_statement_(stats, aluName, selName, stats->aluSelectsA[slot], output);
+        snprintf(aluName, sizeof(aluName), "alu%u_b", slot);
+        snprintf(selName, sizeof(selName), "alu%u_selb", slot);
+        generate_select_statement_(stats, aluName, selName, stats->aluSelectsB[slot], output);
+    }
+    generate_select_statement_(stats, "cpu_mem", "mem_sel", stats->memSelects, output);
+    generate_select_statement_(stats, "cpu_io", "io_sel", stats->ioSelects, output);
     fprintf(output.file, "    process(clk)\n");
     fprintf(output.file, "    begin\n");
     fprintf(output.file, "        if (clk'event and clk = '1') then\n");
+    if (stats->core == Core_Generic)
+    {
+        // NOTE(michiel): The IO keeps running while the loader takes its words
+        fprintf(output.file, "            synced_nrst <= nrst and not prog;\n");
+        fprintf(output.file, "            io_nrst <= nrst;\n");
+    }
+    else
+    {
     fprintf(output.file, "            synced_nrst <= nrst;\n");
+    }
     fprintf(output.file, "        end if;\n");
     fprintf(output.file, "    end process;\n\n");
     
+    if (stats->pipeline.decodeStage || stats->pipeline.operandStage)
+    {
+        generate_pipeline_registers(stats, output);
+    }
+    
     fprintf(output.file, "    io_load <= '1' when (io_sel /= %s) else '0';\n\n", CSTR(Select_Zero));
     fprintf(output.file, "    io : entity work.IO\n");
     fprintf(output.file, "    generic map (BITS => BITS)\n");
     fprintf(output.file, "    port map (\n");
     fprintf(output.file, "        clk        => clk,\n");
-    fprintf(output.file, "        nrst       => synced_nrst,\n");
+    fprintf(output.file, "        nrst       => %s,\n", (stats->core == Core_Generic) ? "io_nrst" : "synced_nrst");
     fprintf(output.file, "        IO_load    => io_load,\n");
     fprintf(output.file, "        IO_out     => cpu_io,\n");
     fprintf(output.file, "        IO_rdy     => io_rdy,\n");
@@ -415,11 +1343,23 @@ generate_cpu_main(OpCodeStats *stats, FileStream output)
     fprintf(output.file, "        d_out      => d_out);\n\n");
     
     fprintf(output.file, "    opcodes : entity work.OpCode\n");
+    if (stats->core == Core_Generic)
+    {
+        fprintf(output.file, "    generic map (BITS => BITS)\n");
+    }
     fprintf(output.file, "    port map (\n");
     fprintf(output.file, "        clk      => clk,\n");
     fprintf(output.file, "        nrst     => synced_nrst,\n");
+    if (stats->core == Core_Generic)
+    {
+        fprintf(output.file, "        prog     => prog,\n");
+        fprintf(output.file, "        wr_valid => io_rdy,\n");
+        fprintf(output.file, "        wr_data  => io_cpu,\n");
+        fprintf(output.file, "        pc_last  => pc_last,\n");
+        fprintf(output.file, "        pc_restart => pc_restart,\n");
+    }
     fprintf(output.file, "        pc       => pc,\n");
-    fprintf(output.file, "        opc      => opc);\n\n");
+    fprintf(output.file, "        opc      => %s);\n\n", stats->pipeline.decodeStage ? "opc_rom" : "opc");
     
     if (stats->addressBits > 0)
     {
@@ -440,15 +1380,37 @@ generate_cpu_main(OpCodeStats *stats, FileStream output)
     fprintf(output.file, "        data_out_b => mem_outb);\n\n");
     }
     
-    fprintf(output.file, "    alu : entity work.ALU\n");
-    fprintf(output.file, "    generic map (BITS => BITS)\n");
-    fprintf(output.file, "    port map (\n");
-    fprintf(output.file, "        clk        => clk,\n");
-    fprintf(output.file, "        nrst       => synced_nrst,\n");
-    fprintf(output.file, "        a          => alu_a,\n");
-    fprintf(output.file, "        b          => alu_b,\n");
-    fprintf(output.file, "        op         => alu_op,\n");
-    fprintf(output.file, "        p          => alu_out);\n\n");
+    for (u32 slot = 0; slot < stats->aluCount; ++slot)
+    {
+        char aluName[32];
+        if (slot)
+        {
+            snprintf(aluName, sizeof(aluName), "alu%u", slot);
+        }
+        else
+        {
+            snprintf(aluName, sizeof(aluName), "alu");
+        }
+        char *operandSuffix = stats->pipeline.operandStage ? "_q" : "";
+        fprintf(output.file, "    %s : entity work.ALU\n", aluName);
+        fprintf(output.file, "    generic map (BITS => BITS, OP_BITS => %u", stats->aluOpBits);
+        if (stats->pipeline.aluStages > 1)
+        {
+            fprintf(output.file, ", STAGES => %u", stats->pipeline.aluStages);
+        }
+        if (stats->pipeline.mulStages)
+        {
+            fprintf(output.file, ", MUL_STAGES => %u", stats->pipeline.mulStages);
+        }
+        fprintf(output.file, ")\n");
+        fprintf(output.file, "    port map (\n");
+        fprintf(output.file, "        clk        => clk,\n");
+        fprintf(output.file, "        nrst       => synced_nrst,\n");
+        fprintf(output.file, "        a          => %s_a%s,\n", aluName, operandSuffix);
+        fprintf(output.file, "        b          => %s_b%s,\n", aluName, operandSuffix);
+        fprintf(output.file, "        op         => %s_op%s,\n", aluName, operandSuffix);
+        fprintf(output.file, "        p          => %s_out);\n\n", aluName);
+    }
     
     fprintf(output.file, "    control : entity work.Controller\n");
     fprintf(output.file, "    generic map (BITS => BITS)\n");
@@ -457,6 +1419,11 @@ generate_cpu_main(OpCodeStats *stats, FileStream output)
     fprintf(output.file, "        nrst       => synced_nrst,\n");
     fprintf(output.file, "        io_rdy     => io_rdy,\n");
     fprintf(output.file, "        opc        => opc,\n");
+    if (stats->core == Core_Generic)
+    {
+        fprintf(output.file, "        pc_last    => pc_last,\n");
+        fprintf(output.file, "        pc_restart => pc_restart,\n");
+    }
     fprintf(output.file, "        pc         => pc,\n");
     fprintf(output.file, "        immediate  => immediate,\n");
     if (stats->addressBits > 0)
@@ -471,10 +1438,443 @@ generate_cpu_main(OpCodeStats *stats, FileStream output)
     fprintf(output.file, "        alu_op     => alu_op,\n");
     fprintf(output.file, "        alu_sela   => alu_sela,\n");
     fprintf(output.file, "        alu_selb   => alu_selb,\n");
+    for (u32 slot = 1; slot < stats->aluCount; ++slot)
+    {
+        fprintf(output.file, "        alu%u_op    => alu%u_op,\n", slot, slot);
+        fprintf(output.file, "        alu%u_sela  => alu%u_sela,\n", slot, slot);
+        fprintf(output.file, "        alu%u_selb  => alu%u_selb,\n", slot, slot);
+    }
     fprintf(output.file, "        io_sel     => io_sel);\n\n");
     
     fprintf(output.file, "end architecture ; -- RTL\n");
 }
 
+internal void
+generate_cosim_testbench(OpCodeStats *stats, FileStream output)
+{
+    // NOTE(michiel): Self checking testbench for the CPU, driven by the inputs simulate() used
+    // (gen_stimulus.txt) and checked against its outputs (gen_expected.txt). The opcode of
+    // tick T runs in the cycle after rising edge T + TICK_OFFSET counted from the reset
+    // release, its output toggles ready on the next edge. A synced core waits at pc 0 for the
+    // IO, so its samples arrive one edge earlier and it starts a cycle later.
+    i_expect(stats->core == Core_Program);
+    u32 tickOffset = 1 + (stats->synced ? 1 : 0) + (stats->pipeline.decodeStage ? 1 : 0);
+    u32 inputOffset = (!stats->synced && stats->pipeline.decodeStage) ? 1 : 0;
+
+    generate_vhdl_header(output);
+    fprintf(output.file, "use std.textio.all;\n\n");
+
+    fprintf(output.file, "entity tb_gen_cpu is\n");
+    fprintf(output.file, "    generic (\n");
+    fprintf(output.file, "        TICK_OFFSET  : integer := %u;  -- Edges after the reset release up to the cycle of tick 0\n", tickOffset);
+    fprintf(output.file, "        INPUT_OFFSET : integer := %u;  -- The sample of tick T toggles load after edge T + INPUT_OFFSET\n", inputOffset);
+    fprintf(output.file, "        SLACK        : integer := 16  -- Cycles an output can be late before it is missing\n");
+    fprintf(output.file, "    );\n");
+    fprintf(output.file, "end entity tb_gen_cpu;\n\n");
+
+    fprintf(output.file, "architecture Testing of tb_gen_cpu is\n\n");
+    fprintf(output.file, "    constant BITS      : integer := %u;\n", stats->bitWidth);
+    fprintf(output.file, "    constant HALF_TIME : time := 10 ns;\n\n");
+    fprintf(output.file, "    signal eos       : std_logic := '0'; -- End Of Simulation\n\n");
+    fprintf(output.file, "    signal clk, nrst : std_logic;\n");
+    fprintf(output.file, "    signal load, rdy : std_logic;\n");
+    fprintf(output.file, "    signal din, dout : std_logic_vector(BITS - 1 downto 0);\n");
+    fprintf(output.file, "    signal edge      : integer := -1;    -- Rising edges after the reset release\n\n");
+    fprintf(output.file, "begin\n\n");
+
+    fprintf(output.file, "    dut : entity work.CPU\n");
+    fprintf(output.file, "    generic map (BITS => BITS)\n");
+    fprintf(output.file, "    port map (\n");
+    fprintf(output.file, "        clk => clk,\n");
+    fprintf(output.file, "        nrst => nrst,\n");
+    fprintf(output.file, "        load => load,\n");
+    fprintf(output.file, "        d_in => din,\n");
+    fprintf(output.file, "        ready => rdy,\n");
+    fprintf(output.file, "        d_out => dout);\n\n");
+
+    fprintf(output.file, "    clking : process -- clock process\n");
+    fprintf(output.file, "    begin\n");
+    fprintf(output.file, "        clk <= '0';\n");
+    fprintf(output.file, "        wait for HALF_TIME;\n");
+    fprintf(output.file, "        clk <= '1';\n");
+    fprintf(output.file, "        wait for HALF_TIME;\n\n");
+    fprintf(output.file, "        if (eos = '1') then\n");
+    fprintf(output.file, "            wait;\n");
+    fprintf(output.file, "        end if;\n");
+    fprintf(output.file, "    end process;\n\n");
+
+    fprintf(output.file, "    counter : process(clk)\n");
+    fprintf(output.file, "    begin\n");
+    fprintf(output.file, "        if (clk'event and clk = '1') then\n");
+    fprintf(output.file, "            if (nrst = '1') then\n");
+    fprintf(output.file, "                edge <= edge + 1;\n");
+    fprintf(output.file, "            end if;\n");
+    fprintf(output.file, "        end if;\n");
+    fprintf(output.file, "    end process;\n\n");
+
+    fprintf(output.file, "    stimuli : process\n");
+    fprintf(output.file, "        file stimulus : text open read_mode is \"gen_stimulus.txt\";\n");
+    fprintf(output.file, "        variable sample : line;\n");
+    fprintf(output.file, "        variable tick, value : integer;\n");
+    fprintf(output.file, "    begin\n");
+    fprintf(output.file, "        nrst <= '0';\n");
+    fprintf(output.file, "        din <= (others => '0');\n");
+    fprintf(output.file, "        load <= '0';\n");
+    fprintf(output.file, "        for idx in 0 to 3 loop\n");
+    fprintf(output.file, "            wait until clk = '0';\n");
+    fprintf(output.file, "        end loop;\n");
+    fprintf(output.file, "        nrst <= '1';\n\n");
+    fprintf(output.file, "        while not endfile(stimulus) loop\n");
+    fprintf(output.file, "            readline(stimulus, sample);\n");
+    fprintf(output.file, "            read(sample, tick);\n");
+    fprintf(output.file, "            read(sample, value);\n");
+    fprintf(output.file, "            while (edge < tick + INPUT_OFFSET) loop\n");
+    fprintf(output.file, "                wait until clk = '0';\n");
+    fprintf(output.file, "            end loop;\n");
+    fprintf(output.file, "            din <= std_logic_vector(to_signed(value, BITS));\n");
+    fprintf(output.file, "            load <= not load;\n");
+    fprintf(output.file, "            wait until clk = '0';\n");
+    fprintf(output.file, "        end loop;\n");
+    fprintf(output.file, "        wait;\n");
+    fprintf(output.file, "    end process;\n\n");
+
+    fprintf(output.file, "    checker : process\n");
+    fprintf(output.file, "        file expected : text open read_mode is \"gen_expected.txt\";\n");
+    fprintf(output.file, "        file trace : text open write_mode is \"gen_tb_trace.txt\";\n");
+    fprintf(output.file, "        variable result, dump : line;\n");
+    fprintf(output.file, "        variable tick, value, got, due : integer;\n");
+    fprintf(output.file, "        variable first_tick, first_edge : integer;\n");
+    fprintf(output.file, "        variable count : integer := 0;\n");
+    fprintf(output.file, "        variable last_rdy : std_logic;\n");
+    fprintf(output.file, "    begin\n");
+    fprintf(output.file, "        wait until edge = 0;\n");
+    fprintf(output.file, "        last_rdy := rdy;\n\n");
+    fprintf(output.file, "        while not endfile(expected) loop\n");
+    fprintf(output.file, "            readline(expected, result);\n");
+    fprintf(output.file, "            read(result, tick);\n");
+    fprintf(output.file, "            read(result, value);\n");
+    fprintf(output.file, "            -- NOTE: The first output fixes the latency, the rest has to keep the spacing\n");
+    fprintf(output.file, "            if (count = 0) then\n");
+    fprintf(output.file, "                due := tick + TICK_OFFSET + 1;\n");
+    fprintf(output.file, "            else\n");
+    fprintf(output.file, "                due := first_edge + tick - first_tick;\n");
+    fprintf(output.file, "            end if;\n\n");
+    fprintf(output.file, "            loop\n");
+    fprintf(output.file, "                wait until clk = '0';\n");
+    fprintf(output.file, "                exit when (rdy /= last_rdy) or (edge > due + SLACK);\n");
+    fprintf(output.file, "            end loop;\n");
+    fprintf(output.file, "            assert (rdy /= last_rdy)\n");
+    fprintf(output.file, "                report \"Output \" & integer'image(count) & \" missing, expected \" & integer'image(value) &\n");
+    fprintf(output.file, "                       \" (tick \" & integer'image(tick) & \") at edge \" & integer'image(due)\n");
+    fprintf(output.file, "                severity failure;\n");
+    fprintf(output.file, "            last_rdy := rdy;\n");
+    fprintf(output.file, "            got := to_integer(signed(dout));\n");
+    fprintf(output.file, "            write(dump, edge);\n");
+    fprintf(output.file, "            write(dump, string'(\" \"));\n");
+    fprintf(output.file, "            write(dump, got);\n");
+    fprintf(output.file, "            writeline(trace, dump);\n\n");
+    fprintf(output.file, "            if (count = 0) then\n");
+    fprintf(output.file, "                assert (edge = due)\n");
+    fprintf(output.file, "                    report \"First output at edge \" & integer'image(edge) & \" instead of \" &\n");
+    fprintf(output.file, "                           integer'image(due) & \", check TICK_OFFSET\"\n");
+    fprintf(output.file, "                    severity warning;\n");
+    fprintf(output.file, "                first_tick := tick;\n");
+    fprintf(output.file, "                first_edge := edge;\n");
+    fprintf(output.file, "                due := edge;\n");
+    fprintf(output.file, "            end if;\n");
+    fprintf(output.file, "            assert (got = value) and (edge = due)\n");
+    fprintf(output.file, "                report \"First divergence at output \" & integer'image(count) & \": expected \" &\n");
+    fprintf(output.file, "                       integer'image(value) & \" (tick \" & integer'image(tick) & \") at edge \" &\n");
+    fprintf(output.file, "                       integer'image(due) & \", got \" & integer'image(got) & \" at edge \" & integer'image(edge)\n");
+    fprintf(output.file, "                severity failure;\n");
+    fprintf(output.file, "            count := count + 1;\n");
+    fprintf(output.file, "        end loop;\n\n");
+    fprintf(output.file, "        report \"All \" & integer'image(count) & \" outputs match the C model\" severity note;\n");
+    fprintf(output.file, "        eos <= '1';\n");
+    fprintf(output.file, "        wait;\n");
+    fprintf(output.file, "    end process;\n\n");
+    fprintf(output.file, "end architecture Testing;\n");
+}
+
+internal char *
+dataflow_signal_name(Dataflow *dataflow, DataflowOperand operand, u32 delay)
+{
+    // NOTE(michiel): The value of an operand the given number of cycles after it is produced
+    char *result = 0;
+    switch (operand.kind)
+    {
+        case DataflowOperand_Constant:
+        {
+            result = (char *)create_string_fmt("std_logic_vector(to_signed(%d, BITS))", operand.value).data;
+        } break;
+
+        case DataflowOperand_Input:
+        {
+            result = (char *)(delay ? create_string_fmt("df_in_d(%u)", delay) :
+                              create_string("df_in")).data;
+        } break;
+
+        case DataflowOperand_Node:
+        {
+            result = (char *)(delay ? create_string_fmt("df_n%u_d(%u)", operand.value, delay) :
+                              create_string_fmt("df_n%u", operand.value)).data;
+        } break;
+
+        INVALID_DEFAULT_CASE;
+    }
+    return result;
+}
+
+internal void
+generate_dataflow_delays(char *name, u32 delay, FileStream output)
+{
+    for (u32 stage = 1; stage <= delay; ++stage)
+    {
+        if (stage == 1)
+        {
+            fprintf(output.file, "            %s_d(1) <= %s;\n", name, name);
+        }
+        else
+        {
+            fprintf(output.file, "            %s_d(%u) <= %s_d(%u);\n", name, stage, name, stage - 1);
+        }
+    }
+}
+
+internal void
+generate_dataflow_vhdl(OpCodeStats *stats, Dataflow *dataflow, FileStream output)
+{
+    // NOTE(michiel): The spatial counterpart of gen_cpu.vhd. d_in is taken every clock where
+    // d_in_valid is high, the outputs of that sample are valid together latency cycles later.
+    i_expect(stats->bitWidth <= 32);
+    i_expect(stats->bitWidth > 0);
+    i_expect(dataflow->stateless);
+    
+    generate_vhdl_header(output);
+    
+    fprintf(output.file, "entity Dataflow is\n");
+    fprintf(output.file, "    generic (\n");
+    fprintf(output.file, "        BITS   : integer := %u\n", stats->bitWidth);
+    fprintf(output.file, "    );\n");
+    fprintf(output.file, "    port (\n");
+    fprintf(output.file, "        clk         : in  std_logic;\n");
+    fprintf(output.file, "        nrst        : in  std_logic;\n\n");
+    fprintf(output.file, "        d_in_valid  : in  std_logic;\n");
+    fprintf(output.file, "        d_in        : in  std_logic_vector(BITS - 1 downto 0);\n\n");
+    for (u32 outputIdx = 0; outputIdx < buf_len(dataflow->outputs); ++outputIdx)
+    {
+        fprintf(output.file, "        d_out_%-5u : out std_logic_vector(BITS - 1 downto 0);\n", outputIdx);
+    }
+    fprintf(output.file, "        d_out_valid : out std_logic\n");
+    fprintf(output.file, "    );\n");
+    fprintf(output.file, "end entity; -- Dataflow\n\n");
+    
+    fprintf(output.file, "architecture RTL of Dataflow is\n\n");
+    fprintf(output.file, "    type delay_line is array(natural range <>) of std_logic_vector(BITS - 1 downto 0);\n\n");
+    fprintf(output.file, "    signal valid : std_logic_vector(%u downto 0);\n\n", dataflow->latency);
+    fprintf(output.file, "    signal df_in : std_logic_vector(BITS - 1 downto 0);\n");
+    if (dataflow->inputMaxDelay)
+    {
+        fprintf(output.file, "    signal df_in_d : delay_line(1 to %u);\n", dataflow->inputMaxDelay);
+    }
+    for (u32 nodeIdx = 0; nodeIdx < buf_len(dataflow->nodes); ++nodeIdx)
+    {
+        DataflowNode *node = dataflow->nodes + nodeIdx;
+        fprintf(output.file, "    signal df_n%u : std_logic_vector(BITS - 1 downto 0);\n", nodeIdx);
+        if (node->stages > 1)
+        {
+            fprintf(output.file, "    signal df_n%u_m : delay_line(1 to %u);\n", nodeIdx, node->stages - 1);
+        }
+        if (node->maxDelay)
+        {
+            fprintf(output.file, "    signal df_n%u_d : delay_line(1 to %u);\n", nodeIdx, node->maxDelay);
+        }
+    }
+    fprintf(output.file, "\n");
+    
+    fprintf(output.file, "begin\n\n");
+    for (u32 outputIdx = 0; outputIdx < buf_len(dataflow->outputs); ++outputIdx)
+    {
+        DataflowOperand operand = dataflow->outputs[outputIdx];
+        fprintf(output.file, "    d_out_%u <= %s;\n", outputIdx,
+                dataflow_signal_name(dataflow, operand, dataflow->latency - dataflow_depth(dataflow, operand)));
+    }
+    fprintf(output.file, "    d_out_valid <= valid(%u);\n\n", dataflow->latency);
+    
+    fprintf(output.file, "    pipeline : process(clk)\n");
+    fprintf(output.file, "    begin\n");
+    fprintf(output.file, "        if (clk'event and clk = '1') then\n");
+    fprintf(output.file, "            if (nrst = '0') then\n");
+    fprintf(output.file, "                valid <= (others => '0');\n");
+    fprintf(output.file, "            else\n");
+    fprintf(output.file, "                valid(0) <= d_in_valid;\n");
+    if (dataflow->latency)
+    {
+        fprintf(output.file, "                valid(%u downto 1) <= valid(%u downto 0);\n",
+                dataflow->latency, dataflow->latency - 1);
+    }
+    fprintf(output.file, "            end if;\n\n");
+    fprintf(output.file, "            df_in <= d_in;\n");
+    generate_dataflow_delays("df_in", dataflow->inputMaxDelay, output);
+    for (u32 nodeIdx = 0; nodeIdx < buf_len(dataflow->nodes); ++nodeIdx)
+    {
+        DataflowNode *node = dataflow->nodes + nodeIdx;
+        u32 start = node->depth - node->stages;
+        char *a = dataflow_signal_name(dataflow, node->a, start - dataflow_depth(dataflow, node->a));
+        char *b = dataflow_signal_name(dataflow, node->b, start - dataflow_depth(dataflow, node->b));
+        fprintf(output.file, "\n            -- Stage %u\n", node->depth);
+        switch (node->op)
+        {
+            case Alu_Or:
+            {
+                fprintf(output.file, "            df_n%u <= %s or %s;\n", nodeIdx, a, b);
+            } break;
+            case Alu_Xor:
+            {
+                fprintf(output.file, "            df_n%u <= %s xor %s;\n", nodeIdx, a, b);
+            } break;
+            case Alu_And:
+            {
+                fprintf(output.file, "            df_n%u <= %s and %s;\n", nodeIdx, a, b);
+            } break;
+            case Alu_Add:
+            {
+                fprintf(output.file, "            df_n%u <= std_logic_vector(signed(%s) + signed(%s));\n", nodeIdx, a, b);
+            } break;
+            case Alu_Sub:
+            {
+                fprintf(output.file, "            df_n%u <= std_logic_vector(signed(%s) - signed(%s));\n", nodeIdx, a, b);
+            } break;
+            case Alu_Sll:
+            case Alu_Srl:
+            case Alu_Sra:
+            {
+                // NOTE(michiel): Constant amounts are only wiring, others get a barrel shifter
+                char *shift = (node->op == Alu_Sll) ? "shift_left" : "shift_right";
+                char *type = (node->op == Alu_Sra) ? "signed" : "unsigned";
+                fprintf(output.file, "            if (unsigned(%s) >= BITS) then\n", b);
+                if ((node->op == Alu_Sra) && (node->a.kind == DataflowOperand_Constant))
+                {
+                    fprintf(output.file, "                df_n%u <= (others => '%c');\n", nodeIdx,
+                            node->a.value < 0 ? '1' : '0');
+                }
+                else if (node->op == Alu_Sra)
+                {
+                    fprintf(output.file, "                df_n%u <= (others => %s(BITS - 1));\n", nodeIdx, a);
+                }
+                else
+                {
+                    fprintf(output.file, "                df_n%u <= (others => '0');\n", nodeIdx);
+                }
+                fprintf(output.file, "            else\n");
+                fprintf(output.file, "                df_n%u <= std_logic_vector(%s(%s(%s), to_integer(unsigned(%s))));\n",
+                        nodeIdx, shift, type, a, b);
+                fprintf(output.file, "            end if;\n");
+            } break;
+            case Alu_Mul:
+            {
+                // NOTE(michiel): The product registers come first, so they fit in a DSP block
+                if (node->stages > 1)
+                {
+                    fprintf(output.file, "            df_n%u_m(1) <= std_logic_vector(resize(signed(%s) * signed(%s), BITS));\n",
+                            nodeIdx, a, b);
+                    for (u32 stage = 2; stage < node->stages; ++stage)
+                    {
+                        fprintf(output.file, "            df_n%u_m(%u) <= df_n%u_m(%u);\n",
+                                nodeIdx, stage, nodeIdx, stage - 1);
+                    }
+                    fprintf(output.file, "            df_n%u <= df_n%u_m(%u);\n", nodeIdx, nodeIdx, node->stages - 1);
+                }
+                else
+                {
+                    fprintf(output.file, "            df_n%u <= std_logic_vector(resize(signed(%s) * signed(%s), BITS));\n",
+                            nodeIdx, a, b);
+                }
+            } break;
+            INVALID_DEFAULT_CASE;
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "df_n%u", nodeIdx);
+        generate_dataflow_delays(name, node->maxDelay, output);
+    }
+    fprintf(output.file, "        end if;\n");
+    fprintf(output.file, "    end process;\n\n");
+    
+    fprintf(output.file, "end architecture ; -- RTL\n");
+}
+
 #undef CSTR_
 #undef CSTR
+
+// NOTE(michiel): The CPU files are generated into temporaries first, their combined hash is
+// the shape of the design. Programs with the same shape only differ in gen_opcodes.mem.
+typedef struct HdlFile
+{
+    char *name;
+    FILE *file;
+} HdlFile;
+
+internal FileStream
+hdl_file_open(HdlFile **files, char *name)
+{
+    HdlFile hdlFile = {0};
+    hdlFile.name = name;
+    hdlFile.file = tmpfile();
+    i_expect(hdlFile.file);
+    buf_push(*files, hdlFile);
+    
+    FileStream result = {0};
+    result.file = hdlFile.file;
+    return result;
+}
+
+internal u64
+hdl_shape_key(HdlFile *files)
+{
+    // NOTE(michiel): FNV-1a over the file names and contents
+    u64 result = 0xCBF29CE484222325ULL;
+    for (u32 fileIdx = 0; fileIdx < buf_len(files); ++fileIdx)
+    {
+        HdlFile *hdlFile = files + fileIdx;
+        for (char *c = hdlFile->name; *c; ++c)
+        {
+            result = (result ^ (u8)*c) * 0x100000001B3ULL;
+        }
+        rewind(hdlFile->file);
+        s32 c;
+        while ((c = fgetc(hdlFile->file)) != EOF)
+        {
+            result = (result ^ (u8)c) * 0x100000001B3ULL;
+        }
+    }
+    return result;
+}
+
+internal void
+hdl_write_files(HdlFile *files)
+{
+    for (u32 fileIdx = 0; fileIdx < buf_len(files); ++fileIdx)
+    {
+        HdlFile *hdlFile = files + fileIdx;
+        FILE *target = fopen(hdlFile->name, "wb");
+        i_expect(target);
+        rewind(hdlFile->file);
+        char buffer[4096];
+        size_t count;
+        while ((count = fread(buffer, 1, sizeof(buffer), hdlFile->file)) > 0)
+        {
+            fwrite(buffer, 1, count, target);
+        }
+        fclose(target);
+    }
+}
+
+internal void
+hdl_close_files(HdlFile *files)
+{
+    for (u32 fileIdx = 0; fileIdx < buf_len(files); ++fileIdx)
+    {
+        fclose(files[fileIdx].file);
+    }
+    buf_free(files);
+}